@@ -4,6 +4,18 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 
+// Bullet, for rigid bodies in the fluid
+#include "../../physics/physics.h"
+#include "sph_rigid_coupling.h"
+
+// neighbour search, and the same steps as OpenCL kernels
+#include "sph_grid.h"
+#include "sph_checkpoint.h"
+#include "sph_emitters.h"
+#if OCTET_OPENCL
+  #include "sph_opencl.h"
+#endif
+
 namespace octet {
 
   typedef struct sim_param_t {
@@ -11,6 +23,7 @@ namespace octet {
     int nframes; /* Number of frames */
     int npframe; /* Steps per frame */
     float h; /* Particle size */
+    float spacing; /* Distance between the particles at the start */
     float dt; /* Time step */
     float rho0; /* Reference density */
     float k; /* Bulk modulus */
@@ -23,24 +36,79 @@ namespace octet {
   //per particle.
   typedef struct sim_state_t {
     int n; /* Number of particles */
+    int capacity; /* Number of particles there is room for */
     float mass; /* Particle mass */
     float* rho; /* Densities */
     float* x; /* Positions */
     float* vh; /* Velocities (half step) */
     float* v; /* Velocities (full step) */
     float* a; /* Acceleration */
+    unsigned* id; /* Ids of the particles, then the unused ids after n */
+    unsigned* slot; /* Index of the particle with each id */
   } sim_state_t;
 
+  // make room for exactly capacity particles; the new ids are numbered on from the old ones.
+  void resize_state(sim_state_t *p, int capacity) {
+    int size = 3*capacity;
+    p->rho = (float *) realloc ( p->rho, capacity*sizeof(float) );
+    p->x = (float *) realloc ( p->x, size*sizeof(float) );
+    p->vh = (float *) realloc ( p->vh, size*sizeof(float) );
+    p->v = (float *) realloc ( p->v, size*sizeof(float) );
+    p->a = (float *) realloc ( p->a, size*sizeof(float) );
+    p->id = (unsigned *) realloc ( p->id, capacity*sizeof(unsigned) );
+    p->slot = (unsigned *) realloc ( p->slot, capacity*sizeof(unsigned) );
+    for (int i = p->capacity; i < capacity; ++i) {
+      p->id[i] = p->slot[i] = i;
+    }
+    p->capacity = capacity;
+  }
+
   sim_state_t* alloc_state(int n, sim_state_t *p) {
-    int size = 3*n;  // I think 2*n not n*n!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
     p->n = n;
-    p->rho = (float *) malloc ( n*sizeof(float) ); // rho is density and has one entry per particle
-    p->x = (float *) malloc ( size*sizeof(float) );
-    p->vh = (float *) malloc ( size*sizeof(float) );
-    p->v = (float *) malloc ( size*sizeof(float) );
-    p->a = (float *) malloc ( size*sizeof(float) );
+    p->capacity = 0;
+    p->rho = p->x = p->vh = p->v = p->a = 0;
+    p->id = p->slot = 0;
+    resize_state(p, n);
     return p;
   }
+
+  // make room for n particles, doubling the capacity so that adding a few at a time rarely reallocates.
+  void reserve_state(sim_state_t *p, int n) {
+    if (n <= p->capacity) return;
+    int capacity = p->capacity < 64 ? 64 : p->capacity * 2;
+    resize_state(p, capacity < n ? n : capacity);
+  }
+
+  // add a particle at rest on its half step and return its id, which it keeps until it is removed.
+  unsigned add_particle(sim_state_t *p, vec3_in pos, vec3_in vel) {
+    reserve_state(p, p->n + 1);
+    int i = p->n++;
+    for (int j = 0; j != 3; ++j) {
+      p->x[3*i+j] = pos[j];
+      p->v[3*i+j] = p->vh[3*i+j] = vel[j];
+      p->a[3*i+j] = 0;
+    }
+    p->rho[i] = 0;
+    return p->id[i];
+  }
+
+  // remove particle i by moving the last particle into its place.
+  // the removed id goes after n to be used again.
+  void remove_particle(sim_state_t *p, int i) {
+    int last = --p->n;
+    for (int j = 0; j != 3; ++j) {
+      p->x[3*i+j] = p->x[3*last+j];
+      p->v[3*i+j] = p->v[3*last+j];
+      p->vh[3*i+j] = p->vh[3*last+j];
+      p->a[3*i+j] = p->a[3*last+j];
+    }
+    p->rho[i] = p->rho[last];
+    unsigned removed = p->id[i];
+    p->id[i] = p->id[last];
+    p->id[last] = removed;
+    p->slot[p->id[i]] = i;
+    p->slot[removed] = last;
+  }
   void free_state(sim_state_t* s);
   // h = 0.05f 1.3f have 2197 points
   static void default_params(sim_param_t* params)
@@ -50,6 +118,7 @@ namespace octet {
     params->npframe = 100;
     params->dt = 0.0015;//1e-4;
     params->h = 0.05;//5e-2;
+    params->spacing = params->h / 1.3f;
     params->rho0 = 1000; // reference density
     params->k = 1e3;//1e3; // bulk modulus
     params->mu = 3.5;//0.1; // viscocity maybe 3.5???
@@ -66,12 +135,571 @@ namespace octet {
     fairyball_shader shader;
 	  GLuint vbo, attribute_position;
 	  int numOfMetaballs;
-    float* mb_positions;
+    dynarray<float> mb_positions;
     //dynarray<float> vertices;
+
+    // live statistics and particle frames for the webui
+    http_server server;
+    int stats_channel;
+    int particles_channel;
+    int frame_number;
+    double step_time;
+    dynarray<uint8_t> particle_frame;
+
+    // rigid bodies floating in the fluid
+    btDefaultCollisionConfiguration config;       /// setup for the world
+    btCollisionDispatcher *dispatcher;            /// handler for collisions between objects
+    btDbvtBroadphase *broadphase;                 /// handler for broadphase (rough) collision
+    btSequentialImpulseConstraintSolver *solver;  /// handler to resolve collisions
+    btContinuousDynamicsWorld *world;             /// physics world, contains rigid bodies
+    dynarray<btRigidBody*> rigid_bodies;
+    sph_rigid_coupling *coupling;
+    dynarray<vec3p> body_samples;
+
+    // dome on the floor that the fluid flows over, as a distance field for the particles
+    sphere dome;
+    ref<signed_distance_field> boundary;
+    unsigned boundary_hits;
+
+    // neighbours for the native density and forces
+    sph_grid grid;
+
+    // taps and drains that change the number of particles (--inflow)
+    bool use_inflow;
+    dynarray<ref<sph_emitter> > emitters;
+    dynarray<ref<sph_sink> > sinks;
+
+    // run the fluid with OpenCL (--opencl on the command line)
+    bool use_opencl;
+
+    // log a hash of the state every frame and keep to the native backend (--deterministic).
+    // results do not depend on the number of threads (--threads n) in either mode.
+    bool deterministic;
+
+    // read the packed 16 byte particles of the grid in the neighbour loops (--mixed_precision).
+    // the state and the sums stay in floats.
+    bool mixed_precision;
+
+    // iterate the pressures until the density is within pressure_tolerance of rho0 (--pcisph) instead
+    // of using the stiff equation of state. This halves the worst squashing (6% against 14%) at the
+    // same step. Time steps are dt_scale times bigger (--dt_scale, default 1), but the solver takes
+    // the rigid bodies to stand still for a step, so next to moving ones the fluid squashes more than
+    // with the equation of state from 2.5 times (19%) and much more from 5 times (40-60%).
+    bool use_pcisph;
+    float dt_scale;
+    float pressure_tolerance;
+    int pressure_iterations;
+    float density_error;
+    dynarray<float> pressure;
+    dynarray<float> pressure_delta;
+    dynarray<float> x_pred;
+    dynarray<float> rho_pred;
+    dynarray<float> a_other;
+    dynarray<float> body_rho;
+    dynarray<float> body_push;
+    dynarray<float> body_grad;
+
+    // PCISPH: the particles within h of each particle, found once a step for all the iterations.
+    // particle i's are the first neighbour_count[i] of neighbours[i*neighbour_stride].
+    struct neighbour {
+      unsigned j;
+      float dx, dy, dz;
+      // acceleration along dx for a pressure sum of one
+      float wp;
+    };
+    dynarray<unsigned> neighbour_count;
+    dynarray<neighbour> neighbours;
+    unsigned neighbour_stride;
+
+    // the fluid the walls of the box stand in for, up to h from a wall in steps of h/wall_steps
+    enum { wall_steps = 32 };
+    dynarray<float> wall_density;
+    dynarray<float> wall_push;
+
+    // also draw each frame with the software renderer and log its hash and frame time (--software).
+    bool use_software;
+    soft_renderer *software;
+
+    // snapshots for restarting long runs (--checkpoint path --checkpoint_every frames, --restart path)
+    sph_checkpoint checkpoint;
+    string checkpoint_path;
+    string restart_path;
+    int checkpoint_every;
+
+    // the numbers of sim_param_t and sim_state_t, in a snapshot
+    struct snapshot_header {
+      int32_t frame_number;
+      int32_t nframes;
+      int32_t npframe;
+      int32_t n;
+      int32_t capacity;
+      float h;
+      float dt;
+      float rho0;
+      float k;
+      float mu;
+      float g;
+      float mass;
+    };
+
+    // what bullet keeps between steps for each body, in a snapshot
+    struct body_snapshot {
+      btTransformFloatData transform;
+      btTransformFloatData interpolation_transform;
+      btVector3FloatData linear_velocity;
+      btVector3FloatData angular_velocity;
+      btVector3FloatData interpolation_linear_velocity;
+      btVector3FloatData interpolation_angular_velocity;
+      int32_t activation_state;
+      float deactivation_time;
+      int32_t pad[2];
+    };
+    #if OCTET_OPENCL
+      sph_opencl *opencl;
+    #endif
+
+    // the box of reflect_bc, which the neighbour grid covers.
+    static aabb get_domain() {
+      return aabb(vec3(0.5f, 0.5f, 0.5f), vec3(0.5f, 0.5f, 0.5f));
+    }
+
+    // start OpenCL if asked for and check that it gives the same answers as the native code.
+    void init_backend() {
+      // other devices may round differently, so only the native code gives the same answers everywhere.
+      if (deterministic && use_opencl) {
+        log("deterministic mode: not using OpenCL\n");
+        use_opencl = false;
+      }
+      // the OpenCL kernels only have the equation of state.
+      if (use_pcisph && use_opencl) {
+        log("pcisph: not using OpenCL\n");
+        use_opencl = false;
+      }
+      // the pressure solver has its own neighbour lists in floats.
+      if (use_pcisph && mixed_precision) {
+        log("pcisph: not using mixed precision\n");
+        mixed_precision = false;
+      }
+      #if OCTET_OPENCL
+        if (use_opencl) start_opencl();
+      #else
+        if (use_opencl) log("OpenCL is not enabled in this build (OCTET_OPENCL)\n");
+        use_opencl = false;
+      #endif
+      log("fluid backend: %s\n", use_opencl ? "OpenCL" : "native");
+    }
+
+    // give OpenCL the arrays again after particles have been added or removed.
+    void update_backend() {
+      #if OCTET_OPENCL
+        sim_state_t *s = state;
+        if (opencl && !opencl->set_particles(s->n, s->capacity, s->x, s->v, s->vh, s->a, s->rho)) {
+          log("fluid backend: going back to native\n");
+          delete opencl;
+          opencl = 0;
+          use_opencl = false;
+        }
+      #endif
+    }
+
+    #if OCTET_OPENCL
+      // run a step both ways from the current state and log the largest differences.
+      // the state is put back afterwards.
+      bool compare_backends() {
+        sim_state_t *s = state;
+        unsigned n3 = s->n * 3;
+        dynarray<float> saved(n3 * 3), native(n3 * 4 + s->n);
+        memcpy(&saved[0], s->x, n3 * sizeof(float));
+        memcpy(&saved[n3], s->v, n3 * sizeof(float));
+        memcpy(&saved[n3*2], s->vh, n3 * sizeof(float));
+
+        float *arrays[] = { s->rho, s->a, s->x, s->v, s->vh };
+        unsigned sizes[] = { (unsigned)s->n, n3, n3, n3, n3 };
+        const char *names[] = { "rho", "a", "x", "v", "vh" };
+        bool ok = true;
+        for (int pass = 0; pass != 2; ++pass) {
+          sph_opencl *cl = opencl;
+          if (pass == 0) opencl = 0;
+          compute_density(s, &params);
+          compute_forces(s, &params);
+          step_particles(s, params.dt, false);
+          opencl = cl;
+
+          for (unsigned k = 0, offset = 0; k != 5; offset += sizes[k++]) {
+            if (pass == 0) {
+              memcpy(&native[offset], arrays[k], sizes[k] * sizeof(float));
+              continue;
+            }
+            float max_error = 0;
+            for (unsigned i = 0; i != sizes[k]; ++i) {
+              float diff = fabsf(arrays[k][i] - native[offset + i]);
+              float scale = fabsf(native[offset + i]) > 1 ? fabsf(native[offset + i]) : 1;
+              max_error = diff / scale > max_error ? diff / scale : max_error;
+            }
+            log("compare_backends: %s max relative error %g\n", names[k], max_error);
+            ok = ok && max_error < 1e-4f;
+          }
+
+          memcpy(s->x, &saved[0], n3 * sizeof(float));
+          memcpy(s->v, &saved[n3], n3 * sizeof(float));
+          memcpy(s->vh, &saved[n3*2], n3 * sizeof(float));
+        }
+        log("compare_backends: %s\n", ok ? "OpenCL matches native" : "OpenCL DIFFERS from native");
+        return ok;
+      }
+    #endif
+
+    static uint64_t fnv1a(uint64_t hash, const void *data, unsigned size) {
+      const uint8_t *src = (const uint8_t*)data;
+      for (unsigned i = 0; i != size; ++i) {
+        hash = ( hash ^ src[i] ) * 0x100000001b3ull;
+      }
+      return hash;
+    }
+
+    void create_world() {
+      dispatcher = new btCollisionDispatcher(&config);
+      broadphase = new btDbvtBroadphase();
+      solver = new btSequentialImpulseConstraintSolver();
+      world = new btContinuousDynamicsWorld(dispatcher, broadphase, solver, &config);
+      world->setGravity(btVector3(0, -params.g, 0));
+    }
+
+    void destroy_world() {
+      for (unsigned i = 0; i != rigid_bodies.size(); ++i) {
+        world->removeRigidBody(rigid_bodies[i]);
+      }
+      delete world;
+      delete solver;
+      delete broadphase;
+      delete dispatcher;
+    }
+
+    // put the bodies back as they were in a new world.
+    // bullet's contact caches and fixed step clock can not be saved, so they start again from nothing.
+    void restore_rigid_bodies(const body_snapshot *snapshots) {
+      destroy_world();
+      create_world();
+      coupling->set_world(world);
+      for (unsigned i = 0; i != rigid_bodies.size(); ++i) {
+        const body_snapshot &snap = snapshots[i];
+        btRigidBody *body = rigid_bodies[i];
+        btTransform transform, interpolation_transform;
+        btVector3 linear_velocity, angular_velocity, interpolation_linear_velocity, interpolation_angular_velocity;
+        transform.deSerializeFloat(snap.transform);
+        interpolation_transform.deSerializeFloat(snap.interpolation_transform);
+        linear_velocity.deSerializeFloat(snap.linear_velocity);
+        angular_velocity.deSerializeFloat(snap.angular_velocity);
+        interpolation_linear_velocity.deSerializeFloat(snap.interpolation_linear_velocity);
+        interpolation_angular_velocity.deSerializeFloat(snap.interpolation_angular_velocity);
+        body->setCenterOfMassTransform(transform);
+        body->setInterpolationWorldTransform(interpolation_transform);
+        body->setLinearVelocity(linear_velocity);
+        body->setAngularVelocity(angular_velocity);
+        body->setInterpolationLinearVelocity(interpolation_linear_velocity);
+        body->setInterpolationAngularVelocity(interpolation_angular_velocity);
+        body->clearForces();
+        body->forceActivationState(snap.activation_state);
+        body->setDeactivationTime(snap.deactivation_time);
+        if (body->getMotionState()) body->getMotionState()->setWorldTransform(interpolation_transform);
+        world->addRigidBody(body);
+      }
+    }
+
+    // copy the state into a snapshot and write it in the background.
+    // this only reads the state, so a run that saves checkpoints is the same as one that does not.
+    void save_checkpoint(const char *path) {
+      const sim_state_t *s = state;
+      snapshot_header header;
+      memset(&header, 0, sizeof(header));
+      header.frame_number = frame_number;
+      header.nframes = params.nframes;
+      header.npframe = params.npframe;
+      header.n = s->n;
+      header.capacity = s->capacity;
+      header.h = params.h;
+      header.dt = params.dt;
+      header.rho0 = params.rho0;
+      header.k = params.k;
+      header.mu = params.mu;
+      header.g = params.g;
+      header.mass = s->mass;
+
+      dynarray<body_snapshot> bodies(rigid_bodies.size());
+      memset(bodies.data(), 0, bodies.size() * sizeof(body_snapshot));
+      for (unsigned i = 0; i != rigid_bodies.size(); ++i) {
+        const btRigidBody *body = rigid_bodies[i];
+        body_snapshot &snap = bodies[i];
+        body->getCenterOfMassTransform().serializeFloat(snap.transform);
+        body->getInterpolationWorldTransform().serializeFloat(snap.interpolation_transform);
+        body->getLinearVelocity().serializeFloat(snap.linear_velocity);
+        body->getAngularVelocity().serializeFloat(snap.angular_velocity);
+        body->getInterpolationLinearVelocity().serializeFloat(snap.interpolation_linear_velocity);
+        body->getInterpolationAngularVelocity().serializeFloat(snap.interpolation_angular_velocity);
+        snap.activation_state = body->getActivationState();
+        snap.deactivation_time = body->getDeactivationTime();
+      }
+
+      dynarray<float> travelled(emitters.size());
+      for (unsigned i = 0; i != emitters.size(); ++i) {
+        travelled[i] = emitters[i]->get_travelled();
+      }
+
+      unsigned n3 = s->n * 3;
+      checkpoint.begin();
+      checkpoint.add("header", &header, sizeof(header));
+      checkpoint.add("x", s->x, n3 * sizeof(float));
+      checkpoint.add("v", s->v, n3 * sizeof(float));
+      checkpoint.add("vh", s->vh, n3 * sizeof(float));
+      checkpoint.add("a", s->a, n3 * sizeof(float));
+      checkpoint.add("rho", s->rho, s->n * sizeof(float));
+      checkpoint.add("id", s->id, s->capacity * sizeof(unsigned));
+      checkpoint.add("bodies", bodies.data(), bodies.size() * sizeof(body_snapshot));
+      checkpoint.add("emitters", travelled.data(), travelled.size() * sizeof(float));
+      // the pressure solver starts from the last step's pressures.
+      if (use_pcisph) checkpoint.add("pressure", pressure.data(), s->n * sizeof(float));
+      checkpoint.write(path);
+    }
+
+    // carry on from a snapshot made by save_checkpoint with the same scene.
+    // the number of particles may have changed since the start if there are taps and drains.
+    // the fluid carries on bitwise as it was, but with bodies bullet's contacts are found afresh,
+    // so the bodies may part from the saved run by rounding errors.
+    bool load_checkpoint(const char *path) {
+      if (!checkpoint.load(path)) return false;
+      sim_state_t *s = state;
+      const snapshot_header *header = (const snapshot_header*)checkpoint.get("header", sizeof(snapshot_header));
+      // the grid, rigid body samples and boundary are made for this h.
+      if (!header || header->h != params.h || header->n < 0 || header->n > header->capacity) {
+        log("load_checkpoint: %s is for a different scene\n", path);
+        return false;
+      }
+      unsigned n = header->n, n3 = n * 3, capacity = header->capacity;
+      const float *x = (const float*)checkpoint.get("x", n3 * sizeof(float));
+      const float *v = (const float*)checkpoint.get("v", n3 * sizeof(float));
+      const float *vh = (const float*)checkpoint.get("vh", n3 * sizeof(float));
+      const float *a = (const float*)checkpoint.get("a", n3 * sizeof(float));
+      const float *rho = (const float*)checkpoint.get("rho", n * sizeof(float));
+      const unsigned *id = (const unsigned*)checkpoint.get("id", capacity * sizeof(unsigned));
+      const body_snapshot *bodies = (const body_snapshot*)checkpoint.get("bodies", rigid_bodies.size() * sizeof(body_snapshot));
+      const float *travelled = (const float*)checkpoint.get("emitters", emitters.size() * sizeof(float));
+      if (!x || !v || !vh || !a || !rho || !id || !bodies || !travelled) {
+        log("load_checkpoint: %s is for a different scene\n", path);
+        return false;
+      }
+      // each id is the slot of a particle, so they must all be different and in range.
+      dynarray<uint8_t> seen(capacity);
+      memset(seen.data(), 0, capacity);
+      for (unsigned i = 0; i != capacity; ++i) {
+        if (id[i] >= capacity || seen[id[i]]) {
+          log("load_checkpoint: %s has a bad particle id\n", path);
+          return false;
+        }
+        seen[id[i]] = 1;
+      }
+
+      frame_number = header->frame_number;
+      params.nframes = header->nframes;
+      params.npframe = header->npframe;
+      params.dt = header->dt;
+      params.rho0 = header->rho0;
+      params.k = header->k;
+      params.mu = header->mu;
+      params.g = header->g;
+      s->mass = header->mass;
+      // the same capacity and ids make later taps and drains do the same as in the saved run.
+      if (s->capacity != (int)capacity) resize_state(s, capacity);
+      s->n = n;
+      memcpy(s->x, x, n3 * sizeof(float));
+      memcpy(s->v, v, n3 * sizeof(float));
+      memcpy(s->vh, vh, n3 * sizeof(float));
+      memcpy(s->a, a, n3 * sizeof(float));
+      memcpy(s->rho, rho, n * sizeof(float));
+      memcpy(s->id, id, capacity * sizeof(unsigned));
+      for (unsigned i = 0; i != capacity; ++i) {
+        s->slot[s->id[i]] = i;
+      }
+      for (unsigned i = 0; i != emitters.size(); ++i) {
+        emitters[i]->set_travelled(travelled[i]);
+      }
+      if (use_pcisph) {
+        // a snapshot of a run without the solver has no pressures, so they start again from zero.
+        const float *p = (const float*)checkpoint.get("pressure", n * sizeof(float));
+        pressure.resize(capacity);
+        memset(pressure.data(), 0, capacity * sizeof(float));
+        if (p) memcpy(pressure.data(), p, n * sizeof(float));
+      }
+      update_backend();
+      restore_rigid_bodies(bodies);
+      log("load_checkpoint: carrying on from frame %d of %s with %d particles\n", frame_number, path, s->n);
+      return true;
+    }
+
+    // add a body with a density relative to the fluid's and let the fluid push it about.
+    void add_rigid_body(mat4t_in modelToWorld, btCollisionShape *shape, float volume, float density) {
+      // bullet's default margin is big compared to our unit box.
+      shape->setMargin(0.002f);
+      btTransform transform(get_btMatrix3x3(modelToWorld), get_btVector3(modelToWorld[3].xyz()));
+      btDefaultMotionState *motionState = new btDefaultMotionState(transform);
+      btScalar mass = volume * density;
+      btVector3 inertiaTensor(0, 0, 0);
+      if (mass) shape->calculateLocalInertia(mass, inertiaTensor);
+      btRigidBody *rigid_body = new btRigidBody(mass, motionState, shape, inertiaTensor);
+      rigid_body->setSleepingThresholds(0.02f, 0.05f);
+      world->addRigidBody(rigid_body);
+      rigid_bodies.push_back(rigid_body);
+      coupling->add_body(rigid_body);
+    }
+
+    // walls of the unit box for the bodies and some boxes and balls dropped into the fluid.
+    void init_rigid_bodies() {
+      world->setGravity(btVector3(0, -params.g, 0));
+      coupling = new sph_rigid_coupling(world, params.h);
+
+      static const float walls[6][4] = {
+        { 1, 0, 0, 0 }, { -1, 0, 0, -1 }, { 0, 1, 0, 0 }, { 0, -1, 0, -1 }, { 0, 0, 1, 0 }, { 0, 0, -1, -1 },
+      };
+      for (int i = 0; i != 6; ++i) {
+        btCollisionShape *shape = new btStaticPlaneShape(btVector3(walls[i][0], walls[i][1], walls[i][2]), walls[i][3]);
+        btRigidBody *rigid_body = new btRigidBody(0, new btDefaultMotionState(), shape);
+        world->addRigidBody(rigid_body);
+        rigid_bodies.push_back(rigid_body);
+      }
+
+      // the bodies bounce off the dome as well as the fluid.
+      {
+        mat4t modelToWorld;
+        modelToWorld.translate(dome.get_center().x(), dome.get_center().y(), dome.get_center().z());
+        btTransform transform(get_btMatrix3x3(modelToWorld), get_btVector3(modelToWorld[3].xyz()));
+        btCollisionShape *shape = new btSphereShape(dome.get_radius());
+        btRigidBody *rigid_body = new btRigidBody(0, new btDefaultMotionState(transform), shape);
+        world->addRigidBody(rigid_body);
+        rigid_bodies.push_back(rigid_body);
+      }
+
+      for (int i = 0; i != 4; ++i) {
+        mat4t modelToWorld;
+        modelToWorld.translate(0.2f + i * 0.2f, 0.8f, 0.3f + ( i & 1 ) * 0.3f);
+        modelToWorld.rotateY(i * 30.0f);
+        if (i & 1) {
+          float radius = 0.06f;
+          add_rigid_body(modelToWorld, new btSphereShape(radius), 4.0f / 3 * 3.14159265f * radius * radius * radius, params.rho0 * 2.0f);
+        } else {
+          vec3 half(0.08f, 0.04f, 0.06f);
+          add_rigid_body(modelToWorld, new btBoxShape(get_btVector3(half)), 8 * half.x() * half.y() * half.z(), params.rho0 * 0.5f);
+        }
+      }
+    }
+
+    // push the bodies with the fluid forces of the last step and move them on by the same time.
+    void step_rigid_bodies() {
+      coupling->apply_impulses();
+      world->stepSimulation(params.dt, 1, params.dt);
+    }
+
+    // bake the dome into a distance field so that any shape could be used as a container or obstacle.
+    void init_boundary() {
+      dome = sphere(vec3(0.75f, 0, 0.75f), 0.2f);
+      boundary = new signed_distance_field();
+      boundary->bake(dome.get_aabb(), 1.0f / 64, dome);
+      boundary_hits = 0;
+    }
+
+    // keep the particles out of the dome, as reflect_bc does for the walls.
+    void collide_boundary(sim_state_t* s) {
+      if (boundary) {
+        boundary_hits = boundary->collide(s->x, s->v, s->vh, s->n, params.h * 0.1f, 0.75f, false);
+      }
+    }
+
+    // a tap over the dome and a drain in a corner of the floor.
+    void init_inflow() {
+      float spacing = params.spacing;
+      emitters.push_back(new sph_emitter(vec3(0.75f, 0.85f, 0.75f), vec3(0, -1, 0), 0.04f, spacing));
+      sinks.push_back(new sph_sink(aabb(vec3(0.9f, 0.03f, 0.1f), vec3(0.1f, 0.03f, 0.1f))));
+    }
+
+    // take out the particles in the drains and add the ones from the taps.
+    void update_particles() {
+      if (emitters.size() == 0 && sinks.size() == 0) return;
+      sim_state_t *s = state;
+      int n = s->n;
+      for (int i = 0; i < s->n; ) {
+        bool drained = false;
+        for (unsigned j = 0; j != sinks.size() && !drained; ++j) {
+          drained = sinks[j]->contains(s->x + 3*i);
+        }
+        // the last particle moves into i, so look at i again.
+        if (drained) {
+          remove_particle(s, i);
+          if ((unsigned)s->n < pressure.size()) pressure[i] = pressure[s->n];
+        } else {
+          ++i;
+        }
+      }
+      for (unsigned j = 0; j != emitters.size(); ++j) {
+        emitters[j]->emit(params.dt, [&](vec3_in pos, vec3_in vel) {
+          unsigned i = s->n;
+          add_particle(s, pos, vel);
+          if (i < pressure.size()) pressure[i] = 0;
+        });
+      }
+      if (s->n != n) update_backend();
+    }
   public:
 
     // this is called when we construct the class
     particles_app(int argc, char **argv) : app(argc, argv) {
+      default_params(&params);
+      create_world();
+      coupling = 0;
+      boundary_hits = 0;
+      use_opencl = false;
+      deterministic = false;
+      mixed_precision = false;
+      use_inflow = false;
+      use_pcisph = false;
+      use_software = false;
+      software = 0;
+      dt_scale = 0;
+      pressure_tolerance = 0.01f;
+      pressure_iterations = 0;
+      density_error = 0;
+      neighbour_stride = 32;
+      checkpoint_every = 100;
+      #if OCTET_OPENCL
+        opencl = 0;
+      #endif
+      for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--opencl")) use_opencl = true;
+        if (!strcmp(argv[i], "--deterministic")) deterministic = true;
+        if (!strcmp(argv[i], "--mixed_precision")) mixed_precision = true;
+        if (!strcmp(argv[i], "--inflow")) use_inflow = true;
+        if (!strcmp(argv[i], "--pcisph")) use_pcisph = true;
+        if (!strcmp(argv[i], "--software")) use_software = true;
+        if (!strcmp(argv[i], "--dt_scale") && i + 1 < argc) dt_scale = (float)atof(argv[++i]);
+        if (!strcmp(argv[i], "--pressure_tolerance") && i + 1 < argc) pressure_tolerance = (float)atof(argv[++i]);
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) thread_pool::get().set_num_threads(atoi(argv[++i]));
+        if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc) checkpoint_path = argv[++i];
+        if (!strcmp(argv[i], "--checkpoint_every") && i + 1 < argc) checkpoint_every = atoi(argv[++i]);
+        if (!strcmp(argv[i], "--restart") && i + 1 < argc) restart_path = argv[++i];
+      }
+    }
+
+    ~particles_app() {
+      checkpoint.wait();
+      destroy_world();
+      for (unsigned i = 0; i != rigid_bodies.size(); ++i) {
+        btRigidBody *rigid_body = rigid_bodies[i];
+        delete rigid_body->getMotionState();
+        delete rigid_body->getCollisionShape();
+        delete rigid_body;
+      }
+      delete coupling;
+      delete software;
+      #if OCTET_OPENCL
+        delete opencl;
+      #endif
     }
 
     // this is called once OpenGL is initialized
@@ -105,14 +733,30 @@ namespace octet {
 
 	    angle = 0.0f;
 
+      // stream to webui/fluid.html
+      server.init(NULL);
+      stats_channel = server.add_channel("fluid_stats", "text/event-stream");
+      particles_channel = server.add_channel("particles", "application/octet-stream");
+      frame_number = 0;
+      step_time = 0;
+
       state = init_particles(&params);
+      if (dt_scale <= 0) dt_scale = 1;
+      params.dt *= dt_scale;
       int nframes = params.nframes;
       int npframe = params.npframe;
       float dt = params.dt;
       int n = state->n;
+      init_backend();
+      if (mixed_precision && !use_opencl) compare_precision();
+      init_boundary();
+      if (use_inflow) init_inflow();
+      init_rigid_bodies();
       compute_accel(state, &params);
       leapfrog_start(state, dt);
+      step_rigid_bodies();
       check_state(state);
+      if (!restart_path.empty()) load_checkpoint(restart_path.c_str());
       //for (int frame = 1; frame < params.nframes; ++frame) {
       //  for (int i = 0; i < params.npframe; ++i) {
       //    compute_accel(state, &params);
@@ -124,6 +768,136 @@ namespace octet {
       float te = cos(90.0f*3.14/180.0f);
     }
 
+    /// move the fluid and the bodies on by one step, run the taps and drains, publish the frame
+    /// to the webui and write a checkpoint if one is due. draw_world calls this every frame;
+    /// headless_tests calls it without a window.
+    void simulate_frame() {
+      double t0 = get_time_seconds();
+      compute_accel(state, &params);
+      leapfrog_step(state, params.dt);
+      step_rigid_bodies();
+      update_particles();
+      step_time = get_time_seconds() - t0;
+      //check_state(state);
+      publish_frame();
+      if (!checkpoint_path.empty() && checkpoint_every > 0 && frame_number % checkpoint_every == 0) {
+        save_checkpoint(checkpoint_path.c_str());
+      }
+    }
+
+    /// FNV-1a of the particles and the rigid bodies. Two runs with the same hash every frame are bitwise identical.
+    uint64_t get_state_hash() const {
+      const sim_state_t *s = state;
+      uint64_t hash = thread_pool::get().parallel_reduce(s->n, 1024, 0xcbf29ce484222325ull,
+        [&](unsigned begin, unsigned end) {
+          uint64_t h = 0xcbf29ce484222325ull;
+          h = fnv1a(h, s->x + begin*3, ( end - begin ) * 3 * sizeof(float));
+          h = fnv1a(h, s->v + begin*3, ( end - begin ) * 3 * sizeof(float));
+          h = fnv1a(h, s->vh + begin*3, ( end - begin ) * 3 * sizeof(float));
+          h = fnv1a(h, s->rho + begin, ( end - begin ) * sizeof(float));
+          h = fnv1a(h, s->id + begin, ( end - begin ) * sizeof(unsigned));
+          return h;
+        },
+        [](uint64_t a, uint64_t b) { return fnv1a(a, &b, sizeof(b)); }
+      );
+      for (unsigned i = 0; i != rigid_bodies.size(); ++i) {
+        const btRigidBody *body = rigid_bodies[i];
+        btScalar values[22];
+        body->getCenterOfMassTransform().getOpenGLMatrix(values);
+        for (int j = 0; j != 3; ++j) {
+          values[16 + j] = body->getLinearVelocity()[j];
+          values[19 + j] = body->getAngularVelocity()[j];
+        }
+        hash = fnv1a(hash, values, sizeof(values));
+      }
+      return hash;
+    }
+
+    /// The particles, for checking them. The first n ids are the live particles'.
+    const sim_state_t *get_state() const {
+      return state;
+    }
+
+    /// The constants of the simulation, eg. rho0 and the time step.
+    const sim_param_t &get_params() const {
+      return params;
+    }
+
+    /// Number of Bullet bodies: the walls and the dome, which are static, then the dropped bodies.
+    unsigned get_num_rigid_bodies() const {
+      return rigid_bodies.size();
+    }
+
+    /// Bullet body i, for reading its position and velocity.
+    const btRigidBody *get_rigid_body(unsigned i) const {
+      return rigid_bodies[i];
+    }
+
+    /// log how far the mixed precision density and forces are from the float ones for the current state, and their speeds.
+    /// returns true if the densities are within 0.1% and the accelerations within 1% of their rms.
+    bool compare_precision() {
+      sim_state_t *s = state;
+      bool was_mixed = mixed_precision;
+      unsigned n = s->n;
+      dynarray<float> rho(n), a(n * 3);
+      double times[2];
+      for (int pass = 0; pass != 2; ++pass) {
+        mixed_precision = pass == 1;
+        double t0 = get_time_seconds();
+        compute_density(s, &params);
+        compute_forces(s, &params);
+        times[pass] = get_time_seconds() - t0;
+        if (pass == 0) {
+          memcpy(rho.data(), s->rho, n * sizeof(float));
+          memcpy(a.data(), s->a, n * 3 * sizeof(float));
+        }
+      }
+
+      float rho_max_error = 0;
+      double a2 = 0, da2 = 0, da2_max = 0;
+      for (unsigned i = 0; i != n; ++i) {
+        float e = fabsf(s->rho[i] - rho[i]) / rho[i];
+        rho_max_error = e > rho_max_error ? e : rho_max_error;
+        double d2 = 0;
+        for (unsigned j = i * 3; j != i * 3 + 3; ++j) {
+          a2 += a[j] * a[j];
+          d2 += ( s->a[j] - a[j] ) * ( s->a[j] - a[j] );
+        }
+        da2 += d2;
+        da2_max = d2 > da2_max ? d2 : da2_max;
+      }
+      float a_rms = (float)sqrt(a2 / ( n ? n : 1 ));
+      log("compare_precision: rho max relative error %g, a rms error %g max error %g (of rms %g)\n",
+        rho_max_error, sqrt(da2 / ( n ? n : 1 )) / a_rms, sqrt(da2_max) / a_rms, a_rms
+      );
+      log("compare_precision: float %.3fms mixed %.3fms for density and forces\n", times[0] * 1000, times[1] * 1000);
+      mixed_precision = was_mixed;
+      return rho_max_error < 1e-3f && sqrt(da2_max) < 1e-2f * a_rms;
+    }
+
+    #if OCTET_OPENCL
+      /// run the fluid with OpenCL from the current state if a device gives the same density,
+      /// forces and leapfrog step as the native code, within compare_backends' tolerance.
+      /// returns false, and stays native, if there is no device or its answers differ.
+      bool start_opencl() {
+        delete opencl;
+        opencl = new sph_opencl();
+        sim_state_t *s = state;
+        bool ok = opencl->init(s->n, s->x, s->v, s->vh, s->a, s->rho, get_domain(), params.h);
+        // a device that gets different answers is not used.
+        if (ok && !compare_backends()) {
+          log("fluid backend: OpenCL on %s differs from native\n", opencl->get_device_name());
+          ok = false;
+        }
+        if (!ok) {
+          delete opencl;
+          opencl = 0;
+        }
+        use_opencl = opencl != 0;
+        return use_opencl;
+      }
+    #endif
+
     void compute_density(sim_state_t* s, sim_param_t* params)
     {
       int n = s->n;
@@ -133,82 +907,608 @@ namespace octet {
       float h2 = h*h;
       float h8 = ( h2*h2 )*( h2*h2 );
       float C = 4 * s->mass / 3.14f / h8;  // 4m/(π*h^8)
-      memset(rho, 0, n*sizeof(float));
-      for (int i = 0; i < n; ++i) {
-        rho[i] += 4 * s->mass / 3.14f / h2;
-        for (int j = i+1; j < n; ++j) { // another for ??????!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-          float dx = x[3*i+0]-x[3*j+0];
-          float dy = x[3*i+1]-x[3*j+1];
-          float dz = x[3*i+2]-x[3*j+2];
-          // x*x + y*y = r*r
-          // next two lines check about the distance in a circle, if another particle is inside its radius then take it into consideration
-          float r2 = dx*dx + dy*dy +dz*dz;
-          float z = h2-r2;
-          if (z > 0) {
-            float rho_ij = C*z*z*z;
-            rho[i] += rho_ij;
-            rho[j] += rho_ij;
+      #if OCTET_OPENCL
+        if (opencl) {
+          opencl->compute_density(s->mass);
+          return;
+        }
+      #endif
+      if (use_pcisph) {
+        // the same sums as below over the neighbour lists, which the pressure solver uses again.
+        find_neighbours(s, params);
+        thread_pool::get().parallel_ranges(n, 256, [&](unsigned begin, unsigned end) {
+          for (unsigned i = begin; i != end; ++i) {
+            float result = 4 * s->mass / 3.14f / h2;
+            for (unsigned k = i * neighbour_stride, e = k + neighbour_count[i]; k != e; ++k) {
+              const neighbour &nb = neighbours[k];
+              float z = h2 - ( nb.dx*nb.dx + nb.dy*nb.dy + nb.dz*nb.dz );
+              if (z > 0) {
+                result += C*z*z*z;
+              }
+            }
+            rho[i] = result;
+          }
+        });
+        return;
+      }
+      // only particles in the cells around a particle can be within h of it.
+      grid.build(x, n);
+      if (mixed_precision) {
+        // the particles of a cell share their neighbours, so unpack them once for all of the cell.
+        grid.pack(x, s->v, n);
+        const unsigned *order = grid.get_order();
+        thread_pool::get().parallel_ranges(grid.get_num_cells(), 64, [&](unsigned begin, unsigned end) {
+          sph_grid::neighbourhood nb;
+          for (unsigned cell = begin; cell != end; ++cell) {
+            if (!grid.get_cell_size(cell)) continue;
+            grid.unpack_neighbourhood(cell, nb, false);
+            // four neighbours at a time in four separate sums, the same with or without SSE.
+            // the particle itself is at r=0 and adds C*h^6, the self term of the float loop.
+            const float *nx = nb.x.data(), *ny = nb.y.data(), *nz = nb.z.data();
+            for (unsigned k = nb.self_begin; k != nb.self_end; ++k) {
+              float xi = nx[k], yi = ny[k], zi = nz[k];
+              float sum[4] = { 0, 0, 0, 0 };
+              #if OCTET_SSE
+                __m128 xi4 = _mm_set1_ps(xi), yi4 = _mm_set1_ps(yi), zi4 = _mm_set1_ps(zi);
+                __m128 h2_4 = _mm_set1_ps(h2), zero = _mm_setzero_ps(), sum4 = zero;
+                for (unsigned j = 0; j != nb.count; j += 4) {
+                  __m128 dx = _mm_sub_ps(xi4, _mm_loadu_ps(nx + j));
+                  __m128 dy = _mm_sub_ps(yi4, _mm_loadu_ps(ny + j));
+                  __m128 dz = _mm_sub_ps(zi4, _mm_loadu_ps(nz + j));
+                  __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                  __m128 z = _mm_max_ps(_mm_sub_ps(h2_4, r2), zero);
+                  sum4 = _mm_add_ps(sum4, _mm_mul_ps(_mm_mul_ps(z, z), z));
+                }
+                _mm_storeu_ps(sum, sum4);
+              #else
+                for (unsigned j = 0; j != nb.count; j += 4) {
+                  for (unsigned l = 0; l != 4; ++l) {
+                    float dx = xi-nx[j+l];
+                    float dy = yi-ny[j+l];
+                    float dz = zi-nz[j+l];
+                    float r2 = dx*dx + dy*dy + dz*dz;
+                    float z = h2-r2;
+                    if (z > 0) {
+                      sum[l] += z*z*z;
+                    }
+                  }
+                }
+              #endif
+              float result = C * ( ( sum[0] + sum[1] ) + ( sum[2] + sum[3] ) );
+              rho[order[nb.first_slot + k - nb.self_begin]] = result;
+            }
+          }
+        });
+        return;
+      }
+      thread_pool::get().parallel_ranges(n, 256, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          float xi = x[3*i+0], yi = x[3*i+1], zi = x[3*i+2];
+          float result = 4 * s->mass / 3.14f / h2;
+          grid.for_each_neighbour(x, i, [&](unsigned j) {
+            if (j == i) return;
+            float dx = xi-x[3*j+0];
+            float dy = yi-x[3*j+1];
+            float dz = zi-x[3*j+2];
+            // x*x + y*y = r*r
+            // next two lines check about the distance in a circle, if another particle is inside its radius then take it into consideration
+            float r2 = dx*dx + dy*dy + dz*dz;
+            float z = h2-r2;
+            if (z > 0) {
+              result += C*z*z*z;
+            }
+          });
+          rho[i] = result;
+        }
+      });
+    }
+
+    // pressure, viscosity and gravity; each particle adds up its own neighbours so that the threads do not share.
+    void compute_forces(sim_state_t* state, sim_param_t* params)
+    {
+      const float h = params->h;
+      const float rho0 = params->rho0;
+      const float k = params->k;
+      const float mu = params->mu;
+      const float g = params->g;
+      const float mass = state->mass;
+      const float h2 = h*h;
+      const float* rho = state->rho;
+      const float* x = state->x;
+      const float* v = state->v;
+      float* a = state->a;
+      int n = state->n;
+      #if OCTET_OPENCL
+        if (opencl) {
+          opencl->compute_forces(mass, rho0, k, mu, g);
+          return;
+        }
+      #endif
+      // Constants for interaction term
+      float C0 = mass / 3.14f / ( (h2)*(h2) );
+      float Cp = 15*k;
+      float Cv = -40*mu;
+      if (mixed_precision) {
+        grid.pack_density(rho);
+        const unsigned *order = grid.get_order();
+        thread_pool::get().parallel_ranges(grid.get_num_cells(), 64, [&](unsigned begin, unsigned end) {
+          sph_grid::neighbourhood nb;
+          for (unsigned cell = begin; cell != end; ++cell) {
+            if (!grid.get_cell_size(cell)) continue;
+            grid.unpack_neighbourhood(cell, nb, true);
+            // four neighbours at a time as in compute_density; r=0 is the particle itself.
+            const float *nx = nb.x.data(), *ny = nb.y.data(), *nz = nb.z.data();
+            const float *nvx = nb.vx.data(), *nvy = nb.vy.data(), *nvz = nb.vz.data(), *nrho = nb.rho.data();
+            for (unsigned k = nb.self_begin; k != nb.self_end; ++k) {
+              float xi = nx[k], yi = ny[k], zi = nz[k];
+              float vxi = nvx[k], vyi = nvy[k], vzi = nvz[k];
+              const float rhoi = nrho[k];
+              float sx[4] = { 0, 0, 0, 0 }, sy[4] = { 0, 0, 0, 0 }, sz[4] = { 0, 0, 0, 0 };
+              #if OCTET_SSE
+                __m128 xi4 = _mm_set1_ps(xi), yi4 = _mm_set1_ps(yi), zi4 = _mm_set1_ps(zi);
+                __m128 vxi4 = _mm_set1_ps(vxi), vyi4 = _mm_set1_ps(vyi), vzi4 = _mm_set1_ps(vzi);
+                __m128 rhoi4 = _mm_set1_ps(rhoi), h4 = _mm_set1_ps(h), h2_4 = _mm_set1_ps(h2), zero = _mm_setzero_ps();
+                __m128 one = _mm_set1_ps(1), C0_4 = _mm_set1_ps(C0), Cp4 = _mm_set1_ps(Cp), Cv4 = _mm_set1_ps(Cv);
+                __m128 rho0_2 = _mm_set1_ps(2*rho0);
+                __m128 ax4 = zero, ay4 = zero, az4 = zero;
+                for (unsigned j = 0; j != nb.count; j += 4) {
+                  __m128 dx = _mm_sub_ps(xi4, _mm_loadu_ps(nx + j));
+                  __m128 dy = _mm_sub_ps(yi4, _mm_loadu_ps(ny + j));
+                  __m128 dz = _mm_sub_ps(zi4, _mm_loadu_ps(nz + j));
+                  __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                  __m128 inside = _mm_and_ps(_mm_cmplt_ps(r2, h2_4), _mm_cmpgt_ps(r2, zero));
+                  if (!_mm_movemask_ps(inside)) continue;
+                  __m128 rhoj = _mm_loadu_ps(nrho + j);
+                  __m128 q = _mm_div_ps(_mm_sqrt_ps(r2), h4);
+                  __m128 u = _mm_sub_ps(one, q);
+                  __m128 w0 = _mm_div_ps(_mm_div_ps(_mm_mul_ps(C0_4, u), rhoi4), rhoj);
+                  __m128 wp = _mm_mul_ps(_mm_mul_ps(w0, Cp4), _mm_sub_ps(_mm_add_ps(rhoi4, rhoj), rho0_2));
+                  wp = _mm_and_ps(_mm_div_ps(_mm_mul_ps(wp, u), q), inside);
+                  __m128 wv = _mm_and_ps(_mm_mul_ps(w0, Cv4), inside);
+                  __m128 dvx = _mm_sub_ps(vxi4, _mm_loadu_ps(nvx + j));
+                  __m128 dvy = _mm_sub_ps(vyi4, _mm_loadu_ps(nvy + j));
+                  __m128 dvz = _mm_sub_ps(vzi4, _mm_loadu_ps(nvz + j));
+                  ax4 = _mm_add_ps(ax4, _mm_add_ps(_mm_mul_ps(wp, dx), _mm_mul_ps(wv, dvx)));
+                  ay4 = _mm_add_ps(ay4, _mm_add_ps(_mm_mul_ps(wp, dy), _mm_mul_ps(wv, dvy)));
+                  az4 = _mm_add_ps(az4, _mm_add_ps(_mm_mul_ps(wp, dz), _mm_mul_ps(wv, dvz)));
+                }
+                _mm_storeu_ps(sx, ax4);
+                _mm_storeu_ps(sy, ay4);
+                _mm_storeu_ps(sz, az4);
+              #else
+                for (unsigned j = 0; j != nb.count; j += 4) {
+                  for (unsigned l = 0; l != 4; ++l) {
+                    float dx = xi-nx[j+l];
+                    float dy = yi-ny[j+l];
+                    float dz = zi-nz[j+l];
+                    float r2 = dx*dx + dy*dy + dz*dz;
+                    if (r2 < h2 && r2 > 0) {
+                      const float rhoj = nrho[j+l];
+                      float q = sqrtf(r2)/h;
+                      float u = 1-q;
+                      float w0 = C0 * u/rhoi/rhoj;
+                      float wp = w0 * Cp * (rhoi+rhoj-2*rho0) * u/q;
+                      float wv = w0 * Cv;
+                      float dvx = vxi-nvx[j+l];
+                      float dvy = vyi-nvy[j+l];
+                      float dvz = vzi-nvz[j+l];
+                      sx[l] += wp*dx + wv*dvx;
+                      sy[l] += wp*dy + wv*dvy;
+                      sz[l] += wp*dz + wv*dvz;
+                    }
+                  }
+                }
+              #endif
+              float ax = ( sx[0] + sx[1] ) + ( sx[2] + sx[3] );
+              float ay = -g + ( ( sy[0] + sy[1] ) + ( sy[2] + sy[3] ) );
+              float az = ( sz[0] + sz[1] ) + ( sz[2] + sz[3] );
+              unsigned i = order[nb.first_slot + k - nb.self_begin];
+              a[3*i+0] = ax;
+              a[3*i+1] = ay;
+              a[3*i+2] = az;
+            }
+          }
+        });
+        return;
+      }
+      thread_pool::get().parallel_ranges(n, 256, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          const float rhoi = rho[i];
+          float xi = x[3*i+0], yi = x[3*i+1], zi = x[3*i+2];
+          // Start with gravity and surface forces
+          float ax = 0, ay = -g, az = 0;
+          grid.for_each_neighbour(x, i, [&](unsigned j) {
+            if (j == i) return;
+            float dx = xi-x[3*j+0];
+            float dy = yi-x[3*j+1];
+            float dz = zi-x[3*j+2];
+            float r2 = dx*dx + dy*dy + dz*dz;
+            // the particles that are not inside the radius contribute to acceleration
+            if (r2 < h2) {
+              const float rhoj = rho[j];
+              float q = sqrtf(r2)/h;
+              float u = 1-q;
+              float w0 = C0 * u/rhoi/rhoj;
+              float wp = w0 * Cp * (rhoi+rhoj-2*rho0) * u/q;
+              float wv = w0 * Cv;
+              float dvx = v[3*i+0]-v[3*j+0];
+              float dvy = v[3*i+1]-v[3*j+1];
+              float dvz = v[3*i+2]-v[3*j+2];
+              ax += wp*dx + wv*dvx;
+              ay += wp*dy + wv*dvy;
+              az += wp*dz + wv*dvz;
+            }
+          });
+          a[3*i+0] = ax;
+          a[3*i+1] = ay;
+          a[3*i+2] = az;
+        }
+      });
+    }
+
+    // PCISPH: sort the particles into the grid and list the neighbours of each within h, in the
+    // order of for_each_neighbour. Each particle has room for neighbour_stride of them; if one has
+    // more, the lists are made again with more room.
+    void find_neighbours(sim_state_t* s, const sim_param_t* params) {
+      const float h2 = params->h * params->h;
+      const float* x = s->x;
+      unsigned n = s->n;
+      grid.build(x, n);
+      neighbour_count.resize(n);
+      for (;;) {
+        neighbours.resize(n * neighbour_stride);
+        unsigned most = thread_pool::get().parallel_reduce(n, 256, 0u,
+          [&](unsigned begin, unsigned end) {
+            unsigned most = 0;
+            for (unsigned i = begin; i != end; ++i) {
+              float xi = x[3*i+0], yi = x[3*i+1], zi = x[3*i+2];
+              neighbour *nb = neighbours.data() + i * neighbour_stride;
+              unsigned count = 0;
+              grid.for_each_neighbour(x, i, [&](unsigned j) {
+                float dx = xi-x[3*j+0];
+                float dy = yi-x[3*j+1];
+                float dz = zi-x[3*j+2];
+                if (j != i && dx*dx + dy*dy + dz*dz < h2) {
+                  if (count < neighbour_stride) {
+                    nb[count].j = j;
+                    nb[count].dx = dx;
+                    nb[count].dy = dy;
+                    nb[count].dz = dz;
+                    nb[count].wp = 0;
+                  }
+                  ++count;
+                }
+              });
+              neighbour_count[i] = count;
+              most = count > most ? count : most;
+            }
+            return most;
+          },
+          [](unsigned a, unsigned b) { return a > b ? a : b; }
+        );
+        if (most <= neighbour_stride) break;
+        neighbour_stride = most;
+      }
+    }
+
+    // PCISPH: the pressure change that puts right a density error of one for a particle with all its
+    // neighbours, on the lattice of place_particles, in a time step of dt.
+    float get_pressure_delta(const sim_param_t* params, float mass, float dt) {
+      const float h = params->h, h2 = h*h, rho0 = params->rho0;
+      const float C = 4 * mass / 3.14f / ( ( h2*h2 )*( h2*h2 ) );
+      const float C0 = mass / 3.14f / ( (h2)*(h2) );
+      float hh = params->spacing;
+      int steps = (int)( h / hh );
+      // particle i at the origin has a pressure of one and pushes its neighbours away, and itself from them.
+      // the first pass adds up how far i moves, the second how much its density changes.
+      vec3 dxi(0, 0, 0);
+      float drho = 0;
+      for (int pass = 0; pass != 2; ++pass) {
+        for (int z = -steps; z <= steps; ++z) {
+          for (int y = -steps; y <= steps; ++y) {
+            for (int x = -steps; x <= steps; ++x) {
+              vec3 dx = vec3((float)x, (float)y, (float)z) * -hh;
+              float r2 = dot(dx, dx);
+              if (r2 == 0 || r2 >= h2) continue;
+              float q = sqrtf(r2)/h;
+              float u = 1-q;
+              vec3 move = ( C0 * u/rho0/rho0 * 15 * u/q * dt*dt ) * dx;
+              if (pass == 0) {
+                dxi += move;
+              } else {
+                float w = h2 - r2;
+                drho += dot(-6 * C * w*w * dx, dxi + move);
+              }
+            }
           }
         }
       }
+      return drho < 0 ? -1 / drho : 0;
+    }
+
+    // PCISPH: the pressure solver sees the walls of the box as layers of particles at rest on the lattice of
+    // place_particles, one spacing apart beyond them, with the same pressure as the particle next to them.
+    // This holds up the particles at a wall rather than letting the solver push them into it.
+    // wall_density is the part of rho0 the layers give a particle at a distance from a wall and wall_push
+    // the acceleration away from the wall for p/rho of one, in units of mass/(rho0*h^3).
+    void init_wall_tables() {
+      float spacing = params.spacing / params.h;
+      int steps = (int)( 1 / spacing );
+      // a whole lattice, for the density of a particle with all its neighbours.
+      float full = 0;
+      for (int z = -steps; z <= steps; ++z) {
+        for (int y = -steps; y <= steps; ++y) {
+          for (int x = -steps; x <= steps; ++x) {
+            float r2 = (float)( x*x + y*y + z*z ) * spacing * spacing;
+            if (r2 < 1) full += ( 1 - r2 ) * ( 1 - r2 ) * ( 1 - r2 );
+          }
+        }
+      }
+      wall_density.resize(wall_steps + 1);
+      wall_push.resize(wall_steps + 1);
+      for (int i = 0; i <= wall_steps; ++i) {
+        float d = (float)i / wall_steps;
+        float density = 0, push = 0;
+        for (int layer = 1; d + layer * spacing < 1; ++layer) {
+          float dy = d + layer * spacing;
+          for (int z = -steps; z <= steps; ++z) {
+            for (int x = -steps; x <= steps; ++x) {
+              float r2 = dy * dy + (float)( x*x + z*z ) * spacing * spacing;
+              if (r2 >= 1) continue;
+              float q = sqrtf(r2);
+              density += ( 1 - r2 ) * ( 1 - r2 ) * ( 1 - r2 );
+              // C0 * u/rhoi/rhoj * 15*(pi+pj) * u/q * dy of compute_forces with pj = pi and rhoj = rho0.
+              push += 30 / 3.14f * ( 1 - q ) * ( 1 - q ) / q * dy;
+            }
+          }
+        }
+        wall_density[i] = density / full;
+        wall_push[i] = push;
+      }
+    }
+
+    // a wall table at distance d from a wall, in units of h.
+    float get_wall(const dynarray<float> &table, float d) const {
+      float t = d * wall_steps;
+      if (t <= 0) return table[0];
+      if (t >= wall_steps) return 0;
+      int i = (int)t;
+      return table[i] + ( table[i + 1] - table[i] ) * ( t - i );
+    }
+
+    // the slope of a wall table at distance d from a wall, per h.
+    float get_wall_slope(const dynarray<float> &table, float d) const {
+      float t = d * wall_steps;
+      if (t < 0 || t >= wall_steps) return 0;
+      int i = (int)t;
+      return ( table[i + 1] - table[i] ) * wall_steps;
+    }
+
+    // PCISPH: predict the positions after the step with viscosity, gravity and the pressures so far,
+    // then raise the pressures where the predicted density is above rho0 until it is within
+    // pressure_tolerance everywhere. The pressures come out as big as they need to be for dt
+    // rather than from the stiffness k of compute_forces.
+    // The neighbours are those that compute_density found; the particles move much less than h in a step.
+    void solve_pressure(sim_state_t* s, sim_param_t* params)
+    {
+      enum { min_iterations = 3, max_iterations = 50 };
+      // delta is for a particle whose neighbours keep their pressures; they all change at once,
+      // so take half of it or the iterations go back and forth.
+      const float omega = 0.5f;
+
+      const float h = params->h;
+      const float h2 = h*h;
+      const float rho0 = params->rho0;
+      const float mu = params->mu;
+      const float g = params->g;
+      const float dt = params->dt;
+      const float mass = s->mass;
+      const float C = 4 * mass / 3.14f / ( ( h2*h2 )*( h2*h2 ) );
+      const float C0 = mass / 3.14f / ( (h2)*(h2) );
+      const float Cv = -40*mu;
+      // particles with few neighbours barely change density with their pressure, so limit how fast it grows.
+      const float max_delta = 4 * get_pressure_delta(params, mass, dt);
+      const float* x = s->x;
+      const float* v = s->v;
+      const float* vh = s->vh;
+      const float* rho = s->rho;
+      float* a = s->a;
+      unsigned n = s->n;
+
+      // sized for the capacity so that they only grow when the state does.
+      // the pressures start from those of the last step, which are mostly the weight of the fluid above.
+      unsigned old_size = pressure.size();
+      pressure.resize(s->capacity);
+      if (old_size < pressure.size()) memset(&pressure[old_size], 0, ( pressure.size() - old_size ) * sizeof(float));
+      pressure_delta.resize(s->capacity);
+      rho_pred.resize(s->capacity);
+      x_pred.resize(s->capacity * 3);
+      a_other.resize(s->capacity * 3);
+      body_rho.resize(s->capacity);
+      body_push.resize(s->capacity * 3);
+      body_grad.resize(s->capacity * 3);
+      if (wall_density.size() == 0) init_wall_tables();
+
+      // the rigid bodies take the pressures of the particles near them. Their density is predicted
+      // from its gradient and their push is added to the prediction; add_forces pushes for real.
+      if (coupling) {
+        coupling->get_pressure_terms(x, rho, body_push.data(), body_grad.data(), n, rho0);
+      } else {
+        memset(body_push.data(), 0, n * 3 * sizeof(float));
+        memset(body_grad.data(), 0, n * 3 * sizeof(float));
+      }
+
+      // viscosity and gravity as in compute_forces, the pressure weights of the neighbours and
+      // the pressure change that puts right a density error of one, as in get_pressure_delta but
+      // with the particle's own neighbours and walls.
+      thread_pool::get().parallel_ranges(n, 256, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          const float rhoi = rho[i];
+          float xi = x[3*i+0], yi = x[3*i+1], zi = x[3*i+2];
+          float ax = 0, ay = -g, az = 0;
+          float push = mass / ( rhoi * rho0 * h2 * h );
+          float mx = push * ( get_wall(wall_push, xi / h) - get_wall(wall_push, ( 1 - xi ) / h) );
+          float my = push * ( get_wall(wall_push, yi / h) - get_wall(wall_push, ( 1 - yi ) / h) );
+          float mz = push * ( get_wall(wall_push, zi / h) - get_wall(wall_push, ( 1 - zi ) / h) );
+          mx += body_push[3*i+0];
+          my += body_push[3*i+1];
+          mz += body_push[3*i+2];
+          float fluid_rho = 4 * mass / 3.14f / h2;
+          for (unsigned k = i * neighbour_stride, e = k + neighbour_count[i]; k != e; ++k) {
+            neighbour &nb = neighbours[k];
+            unsigned j = nb.j;
+            float r2 = nb.dx*nb.dx + nb.dy*nb.dy + nb.dz*nb.dz;
+            float q = sqrtf(r2)/h;
+            float u = 1-q;
+            if (u <= 0) continue;
+            fluid_rho += C * ( h2 - r2 ) * ( h2 - r2 ) * ( h2 - r2 );
+            float w0 = C0 * u/rhoi/rho[j];
+            float wv = w0 * Cv;
+            nb.wp = w0 * 15 * u/q;
+            ax += wv*(v[3*i+0]-v[3*j+0]);
+            ay += wv*(v[3*i+1]-v[3*j+1]);
+            az += wv*(v[3*i+2]-v[3*j+2]);
+            mx += nb.wp*nb.dx;
+            my += nb.wp*nb.dy;
+            mz += nb.wp*nb.dz;
+          }
+          a_other[3*i+0] = a[3*i+0] = ax;
+          a_other[3*i+1] = a[3*i+1] = ay;
+          a_other[3*i+2] = a[3*i+2] = az;
+          body_rho[i] = rho[i] - fluid_rho;
+
+          // a pressure of one moves i by m dt^2 and each neighbour the other way.
+          mx *= dt*dt;
+          my *= dt*dt;
+          mz *= dt*dt;
+          float drho = rho0 / h * (
+            ( get_wall_slope(wall_density, xi / h) - get_wall_slope(wall_density, ( 1 - xi ) / h) ) * mx +
+            ( get_wall_slope(wall_density, yi / h) - get_wall_slope(wall_density, ( 1 - yi ) / h) ) * my +
+            ( get_wall_slope(wall_density, zi / h) - get_wall_slope(wall_density, ( 1 - zi ) / h) ) * mz
+          ) + body_grad[3*i+0] * mx + body_grad[3*i+1] * my + body_grad[3*i+2] * mz;
+          for (unsigned k = i * neighbour_stride, e = k + neighbour_count[i]; k != e; ++k) {
+            const neighbour &nb = neighbours[k];
+            float w = h2 - ( nb.dx*nb.dx + nb.dy*nb.dy + nb.dz*nb.dz );
+            if (w <= 0) continue;
+            float move = nb.wp * dt*dt;
+            drho -= 6 * C * w*w * ( nb.dx * ( mx + move*nb.dx ) + nb.dy * ( my + move*nb.dy ) + nb.dz * ( mz + move*nb.dz ) );
+          }
+          pressure_delta[i] = drho < 0 && -1 / drho < max_delta ? -1 / drho : max_delta;
+        }
+      });
+
+      float error = 0;
+      int iteration = 0;
+      for (;; ++iteration) {
+        // where leapfrog_step will put the particles, kept in the box as stop_bc will.
+        thread_pool::get().parallel_ranges(n * 3, 1024, [&](unsigned begin, unsigned end) {
+          for (unsigned i = begin; i != end; ++i) {
+            float xp = x[i] + ( vh[i] + ( a[i] + body_push[i] * pressure[i/3] ) * dt ) * dt;
+            x_pred[i] = xp < 0 ? 0 : xp > 1 ? 1 : xp;
+          }
+        });
+
+        // densities there.
+        thread_pool::get().parallel_ranges(n, 256, [&](unsigned begin, unsigned end) {
+          for (unsigned i = begin; i != end; ++i) {
+            float xi = x_pred[3*i+0], yi = x_pred[3*i+1], zi = x_pred[3*i+2];
+            float result = 4 * mass / 3.14f / h2;
+            for (unsigned k = i * neighbour_stride, e = k + neighbour_count[i]; k != e; ++k) {
+              unsigned j = neighbours[k].j;
+              float dx = xi-x_pred[3*j+0];
+              float dy = yi-x_pred[3*j+1];
+              float dz = zi-x_pred[3*j+2];
+              float r2 = dx*dx + dy*dy + dz*dz;
+              float z = h2-r2;
+              if (z > 0) {
+                result += C*z*z*z;
+              }
+            }
+            // the walls of the box, from 0 to 1 on each axis, and the rigid bodies.
+            for (int k = 0; k != 3; ++k) {
+              float d = x_pred[3*i+k] / h;
+              result += rho0 * ( get_wall(wall_density, d) + get_wall(wall_density, 1 / h - d) );
+              result += body_grad[3*i+k] * ( x_pred[3*i+k] - x[3*i+k] );
+            }
+            result += body_rho[i];
+            rho_pred[i] = result;
+          }
+        });
+
+        // only squashing counts; particles at the surface are allowed to be less dense.
+        error = thread_pool::get().parallel_reduce(n, 1024, 0.0f,
+          [&](unsigned begin, unsigned end) {
+            float e = 0;
+            for (unsigned i = begin; i != end; ++i) {
+              float ei = ( rho_pred[i] - rho0 ) / rho0;
+              e = ei > e ? ei : e;
+            }
+            return e;
+          },
+          [](float a, float b) { return a > b ? a : b; }
+        );
+        if (( error < pressure_tolerance && iteration >= min_iterations ) || iteration == max_iterations) break;
+
+        thread_pool::get().parallel_ranges(n, 1024, [&](unsigned begin, unsigned end) {
+          for (unsigned i = begin; i != end; ++i) {
+            float p = pressure[i] + omega * pressure_delta[i] * ( rho_pred[i] - rho0 );
+            pressure[i] = p > 0 ? p : 0;
+          }
+        });
+
+        // the pressure part of compute_forces with these pressures in place of k(rho-rho0).
+        thread_pool::get().parallel_ranges(n, 256, [&](unsigned begin, unsigned end) {
+          for (unsigned i = begin; i != end; ++i) {
+            const float rhoi = rho[i];
+            const float pi = pressure[i];
+            float xi = x[3*i+0], yi = x[3*i+1], zi = x[3*i+2];
+            float ax = a_other[3*i+0], ay = a_other[3*i+1], az = a_other[3*i+2];
+            for (unsigned k = i * neighbour_stride, e = k + neighbour_count[i]; k != e; ++k) {
+              const neighbour &nb = neighbours[k];
+              float wp = nb.wp * (pi+pressure[nb.j]);
+              ax += wp*nb.dx;
+              ay += wp*nb.dy;
+              az += wp*nb.dz;
+            }
+            float push = pi / rhoi * mass / ( rho0 * h2 * h );
+            ax += push * ( get_wall(wall_push, xi / h) - get_wall(wall_push, ( 1 - xi ) / h) );
+            ay += push * ( get_wall(wall_push, yi / h) - get_wall(wall_push, ( 1 - yi ) / h) );
+            az += push * ( get_wall(wall_push, zi / h) - get_wall(wall_push, ( 1 - zi ) / h) );
+            a[3*i+0] = ax;
+            a[3*i+1] = ay;
+            a[3*i+2] = az;
+          }
+        });
+      }
+      pressure_iterations = iteration;
+      density_error = error;
     }
 
 void compute_accel(sim_state_t* state, sim_param_t* params)
 {
   // Unpack basic parameters
-  const float h = params->h;
   const float rho0 = params->rho0;
   const float k = params->k;
   const float mu = params->mu;
-  const float g = params->g;
   const float mass = state->mass;
-  const float h2 = h*h;
   // Unpack system state
   const float* rho = state->rho;
   const float* x = state->x;
   const float* v = state->v;
   float* a = state->a;
   int n = state->n;
+  // Find the rigid bodies near the fluid
+  if (coupling) coupling->begin_step(x, n);
   // Compute density and color
   compute_density(state, params);
-  // Start with gravity and surface forces
-  for (int i = 0; i < n; ++i) {
-    a[3*i+0] = 0;
-    a[3*i+1] = -g;
-    a[3*i+2] = 0;
+  if (coupling) coupling->add_density(x, state->rho, n, rho0);
+  if (use_pcisph) {
+    solve_pressure(state, params);
+  } else {
+    compute_forces(state, params);
   }
-  // Constants for interaction term
-  float C0 = mass / 3.14f / ( (h2)*(h2) );
-  float Cp = 15*k;
-  float Cv = -40*mu;
-  // Now compute interaction forces
-  for (int i = 0; i < n; ++i) {
-    const float rhoi = rho[i];
-    for (int j = i+1; j < n; ++j) {
-      float dx = x[3*i+0]-x[3*j+0];
-      float dy = x[3*i+1]-x[3*j+1];
-      float dz = x[3*i+2]-x[3*j+2];
-      float r2 = dx*dx + dy*dy + dz*dz;
-      // the particles that are not inside the radius contribute to acceleration
-      if (r2 < h2) {
-        const float rhoj = rho[j];
-        float q = sqrt(r2)/h;
-        float u = 1-q;
-        float w0 = C0 * u/rhoi/rhoj;
-        float wp = w0 * Cp * (rhoi+rhoj-2*rho0) * u/q;
-        float wv = w0 * Cv;
-        float dvx = v[3*i+0]-v[3*j+0];
-        float dvy = v[3*i+1]-v[3*j+1];
-        float dvz = v[3*i+2]-v[3*j+2];
-        a[3*i+0] += (wp*dx + wv*dvx);
-        a[3*i+1] += (wp*dy + wv*dvy);
-        a[3*i+2] += (wp*dz + wv*dvz);
-        a[3*j+0] -= (wp*dx + wv*dvx);
-        a[3*j+1] -= (wp*dy + wv*dvy);
-        a[3*j+2] -= (wp*dz + wv*dvz);
-       }
-      }
-    }
+  // Pressure and viscosity from the rigid bodies, and their reactions
+  if (coupling) coupling->add_forces(x, v, rho, a, n, mass, rho0, k, mu, params->dt, use_pcisph ? pressure.data() : 0);
 }
 //Leapfrog integration is equivalent to updating positions x(t) and velocities v(t) at interleaved time points,
 //staggered in such a way that they 'leapfrog' over each other.
@@ -219,28 +1519,39 @@ void compute_accel(sim_state_t* state, sim_param_t* params)
 // we compute the v^(i+1/2) stored in vh and we compute an approximation of v^(i+1) (stored in v) 
 void leapfrog_step(sim_state_t* s, double dt)
 {
-  const float* a = s->a;
-  float* vh = s->vh;
-  float* v = s->v;
-  float* x = s->x;
-  int n = s->n;
-  for (int i = 0; i < 3*n; ++i) { vh[i] += a[i] * dt; }
-  for (int i = 0; i < 3*n; ++i) { v[i] = vh[i] + a[i] * dt / 2; }
-  for (int i = 0; i < 3*n; ++i) { x[i] += vh[i] * dt; }
-  reflect_bc(s); // reflect the particles
+  step_particles(s, dt, false);
+  if (use_pcisph) stop_bc(s); else reflect_bc(s); // keep the particles in the box
+  collide_boundary(s);
 }
 // At the first step, the leapfrog iteration only has the initial velocities v0, so we need to do something special
 void leapfrog_start(sim_state_t* s, double dt)
 {
+  step_particles(s, dt, true);
+  if (use_pcisph) stop_bc(s); else reflect_bc(s);
+  collide_boundary(s);
+}
+// the leapfrog update without the boundaries; start is the first step, which has no half step velocities.
+void step_particles(sim_state_t* s, double dt, bool start)
+{
+  #if OCTET_OPENCL
+    if (opencl) {
+      opencl->leapfrog((float)dt, start);
+      return;
+    }
+  #endif
   const float* a = s->a;
   float* vh = s->vh;
   float* v = s->v;
   float* x = s->x;
   int n = s->n;
-  for (int i = 0; i < 3*n; ++i) { vh[i] = v[i] + a[i] * dt / 2; }
-  for (int i = 0; i < 3*n; ++i) { v[i] += a[i] * dt; }
+  if (start) {
+    for (int i = 0; i < 3*n; ++i) { vh[i] = v[i] + a[i] * dt / 2; }
+    for (int i = 0; i < 3*n; ++i) { v[i] += a[i] * dt; }
+  } else {
+    for (int i = 0; i < 3*n; ++i) { vh[i] += a[i] * dt; }
+    for (int i = 0; i < 3*n; ++i) { v[i] = vh[i] + a[i] * dt / 2; }
+  }
   for (int i = 0; i < 3*n; ++i) { x[i] += vh[i] * dt; }
-  reflect_bc(s);
 }
 // which == 0 vertical barrier
 // which == 1 horrizontal barrier
@@ -293,6 +1604,28 @@ static void reflect_bc(sim_state_t* s)
   }
 }
 
+// the walls for the pressure solver, which has already slowed the particles down for them:
+// particles that get through are put back on the wall and lose their speed into it, which
+// solve_pressure can predict, where a bounce would send them back into the fluid.
+static void stop_bc(sim_state_t* s)
+{
+  float* vh = s->vh;
+  float* v = s->v;
+  float* x = s->x;
+  int n = s->n;
+  for (int i = 0; i < 3*n; ++i) {
+    if (x[i] < 0) {
+      x[i] = 0;
+      v[i] = v[i] < 0 ? 0 : v[i];
+      vh[i] = vh[i] < 0 ? 0 : vh[i];
+    } else if (x[i] > 1) {
+      x[i] = 1;
+      v[i] = v[i] > 0 ? 0 : v[i];
+      vh[i] = vh[i] > 0 ? 0 : vh[i];
+    }
+  }
+}
+
 typedef int (*domain_fun_t)(float, float);
 domain_fun_t functPointer;
 int box_indicator(float x, float y, float z)
@@ -310,8 +1643,7 @@ int circ_indicator(float x, float y)
 // The place particle routine determines the initial particle placement, but not the desired mass.
 sim_state_t* place_particles(sim_param_t* param)  //, domain_fun_t indicatef
 {
-  float h = param->h;
-  float hh = h/1.3f; // h/1.3f; // this determine the number of particles
+  float hh = param->spacing; // this determine the number of particles
   // Count mesh points that fall in indicated region.
   int count = 0;
   for (float x = 0; x < 1; x += hh) {   
@@ -345,8 +1677,7 @@ sim_state_t* place_particles(sim_param_t* param)  //, domain_fun_t indicatef
 }
 // force should be applied to some of these
 void addVelocity ( sim_state_t& s, sim_param_t& param, float x, float y, float z ) {
-  float h = param.h;
-  float hh = h/1.3f; // h/1.3f; // this determine the number of particles
+  float hh = param.spacing; // this determine the number of particles
   int p = 0;
   for (float i = 0.0f; i < 0.5f; i += 4*hh) {
     for (float j = 0.0f; j < 0.5f; j += 4*hh) {
@@ -362,8 +1693,7 @@ void addVelocity ( sim_state_t& s, sim_param_t& param, float x, float y, float z
   }
 }
 void zeroVelocity ( sim_state_t& s, sim_param_t& param ) {
-  float h = param.h;
-  float hh = h/1.3f; // h/1.3f; // this determine the number of particles
+  float hh = param.spacing; // this determine the number of particles
   int p = 0;
   for (float x = 0; x < 1; x += hh) {
     for (float y = 0; y < 1; y += hh) {
@@ -391,11 +1721,24 @@ void normalize_mass(sim_state_t* s, sim_param_t* param)
     rhos += s->rho[i];
   }
   s->mass *= ( rho0*rhos / rho2s );
+  // the pressure solver takes particles with all their neighbours to be at rest, so they must be at rho0.
+  if (use_pcisph) {
+    compute_density(s, param);
+    float rho_max = 0;
+    for (int i = 0; i < s->n; ++i) {
+      rho_max = s->rho[i] > rho_max ? s->rho[i] : rho_max;
+    }
+    if (rho_max > 0) s->mass *= rho0 / rho_max;
+  }
 }
 
 sim_state_t* init_particles(sim_param_t* param)
 {
   default_params(param);
+  // the pressure solver keeps the spacing but has h of 1.75 spacings, for 26 neighbours instead of six;
+  // with six its predicted densities are too rough for steps bigger than those of the equation of state.
+  if (use_pcisph) param->h = param->spacing * 1.75f;
+  grid.init(get_domain(), param->h);
   sim_state_t* s = place_particles(param); //, box_indicator
   normalize_mass(s, param);
   return s;
@@ -410,34 +1753,9 @@ void check_state(sim_state_t* s)
   //  assert( yi >= 0 || yi <= 1 );
   //}
 }
-    // this is called to draw the world
-    void draw_world(int x, int y, int w, int h) {
-
-      glViewport(x, y, w, h);
-      glClearColor(0, 0, 0, 1);
-      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-      glEnable(GL_DEPTH_TEST);
-      mat4t modelToProjection = mat4t::build_projection_matrix(modelToWorld, cameraToWorld);
-      int vx, vy;
-	    get_viewport_size (vx, vy);
-      
-	    UpdateMetaballs (state->x, state->n, vx, vy);
-      
-	    //float color[] = {0, 0, 1, 1};
-        //color_shader_.render(modelToProjection, color);
-	    //shader.render (modelToProjection, mb_positions, 20.0f, state->n);
-     // 
-     //   compute_accel(state, &params);
-     //   leapfrog_step(state, params.dt);
-     //   check_state(state);
-     // 
-	    //glBindBuffer (GL_ARRAY_BUFFER, vbo);
-	    //glEnableVertexAttribArray (attribute_position);
-	    //glVertexAttribPointer (attribute_position, 3, GL_FLOAT, GL_FALSE, 3 * sizeof (float), 0);
-	    //glDrawArrays (GL_TRIANGLES, 0, 6);
-
-		
-	float cube_verts[] = {
+    // the edges of the box the particles are kept in, as pairs of points for GL_LINES.
+    static const float *cube_edges() {
+      static const float verts[] = {
 		  	0.0f, 0.0f, 0.0f,//p0
 		  	0.0f, 1.0f, 0.0f,//p1
 
@@ -474,6 +1792,49 @@ void check_state(sim_state_t* s)
 			1.0f, 0.0f, 0.0f,//p3
 		  	1.0f, 0.0f, 1.0f,//p7
 		  };
+      return verts;
+    }
+
+    /// draw the box and the particles with a software renderer, without stepping the simulation.
+    /// this lets frames and frame times be checked without a GL context.
+    void draw_world_software(soft_renderer &sr) {
+      mat4t modelToProjection = mat4t::build_projection_matrix(modelToWorld, cameraToWorld);
+      sr.begin_frame(vec4(0, 0, 0, 1));
+      sr.draw_lines(modelToProjection, cube_edges(), 12*2, vec4(1, 1, 1, 1));
+      sr.draw_points(modelToProjection, state->x, state->n, 3*sizeof(float), 5.5f, vec4(0, 0, 1, 1));
+      coupling->get_world_samples(body_samples);
+      sr.draw_points(modelToProjection, (const float*)body_samples.data(), body_samples.size(), sizeof(vec3p), 3.0f, vec4(0, 1, 0, 1));
+      sr.end_frame();
+    }
+
+    // this is called to draw the world
+    void draw_world(int x, int y, int w, int h) {
+
+      glViewport(x, y, w, h);
+      glClearColor(0, 0, 0, 1);
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      glEnable(GL_DEPTH_TEST);
+      mat4t modelToProjection = mat4t::build_projection_matrix(modelToWorld, cameraToWorld);
+      int vx, vy;
+	    get_viewport_size (vx, vy);
+      
+	    UpdateMetaballs (state->x, state->n, vx, vy);
+      
+	    //float color[] = {0, 0, 1, 1};
+        //color_shader_.render(modelToProjection, color);
+	    //shader.render (modelToProjection, mb_positions, 20.0f, state->n);
+     // 
+     //   compute_accel(state, &params);
+     //   leapfrog_step(state, params.dt);
+     //   check_state(state);
+     // 
+	    //glBindBuffer (GL_ARRAY_BUFFER, vbo);
+	    //glEnableVertexAttribArray (attribute_position);
+	    //glVertexAttribPointer (attribute_position, 3, GL_FLOAT, GL_FALSE, 3 * sizeof (float), 0);
+	    //glDrawArrays (GL_TRIANGLES, 0, 6);
+
+		
+	const float *cube_verts = cube_edges();
 
 		vec4 color1(1, 1, 1, 1);
       color_shader_.render(modelToProjection, color1.get());
@@ -485,9 +1846,16 @@ void check_state(sim_state_t* s)
       vec4 color(0, 0, 1, 1);
       color_shader_.render(modelToProjection, color.get());
       
-      compute_accel(state, &params);
-      leapfrog_step(state, params.dt);
-      //check_state(state);
+      simulate_frame();
+      if (use_software) {
+        if (!software) software = new soft_renderer(w, h);
+        draw_world_software(*software);
+        log("frame %d software hash %016llx\n", frame_number, (unsigned long long)software->get_hash());
+        if (frame_number % 100 == 0) {
+          software->log_stats();
+          software->reset_stats();
+        }
+      }
       
 	   glEnable(GL_ALPHA_TEST);
 		glAlphaFunc(GL_NOTEQUAL, 0);
@@ -502,6 +1870,14 @@ void check_state(sim_state_t* s)
       
       glDrawArrays(GL_POINTS, 0,  state->n );
 
+      // the surfaces of the rigid bodies
+      vec4 body_color(0, 1, 0, 1);
+      color_shader_.render(modelToProjection, body_color.get());
+      coupling->get_world_samples(body_samples);
+      glPointSize(3.0f);
+      glVertexAttribPointer(attribute_pos, 3, GL_FLOAT, GL_FALSE, sizeof(vec3p), (void*)body_samples.data());
+      glDrawArrays(GL_POINTS, 0, body_samples.size());
+
 	   glDisable(GL_POINT_SMOOTH);
     glBlendFunc(GL_NONE, GL_NONE);
     glDisable(GL_BLEND);
@@ -547,10 +1923,84 @@ void check_state(sim_state_t* s)
 
     }
 
+    // send the state of the simulation to any web browsers that are watching.
+    // this copies the data and returns, the server thread does the sending.
+    struct frame_stats {
+      compensated_sum rho_sum;
+      compensated_sum v2_sum;
+      float rho_max;
+      float v2_max;
+    };
+
+    // sums over the particles that come out the same for any number of threads.
+    frame_stats get_frame_stats() const {
+      const sim_state_t *s = state;
+      frame_stats zero;
+      zero.rho_max = zero.v2_max = 0;
+      return thread_pool::get().parallel_reduce(s->n, 1024, zero,
+        [&](unsigned begin, unsigned end) {
+          frame_stats r = zero;
+          for (unsigned i = begin; i != end; ++i) {
+            const float *v = s->v + 3*i;
+            float v2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+            r.rho_sum += s->rho[i];
+            r.v2_sum += v2;
+            r.rho_max = s->rho[i] > r.rho_max ? s->rho[i] : r.rho_max;
+            r.v2_max = v2 > r.v2_max ? v2 : r.v2_max;
+          }
+          return r;
+        },
+        [](const frame_stats &a, const frame_stats &b) {
+          frame_stats r;
+          r.rho_sum = a.rho_sum + b.rho_sum;
+          r.v2_sum = a.v2_sum + b.v2_sum;
+          r.rho_max = a.rho_max > b.rho_max ? a.rho_max : b.rho_max;
+          r.v2_max = a.v2_max > b.v2_max ? a.v2_max : b.v2_max;
+          return r;
+        }
+      );
+    }
+
+    void publish_frame() {
+      server.update();
+      frame_number++;
+
+      bool stats = server.has_subscribers(stats_channel);
+      uint64_t hash = stats || deterministic ? get_state_hash() : 0;
+      if (deterministic) {
+        log("frame %d hash %016llx\n", frame_number, (unsigned long long)hash);
+      }
+
+      if (stats) {
+        frame_stats totals = get_frame_stats();
+        float rho_sum = totals.rho_sum.get(), ke = 0.5f * state->mass * totals.v2_sum.get();
+        char tmp[1024];
+        sprintf(
+          tmp, "data: { \"frame\": %d, \"n\": %d, \"time\": %f, \"step_ms\": %f, \"rho_mean\": %f, \"rho_max\": %f, \"v_max\": %f, \"kinetic_energy\": %g, \"bodies\": %u, \"active_bodies\": %u, \"boundary_samples\": %u, \"boundary_hits\": %u, \"pressure_iterations\": %d, \"density_error\": %f, \"hash\": \"%016llx\" }\n\n",
+          frame_number, state->n, frame_number * params.dt, step_time * 1000, state->n ? rho_sum / state->n : 0, totals.rho_max, sqrtf(totals.v2_max), ke,
+          coupling->get_num_bodies(), coupling->get_num_active_bodies(), coupling->get_num_active_samples(), boundary_hits, pressure_iterations, density_error, (unsigned long long)hash
+        );
+        server.publish(stats_channel, tmp);
+      }
+
+      // frame is the particle count followed by x, y, z for each particle
+      // the buffer is kept and grows in steps, as the number of particles changes.
+      if (server.has_subscribers(particles_channel)) {
+        unsigned size = 4 + state->n * 3 * sizeof(float);
+        if (particle_frame.capacity() < size) particle_frame.reserve(size + size / 2);
+        particle_frame.resize(size);
+        uint32_t n = (uint32_t)state->n;
+        memcpy(&particle_frame[0], &n, 4);
+        memcpy(&particle_frame[4], state->x, state->n * 3 * sizeof(float));
+        server.publish(particles_channel, &particle_frame[0], particle_frame.size());
+      }
+    }
+
     void UpdateMetaballs (float* pos, const int &size, const int &vx, const int &vy)
 	  {
 	  	numOfMetaballs = size;
-	  	mb_positions = new float[numOfMetaballs * 2];
+	  	if (mb_positions.capacity() < (unsigned)numOfMetaballs * 2) mb_positions.reserve(numOfMetaballs * 3);
+	  	mb_positions.resize(numOfMetaballs * 2);
     
 	  	for (int i = 0; i < numOfMetaballs; i++)
 	  	{
@@ -11,7 +11,7 @@
 #include <math.h>
 #include <vector>
 #include "../../octet.h"
-#include "particles_app.h"
+#include "3D_Particle_App.h"
 //#include "Metaballs.h"
 //#include "particles_app2Dworking.h"
 //#include "SPH.h"
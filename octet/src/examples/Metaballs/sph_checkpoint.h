@@ -0,0 +1,190 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Simulation snapshots written in the background
+//
+
+namespace octet {
+  /// Snapshots of a simulation as named blocks of bytes, written to disk on a worker thread.
+  ///
+  /// begin() and add() copy the state into one of two buffers, which is all the simulation waits for.
+  /// write() then saves that buffer on a thread while the next snapshot goes in the other one.
+  /// Files are written to path.tmp and renamed, so a job that dies while writing leaves the
+  /// last good snapshot behind. load() maps a file and checks its hash before get() returns blocks.
+  ///
+  /// Example
+  ///
+  ///     checkpoint.begin();
+  ///     checkpoint.add("x", x, n * 3 * sizeof(float));
+  ///     checkpoint.write("run.snap");
+  ///     ...
+  ///     if (checkpoint.load("run.snap")) {
+  ///       const float *x = (const float*)checkpoint.get("x", n * 3 * sizeof(float));
+  ///     }
+  class sph_checkpoint {
+    struct file_header {
+      char magic[8];
+      uint32_t version;
+      uint32_t num_blocks;
+      uint64_t size;
+      uint64_t hash;
+    };
+
+    // each block is padded to a multiple of 16 bytes
+    struct block_header {
+      char name[16];
+      uint64_t size;
+      uint64_t reserved;
+    };
+
+    enum { version = 1 };
+
+    // one buffer is filled while the other one is written
+    dynarray<uint8_t> buffers[2];
+    unsigned filling;
+    unsigned num_blocks;
+
+    std::thread *writer;
+    string write_path;
+    bool write_ok;
+
+    // the last file loaded
+    mapped_file file;
+
+    static uint64_t get_hash(const uint8_t *data, size_t size) {
+      uint64_t hash = 0xcbf29ce484222325ull;
+      for (size_t i = 0; i != size; ++i) {
+        hash = ( hash ^ data[i] ) * 0x100000001b3ull;
+      }
+      return hash;
+    }
+
+    static void write_entry(sph_checkpoint *self, unsigned buffer) {
+      self->write_buffer(buffer);
+    }
+
+    void write_buffer(unsigned buffer) {
+      dynarray<uint8_t> &buf = buffers[buffer];
+      file_header *header = (file_header*)buf.data();
+      header->hash = get_hash(buf.data() + sizeof(file_header), buf.size() - sizeof(file_header));
+
+      string tmp_path;
+      tmp_path.format("%s.tmp", write_path.c_str());
+      FILE *out = fopen(tmp_path.c_str(), "wb");
+      write_ok = out && fwrite(buf.data(), 1, buf.size(), out) == buf.size();
+      if (out) write_ok = fclose(out) == 0 && write_ok;
+      if (write_ok && rename(tmp_path.c_str(), write_path.c_str()) != 0) {
+        // windows will not rename over a file
+        remove(write_path.c_str());
+        write_ok = rename(tmp_path.c_str(), write_path.c_str()) == 0;
+      }
+    }
+
+    // copying would share the writer thread
+    sph_checkpoint(const sph_checkpoint &rhs);
+    sph_checkpoint &operator=(const sph_checkpoint &rhs);
+
+  public:
+    sph_checkpoint() {
+      filling = 0;
+      num_blocks = 0;
+      writer = 0;
+      write_ok = true;
+    }
+
+    ~sph_checkpoint() {
+      wait();
+    }
+
+    /// Start a new snapshot.
+    void begin() {
+      dynarray<uint8_t> &buf = buffers[filling];
+      buf.resize(sizeof(file_header));
+      memset(buf.data(), 0, sizeof(file_header));
+      num_blocks = 0;
+    }
+
+    /// Copy size bytes into the snapshot as a block called name (at most 15 characters).
+    void add(const char *name, const void *data, size_t size) {
+      dynarray<uint8_t> &buf = buffers[filling];
+      unsigned offset = buf.size();
+      unsigned padded = ( (unsigned)size + 15 ) & ~15;
+      buf.resize(offset + sizeof(block_header) + padded);
+      block_header *block = (block_header*)( buf.data() + offset );
+      memset(block, 0, sizeof(block_header));
+      strncpy(block->name, name, sizeof(block->name) - 1);
+      block->size = size;
+      uint8_t *dest = buf.data() + offset + sizeof(block_header);
+      memcpy(dest, data, size);
+      memset(dest + size, 0, padded - size);
+      num_blocks++;
+    }
+
+    /// Save the snapshot to path on a worker thread.
+    /// Waits for the previous write, which usually finished long ago.
+    void write(const char *path) {
+      wait();
+      dynarray<uint8_t> &buf = buffers[filling];
+      file_header *header = (file_header*)buf.data();
+      memcpy(header->magic, "OCTSNAP", 8);
+      header->version = version;
+      header->num_blocks = num_blocks;
+      header->size = buf.size();
+      write_path = path;
+      writer = new std::thread(write_entry, this, filling);
+      filling ^= 1;
+    }
+
+    /// Wait for the last write to finish. Returns false if it failed.
+    bool wait() {
+      if (writer) {
+        writer->join();
+        delete writer;
+        writer = 0;
+        if (!write_ok) log("sph_checkpoint: could not write %s\n", write_path.c_str());
+      }
+      return write_ok;
+    }
+
+    /// Map a snapshot file. Returns false if it is missing, truncated or damaged.
+    bool load(const char *path) {
+      if (!file.open(path)) {
+        log("sph_checkpoint: could not open %s\n", path);
+        return false;
+      }
+      const file_header *header = (const file_header*)file.data();
+      if (
+        file.size() < sizeof(file_header) || memcmp(header->magic, "OCTSNAP", 8) ||
+        header->version != version || header->size != file.size() ||
+        header->hash != get_hash(file.data() + sizeof(file_header), file.size() - sizeof(file_header))
+      ) {
+        log("sph_checkpoint: %s is not a good snapshot\n", path);
+        file.close();
+        return false;
+      }
+      return true;
+    }
+
+    /// A block of the loaded snapshot, or null if there is no such block or it is not size bytes.
+    /// The data stays valid until the next load().
+    const void *get(const char *name, size_t size) const {
+      if (file.size() < sizeof(file_header)) return 0;
+      const file_header *header = (const file_header*)file.data();
+      size_t offset = sizeof(file_header);
+      for (unsigned i = 0; i != header->num_blocks && offset + sizeof(block_header) <= file.size(); ++i) {
+        const block_header *block = (const block_header*)( file.data() + offset );
+        size_t padded = ( (size_t)block->size + 15 ) & ~(size_t)15;
+        offset += sizeof(block_header);
+        if (offset + padded > file.size()) return 0;
+        if (!strncmp(block->name, name, sizeof(block->name))) {
+          return block->size == size ? file.data() + offset : 0;
+        }
+        offset += padded;
+      }
+      return 0;
+    }
+  };
+}
@@ -0,0 +1,105 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Emitters and sinks that add and remove fluid particles as the simulation runs
+//
+
+namespace octet {
+  /// A tap: a disc that lets out layers of particles at a steady velocity.
+  ///
+  /// The particles of a layer are on a square grid of the given spacing, so a spacing of h/1.3,
+  /// as place_particles uses, gives water at about the rest density. A new layer leaves each time
+  /// the last one has moved a spacing away from the disc.
+  ///
+  /// Example
+  ///
+  ///     ref<sph_emitter> tap = new sph_emitter(vec3(0.5f, 0.9f, 0.5f), vec3(0, -1, 0), 0.05f, h / 1.3f);
+  ///     tap->emit(dt, [&](vec3_in pos, vec3_in vel) { add_particle(state, pos, vel); });
+  class sph_emitter : public resource {
+    vec3 center;
+    vec3 velocity;
+    float spacing;
+
+    // how far the last layer has gone from the disc
+    float travelled;
+
+    // offsets of the particles of a layer from the center
+    dynarray<vec3p> layer;
+
+  public:
+    /// A disc of radius at center, facing along velocity.
+    sph_emitter(vec3_in center_, vec3_in velocity_, float radius, float spacing_) {
+      center = center_;
+      velocity = velocity_;
+      spacing = spacing_;
+      travelled = 0;
+
+      // two directions across the disc
+      vec3 dir = velocity.normalize();
+      vec3 side = fabsf(dir.x()) < 0.9f ? vec3(1, 0, 0) : vec3(0, 1, 0);
+      vec3 u = dir.cross(side).normalize();
+      vec3 w = dir.cross(u);
+      int steps = (int)( radius / spacing );
+      for (int i = -steps; i <= steps; ++i) {
+        for (int j = -steps; j <= steps; ++j) {
+          if (( i * i + j * j ) * spacing * spacing <= radius * radius) {
+            layer.push_back(u * ( i * spacing ) + w * ( j * spacing ));
+          }
+        }
+      }
+    }
+
+    /// Move on by dt and call fn(pos, vel) for each particle that leaves the disc.
+    template <class fn_t> void emit(float dt, fn_t fn) {
+      float speed = velocity.length();
+      if (speed == 0) return;
+      vec3 dir = velocity / speed;
+      travelled += speed * dt;
+      while (travelled >= spacing) {
+        // the layer left when the last one was a spacing away and has been moving since.
+        travelled -= spacing;
+        vec3 front = center + dir * travelled;
+        for (unsigned i = 0; i != layer.size(); ++i) {
+          fn(front + vec3(layer[i]), velocity);
+        }
+      }
+    }
+
+    /// Number of particles in each layer.
+    unsigned get_layer_size() const {
+      return layer.size();
+    }
+
+    /// Particles let out per second.
+    float get_rate() const {
+      return layer.size() * velocity.length() / spacing;
+    }
+
+    /// How far the last layer has gone, for snapshots.
+    float get_travelled() const {
+      return travelled;
+    }
+
+    void set_travelled(float value) {
+      travelled = value;
+    }
+  };
+
+  /// A drain: a box that particles are taken out of when they go into it.
+  class sph_sink : public resource {
+    aabb box;
+
+  public:
+    sph_sink(const aabb &box_) {
+      box = box_;
+    }
+
+    /// True if the particle at x (xyz) should be removed.
+    bool contains(const float *x) const {
+      return box.intersects(vec3(x[0], x[1], x[2]));
+    }
+  };
+}
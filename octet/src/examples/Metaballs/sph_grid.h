@@ -0,0 +1,263 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Uniform grid for finding SPH neighbours
+//
+
+namespace octet {
+  /// Particles sorted into cells of size h so that neighbours are found in the 27 cells around a particle.
+  ///
+  /// Particles are ordered by cell and then by index, so loops over neighbours visit them in the
+  /// same order every time and in the same order as the OpenCL backend (sph_opencl).
+  /// Particles outside the domain go in the nearest cell, which still finds all their neighbours.
+  ///
+  /// pack() also makes a copy of the particles in sorted order with 16 bytes each instead of 28
+  /// for the neighbour loops, whose memory traffic is most of the cost of a step.
+  class sph_grid {
+  public:
+    /// A particle in the packed copy: position in 65536ths of a cell from the corner of its cell,
+    /// velocity in half floats and density.
+    struct packed_particle {
+      uint16_t pos[3];
+      uint16_t vel[3];
+      float rho;
+    };
+
+  private:
+    vec3 origin;
+    float inv_cell_size;
+    int dims[3];
+
+    // cell of each particle
+    dynarray<unsigned> keys;
+
+    // particle indices sorted by cell
+    dynarray<unsigned> order;
+
+    // order[cell_start[c]] .. order[cell_start[c+1]-1] are in cell c
+    dynarray<unsigned> cell_start;
+
+    // next free place in each cell during the sort
+    dynarray<unsigned> next;
+
+    // particles in sorted order, made by pack()
+    dynarray<packed_particle> packed;
+
+  public:
+    sph_grid() {
+      origin = vec3(0, 0, 0);
+      inv_cell_size = 1;
+      dims[0] = dims[1] = dims[2] = 1;
+    }
+
+    /// Cover domain with cells of size h.
+    void init(const aabb &domain, float h) {
+      origin = domain.get_min();
+      inv_cell_size = 1.0f / h;
+      vec3 size = domain.get_max() - domain.get_min();
+      for (int a = 0; a != 3; ++a) {
+        dims[a] = (int)ceilf(size[a] * inv_cell_size);
+        dims[a] = dims[a] < 1 ? 1 : dims[a];
+      }
+      cell_start.resize(dims[0] * dims[1] * dims[2] + 1);
+      next.resize(dims[0] * dims[1] * dims[2]);
+    }
+
+    /// Cell coordinate of a position on one axis.
+    int get_coord(float x, int axis) const {
+      int c = (int)floorf(( x - origin[axis] ) * inv_cell_size);
+      return c < 0 ? 0 : c >= dims[axis] ? dims[axis] - 1 : c;
+    }
+
+    /// Sort n particles with positions x (xyz for each) into the cells.
+    /// The number of particles may change from one call to the next.
+    void build(const float *x, unsigned n) {
+      // leave room to grow so that a slowly rising count does not reallocate every step.
+      if (keys.capacity() < n) {
+        keys.reserve(n + n / 2);
+        order.reserve(n + n / 2);
+      }
+      keys.resize(n);
+      order.resize(n);
+      unsigned num_cells = cell_start.size() - 1;
+      memset(cell_start.data(), 0, cell_start.size() * sizeof(unsigned));
+
+      thread_pool::get().parallel_ranges(n, 1024, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          const float *p = x + i * 3;
+          keys[i] = ( get_coord(p[2], 2) * dims[1] + get_coord(p[1], 1) ) * dims[0] + get_coord(p[0], 0);
+        }
+      });
+
+      // counting sort, stable so particles stay in index order within a cell.
+      for (unsigned i = 0; i != n; ++i) {
+        cell_start[keys[i] + 1]++;
+      }
+      for (unsigned c = 0; c != num_cells; ++c) {
+        cell_start[c + 1] += cell_start[c];
+      }
+      memcpy(next.data(), cell_start.data(), num_cells * sizeof(unsigned));
+      for (unsigned i = 0; i != n; ++i) {
+        order[next[keys[i]]++] = i;
+      }
+    }
+
+    /// Call fn(j) for every particle j in the cells around particle i, including i itself.
+    template <class fn_t> void for_each_neighbour(const float *x, unsigned i, fn_t fn) const {
+      const float *p = x + i * 3;
+      int cx = get_coord(p[0], 0), cy = get_coord(p[1], 1), cz = get_coord(p[2], 2);
+      int z0 = cz > 0 ? cz - 1 : 0, z1 = cz < dims[2] - 1 ? cz + 1 : cz;
+      int y0 = cy > 0 ? cy - 1 : 0, y1 = cy < dims[1] - 1 ? cy + 1 : cy;
+      int x0 = cx > 0 ? cx - 1 : 0, x1 = cx < dims[0] - 1 ? cx + 1 : cx;
+      for (int z = z0; z <= z1; ++z) {
+        for (int y = y0; y <= y1; ++y) {
+          // the cells x0..x1 are next to each other in the sorted order.
+          unsigned row = ( z * dims[1] + y ) * dims[0];
+          unsigned end = cell_start[row + x1 + 1];
+          for (unsigned s = cell_start[row + x0]; s != end; ++s) {
+            fn(order[s]);
+          }
+        }
+      }
+    }
+
+    /// Copy the positions and velocities of the particles into the packed array, in sorted order.
+    /// Call after build(). Positions are rounded to 1/65536th of a cell, or clamped to the cell for
+    /// particles outside the domain, and velocities have 11 significant bits.
+    void pack(const float *x, const float *v, unsigned n) {
+      if (packed.capacity() < n) packed.reserve(n + n / 2);
+      packed.resize(n);
+      float scale = inv_cell_size * 65536;
+      thread_pool::get().parallel_ranges(n, 1024, [&](unsigned begin, unsigned end) {
+        for (unsigned s = begin; s != end; ++s) {
+          unsigned i = order[s];
+          unsigned key = keys[i];
+          int cell[3] = { (int)( key % dims[0] ), (int)( key / dims[0] % dims[1] ), (int)( key / dims[0] / dims[1] ) };
+          packed_particle &p = packed[s];
+          for (int a = 0; a != 3; ++a) {
+            float offset = ( x[i*3+a] - origin[a] ) * scale - cell[a] * 65536.0f;
+            int q = (int)floorf(offset + 0.5f);
+            p.pos[a] = (uint16_t)( q < 0 ? 0 : q > 65535 ? 65535 : q );
+            p.vel[a] = float_to_half(v[i*3+a]);
+          }
+          p.rho = 0;
+        }
+      });
+    }
+
+    /// Copy the densities into the packed array.
+    void pack_density(const float *rho) {
+      thread_pool::get().parallel_ranges(packed.size(), 1024, [&](unsigned begin, unsigned end) {
+        for (unsigned s = begin; s != end; ++s) {
+          packed[s].rho = rho[order[s]];
+        }
+      });
+    }
+
+    /// The particles in and around a cell unpacked to floats, with positions from the corner of the cell.
+    /// The cell's own particles are self_begin .. self_end-1 and are particles order[first_slot + k - self_begin].
+    /// count is a multiple of four; the extra particles are far away so that loops can work in fours.
+    struct neighbourhood {
+      dynarray<float> x, y, z, vx, vy, vz, rho;
+      unsigned count;
+      unsigned self_begin;
+      unsigned self_end;
+      unsigned first_slot;
+    };
+
+    /// Number of cells.
+    unsigned get_num_cells() const {
+      return cell_start.size() - 1;
+    }
+
+    /// Number of particles in a cell.
+    unsigned get_cell_size(unsigned cell) const {
+      return cell_start[cell + 1] - cell_start[cell];
+    }
+
+    /// Unpack the packed particles in the cells around a cell, in the order of for_each_neighbour.
+    /// Positions are made exactly in fixed point before rounding to float; velocities and densities are
+    /// only unpacked if asked for.
+    void unpack_neighbourhood(unsigned cell, neighbourhood &nb, bool velocities) const {
+      int cx = cell % dims[0], cy = cell / dims[0] % dims[1], cz = cell / dims[0] / dims[1];
+      int z0 = cz > 0 ? cz - 1 : 0, z1 = cz < dims[2] - 1 ? cz + 1 : cz;
+      int y0 = cy > 0 ? cy - 1 : 0, y1 = cy < dims[1] - 1 ? cy + 1 : cy;
+      int x0 = cx > 0 ? cx - 1 : 0, x1 = cx < dims[0] - 1 ? cx + 1 : cx;
+      float unit = 1.0f / ( inv_cell_size * 65536 );
+
+      unsigned count = 0;
+      for (int z = z0; z <= z1; ++z) {
+        for (int y = y0; y <= y1; ++y) {
+          unsigned row = ( z * dims[1] + y ) * dims[0];
+          count += cell_start[row + x1 + 1] - cell_start[row + x0];
+        }
+      }
+      // pad to a multiple of four with particles too far away to count.
+      unsigned padded = ( count + 3 ) & ~3;
+      if (nb.x.size() < padded) {
+        nb.x.resize(padded); nb.y.resize(padded); nb.z.resize(padded);
+        nb.vx.resize(padded); nb.vy.resize(padded); nb.vz.resize(padded); nb.rho.resize(padded);
+      }
+      for (unsigned k = count; k != padded; ++k) {
+        nb.x[k] = nb.y[k] = nb.z[k] = 1e6f;
+        nb.vx[k] = nb.vy[k] = nb.vz[k] = 0;
+        nb.rho[k] = 1;
+      }
+
+      unsigned k = 0;
+      nb.self_begin = nb.self_end = nb.first_slot = 0;
+      for (int z = z0; z <= z1; ++z) {
+        int qz = ( z - cz ) * 65536;
+        for (int y = y0; y <= y1; ++y) {
+          int qy = ( y - cy ) * 65536;
+          unsigned row = ( z * dims[1] + y ) * dims[0];
+          for (int x = x0; x <= x1; ++x) {
+            int qx = ( x - cx ) * 65536;
+            unsigned begin = cell_start[row + x], end = cell_start[row + x + 1];
+            if (row + x == cell) {
+              nb.self_begin = k;
+              nb.self_end = k + end - begin;
+              nb.first_slot = begin;
+            }
+            for (unsigned t = begin; t != end; ++t, ++k) {
+              const packed_particle &p = packed[t];
+              nb.x[k] = ( qx + p.pos[0] ) * unit;
+              nb.y[k] = ( qy + p.pos[1] ) * unit;
+              nb.z[k] = ( qz + p.pos[2] ) * unit;
+              if (velocities) {
+                nb.vx[k] = half_to_float(p.vel[0]);
+                nb.vy[k] = half_to_float(p.vel[1]);
+                nb.vz[k] = half_to_float(p.vel[2]);
+                nb.rho[k] = p.rho;
+              }
+            }
+          }
+        }
+      }
+      nb.count = padded;
+    }
+
+    /// A particle of the packed array.
+    const packed_particle &get_packed(unsigned s) const {
+      return packed[s];
+    }
+
+    /// Grid dimensions in cells.
+    int get_dim(int axis) const {
+      return dims[axis];
+    }
+
+    /// Corner of the grid.
+    vec3 get_origin() const {
+      return origin;
+    }
+
+    /// Particle indices sorted by cell.
+    const unsigned *get_order() const {
+      return order.data();
+    }
+  };
+}
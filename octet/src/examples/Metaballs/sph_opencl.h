@@ -0,0 +1,475 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// OpenCL backend for the SPH fluid
+//
+
+// OpenCL 1.2, newer than the headers in platform/CL
+#ifndef CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT
+  #define CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT (1 << 7)
+#endif
+
+namespace octet {
+  /// OpenCL kernels for the neighbour grid, density, forces and leapfrog steps of the fluid.
+  ///
+  /// The kernels do the same sums in the same order as the native code (sph_grid and
+  /// particles_app), one work item per particle, so any OpenCL device will do. On a CPU
+  /// device (eg. PoCL) this runs on every core with the compiler vectorising across work items.
+  ///
+  /// The buffers use the simulation's arrays (CL_MEM_USE_HOST_PTR) and are mapped while the
+  /// host uses them, so there is no copying on a CPU device. Call set_particles when particles
+  /// are added or removed.
+  ///
+  /// Example
+  ///
+  ///     sph_opencl cl;
+  ///     if (cl.init(n, x, v, vh, a, rho, aabb(vec3(0.5f), vec3(0.5f)), h)) {
+  ///       cl.compute_density(mass);
+  ///       cl.compute_forces(mass, rho0, k, mu, g);
+  ///       cl.leapfrog(dt, false);
+  ///     }
+  class sph_opencl {
+    // positions are xyz for each particle; keys are cell << 32 | particle and sort to the particle order.
+    static const char *get_source() {
+      return SHADER_STR(
+        __kernel void compute_keys(__global const float *x, __global ulong *keys, uint n, uint sort_size, float ox, float oy, float oz, float inv_h, int nx, int ny, int nz) {
+          uint i = get_global_id(0);
+          if (i >= sort_size) return;
+          if (i >= n) {
+            keys[i] = ~(ulong)0;
+            return;
+          }
+          int cx = (int)floor((x[i*3+0] - ox) * inv_h);
+          int cy = (int)floor((x[i*3+1] - oy) * inv_h);
+          int cz = (int)floor((x[i*3+2] - oz) * inv_h);
+          cx = cx < 0 ? 0 : cx >= nx ? nx - 1 : cx;
+          cy = cy < 0 ? 0 : cy >= ny ? ny - 1 : cy;
+          cz = cz < 0 ? 0 : cz >= nz ? nz - 1 : cz;
+          ulong cell = (ulong)((cz * ny + cy) * nx + cx);
+          keys[i] = (cell << 32) | i;
+        }
+
+        __kernel void bitonic_step(__global ulong *keys, uint j, uint k) {
+          uint i = get_global_id(0);
+          uint ixj = i ^ j;
+          if (ixj <= i) return;
+          ulong a = keys[i];
+          ulong b = keys[ixj];
+          int ascending = (i & k) == 0;
+          if ((a > b) == ascending) {
+            keys[i] = b;
+            keys[ixj] = a;
+          }
+        }
+
+        __kernel void find_cells(__global const ulong *keys, __global uint *order, __global uint *cell_start, uint n, uint num_cells) {
+          uint s = get_global_id(0);
+          if (s > n) return;
+          uint cell = s < n ? (uint)(keys[s] >> 32) : num_cells;
+          int prev = s > 0 ? (int)(keys[s-1] >> 32) : -1;
+          for (int c = prev + 1; c <= (int)cell; ++c) {
+            cell_start[c] = s;
+          }
+          if (s < n) order[s] = (uint)keys[s];
+        }
+
+        __kernel void compute_density(__global const float *x, __global float *rho, __global const uint *order, __global const uint *cell_start, uint n, float ox, float oy, float oz, float h, int nx, int ny, int nz, float mass) {
+          uint i = get_global_id(0);
+          if (i >= n) return;
+          float inv_h = 1.0f / h;
+          float h2 = h*h;
+          float h8 = (h2*h2)*(h2*h2);
+          float C = 4 * mass / 3.14f / h8;
+          float xi = x[i*3+0];
+          float yi = x[i*3+1];
+          float zi = x[i*3+2];
+          int cx = (int)floor((xi - ox) * inv_h);
+          int cy = (int)floor((yi - oy) * inv_h);
+          int cz = (int)floor((zi - oz) * inv_h);
+          cx = cx < 0 ? 0 : cx >= nx ? nx - 1 : cx;
+          cy = cy < 0 ? 0 : cy >= ny ? ny - 1 : cy;
+          cz = cz < 0 ? 0 : cz >= nz ? nz - 1 : cz;
+          int x0 = cx > 0 ? cx - 1 : 0;
+          int x1 = cx < nx - 1 ? cx + 1 : cx;
+          float result = 4 * mass / 3.14f / h2;
+          for (int z = (cz > 0 ? cz - 1 : 0); z <= (cz < nz - 1 ? cz + 1 : cz); ++z) {
+            for (int y = (cy > 0 ? cy - 1 : 0); y <= (cy < ny - 1 ? cy + 1 : cy); ++y) {
+              uint row = (z * ny + y) * nx;
+              uint end = cell_start[row + x1 + 1];
+              for (uint s = cell_start[row + x0]; s != end; ++s) {
+                uint j = order[s];
+                if (j == i) continue;
+                float dx = xi - x[j*3+0];
+                float dy = yi - x[j*3+1];
+                float dz = zi - x[j*3+2];
+                float r2 = dx*dx + dy*dy + dz*dz;
+                float q = h2 - r2;
+                if (q > 0) {
+                  result += C*q*q*q;
+                }
+              }
+            }
+          }
+          rho[i] = result;
+        }
+
+        __kernel void compute_forces(__global const float *x, __global const float *v, __global const float *rho, __global float *a, __global const uint *order, __global const uint *cell_start, uint n, float ox, float oy, float oz, float h, int nx, int ny, int nz, float mass, float rho0, float k, float mu, float g) {
+          uint i = get_global_id(0);
+          if (i >= n) return;
+          float inv_h = 1.0f / h;
+          float h2 = h*h;
+          float C0 = mass / 3.14f / ((h2)*(h2));
+          float Cp = 15*k;
+          float Cv = -40*mu;
+          float xi = x[i*3+0];
+          float yi = x[i*3+1];
+          float zi = x[i*3+2];
+          float rhoi = rho[i];
+          int cx = (int)floor((xi - ox) * inv_h);
+          int cy = (int)floor((yi - oy) * inv_h);
+          int cz = (int)floor((zi - oz) * inv_h);
+          cx = cx < 0 ? 0 : cx >= nx ? nx - 1 : cx;
+          cy = cy < 0 ? 0 : cy >= ny ? ny - 1 : cy;
+          cz = cz < 0 ? 0 : cz >= nz ? nz - 1 : cz;
+          int x0 = cx > 0 ? cx - 1 : 0;
+          int x1 = cx < nx - 1 ? cx + 1 : cx;
+          float ax = 0;
+          float ay = -g;
+          float az = 0;
+          for (int z = (cz > 0 ? cz - 1 : 0); z <= (cz < nz - 1 ? cz + 1 : cz); ++z) {
+            for (int y = (cy > 0 ? cy - 1 : 0); y <= (cy < ny - 1 ? cy + 1 : cy); ++y) {
+              uint row = (z * ny + y) * nx;
+              uint end = cell_start[row + x1 + 1];
+              for (uint s = cell_start[row + x0]; s != end; ++s) {
+                uint j = order[s];
+                if (j == i) continue;
+                float dx = xi - x[j*3+0];
+                float dy = yi - x[j*3+1];
+                float dz = zi - x[j*3+2];
+                float r2 = dx*dx + dy*dy + dz*dz;
+                if (r2 < h2) {
+                  float rhoj = rho[j];
+                  float q = sqrt(r2)/h;
+                  float u = 1-q;
+                  float w0 = C0 * u/rhoi/rhoj;
+                  float wp = w0 * Cp * (rhoi+rhoj-2*rho0) * u/q;
+                  float wv = w0 * Cv;
+                  float dvx = v[i*3+0] - v[j*3+0];
+                  float dvy = v[i*3+1] - v[j*3+1];
+                  float dvz = v[i*3+2] - v[j*3+2];
+                  ax += wp*dx + wv*dvx;
+                  ay += wp*dy + wv*dvy;
+                  az += wp*dz + wv*dvz;
+                }
+              }
+            }
+          }
+          a[i*3+0] = ax;
+          a[i*3+1] = ay;
+          a[i*3+2] = az;
+        }
+
+        __kernel void leapfrog_step(__global float *x, __global float *v, __global float *vh, __global const float *a, uint size, float dt) {
+          uint i = get_global_id(0);
+          if (i >= size) return;
+          float vhi = vh[i] + a[i] * dt;
+          vh[i] = vhi;
+          v[i] = vhi + a[i] * dt / 2;
+          x[i] += vhi * dt;
+        }
+
+        __kernel void leapfrog_start(__global float *x, __global float *v, __global float *vh, __global const float *a, uint size, float dt) {
+          uint i = get_global_id(0);
+          if (i >= size) return;
+          float vhi = v[i] + a[i] * dt / 2;
+          vh[i] = vhi;
+          v[i] += a[i] * dt;
+          x[i] += vhi * dt;
+        }
+      );
+    }
+
+    enum {
+      mem_x, mem_v, mem_vh, mem_a, mem_rho, num_host_mems,
+      mem_keys = num_host_mems, mem_order, mem_cell_start, num_mems,
+    };
+
+    enum {
+      kernel_compute_keys, kernel_bitonic_step, kernel_find_cells, kernel_compute_density, kernel_compute_forces,
+      kernel_leapfrog_step, kernel_leapfrog_start, num_kernels,
+    };
+
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernels[num_kernels];
+    cl_mem mems[num_mems];
+    float *host[num_host_mems];
+    bool mapped;
+
+    unsigned n;
+    unsigned capacity;
+    unsigned sort_size;
+    unsigned num_cells;
+    float origin[3];
+    float h;
+    int dims[3];
+    char device_name[128];
+
+    void release() {
+      if (mapped) unmap();
+      for (unsigned i = 0; i != num_mems; ++i) {
+        if (mems[i]) clReleaseMemObject(mems[i]);
+        mems[i] = 0;
+      }
+      for (unsigned i = 0; i != num_kernels; ++i) {
+        if (kernels[i]) clReleaseKernel(kernels[i]);
+        kernels[i] = 0;
+      }
+      if (program) clReleaseProgram(program);
+      if (queue) clReleaseCommandQueue(queue);
+      if (context) clReleaseContext(context);
+      program = 0;
+      queue = 0;
+      context = 0;
+    }
+
+    // give the simulation arrays to the device.
+    void unmap() {
+      for (unsigned i = 0; i != num_host_mems; ++i) {
+        clEnqueueUnmapMemObject(queue, mems[i], host[i], 0, NULL, NULL);
+      }
+      mapped = false;
+    }
+
+    // wait for the kernels and give the simulation arrays back to the host.
+    // the whole of each array is mapped, as particles may be added after n.
+    void map() {
+      for (unsigned i = 0; i != num_host_mems; ++i) {
+        size_t size = ( i == mem_rho ? capacity : capacity * 3 ) * sizeof(float);
+        cl_int err = CL_SUCCESS;
+        void *ptr = clEnqueueMapBuffer(queue, mems[i], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, NULL, NULL, &err);
+        // buffers made with CL_MEM_USE_HOST_PTR map to the host's array.
+        if (ptr != host[i]) log("sph_opencl: buffer %d mapped to %p, not %p (err %d)\n", i, ptr, host[i], err);
+      }
+      mapped = true;
+    }
+
+    template <class type> void set_arg(cl_kernel kernel, unsigned index, const type &value) {
+      clSetKernelArg(kernel, index, sizeof(value), &value);
+    }
+
+    void run(unsigned kernel, unsigned count) {
+      if (!count) return;
+      size_t global_size = count;
+      cl_int err = clEnqueueNDRangeKernel(queue, kernels[kernel], 1, NULL, &global_size, NULL, 0, NULL, NULL);
+      if (err != CL_SUCCESS) log("sph_opencl: kernel %d failed (err %d)\n", kernel, err);
+    }
+
+    // sort the particles into cells.
+    void build_grid() {
+      cl_kernel k = kernels[kernel_compute_keys];
+      set_arg(k, 0, mems[mem_x]); set_arg(k, 1, mems[mem_keys]); set_arg(k, 2, n); set_arg(k, 3, sort_size);
+      set_arg(k, 4, origin[0]); set_arg(k, 5, origin[1]); set_arg(k, 6, origin[2]); set_arg(k, 7, 1.0f / h);
+      set_arg(k, 8, dims[0]); set_arg(k, 9, dims[1]); set_arg(k, 10, dims[2]);
+      run(kernel_compute_keys, sort_size);
+
+      k = kernels[kernel_bitonic_step];
+      set_arg(k, 0, mems[mem_keys]);
+      for (unsigned size = 2; size <= sort_size; size <<= 1) {
+        for (unsigned stride = size >> 1; stride > 0; stride >>= 1) {
+          set_arg(k, 1, stride);
+          set_arg(k, 2, size);
+          run(kernel_bitonic_step, sort_size);
+        }
+      }
+
+      k = kernels[kernel_find_cells];
+      set_arg(k, 0, mems[mem_keys]); set_arg(k, 1, mems[mem_order]); set_arg(k, 2, mems[mem_cell_start]);
+      set_arg(k, 3, n); set_arg(k, 4, num_cells);
+      run(kernel_find_cells, n + 1);
+    }
+
+    // arguments shared by the density and force kernels after the buffers.
+    void set_grid_args(cl_kernel k, unsigned first) {
+      set_arg(k, first + 0, n);
+      set_arg(k, first + 1, origin[0]); set_arg(k, first + 2, origin[1]); set_arg(k, first + 3, origin[2]);
+      set_arg(k, first + 4, h);
+      set_arg(k, first + 5, dims[0]); set_arg(k, first + 6, dims[1]); set_arg(k, first + 7, dims[2]);
+    }
+
+  public:
+    sph_opencl() {
+      context = 0;
+      queue = 0;
+      program = 0;
+      memset(kernels, 0, sizeof(kernels));
+      memset(mems, 0, sizeof(mems));
+      memset(host, 0, sizeof(host));
+      mapped = false;
+      n = capacity = sort_size = num_cells = 0;
+      h = 1;
+      device_name[0] = 0;
+    }
+
+    ~sph_opencl() {
+      release();
+    }
+
+    /// Set up the first OpenCL device for n particles in the simulation's arrays.
+    /// domain and h set the neighbour grid, as in sph_grid::init.
+    /// Returns false (and logs why) if there is no OpenCL device or the kernels do not build.
+    bool init(unsigned n_, float *x, float *v, float *vh, float *a, float *rho, const aabb &domain, float h_) {
+      release();
+      n = capacity = 0;
+      h = h_;
+      vec3 lo = domain.get_min(), size = domain.get_max() - domain.get_min();
+      num_cells = 1;
+      for (int i = 0; i != 3; ++i) {
+        origin[i] = lo[i];
+        dims[i] = (int)ceilf(size[i] / h);
+        dims[i] = dims[i] < 1 ? 1 : dims[i];
+        num_cells *= dims[i];
+      }
+      cl_platform_id platform;
+      cl_uint num_platforms = 0;
+      if (clGetPlatformIDs(1, &platform, &num_platforms) != CL_SUCCESS || num_platforms == 0) {
+        log("sph_opencl: no OpenCL platform\n");
+        return false;
+      }
+
+      // any device will do, a CPU one such as PoCL included.
+      cl_device_id device;
+      cl_uint num_devices = 0;
+      if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, &num_devices) != CL_SUCCESS || num_devices == 0) {
+        log("sph_opencl: no OpenCL device\n");
+        return false;
+      }
+      clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+
+      cl_int err = CL_SUCCESS;
+      context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+      if (err == CL_SUCCESS) queue = clCreateCommandQueue(context, device, 0, &err);
+      if (err != CL_SUCCESS) {
+        log("sph_opencl: could not make a context on %s (err %d)\n", device_name, err);
+        release();
+        return false;
+      }
+
+      // no fused multiply-adds and exact division and sqrt, where the device can, to match the native code.
+      const char *sources[] = { "#pragma OPENCL FP_CONTRACT OFF\n", get_source() };
+      cl_device_fp_config fp_config = 0;
+      clGetDeviceInfo(device, CL_DEVICE_SINGLE_FP_CONFIG, sizeof(fp_config), &fp_config, NULL);
+      const char *options = fp_config & CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT ? "-cl-fp32-correctly-rounded-divide-sqrt" : "";
+      program = clCreateProgramWithSource(context, 2, sources, NULL, &err);
+      if (err == CL_SUCCESS) err = clBuildProgram(program, 1, &device, options, NULL, NULL);
+      if (err != CL_SUCCESS) {
+        char build_log[4096];
+        build_log[0] = 0;
+        if (program) clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(build_log), build_log, NULL);
+        log("sph_opencl: kernels did not build on %s (err %d)\n%s\n", device_name, err, build_log);
+        release();
+        return false;
+      }
+
+      static const char *names[num_kernels] = {
+        "compute_keys", "bitonic_step", "find_cells", "compute_density", "compute_forces", "leapfrog_step", "leapfrog_start",
+      };
+      for (unsigned i = 0; i != num_kernels && err == CL_SUCCESS; ++i) {
+        kernels[i] = clCreateKernel(program, names[i], &err);
+      }
+
+      if (err != CL_SUCCESS || !set_particles(n_, n_, x, v, vh, a, rho)) {
+        log("sph_opencl: could not make kernels and buffers on %s (err %d)\n", device_name, err);
+        release();
+        return false;
+      }
+      log("sph_opencl: running on %s\n", device_name);
+      return true;
+    }
+
+    /// Follow a change in the number of particles or in the simulation's arrays, which have room for capacity_.
+    /// The buffers are only made again when the arrays move or get bigger.
+    bool set_particles(unsigned n_, unsigned capacity_, float *x, float *v, float *vh, float *a, float *rho) {
+      if (mapped) unmap();
+      n = n_;
+      for (sort_size = 1; sort_size < n; sort_size <<= 1);
+
+      float *arrays[num_host_mems] = { x, v, vh, a, rho };
+      bool same = capacity_ == capacity;
+      for (unsigned i = 0; i != num_host_mems; ++i) {
+        same = same && host[i] == arrays[i];
+      }
+      if (!same) {
+        for (unsigned i = 0; i != num_mems; ++i) {
+          if (mems[i]) clReleaseMemObject(mems[i]);
+          mems[i] = 0;
+        }
+        capacity = capacity_;
+        unsigned max_sort_size = 1;
+        while (max_sort_size < capacity) max_sort_size <<= 1;
+
+        cl_int err = CL_SUCCESS;
+        for (unsigned i = 0; i != num_host_mems && err == CL_SUCCESS; ++i) {
+          host[i] = arrays[i];
+          size_t size = ( i == mem_rho ? capacity : capacity * 3 ) * sizeof(float);
+          mems[i] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, size, host[i], &err);
+        }
+        if (err == CL_SUCCESS) mems[mem_keys] = clCreateBuffer(context, CL_MEM_READ_WRITE, max_sort_size * sizeof(cl_ulong), NULL, &err);
+        if (err == CL_SUCCESS) mems[mem_order] = clCreateBuffer(context, CL_MEM_READ_WRITE, capacity * sizeof(cl_uint), NULL, &err);
+        if (err == CL_SUCCESS) mems[mem_cell_start] = clCreateBuffer(context, CL_MEM_READ_WRITE, ( num_cells + 1 ) * sizeof(cl_uint), NULL, &err);
+        if (err != CL_SUCCESS) {
+          log("sph_opencl: could not make buffers for %u particles (err %d)\n", capacity, err);
+          return false;
+        }
+      }
+
+      // the host owns the arrays between steps.
+      map();
+      return true;
+    }
+
+    /// Build the neighbour grid and compute the densities.
+    void compute_density(float mass) {
+      unmap();
+      build_grid();
+      cl_kernel k = kernels[kernel_compute_density];
+      set_arg(k, 0, mems[mem_x]); set_arg(k, 1, mems[mem_rho]); set_arg(k, 2, mems[mem_order]); set_arg(k, 3, mems[mem_cell_start]);
+      set_grid_args(k, 4);
+      set_arg(k, 12, mass);
+      run(kernel_compute_density, n);
+      map();
+    }
+
+    /// Compute the accelerations from the densities, using the grid of compute_density.
+    void compute_forces(float mass, float rho0, float k_, float mu, float g) {
+      unmap();
+      cl_kernel k = kernels[kernel_compute_forces];
+      set_arg(k, 0, mems[mem_x]); set_arg(k, 1, mems[mem_v]); set_arg(k, 2, mems[mem_rho]); set_arg(k, 3, mems[mem_a]);
+      set_arg(k, 4, mems[mem_order]); set_arg(k, 5, mems[mem_cell_start]);
+      set_grid_args(k, 6);
+      set_arg(k, 14, mass); set_arg(k, 15, rho0); set_arg(k, 16, k_); set_arg(k, 17, mu); set_arg(k, 18, g);
+      run(kernel_compute_forces, n);
+      map();
+    }
+
+    /// Move the particles on by dt. The first step (start) has no half step velocities yet.
+    void leapfrog(float dt, bool start) {
+      unmap();
+      unsigned kernel = start ? kernel_leapfrog_start : kernel_leapfrog_step;
+      cl_kernel k = kernels[kernel];
+      set_arg(k, 0, mems[mem_x]); set_arg(k, 1, mems[mem_v]); set_arg(k, 2, mems[mem_vh]); set_arg(k, 3, mems[mem_a]);
+      set_arg(k, 4, n * 3); set_arg(k, 5, dt);
+      run(kernel, n * 3);
+      map();
+    }
+
+    /// Name of the OpenCL device.
+    const char *get_device_name() const {
+      return device_name;
+    }
+  };
+}
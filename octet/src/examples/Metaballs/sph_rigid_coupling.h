@@ -0,0 +1,613 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Two way coupling between the SPH fluid and Bullet rigid bodies
+//
+
+namespace octet {
+  /// Couples the SPH fluid of the particle app to Bullet rigid bodies.
+  ///
+  /// The surface of each body is sampled once, in body space, as boundary particles
+  /// each with a volume from the number of samples around it (Akinci et al. 2012).
+  /// Every step, the bodies whose broadphase bounds meet the fluid are found with
+  /// the world's broadphase and their samples are moved to world space and hashed into
+  /// cells of size h. Fluid particles look up the samples around them to add boundary
+  /// density and pressure/viscosity forces and the opposite forces are summed for each
+  /// body and applied as impulses before the next Bullet step.
+  ///
+  /// Positions, velocities, densities and accelerations use the x, y, z layout of sim_state_t
+  /// and the kernels are the ones used by the particle app.
+  ///
+  /// Example
+  ///
+  ///     coupling.begin_step(state->x, state->n);
+  ///     compute_density(...); coupling.add_density(state->x, state->rho, state->n);
+  ///     compute_forces(...); coupling.add_forces(...);
+  ///     leapfrog_step(...);
+  ///     coupling.apply_impulses();
+  ///     world->stepSimulation(dt, 1, dt);
+  class sph_rigid_coupling {
+    // fluid particles per chunk of the force gather.
+    // this is fixed, so the sums for each body do not depend on the number of threads.
+    static const unsigned chunk_size = 256;
+
+    struct body_t {
+      btRigidBody *rigid_body;
+      unsigned first_sample;
+      unsigned num_samples;
+      vec3 impulse;
+      vec3 torque_impulse;
+    };
+
+    // a body that the fluid can reach this step.
+    struct active_body_t {
+      unsigned body;
+      vec3 centre;
+      vec3 linear_velocity;
+      vec3 angular_velocity;
+    };
+
+    // points hashed into cells of size h and sorted by bucket.
+    struct cell_grid {
+      float inv_h;
+      unsigned shift;
+      dynarray<unsigned> start;
+      dynarray<unsigned> order;
+      dynarray<uint32_t> keys;
+
+      // ten bits of each cell coordinate. cells within one of each other always have different keys.
+      static uint32_t cell_key(int x, int y, int z) {
+        return ( (uint32_t)x & 0x3ff ) | ( ( (uint32_t)y & 0x3ff ) << 10 ) | ( ( (uint32_t)z & 0x3ff ) << 20 );
+      }
+
+      // the top bits of a multiplicative hash depend on all of the key.
+      unsigned bucket(uint32_t key) const {
+        return key * 2654435761u >> shift;
+      }
+
+      void cell(vec3_in pos, int &x, int &y, int &z) const {
+        x = (int)floorf(pos.x() * inv_h);
+        y = (int)floorf(pos.y() * inv_h);
+        z = (int)floorf(pos.z() * inv_h);
+      }
+
+      // counting sort of the points by bucket.
+      void build(const vec4 *pos, unsigned count, float h) {
+        inv_h = 1.0f / h;
+        unsigned num_buckets = 64;
+        shift = 32 - 6;
+        while (num_buckets < count * 2) {
+          num_buckets *= 2;
+          shift--;
+        }
+
+        start.resize(num_buckets + 1);
+        order.resize(count);
+        keys.resize(count);
+        memset(start.data(), 0, start.size() * sizeof(unsigned));
+
+        for (unsigned i = 0; i != count; ++i) {
+          int x, y, z;
+          cell(pos[i].xyz(), x, y, z);
+          keys[i] = cell_key(x, y, z);
+          start[bucket(keys[i]) + 1]++;
+        }
+        for (unsigned b = 0; b != num_buckets; ++b) {
+          start[b + 1] += start[b];
+        }
+
+        dynarray<unsigned> next(num_buckets);
+        memcpy(next.data(), start.data(), num_buckets * sizeof(unsigned));
+        dynarray<uint32_t> unsorted_keys(count);
+        if (count) memcpy(unsorted_keys.data(), keys.data(), count * sizeof(uint32_t));
+        for (unsigned i = 0; i != count; ++i) {
+          unsigned s = next[bucket(unsorted_keys[i])]++;
+          order[s] = i;
+          keys[s] = unsorted_keys[i];
+        }
+      }
+
+      /// call fn(sorted_index) for the points in the 27 cells around pos.
+      template <class fn_t> void for_each_near(vec3_in pos, fn_t fn) const {
+        if (order.size() == 0) return;
+        int cx, cy, cz;
+        cell(pos, cx, cy, cz);
+        for (int z = cz - 1; z <= cz + 1; ++z) {
+          for (int y = cy - 1; y <= cy + 1; ++y) {
+            for (int x = cx - 1; x <= cx + 1; ++x) {
+              uint32_t key = cell_key(x, y, z);
+              unsigned b = bucket(key);
+              for (unsigned s = start[b], e = start[b + 1]; s != e; ++s) {
+                // buckets may be shared with other cells.
+                if (keys[s] == key) fn(s);
+              }
+            }
+          }
+        }
+      }
+    };
+
+    // collects the bodies whose broadphase bounds meet a box.
+    struct aabb_callback : btBroadphaseAabbCallback {
+      sph_rigid_coupling *coupling;
+
+      bool process(const btBroadphaseProxy *proxy) {
+        void *object = proxy->m_clientObject;
+        int index = coupling->body_index.get_index(object);
+        if (index >= 0) {
+          coupling->active_list.push_back(coupling->body_index.get_value(index));
+        }
+        return true;
+      }
+    };
+
+    btDynamicsWorld *world;
+    float h;
+    float default_spacing;
+
+    dynarray<body_t> bodies;
+    hash_map<void*, unsigned> body_index;
+
+    // body space position and boundary volume (w) of every sample.
+    dynarray<vec4> local_samples;
+
+    // reached bodies this step, in the order they were added.
+    dynarray<unsigned> active_list;
+    dynarray<active_body_t> active;
+
+    // world space position and volume of the samples of the reached bodies, sorted by cell.
+    dynarray<vec4> unsorted_samples;
+    dynarray<unsigned> unsorted_owner;
+    dynarray<vec4> samples;
+    dynarray<unsigned> sample_owner;
+    cell_grid grid;
+
+    // force and torque on each active body from each chunk of fluid particles.
+    dynarray<vec3> chunk_forces;
+    dynarray<vec3> chunk_torques;
+
+    // mass free density kernel of the particle app: 4 / (pi h^8) * (h^2 - r^2)^3
+    float kernel(float r2) const {
+      float h2 = h * h;
+      float z = h2 - r2;
+      return z > 0 ? 4 / 3.14f / ( ( h2*h2 )*( h2*h2 ) ) * z * z * z : 0;
+    }
+
+    static vec3 get_vec3(const btVector3 &v) {
+      return vec3(v[0], v[1], v[2]);
+    }
+
+    void add_sample(vec3_in pos) {
+      local_samples.push_back(vec4(pos, 0));
+    }
+
+    // a lattice on each face of a box. points on edges belong to the face with the lowest axis.
+    void sample_box(const btTransform &shapeToBody, const btVector3 &half, float spacing) {
+      int n[3];
+      for (int a = 0; a != 3; ++a) {
+        n[a] = (int)ceilf(2 * half[a] / spacing);
+        if (n[a] < 1) n[a] = 1;
+      }
+      for (int axis = 0; axis != 3; ++axis) {
+        int u = ( axis + 1 ) % 3, v = ( axis + 2 ) % 3;
+        for (int side = -1; side <= 1; side += 2) {
+          for (int i = 0; i <= n[u]; ++i) {
+            if (u < axis && ( i == 0 || i == n[u] )) continue;
+            for (int j = 0; j <= n[v]; ++j) {
+              if (v < axis && ( j == 0 || j == n[v] )) continue;
+              btVector3 p;
+              p[axis] = side * half[axis];
+              p[u] = half[u] * ( 2.0f * i / n[u] - 1 );
+              p[v] = half[v] * ( 2.0f * j / n[v] - 1 );
+              add_sample(get_vec3(shapeToBody * p));
+            }
+          }
+        }
+      }
+    }
+
+    // a Fibonacci spiral of points on a sphere.
+    void sample_sphere(const btTransform &shapeToBody, float radius, float spacing) {
+      unsigned count = (unsigned)ceilf(4 * 3.14159265f * radius * radius / ( spacing * spacing ));
+      if (count < 4) count = 4;
+      float golden = 3.14159265f * ( 3 - sqrtf(5.0f) );
+      for (unsigned i = 0; i != count; ++i) {
+        float y = 1 - ( i + 0.5f ) * 2 / count;
+        float r = sqrtf(1 - y * y);
+        float phi = golden * i;
+        btVector3 p(cosf(phi) * r * radius, y * radius, sinf(phi) * r * radius);
+        add_sample(get_vec3(shapeToBody * p));
+      }
+    }
+
+    // a layer of lattice points within half a spacing of the surface of any convex shape.
+    void sample_convex(const btTransform &shapeToBody, const btConvexShape *shape, float spacing) {
+      const btTransform &identity = btTransform::getIdentity();
+      btVector3 lo, hi;
+      shape->getAabb(identity, lo, hi);
+      int n[3];
+      for (int a = 0; a != 3; ++a) {
+        n[a] = (int)ceilf(( hi[a] - lo[a] ) / spacing) + 1;
+      }
+      for (int z = 0; z <= n[2]; ++z) {
+        for (int y = 0; y <= n[1]; ++y) {
+          for (int x = 0; x <= n[0]; ++x) {
+            btVector3 p = lo + btVector3((x - 0.5f) * spacing, (y - 0.5f) * spacing, (z - 0.5f) * spacing);
+            btGjkEpaSolver2::sResults results;
+            btScalar d = btGjkEpaSolver2::SignedDistance(p, 0, shape, identity, results);
+            if (fabsf(d) <= spacing * 0.5f) {
+              add_sample(get_vec3(shapeToBody * p));
+            }
+          }
+        }
+      }
+    }
+
+    // a lattice on every triangle of a concave shape.
+    struct triangle_sampler : btTriangleCallback {
+      sph_rigid_coupling *coupling;
+      btTransform shapeToBody;
+      float spacing;
+
+      void processTriangle(btVector3 *tri, int part, int index) {
+        float len = tri[0].distance(tri[1]);
+        len = btMax(len, tri[1].distance(tri[2]));
+        len = btMax(len, tri[2].distance(tri[0]));
+        int n = (int)ceilf(len / spacing);
+        if (n < 1) n = 1;
+        for (int i = 0; i <= n; ++i) {
+          for (int j = 0; i + j <= n; ++j) {
+            btVector3 p = tri[0] + ( tri[1] - tri[0] ) * ( (float)i / n ) + ( tri[2] - tri[0] ) * ( (float)j / n );
+            coupling->add_sample(get_vec3(shapeToBody * p));
+          }
+        }
+      }
+    };
+
+    void sample_shape(const btTransform &shapeToBody, const btCollisionShape *shape, float spacing) {
+      switch (shape->getShapeType()) {
+        case SPHERE_SHAPE_PROXYTYPE: {
+          sample_sphere(shapeToBody, ((const btSphereShape*)shape)->getRadius(), spacing);
+        } break;
+        case BOX_SHAPE_PROXYTYPE: {
+          sample_box(shapeToBody, ((const btBoxShape*)shape)->getHalfExtentsWithMargin(), spacing);
+        } break;
+        case COMPOUND_SHAPE_PROXYTYPE: {
+          const btCompoundShape *compound = (const btCompoundShape*)shape;
+          for (int i = 0; i != compound->getNumChildShapes(); ++i) {
+            sample_shape(shapeToBody * compound->getChildTransform(i), compound->getChildShape(i), spacing);
+          }
+        } break;
+        case STATIC_PLANE_PROXYTYPE: {
+          // infinite planes are walls: leave them to the fluid's own boundaries.
+        } break;
+        default: {
+          if (shape->isConvex()) {
+            sample_convex(shapeToBody, (const btConvexShape*)shape, spacing);
+          } else if (shape->isConcave()) {
+            btVector3 lo, hi;
+            shape->getAabb(btTransform::getIdentity(), lo, hi);
+            triangle_sampler sampler;
+            sampler.coupling = this;
+            sampler.shapeToBody = shapeToBody;
+            sampler.spacing = spacing;
+            ((const btConcaveShape*)shape)->processAllTriangles(&sampler, lo, hi);
+          } else {
+            printf("warning: sph_rigid_coupling can't sample shape type %d\n", shape->getShapeType());
+          }
+        } break;
+      }
+    }
+
+    // the boundary volume of each sample is the inverse of the sum of the kernel over the
+    // samples of its body, so densely sampled areas do not push harder than sparse ones.
+    void compute_volumes(unsigned first, unsigned count) {
+      cell_grid local_grid;
+      local_grid.build(local_samples.data() + first, count, h);
+      vec4 *pos = local_samples.data() + first;
+      thread_pool::get().parallel_for(count, [&](unsigned i) {
+        float sum = 0;
+        local_grid.for_each_near(pos[i].xyz(), [&](unsigned s) {
+          sum += kernel(squared(pos[i].xyz() - pos[local_grid.order[s]].xyz()));
+        });
+        pos[i][3] = 1.0f / sum;
+      });
+    }
+
+  public:
+    /// Couple rigid bodies in world to a fluid with particle size h.
+    /// Surfaces are sampled every spacing units, half the particle size by default.
+    sph_rigid_coupling(btDynamicsWorld *world, float h, float spacing = 0) {
+      this->world = world;
+      this->h = h;
+      default_spacing = spacing ? spacing : h * 0.5f;
+    }
+
+    /// Use a new world for finding bodies near the fluid, eg. after restoring a snapshot.
+    void set_world(btDynamicsWorld *world) {
+      this->world = world;
+    }
+
+    /// Sample the collision shape of a body and add it to the coupling.
+    /// Static bodies push the fluid but are not pushed back.
+    /// Returns the index of the body.
+    unsigned add_body(btRigidBody *rigid_body, float spacing = 0) {
+      body_t body;
+      body.rigid_body = rigid_body;
+      body.first_sample = local_samples.size();
+      body.impulse = body.torque_impulse = vec3(0, 0, 0);
+
+      sample_shape(btTransform::getIdentity(), rigid_body->getCollisionShape(), spacing ? spacing : default_spacing);
+
+      body.num_samples = local_samples.size() - body.first_sample;
+      compute_volumes(body.first_sample, body.num_samples);
+
+      unsigned result = bodies.size();
+      body_index[(void*)(btCollisionObject*)rigid_body] = result;
+      bodies.push_back(body);
+      return result;
+    }
+
+    /// Find the bodies the fluid can reach and hash their samples in world space.
+    /// Call once per step before add_density and add_forces.
+    void begin_step(const float *x, int n) {
+      active_list.resize(0);
+      active.resize(0);
+      samples.resize(0);
+      sample_owner.resize(0);
+      if (n <= 0 || bodies.size() == 0) {
+        grid.build(samples.data(), 0, h);
+        return;
+      }
+
+      // bounds of the fluid from fixed ranges of particles.
+      unsigned num_ranges = ( n + chunk_size - 1 ) / chunk_size;
+      dynarray<vec3> range_min(num_ranges), range_max(num_ranges);
+      thread_pool::get().parallel_ranges(n, chunk_size, [&](unsigned begin, unsigned end) {
+        vec3 lo(x[begin*3+0], x[begin*3+1], x[begin*3+2]), hi = lo;
+        for (unsigned i = begin + 1; i != end; ++i) {
+          vec3 p(x[i*3+0], x[i*3+1], x[i*3+2]);
+          lo = min(lo, p);
+          hi = max(hi, p);
+        }
+        range_min[begin / chunk_size] = lo;
+        range_max[begin / chunk_size] = hi;
+      });
+      vec3 lo = range_min[0], hi = range_max[0];
+      for (unsigned r = 1; r != num_ranges; ++r) {
+        lo = min(lo, range_min[r]);
+        hi = max(hi, range_max[r]);
+      }
+
+      aabb_callback callback;
+      callback.coupling = this;
+      world->getBroadphase()->aabbTest(get_btVector3(lo - vec3(h)), get_btVector3(hi + vec3(h)), callback);
+
+      // the broadphase visits bodies in tree order and may visit them more than once.
+      // sort them so the results don't depend on it.
+      unsigned num_found = active_list.size();
+      for (unsigned i = 1; i < num_found; ++i) {
+        unsigned b = active_list[i], j = i;
+        for (; j > 0 && active_list[j-1] > b; --j) active_list[j] = active_list[j-1];
+        active_list[j] = b;
+      }
+      unsigned num_active = 0;
+      for (unsigned i = 0; i != num_found; ++i) {
+        if (num_active == 0 || active_list[num_active-1] != active_list[i]) {
+          active_list[num_active++] = active_list[i];
+        }
+      }
+      active_list.resize(num_active);
+
+      unsigned num_samples = 0;
+      active.resize(num_active);
+      dynarray<unsigned> first_sample(num_active);
+      for (unsigned a = 0; a != num_active; ++a) {
+        const body_t &body = bodies[active_list[a]];
+        btRigidBody *rigid_body = body.rigid_body;
+        active[a].body = active_list[a];
+        active[a].centre = get_vec3(rigid_body->getCenterOfMassPosition());
+        active[a].linear_velocity = get_vec3(rigid_body->getLinearVelocity());
+        active[a].angular_velocity = get_vec3(rigid_body->getAngularVelocity());
+        first_sample[a] = num_samples;
+        num_samples += body.num_samples;
+      }
+
+      unsorted_samples.resize(num_samples);
+      unsorted_owner.resize(num_samples);
+      thread_pool::get().parallel_for(num_active, [&](unsigned a) {
+        const body_t &body = bodies[active[a].body];
+        const btTransform &bodyToWorld = body.rigid_body->getWorldTransform();
+        const vec4 *src = local_samples.data() + body.first_sample;
+        vec4 *dest = unsorted_samples.data() + first_sample[a];
+        unsigned *owner = unsorted_owner.data() + first_sample[a];
+        for (unsigned i = 0; i != body.num_samples; ++i) {
+          btVector3 p = bodyToWorld * btVector3(src[i][0], src[i][1], src[i][2]);
+          dest[i] = vec4(p[0], p[1], p[2], src[i][3]);
+          owner[i] = a;
+        }
+      });
+
+      // sort the samples by cell so that lookups read them in order.
+      grid.build(unsorted_samples.data(), num_samples, h);
+      samples.resize(num_samples);
+      sample_owner.resize(num_samples);
+      thread_pool::get().parallel_ranges(num_samples, 4096, [&](unsigned begin, unsigned end) {
+        for (unsigned s = begin; s != end; ++s) {
+          samples[s] = unsorted_samples[grid.order[s]];
+          sample_owner[s] = unsorted_owner[grid.order[s]];
+        }
+      });
+    }
+
+    /// Add the density of the boundary samples around each particle: rho0 * volume * W(r)
+    void add_density(const float *x, float *rho, int n, float rho0) {
+      if (samples.size() == 0) return;
+      thread_pool::get().parallel_ranges(n, chunk_size, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          vec3 xi(x[i*3+0], x[i*3+1], x[i*3+2]);
+          float sum = 0;
+          grid.for_each_near(xi, [&](unsigned s) {
+            sum += samples[s][3] * kernel(squared(xi - samples[s].xyz()));
+          });
+          rho[i] += rho0 * sum;
+        }
+      });
+    }
+
+    /// For a pressure solver: the acceleration from the boundary for a particle pressure of one
+    /// (push, xyz for each particle) and the gradient of the boundary's part of the density (grad),
+    /// so that the solver can predict the density as the particles move.
+    void get_pressure_terms(const float *x, const float *rho, float *push, float *grad, int n, float rho0) {
+      if (samples.size() == 0) {
+        memset(push, 0, n * 3 * sizeof(float));
+        memset(grad, 0, n * 3 * sizeof(float));
+        return;
+      }
+      float h2 = h * h;
+      float C0 = rho0 / 3.14f / ( h2 * h2 );
+      float C = -24 / 3.14f / ( ( h2*h2 )*( h2*h2 ) );
+      thread_pool::get().parallel_ranges(n, chunk_size, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          vec3 xi(x[i*3+0], x[i*3+1], x[i*3+2]);
+          float rhoi = rho[i];
+          vec3 pi(0, 0, 0), gi(0, 0, 0);
+          grid.for_each_near(xi, [&](unsigned s) {
+            vec3 d = xi - samples[s].xyz();
+            float r2 = squared(d);
+            if (r2 < h2) {
+              float q = sqrtf(r2) / h;
+              q = q < 1e-3f ? 1e-3f : q;
+              float u = 1 - q;
+              // the pressure term of add_forces with 15 * 2 * p for a pressure p.
+              pi += d * ( C0 * samples[s][3] * u / rhoi / rhoi * 30 * u / q );
+              float z = h2 - r2;
+              gi += d * ( rho0 * samples[s][3] * C * z * z );
+            }
+          });
+          push[i*3+0] = pi.x(); push[i*3+1] = pi.y(); push[i*3+2] = pi.z();
+          grad[i*3+0] = gi.x(); grad[i*3+1] = gi.y(); grad[i*3+2] = gi.z();
+        }
+      });
+    }
+
+    /// Add pressure and viscosity accelerations from the boundary to the particles and
+    /// add the opposite forces, times dt, to the impulses of the bodies.
+    /// The boundary is given the density of the particle and only pushes.
+    /// With pressure (one for each particle, from a pressure solver) the boundary has the
+    /// particle's pressure instead of k(rho-rho0).
+    void add_forces(const float *x, const float *v, const float *rho, float *a, int n, float mass, float rho0, float k, float mu, float dt, const float *pressure = 0) {
+      unsigned num_active = active.size();
+      if (samples.size() == 0 || n <= 0) return;
+
+      float h2 = h * h;
+      float C0 = rho0 / 3.14f / ( h2 * h2 );
+      float Cp = 15 * k;
+      float Cv = -40 * mu;
+      unsigned num_chunks = ( n + chunk_size - 1 ) / chunk_size;
+      chunk_forces.resize(num_chunks * num_active);
+      chunk_torques.resize(num_chunks * num_active);
+
+      thread_pool::get().parallel_ranges(n, chunk_size, [&](unsigned begin, unsigned end) {
+        vec3 *forces = chunk_forces.data() + begin / chunk_size * num_active;
+        vec3 *torques = chunk_torques.data() + begin / chunk_size * num_active;
+        for (unsigned b = 0; b != num_active; ++b) {
+          forces[b] = torques[b] = vec3(0, 0, 0);
+        }
+        for (unsigned i = begin; i != end; ++i) {
+          vec3 xi(x[i*3+0], x[i*3+1], x[i*3+2]);
+          vec3 vi(v[i*3+0], v[i*3+1], v[i*3+2]);
+          float rhoi = rho[i];
+          float pi = pressure ? 30 * pressure[i] : Cp * 2 * ( rhoi > rho0 ? rhoi - rho0 : 0 );
+          vec3 ai(0, 0, 0);
+          grid.for_each_near(xi, [&](unsigned s) {
+            vec3 d = xi - samples[s].xyz();
+            float r2 = squared(d);
+            if (r2 < h2) {
+              const active_body_t &body = active[sample_owner[s]];
+              vec3 rel = samples[s].xyz() - body.centre;
+              vec3 vb = body.linear_velocity + cross(body.angular_velocity, rel);
+              float q = sqrtf(r2) / h;
+              q = q < 1e-3f ? 1e-3f : q;
+              float u = 1 - q;
+              float w0 = C0 * samples[s][3] * u / rhoi / rhoi;
+              float wp = w0 * pi * u / q;
+              float wv = w0 * Cv;
+              vec3 da = d * wp + ( vi - vb ) * wv;
+              ai += da;
+              vec3 f = da * -mass;
+              forces[sample_owner[s]] += f;
+              torques[sample_owner[s]] += cross(rel, f);
+            }
+          });
+          a[i*3+0] += ai.x();
+          a[i*3+1] += ai.y();
+          a[i*3+2] += ai.z();
+        }
+      });
+
+      // sum the chunks in order.
+      for (unsigned b = 0; b != num_active; ++b) {
+        vec3 force(0, 0, 0), torque(0, 0, 0);
+        for (unsigned c = 0; c != num_chunks; ++c) {
+          force += chunk_forces[c * num_active + b];
+          torque += chunk_torques[c * num_active + b];
+        }
+        body_t &body = bodies[active[b].body];
+        body.impulse += force * dt;
+        body.torque_impulse += torque * dt;
+      }
+    }
+
+    /// Apply the impulses summed by add_forces to the dynamic bodies.
+    /// Call before stepping the Bullet world.
+    void apply_impulses() {
+      for (unsigned i = 0; i != bodies.size(); ++i) {
+        body_t &body = bodies[i];
+        if (squared(body.impulse) + squared(body.torque_impulse) != 0 && !body.rigid_body->isStaticOrKinematicObject()) {
+          body.rigid_body->activate();
+          body.rigid_body->applyCentralImpulse(get_btVector3(body.impulse));
+          body.rigid_body->applyTorqueImpulse(get_btVector3(body.torque_impulse));
+        }
+        body.impulse = body.torque_impulse = vec3(0, 0, 0);
+      }
+    }
+
+    /// Get the world space positions of the samples of all the bodies, eg. for drawing.
+    void get_world_samples(dynarray<vec3p> &result) const {
+      result.resize(local_samples.size());
+      thread_pool::get().parallel_for(bodies.size(), [&](unsigned b) {
+        const body_t &body = bodies[b];
+        const btTransform &bodyToWorld = body.rigid_body->getWorldTransform();
+        for (unsigned i = 0; i != body.num_samples; ++i) {
+          const vec4 &src = local_samples[body.first_sample + i];
+          btVector3 p = bodyToWorld * btVector3(src[0], src[1], src[2]);
+          result[body.first_sample + i] = vec3(p[0], p[1], p[2]);
+        }
+      });
+    }
+
+    /// Number of bodies added.
+    unsigned get_num_bodies() const {
+      return bodies.size();
+    }
+
+    /// Number of samples on all the bodies.
+    unsigned get_num_samples() const {
+      return local_samples.size();
+    }
+
+    /// Number of bodies the fluid could reach this step.
+    unsigned get_num_active_bodies() const {
+      return active.size();
+    }
+
+    /// Number of samples on the bodies the fluid could reach this step.
+    unsigned get_num_active_samples() const {
+      return samples.size();
+    }
+  };
+}
@@ -21,11 +21,10 @@ namespace octet {
       app_scene =  new visual_scene();
 
       resource_dict dict;
-      if (!loader.load_xml("assets/duck_triangulate.dae")) {
+      if (!loader.load_resources("assets/duck_triangulate.dae", dict)) {
         // failed to load file
         return;
       }
-      loader.get_resources(dict);
 
       dynarray<resource*> meshes;
       dict.find_all(meshes, atom_mesh);
@@ -5,10 +5,50 @@
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
 namespace octet {
-  /// Scene containing a box with octet.
+  /// Scene showing slices through a 4D NIFTI scan.
+  ///
+  /// Up and down move through the slices, left and right through the time points.
+  /// Only the bricks crossing the current slice are read from the file.
   class example_nifti : public app {
     // scene for drawing box
     ref<visual_scene> app_scene;
+
+    // the scan and the slice we are showing
+    ref<nifti_file> scan;
+    ref<image> slice_image;
+    unsigned slice_index;
+    unsigned frame;
+
+    // scratch space for the slice
+    dynarray<float> values;
+    dynarray<uint8_t> pixels;
+
+    /// read a slice from the volume and put it in the texture as greyscale.
+    void update_slice() {
+      nifti_volume &vol = scan->get_volume();
+      if (!vol.get_slice_float(values, 2, slice_index, frame)) return;
+
+      // use the display range from the header if there is one.
+      float lo = vol.get_header().cal_min, hi = vol.get_header().cal_max;
+      if (lo >= hi) {
+        lo = hi = values[0];
+        for (unsigned i = 0; i != values.size(); ++i) {
+          lo = values[i] < lo ? values[i] : lo;
+          hi = values[i] > hi ? values[i] : hi;
+        }
+      }
+      float scale = hi > lo ? 255.0f / (hi - lo) : 0;
+
+      pixels.resize(values.size() * 4);
+      for (unsigned i = 0; i != values.size(); ++i) {
+        float v = (values[i] - lo) * scale;
+        uint8_t grey = (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+        pixels[i*4+0] = pixels[i*4+1] = pixels[i*4+2] = grey;
+        pixels[i*4+3] = 255;
+      }
+      slice_image->set_pixels(GL_RGBA, vol.get_width(), vol.get_height(), &pixels[0]);
+    }
+
   public:
     /// this is called when we construct the class before everything is initialised.
     example_nifti(int argc, char **argv) : app(argc, argv) {
@@ -19,9 +59,19 @@ namespace octet {
       app_scene =  new visual_scene();
       app_scene->create_default_camera_and_lights();
 
-      image *img = new image("assets/nifti/Sample_fMR_dataset_BdeGelderLab.nii");
-      material *mat = new material(img);
-      mesh_box *box = new mesh_box(vec3(4));
+      scan = new nifti_file("assets/nifti/Sample_fMR_dataset_BdeGelderLab.nii");
+      slice_image = new image();
+      slice_index = scan->get_volume().get_depth() / 2;
+      frame = 0;
+      if (!scan->get_volume().is_open()) {
+        uint8_t black[4] = { 0, 0, 0, 255 };
+        slice_image->set_pixels(GL_RGBA, 1, 1, black);
+      } else {
+        update_slice();
+      }
+
+      material *mat = new material(slice_image);
+      mesh_box *box = new mesh_box(vec3(4, 4, 0.1f));
       scene_node *node = new scene_node();
       app_scene->add_child(node);
       app_scene->add_mesh_instance(new mesh_instance(node, box, mat));
@@ -29,6 +79,16 @@ namespace octet {
 
     /// this is called to draw the world
     void draw_world(int x, int y, int w, int h) {
+      nifti_volume &vol = scan->get_volume();
+      if (vol.is_open()) {
+        unsigned old_slice = slice_index, old_frame = frame;
+        if (is_key_down(key_up) && slice_index + 1 < vol.get_depth()) slice_index++;
+        if (is_key_down(key_down) && slice_index > 0) slice_index--;
+        if (is_key_down(key_right)) frame = (frame + 1) % vol.get_frames();
+        if (is_key_down(key_left)) frame = (frame + vol.get_frames() - 1) % vol.get_frames();
+        if (slice_index != old_slice || frame != old_frame) update_slice();
+      }
+
       int vx = 0, vy = 0;
       get_viewport_size(vx, vy);
       app_scene->begin_render(vx, vy);
@@ -38,11 +98,6 @@ namespace octet {
 
       // draw the scene
       app_scene->render((float)vx / vy);
-
-      // tumble the box  (there is only one mesh instance)
-      scene_node *node = app_scene->get_mesh_instance(0)->get_node();
-      node->rotate(1, vec3(1, 0, 0));
-      node->rotate(1, vec3(0, 1, 0));
     }
   };
 }
@@ -9,6 +9,7 @@
 
 #include "../../octet.h"
 
+#include "nifti_file.h"
 #include "example_nifti.h"
 
 /// Create a box with a 3d animated texture
@@ -95,130 +95,37 @@ namespace octet {
       NIFTI_SLICE_ALT_DEC2 = 6,
     };
 
-    /// storage for the file.
-    dynarray<uint8_t> buffer;
-
-    /// zip decoder
-    zip_decoder dec;
-
-    struct nifti_header {
-      int      sizeof_hdr;    /// MUST be 348
-      char     data_type[10]; /// ++UNUSED++
-      char     db_name[18];   /// ++UNUSED++
-      int      extents;       /// ++UNUSED++
-      short    session_error; /// ++UNUSED++
-      char     regular;       /// ++UNUSED++
-      char     dim_info;      /// MRI slice ordering.
-
-                                          ///--- was image_dimension substruct ---
-      short    dim[8];        /// Data array dimensions.
-      float    intent_p1 ;    /// 1st intent parameter.
-                                                          ///  short unused9;
-      float    intent_p2 ;    /// 2nd intent parameter.
-                                                          ///  short unused11;
-      float    intent_p3 ;    /// 3rd intent parameter.
-                                                          ///  short unused13;
-      short    intent_code ;  /// NIFTI_INTENT_* code.
-      short    datatype;      /// Defines data type!
-      short    bitpix;        /// Number bits/voxel.
-      short    slice_start;   /// First slice index.
-      float    pixdim[8];     /// Grid spacings.
-      float    vox_offset;    /// Offset into .nii file
-      float    scl_slope ;    /// Data scaling: slope.
-      float    scl_inter ;    /// Data scaling: offset.
-      short    slice_end;     /// Last slice index.
-      char     slice_code ;   /// Slice timing order.
-      char     xyzt_units ;   /// Units of pixdim[1..4]
-      float    cal_max;       /// Max display intensity
-      float    cal_min;       /// Min display intensity
-      float    slice_duration;/// Time for 1 slice.
-      float    toffset;       /// Time axis shift.
-      int      glmax;         /// ++UNUSED++
-      int      glmin;         /// ++UNUSED++
-
-                                              /// --- was data_history substruct ---
-      char     descrip[80];   /// any text you like.
-      char     aux_file[24];  /// auxiliary filename.
-
-      short    qform_code ;   /// NIFTI_XFORM_* code.
-      short    sform_code ;   /// NIFTI_XFORM_* code.
-                                                          ///    are replaced
-      float    quatern_b ;    /// Quaternion b param.
-      float    quatern_c ;    /// Quaternion c param.
-      float    quatern_d ;    /// Quaternion d param.
-      float    qoffset_x ;    /// Quaternion x shift.
-      float    qoffset_y ;    /// Quaternion y shift.
-      float    qoffset_z ;    /// Quaternion z shift.
-
-      float    srow_x[4] ;    /// 1st row affine transform.
-      float    srow_y[4] ;    /// 2nd row affine transform.
-      float    srow_z[4] ;    /// 3rd row affine transform.
-
-      char    intent_name[16];/// 'name' or meaning of data.
-
-      char    magic[4] ;      /// MUST be "ni1\0" or "n+1\0".
-    };
-
-    /// byte-swapped copy of header
-    nifti_header h;
-
-    void swap_header() {
-      assert(0 && "todo: support byte ordering");
-    }
+    /// the file, paged in a brick at a time.
+    nifti_volume volume;
 
     /// return true if the header is broken.
-    // todo: if this becomes a more than a sketch, check the header thoroughly.
     bool check_header(const char *url) {
-      if (buffer.size() < sizeof(nifti_header)) {
+      if (!volume.is_open()) {
         log("bad or non-existant nifiti file %s\n", url);
         return true;
       }
 
-      h = (nifti_header&)buffer[0];
-      if (h.dim[0] >= 7) swap_header();
-
-      if (
-        h.sizeof_hdr != sizeof(nifti_header) ||
-        (!memcmp(h.magic, "ni1", 4) && !memcmp(h.magic, "n+1", 4))
-      ) {
-        log("bad header nifiti file %s\n", url);
-        return true;
-      }
-
-      const uint8_t *extension = &buffer[sizeof(nifti_header)];
-      int vox_offset = (int)(float)h.vox_offset;
-      int bitpix = h.bitpix;
-
-      log("vox_offset = %08x\n", vox_offset);
-      log("extension = %02x %02x %02x %02x\n", extension[0], extension[1], extension[2], extension[3]);
-
-      int num_dim = h.dim[0];
-      int tot_voxels = 1;
-      for (int i = 1; i <= num_dim; ++i) {
-        log("dim[%d] = %d   pd=%f\n", i, (int)h.dim[i], (float)h.pixdim[i]);
-        tot_voxels *= h.dim[i];
-      }
-
-      log("bitpix=%d\n", bitpix);
+      const nifti_decoder::nifti_header &h = volume.get_header();
+      log("dims = %d x %d x %d x %d\n", volume.get_width(), volume.get_height(), volume.get_depth(), volume.get_frames());
+      log("pixdim = %f %f %f %f\n", h.pixdim[1], h.pixdim[2], h.pixdim[3], h.pixdim[4]);
+      log("datatype=%d bitpix=%d\n", volume.get_datatype(), h.bitpix);
       log("intent_code=%d\n", h.intent_code);
-      log("expected size=%d\n", vox_offset + tot_voxels * bitpix / 8);
-      log("actual size=%d\n", buffer.size());
       log("xyzt_units=%08x\n", h.xyzt_units);
-
-      /*switch (h.intent_code) {
-      }*/
       return false;
     }
   public:
     nifti_file() {
-      assert(sizeof(nifti_header) == 348);
     }
 
+    /// map a .nii or .nii.gz file; voxels are read when they are used.
     nifti_file(const char *url) {
-      app_utils::get_url(buffer, url);
-      if (check_header(url)) return;
-
+      volume.open(app_utils::get_path(url));
+      check_header(url);
+    }
 
+    /// access the voxels by brick or slice
+    nifti_volume &get_volume() {
+      return volume;
     }
   };
 }
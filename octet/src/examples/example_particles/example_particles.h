@@ -12,6 +12,11 @@ namespace octet {
 
     // particle system
     ref<mesh_particle_system> system;
+    ref<mesh_instance> system_instance;
+
+    // quads built on the CPU and points expanded in the shader (hold S)
+    ref<material> sprites;
+    ref<material> point_sprites;
 
     random r;
   public:
@@ -24,12 +29,23 @@ namespace octet {
       app_scene =  new visual_scene();
       app_scene->create_default_camera_and_lights();
 
-      material *sprites = new material("assets/particles.gif");
+      image *sprite_image = new image("assets/particles.gif");
+      sprites = new material(sprite_image);
+      point_sprites = new material(sprite_image, 512.0f);
       system = new mesh_particle_system();
 
       scene_node *node = new scene_node();
       app_scene->add_child(node);
-      app_scene->add_mesh_instance(new mesh_instance(node, system, sprites));
+      system_instance = new mesh_instance(node, system, sprites);
+      app_scene->add_mesh_instance(system_instance);
+
+      // desktop OpenGL needs to be told to use gl_PointSize and gl_PointCoord.
+      #ifdef GL_VERTEX_PROGRAM_POINT_SIZE
+        glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+      #endif
+      #ifdef GL_POINT_SPRITE
+        glEnable(GL_POINT_SPRITE);
+      #endif
     }
 
     /// this is called to draw the world
@@ -57,6 +73,13 @@ namespace octet {
       pa.lifetime = 50;
       system->add_particle_animator(pa);
 
+      bool expand_in_shader = is_key_down('S');
+      if (expand_in_shader != system->get_expand_in_shader()) {
+        system->set_expand_in_shader(expand_in_shader);
+        system_instance->set_material(expand_in_shader ? point_sprites : sprites);
+      }
+      point_sprites->set_point_scale(vy * 0.5f * ci->get_cameraToProjection()[1][1]);
+
       system->set_cameraToWorld(ci->get_node()->calcModelToWorld());
       system->animate(1.0f/30);
       system->update();
@@ -11,6 +11,13 @@
 // Work for a paper on OBB collision
 
 namespace octet {
+  /// Flow cytometry standard (FCS) event file.
+  ///
+  /// The file is memory mapped and the events are stored by column, one
+  /// contiguous array of floats per parameter, so projecting onto a few axes
+  /// only touches the columns we need. Byte swapping and the transpose are done
+  /// in bulk blocks across the thread pool, and per-column statistics are
+  /// computed once in parallel and cached.
   class fcs_file : public resource {
     struct param {
       std::string short_name;
@@ -24,8 +31,29 @@ namespace octet {
       param() { bits = 32; amp_type = 0; is_log = false; range = 0; gain = 1.0f; }
     };
 
+    /// cached statistics for one parameter
+    struct column_stats {
+      float min;
+      float max;
+      float mean;
+      dynarray<unsigned> histogram;
+    };
+
+    enum {
+      // events per block when swapping and transposing.
+      block_events = 4096,
+    };
+
+    mapped_file file;
+
+    // data[col * num_events + row]
     dynarray<float> data;
     dynarray<param> params;
+    dynarray<column_stats> stats;
+    unsigned num_events;
+    unsigned num_bins;
+    size_t begin_data;
+    size_t end_data;
     char datatype;
     char byteord;
 
@@ -33,11 +61,11 @@ namespace octet {
     char value[65536];
 
 
-    const uint8_t *read_segment(char *dest, size_t size, const uint8_t *src) {
-      if (*src != 12) return src+1;
+    const uint8_t *read_segment(char *dest, size_t size, const uint8_t *src, const uint8_t *src_max) {
+      if (src >= src_max || *src != 12) return src+1;
       ++src;
       unsigned i = 0;
-      while (*src != 12) {
+      while (src < src_max && *src != 12) {
         if (i+1 < size) dest[i++] = *src;
         src++;
       }
@@ -47,7 +75,7 @@ namespace octet {
 
     void process_text(const uint8_t *text_min, const uint8_t *text_max) {
       const uint8_t *src = text_min;
-      src = read_segment(value, sizeof(value), src);
+      src = read_segment(value, sizeof(value), src, text_max);
       while (src < text_max) {
         if (value[0] != '$') {
           printf("odd text segment %s\n", value); return;
@@ -56,7 +84,7 @@ namespace octet {
         //printf("%s,", value);
         unsigned arg = 0;
         while (src < text_max) {
-          src = read_segment(value, sizeof(value), src);
+          src = read_segment(value, sizeof(value), src, text_max);
           if (value[0] == '$') break;
           //printf("%s,", value);
 
@@ -66,6 +94,10 @@ namespace octet {
           } else if (!strcmp(key, "BYTEORD") && arg == 0) {
             byteord = value[0];
             //printf("BYTEORD %s\n", value);
+          } else if (!strcmp(key, "BEGINDATA") && arg == 0) {
+            begin_data = (size_t)atof(value);
+          } else if (!strcmp(key, "ENDDATA") && arg == 0) {
+            end_data = (size_t)atof(value);
           } else if (!strcmp(key, "NEXTDATA") && arg == 0) {
             //printf("NEXTDATA %s\n", value);
           } else if (!strcmp(key, "PAR") && arg == 0) {
@@ -77,6 +109,11 @@ namespace octet {
             for (; *src >= '0' && *src <= '9'; ++src) {
               pnum = pnum * 10 + *src - '0';
             }
+            if (pnum - 1 >= params.size()) {
+              printf("bad parameter: %s\n", key);
+              arg++;
+              continue;
+            }
             param &p = params[pnum - 1];
             if (!strcmp(src, "B")) {
               p.bits = atoi(value);
@@ -109,19 +146,67 @@ namespace octet {
         //printf("\n");
       }
     }
+
+    /// copy words, swapping the byte order if needed.
+    /// src may be unaligned as it points into the mapped file.
+    static void swap_words(uint32_t *dest, const uint8_t *src, unsigned num_words, bool swap) {
+      if (!swap) {
+        memcpy(dest, src, num_words * 4);
+        return;
+      }
+      unsigned i = 0;
+      #if OCTET_SSE
+        for (; i + 4 <= num_words; i += 4) {
+          __m128i x = _mm_loadu_si128((const __m128i*)(src + i * 4));
+          // swap the bytes of each 16 bit half, then the halves.
+          x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+          x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+          x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+          _mm_storeu_si128((__m128i*)(dest + i), x);
+        }
+      #endif
+      // simple enough for the compiler to vectorise.
+      for (; i != num_words; ++i) {
+        uint32_t x;
+        memcpy(&x, src + i * 4, 4);
+        dest[i] = ( x >> 24 ) | ( ( x >> 8 ) & 0xff00 ) | ( ( x << 8 ) & 0xff0000 ) | ( x << 24 );
+      }
+    }
+
     void process_data(const uint8_t *data_min, const uint8_t *data_max) {
+      unsigned np = params.size();
+      if (np == 0 || data_max <= data_min) return;
+
       switch (datatype) {
         case 'F': {
-          data.reserve((data_max - data_min) / sizeof(float));
-          for (const uint8_t *src = data_min; src+3 < data_max; src += 4) {
-            union { float f; uint8_t u[4]; } u;
-            if (byteord == '1') {
-              u.u[0] = src[0]; u.u[1] = src[1]; u.u[2] = src[2]; u.u[3] = src[3];
-            } else {
-              u.u[0] = src[3]; u.u[1] = src[2]; u.u[2] = src[1]; u.u[3] = src[0];
+          for (unsigned j = 0; j != np; ++j) {
+            if (params[j].bits != 32) {
+              printf("unsupported parameter size %d\n", params[j].bits);
+              return;
             }
-            data.push_back(u.f);
           }
+
+          // the events are stored row by row in the file.
+          // swap a block of rows into a scratch buffer and then scatter them to the columns.
+          num_events = (unsigned)( (data_max - data_min) / ( np * 4 ) );
+          data.resize(num_events * np);
+          bool swap = byteord != '1';
+          unsigned num_blocks = ( num_events + block_events - 1 ) / block_events;
+
+          thread_pool::get().parallel_for(num_blocks, [&](unsigned block) {
+            unsigned begin = block * block_events;
+            unsigned end = begin + block_events < num_events ? begin + block_events : num_events;
+            dynarray<uint32_t> scratch(( end - begin ) * np);
+            swap_words(scratch.data(), data_min + begin * np * 4, scratch.size(), swap);
+
+            const float *rows = (const float*)scratch.data();
+            for (unsigned j = 0; j != np; ++j) {
+              float *col = data.data() + j * num_events;
+              for (unsigned i = begin; i != end; ++i) {
+                col[i] = rows[( i - begin ) * np + j];
+              }
+            }
+          });
         } break;
         default: {
           printf("unsupported data type %c\n", datatype);
@@ -129,12 +214,35 @@ namespace octet {
       }
     }
 
+    /// min, max and mean of every column, one column per task.
+    void compute_stats() {
+      unsigned np = params.size();
+      stats.resize(np);
+      thread_pool::get().parallel_for(np, [&](unsigned j) {
+        const float *col = get_column(j);
+        column_stats &s = stats[j];
+        float lo = num_events ? col[0] : 0;
+        float hi = lo;
+        double sum = 0;
+        for (unsigned i = 0; i != num_events; ++i) {
+          float v = col[i];
+          lo = v < lo ? v : lo;
+          hi = v > hi ? v : hi;
+          sum += v;
+        }
+        s.min = lo;
+        s.max = hi;
+        s.mean = num_events ? (float)( sum / num_events ) : 0;
+        s.histogram.reset();
+      });
+    }
+
     void write_csv(const char *filename) {
       FILE *csv = fopen(filename, "wb");
       if (!csv) { printf("unable to open %s\n", filename); return; }
 
       int np = (int)params.size();
-      int nevents = (int)(data.size() / params.size());
+      int nevents = (int)num_events;
 
       for (int j = 0; j != np; ++j) {
         fprintf(csv, j==0 ? "%s" : ",%s", params[j].name.c_str());
@@ -148,43 +256,69 @@ namespace octet {
 
       for (int i = 0; i != nevents; ++i) {
         for (int j = 0; j != np; ++j) {
-          fprintf(csv, j==0 ? "%f" : ",%f", data[i*np+j]);
+          fprintf(csv, j==0 ? "%f" : ",%f", get_value(i, j));
         }
         fprintf(csv, "\n");
       }
       fclose(csv);
     }
   public:
-    fcs_file(const char *fcs) {
-      // swallow the file
-      FILE *fp = fopen(fcs, "rb");
-      fseek(fp, 0, SEEK_END);
-      long len = ftell(fp);
-      fseek(fp, 0, SEEK_SET);
-      uint8_t *file_data = (uint8_t *)malloc((size_t)len);
-      fread(file_data, 1, (size_t)len, fp);
-      fclose(fp);
-
-      // read header
-      int verh, verl, textb, texte, datab, datae;
-      int n = _snscanf((char*)file_data, 58, "FCS%d.%d %d %d %d %d", &verh, &verl, &textb, &texte, &datab, &datae);
-      if (n != 6) { printf("not a FCS file\n"); return ; }
-
-      process_text(file_data + textb, file_data + texte);
-      process_data(file_data + datab, file_data + datae);
-
-      printf("%d params, %d data items\n", params.size(), data.size());
+    fcs_file(const char *fcs, unsigned num_bins = 256) : num_events(0), num_bins(num_bins), begin_data(0), end_data(0), datatype(0), byteord('1') {
+      if (!file.open(fcs) || file.size() < 58) { printf("can't open %s\n", fcs); return; }
+      const uint8_t *file_data = file.data();
+      size_t len = file.size();
+
+      // read header: version then four right justified 8 column offsets, which may touch.
+      if (memcmp(file_data, "FCS", 3)) { printf("not a FCS file\n"); return ; }
+      unsigned offsets[4];
+      for (unsigned i = 0; i != 4; ++i) {
+        char field[9];
+        memcpy(field, file_data + 10 + i * 8, 8);
+        field[8] = 0;
+        offsets[i] = (unsigned)atoi(field);
+      }
+      size_t textb = offsets[0], texte = offsets[1], datab = offsets[2], datae = offsets[3];
+      if (texte < textb || texte >= len) { printf("bad FCS text segment\n"); return; }
+
+      process_text(file_data + textb, file_data + texte + 1);
+
+      // files over 100MB keep the data offsets in the text segment.
+      if (datab == 0 && datae == 0) {
+        datab = begin_data;
+        datae = end_data;
+      }
+      if (datae < datab || datab >= len) { printf("bad FCS data segment\n"); return; }
+      if (datae >= len) datae = len - 1;
+
+      file.will_need(datab, datae - datab + 1);
+      process_data(file_data + datab, file_data + datae + 1);
+      compute_stats();
+
+      // the events are now in our columns, so we don't need the mapping.
+      file.close();
+
+      printf("%d params, %d events\n", params.size(), num_events);
 
       //write_csv(out);
     }
 
     int get_num_values() {
-      return (int)(data.size() / params.size());
+      return (int)num_events;
     }
 
-    float get_value(int row, int col) {
+    int get_num_params() {
+      return (int)params.size();
+    }
+
+    /// all the values of one parameter.
+    const float *get_column(int col) {
       assert((unsigned)col < params.size());
-      return data[params.size() * row + col];
+      return data.data() + col * num_events;
+    }
+
+    float get_value(int row, int col) {
+      assert((unsigned)col < params.size() && (unsigned)row < num_events);
+      return data[col * num_events + row];
     }
 
     float get_gain(int col) {
@@ -192,33 +326,63 @@ namespace octet {
       return (float)params[col].gain;
     }
 
+    float get_min(int col) {
+      assert((unsigned)col < stats.size());
+      return stats[col].min;
+    }
+
+    float get_max(int col) {
+      assert((unsigned)col < stats.size());
+      return stats[col].max;
+    }
+
+    /// cached mean of each parameter.
     void get_mean(dynarray<float> &mean) {
-      int num_params = (int)params.size();
+      int num_params = (int)stats.size();
       mean.resize(num_params);
       for (int i = 0; i != num_params; ++i) {
-        mean[i] = 0;
+        mean[i] = stats[i].mean;
       }
+    }
 
-      int num_values = get_num_values();
-      for (int j = 0; j != num_values; ++j) {
-        for (int i = 0; i != num_params; ++i) {
-          mean[i] += data[j*num_params + i];
-        }
+    /// Histogram of a parameter between its min and max, built on first use and cached.
+    const dynarray<unsigned> &get_histogram(int col) {
+      assert((unsigned)col < stats.size());
+      column_stats &s = stats[col];
+      if (s.histogram.size() == num_bins || num_bins == 0) {
+        return s.histogram;
       }
 
-      float scale = 1.0f / num_values;
-      for (int i = 0; i != num_params; ++i) {
-        mean[i] *= scale;
+      // each thread counts a range of events, then we add the counts together.
+      const float *values = get_column(col);
+      unsigned grain = 65536;
+      unsigned num_ranges = ( num_events + grain - 1 ) / grain;
+      dynarray<unsigned> partial(num_ranges * num_bins);
+      memset(partial.data(), 0, partial.size() * sizeof(unsigned));
+      float scale = s.max > s.min ? num_bins / ( s.max - s.min ) : 0;
+      float lo = s.min;
+      unsigned last = num_bins - 1;
+      thread_pool::get().parallel_ranges(num_events, grain, [&](unsigned begin, unsigned end) {
+        unsigned *counts = partial.data() + ( begin / grain ) * num_bins;
+        for (unsigned i = begin; i != end; ++i) {
+          unsigned bin = (unsigned)( ( values[i] - lo ) * scale );
+          counts[bin < last ? bin : last]++;
+        }
+      });
+
+      s.histogram.resize(num_bins);
+      for (unsigned b = 0; b != num_bins; ++b) {
+        unsigned total = 0;
+        for (unsigned r = 0; r != num_ranges; ++r) {
+          total += partial[r * num_bins + b];
+        }
+        s.histogram[b] = total;
       }
+      return s.histogram;
     }
   };
 
   class flow_cytometry : public app {
-    typedef mat4t mat4t;
-    typedef vec4 vec4;
-    typedef animation animation;
-    typedef scene_node scene_node;
-
     // shaders to draw triangles
     bump_shader object_shader;
     bump_shader skin_shader;
@@ -227,35 +391,49 @@ namespace octet {
 
     ivec3 samples;
 
-    ref<scene> app_scene;
+    ref<visual_scene> app_scene;
     ref<mesh_instance> axis_mi;
     ref<mesh_instance> points_mi;
+    ref<material> points_mat;
 
     ref<fcs_file> file;
+    int num_channels;
+    bool axis_key_was_down[3];
 
-    void update() {
+    // copy up to eight parameters into the points mesh. This only happens when we load a file.
+    void upload() {
       mesh_points *points_mesh = points_mi->get_mesh()->get_mesh_points();
 
-      vec4 white(1, 1, 1, 1);
       int num_values = file->get_num_values();
-      //vec3 scale(20.0f/file->get_gain(1), 20.0f/file->get_gain(2), 20.0f/file->get_gain(3));
-      vec3 big(0.0f);
-      vec3 invalid(262143.0f);
-      dynarray<float> mean;
-      file->get_mean(mean);
+      num_channels = file->get_num_params() < (int)mesh_points::max_channels ? file->get_num_params() : (int)mesh_points::max_channels;
+      if (num_channels == 0) {
+        points_mesh->clear();
+        return;
+      }
 
-      for (int i = 0; i != num_values; ++i) {
-        vec3 pt(
-          file->get_value(i, samples[0]),
-          file->get_value(i, samples[1]),
-          file->get_value(i, samples[2])
-        );
-        if (any(pt != invalid)) {
-          big = max(big, pt);
-          char tmp[256], tmp2[256];
-          //log("%s %s\n", pt.toString(tmp, sizeof(tmp)), big.toString(tmp2, sizeof(tmp2)));
+      // saturated events are hidden in the shader, only on the channels we show (see project()).
+      const float *columns[mesh_points::max_channels];
+      for (int c = 0; c != num_channels; ++c) {
+        columns[c] = file->get_column(c);
+      }
+      int nc = num_channels;
+      points_mesh->generate((unsigned)num_values, (unsigned)num_channels, [&](unsigned i, float *values, uint8_t *color) {
+        for (int c = 0; c != nc; ++c) {
+          values[c] = columns[c][i];
         }
+      });
+    }
+
+    // choose which channels to show on x, y and z. This just sets uniforms.
+    void project() {
+      for (int i = 0; i != 3; ++i) {
+        if (samples[i] >= num_channels) samples[i] = 0;
       }
+      if (num_channels == 0) return;
+
+      //vec3 scale(20.0f/file->get_gain(1), 20.0f/file->get_gain(2), 20.0f/file->get_gain(3));
+      dynarray<float> mean;
+      file->get_mean(mean);
 
       vec3 scale = vec3(
         10.0f / mean[samples[0]],
@@ -263,29 +441,36 @@ namespace octet {
         -10.0f / mean[samples[2]]
       );
 
-      for (int i = 0; i != num_values; ++i) {
-        vec3 pt(
-          file->get_value(i, samples[0]),
-          file->get_value(i, samples[1]),
-          file->get_value(i, samples[2])
-        );
-        if (any(pt != invalid)) {
-          points_mesh->add_point(pt * scale, white);
-        }
+      // column c of the projection is the position contributed by channel c.
+      mat4t projection[2];
+      projection[0] = projection[1] = mat4t() * 0.0f;
+      for (int i = 0; i != 3; ++i) {
+        int c = samples[i];
+        projection[c / 4][c % 4][i] += scale[i];
       }
-      points_mesh->update();
-      points_mesh->set_mode(GL_POINTS);
+      points_mat->set_projection(projection[0], projection[1], vec3(0, 0, 0));
+
+      // hide events that are saturated on x, y or z; other channels may be saturated.
+      // 262143 is the largest value of an 18 bit ADC, so events there are off the scale.
+      const float saturated_value = 262143.0f;
+      vec4 saturation[2] = { vec4(1e30f), vec4(1e30f) };
+      for (int i = 0; i != 3; ++i) {
+        int c = samples[i];
+        saturation[c / 4][c % 4] = saturated_value;
+      }
+      points_mat->set_saturation(saturation[0], saturation[1]);
     }
 
     void load_file(const char *filename) {
       file = new fcs_file(filename);
-      update();
+      upload();
+      project();
     }
 
-
   public:
     // this is called when we construct the class
-    flow_cytometry(int argc, char **argv) : app(argc, argv), ball(), samples(1, 2, 3) {
+    flow_cytometry(int argc, char **argv) : app(argc, argv), ball(), samples(1, 2, 3), num_channels(0) {
+      axis_key_was_down[0] = axis_key_was_down[1] = axis_key_was_down[2] = false;
     }
 
     // this is called once OpenGL is initialized
@@ -294,7 +479,7 @@ namespace octet {
       object_shader.init(false);
       skin_shader.init(true);
 
-      app_scene =  new scene();
+      app_scene =  new visual_scene();
       app_scene->create_default_camera_and_lights();
       scene_node *points_node = app_scene->add_scene_node();
       scene_node *axis_node = app_scene->add_scene_node();
@@ -316,8 +501,9 @@ namespace octet {
       axis_mesh->set_mode(GL_LINES);
       axis_mesh->update();
 
-      axis_mi = app_scene->add_mesh_instance(new mesh_instance(points_node, points_mesh, mat));
-      points_mi = app_scene->add_mesh_instance(new mesh_instance(axis_node, axis_mesh, mat));
+      points_mat = new material(vec4(1, 1, 1, 1), mesh_points::max_channels);
+      points_mi = app_scene->add_mesh_instance(new mesh_instance(points_node, points_mesh, points_mat));
+      axis_mi = app_scene->add_mesh_instance(new mesh_instance(axis_node, axis_mesh, mat));
 
       camera_instance *cam = app_scene->get_camera_instance(0);
       scene_node *node = cam->get_node();
@@ -339,6 +525,17 @@ namespace octet {
         queue.resize(0);
       }
 
+      // X, Y and Z step through the parameters on each axis.
+      static const char axis_keys[] = { 'X', 'Y', 'Z' };
+      for (int i = 0; i != 3; ++i) {
+        bool down = is_key_down(axis_keys[i]);
+        if (down && !axis_key_was_down[i] && num_channels) {
+          samples[i] = ( samples[i] + 1 ) % num_channels;
+          project();
+        }
+        axis_key_was_down[i] = down;
+      }
+
       if (app_scene && app_scene->get_num_camera_instances()) {
         int vx = 0, vy = 0;
         get_viewport_size(vx, vy);
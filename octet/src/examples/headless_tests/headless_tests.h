@@ -0,0 +1,1524 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Checks and benchmarks that run without a window.
+//
+// Level: 1
+//
+// Each test logs what it measured and returns false if it failed, so that
+// a build machine without a display can run them and look at the exit code.
+// Tests that make meshes call OpenGL, so build for the generic platform
+// (__GENERIC__), whose GL functions do nothing, when there is no display.
+
+namespace octet {
+  /// Command line tests for the loaders and renderers.
+  ///
+  /// Example
+  ///
+  ///     headless_tests                          run every test on the stock assets
+  ///     headless_tests inflate my.zip other.zip run one test on some files
+  class headless_tests {
+    typedef bool (*test_t)(const char *path);
+
+    struct test_info {
+      const char *name;
+      test_t test;
+      const char *default_path;
+    };
+
+    static const test_info *get_tests(unsigned &num_tests) {
+      static const test_info tests[] = {
+        { "inflate", inflate, "assets/collada.zip" },
+        { "extract", extract, "assets/collada.zip" },
+        { "snapshot", snapshot, "assets/Laurana50k.dae" },
+        { "jpeg", jpeg, "assets/duckCM.jpg" },
+        { "render", render, "headless_tests_render.tga" },
+        { "threads", threads, "nested" },
+        { "opencl", opencl, "fluid" },
+        { "checkpoint", checkpoint, "headless_tests_checkpoint.bin" },
+        { "image", image_dxt, "assets/duckCM.jpg" },
+        { "xml", xml, "assets/Laurana50k.dae" },
+        { "sdf", sdf, "box" },
+        { "voxels", voxels, "box" },
+        { "smooth", smooth_mesh, "sphere" },
+        { "collada", collada, "assets/duck_triangulate.dae" },
+        { "nifti", nifti, "headless_tests_volume.nii" },
+        { "fcs", fcs, "headless_tests_events.fcs" },
+        { "points", points, "channels" },
+        { "http", http, "requests" },
+        { "particles", particles, "billboards" },
+        { "deterministic", deterministic, "threads" },
+        { "coupling", coupling, "bodies" },
+        { "precision", precision, "mixed" },
+        { "inflow", inflow, "tap" },
+        { "pcisph", pcisph, "solver" },
+      };
+      num_tests = sizeof(tests) / sizeof(tests[0]);
+      return tests;
+    }
+
+    static bool run_test(const test_info &t, const char *path) {
+      bool ok = t.test(path);
+      // the details are in log.txt
+      printf("%s %s: %s\n", t.name, path, ok ? "passed" : "FAILED");
+      log("%s %s: %s\n", t.name, path, ok ? "passed" : "FAILED");
+      return ok;
+    }
+
+  public:
+    /// inflate every member of an archive with the fast and reference decoders, which must agree.
+    /// The default archive holds the COLLADA files in assets, 3.8MB of them in one member.
+    /// Members of a few KB, like those in big.zip, take about as long to set up as to decode,
+    /// so their timings say little about either path.
+    static bool inflate(const char *path) {
+      ref<zip_file> zip = new zip_file(app_utils::get_path(path), true);
+      return zip->benchmark();
+    }
+
+    /// extract every member of a mapped archive one at a time and in parallel, which must agree.
+    static bool extract(const char *path) {
+      ref<zip_file> zip = new zip_file(app_utils::get_path(path), true);
+      return zip->benchmark_batch();
+    }
+
+    /// decode a JPEG file with the fast and reference paths, compare them and log the speed of each.
+    static bool jpeg(const char *path) {
+      return jpeg_decoder::benchmark_file(app_utils::get_path(path));
+    }
+
+    // time to load a file written by a visitor, repeated until we have a measurable time.
+    template <class reader_t> static double time_load(const char *path, bool &ok) {
+      const double min_time = 0.25;
+      unsigned runs = 0;
+      double start = get_time_seconds(), elapsed = 0;
+      do {
+        ref<resource_dict> dict = new resource_dict();
+        FILE *file = fopen(path, "rb");
+        reader_t reader(file);
+        dict->visit(reader);
+        ok = ok && !reader.get_error();
+        fclose(file);
+        runs++;
+        elapsed = get_time_seconds() - start;
+      } while (elapsed < min_time);
+      return elapsed / runs;
+    }
+
+    /// convert a COLLADA file and time loading it back from a binary_writer file and from a snapshot.
+    /// Big meshes are mostly memcpy either way, so we add a scene of many small nodes,
+    /// like a level, where the cost of each field shows.
+    /// A reloaded snapshot must read without errors and give a snapshot of the same size again.
+    static bool snapshot(const char *path) {
+      collada_builder loader;
+      ref<resource_dict> dict = new resource_dict();
+      if (!loader.load_resources(path, *dict)) return false;
+
+      visual_scene *level = new visual_scene();
+      mesh_box *box = new mesh_box(vec3(0.5f));
+      material *mat = new material(vec4(1, 1, 1, 1));
+      for (int i = 0; i != 5000; ++i) {
+        scene_node *node = level->add_scene_node();
+        node->translate(vec3((float)(i % 100), 0, (float)(i / 100)));
+        level->add_mesh_instance(new mesh_instance(node, box, mat));
+      }
+      dict->set_resource("headless_tests_level", level);
+
+      const char *bin_path = "headless_tests.bin";
+      const char *snap_path = "headless_tests.snap";
+      FILE *file = fopen(bin_path, "wb");
+      if (!file) return false;
+      binary_writer bin_writer(file);
+      dict->visit(bin_writer);
+      fclose(file);
+      snapshot_writer snap_writer;
+      dict->visit(snap_writer);
+      if (!snap_writer.save(snap_path)) return false;
+
+      // binary_reader takes a FILE and snapshot_reader a path.
+      struct snap_reader : snapshot_reader {
+        snap_reader(FILE *) : snapshot_reader("headless_tests.snap") {}
+      };
+      bool ok = true;
+      double bin_time = time_load<binary_reader>(bin_path, ok);
+      double snap_time = time_load<snap_reader>(snap_path, ok);
+      log("snapshot %s: binary_reader %.3fms snapshot_reader %.3fms on %d threads\n",
+        path, bin_time * 1000, snap_time * 1000, thread_pool::get().get_num_threads()
+      );
+
+      ref<resource_dict> reloaded = new resource_dict();
+      snapshot_reader reader(snap_path);
+      reloaded->visit(reader);
+      ok = ok && !reader.get_error();
+      snapshot_writer rewriter;
+      reloaded->visit(rewriter);
+      ok = ok && rewriter.save(bin_path);
+
+      // the dictionary may come back in a different order, so only the sizes must match.
+      mapped_file first(snap_path), second(bin_path);
+      ok = ok && first.size() == second.size();
+      first.close();
+      second.close();
+
+      remove(bin_path);
+      remove(snap_path);
+      return ok;
+    }
+
+    // a fixed scene for the software renderer: flat, lit and textured meshes, points and lines.
+    static void render_scene(soft_renderer &sr) {
+      ref<visual_scene> scene = new visual_scene();
+
+      // a checkerboard so that we don't depend on an image decoder.
+      uint8_t checks[16 * 16 * 4];
+      for (unsigned i = 0; i != 16 * 16; ++i) {
+        uint8_t c = ( (i ^ (i >> 4)) & 1 ) ? 255 : 32;
+        checks[i*4+0] = c; checks[i*4+1] = c; checks[i*4+2] = 128; checks[i*4+3] = 255;
+      }
+      image *img = new image();
+      img->set_pixels(0x1908, 16, 16, checks); // GL_RGBA
+
+      mesh *meshes[] = { new mesh_box(vec3(0.8f)), new mesh_sphere(vec3(0, 0, 0), 1.0f, 2), new mesh_box(vec3(0.8f)) };
+      material *materials[] = { new material(vec4(1, 0, 0, 1)), new material(), new material(img) };
+      for (int i = 0; i != 3; ++i) {
+        scene_node *node = scene->add_scene_node();
+        node->translate(vec3(i * 2.5f - 2.5f, 0, 0));
+        node->rotate(30.0f * i + 15, vec3(0.3f, 1, 0.2f));
+        scene->add_mesh_instance(new mesh_instance(node, meshes[i], materials[i]));
+      }
+      scene->create_default_camera_and_lights();
+
+      // the default camera is a long way off, bring it in to fill the frame.
+      camera_instance *cam = scene->get_camera_instance(0);
+      cam->get_node()->access_nodeToParent().loadIdentity();
+      cam->get_node()->access_nodeToParent().translate(0, 0, 10);
+
+      float aspect = (float)sr.get_width() / sr.get_height();
+      sr.begin_frame(vec4(0, 0, 0.2f, 1));
+      scene->render(sr, aspect);
+
+      // a ring of points and a frame of lines in front of the meshes.
+      mat4t modelToProjection, modelToCamera;
+      cam->get_matrices(modelToProjection, modelToCamera, mat4t());
+      float ring[64 * 3];
+      for (unsigned i = 0; i != 64; ++i) {
+        ring[i*3+0] = cosf(i * 0.0981748f) * 4;
+        ring[i*3+1] = sinf(i * 0.0981748f) * 2;
+        ring[i*3+2] = 1;
+      }
+      sr.draw_points(modelToProjection, ring, 64, 3 * sizeof(float), 6.0f, vec4(1, 1, 0, 0.5f));
+      float frame[] = { -4, -2, 1,  4, -2, 1,  4, -2, 1,  4, 2, 1,  4, 2, 1,  -4, 2, 1,  -4, 2, 1,  -4, -2, 1 };
+      sr.draw_lines(modelToProjection, frame, 8, vec4(0, 1, 0, 1));
+      sr.end_frame();
+    }
+
+    /// render a fixed scene with the software renderer on 1, 2 and 8 threads.
+    /// The images must be the same for every thread count and match the stored hash.
+    /// If the renderer changes on purpose, check the image in path (a TGA file) and update the hash.
+    static bool render(const char *path) {
+      // hash of the image when the test was written (g++ -O2, x86-64).
+      // A compiler that rounds floats differently (eg. with fused multiply-adds) may need its own.
+      const uint64_t reference = 0x47726cd361e580a1ull;
+
+      thread_pool &pool = thread_pool::get();
+      unsigned old_threads = pool.get_num_threads();
+      static const unsigned thread_counts[] = { 1, 2, 8 };
+      soft_renderer sr(320, 240);
+      bool ok = true;
+      for (unsigned i = 0; i != 3; ++i) {
+        pool.set_num_threads(thread_counts[i]);
+        render_scene(sr);
+        uint64_t hash = sr.get_hash();
+        log("render: %d threads hash %016llx %.3fms\n", thread_counts[i], (unsigned long long)hash, sr.get_stats().frame_ms);
+        if (hash != reference) {
+          ok = false;
+        }
+      }
+      pool.set_num_threads(old_threads);
+      if (!ok) {
+        sr.save_tga(path);
+        log("render: expected %016llx, image saved in %s\n", (unsigned long long)reference, path);
+      }
+      return ok;
+    }
+
+    /// run loops inside loops on 1, 2 and 8 threads. The inner loops run in the thread of the
+    /// outer item, and every item must run exactly once.
+    static bool threads(const char *path) {
+      thread_pool &pool = thread_pool::get();
+      unsigned old_threads = pool.get_num_threads();
+      static const unsigned thread_counts[] = { 1, 2, 8 };
+      bool ok = true;
+      for (unsigned i = 0; i != 3; ++i) {
+        pool.set_num_threads(thread_counts[i]);
+        std::atomic<unsigned> items(0);
+        pool.parallel_for(64, [&](unsigned) {
+          pool.parallel_for(16, [&](unsigned) {
+            pool.parallel_ranges(10, 3, [&](unsigned begin, unsigned end) { items += end - begin; });
+          });
+        });
+        log("threads %s: %d threads %d of %d items\n", path, thread_counts[i], items.load(), 64 * 16 * 10);
+        ok = ok && items == 64 * 16 * 10;
+      }
+      pool.set_num_threads(old_threads);
+      return ok;
+    }
+
+    // decode a 4x4 DXT5 block into RGBA texels, stride bytes apart, clipped to w x h.
+    static void decode_dxt5_block(uint8_t *dest, unsigned stride, unsigned w, unsigned h, const uint8_t *block) {
+      unsigned alphas[8] = { block[0], block[1] };
+      for (unsigned i = 2; i != 8; ++i) {
+        if (block[0] > block[1]) {
+          alphas[i] = ( ( 8 - i ) * block[0] + ( i - 1 ) * block[1] ) / 7;
+        } else {
+          alphas[i] = i == 6 ? 0 : i == 7 ? 255 : ( ( 6 - i ) * block[0] + ( i - 1 ) * block[1] ) / 5;
+        }
+      }
+      uint64_t alpha_bits = 0;
+      for (unsigned i = 0; i != 6; ++i) {
+        alpha_bits |= (uint64_t)block[2 + i] << ( i * 8 );
+      }
+
+      unsigned ends[2] = { block[8] | (unsigned)block[9] << 8, block[10] | (unsigned)block[11] << 8 };
+      unsigned palette[4][3];
+      for (unsigned e = 0; e != 2; ++e) {
+        palette[e][0] = ( ends[e] >> 11 ) * 255 / 31;
+        palette[e][1] = ( ( ends[e] >> 5 ) & 63 ) * 255 / 63;
+        palette[e][2] = ( ends[e] & 31 ) * 255 / 31;
+      }
+      for (unsigned c = 0; c != 3; ++c) {
+        palette[2][c] = ( 2 * palette[0][c] + palette[1][c] ) / 3;
+        palette[3][c] = ( palette[0][c] + 2 * palette[1][c] ) / 3;
+      }
+      unsigned indices = block[12] | (unsigned)block[13] << 8 | (unsigned)block[14] << 16 | (unsigned)block[15] << 24;
+
+      for (unsigned i = 0; i != 16; ++i) {
+        if (i % 4 >= w || i / 4 >= h) continue;
+        uint8_t *texel = dest + ( i / 4 ) * stride + ( i % 4 ) * 4;
+        const unsigned *colour = palette[( indices >> ( i * 2 ) ) & 3];
+        texel[0] = (uint8_t)colour[0];
+        texel[1] = (uint8_t)colour[1];
+        texel[2] = (uint8_t)colour[2];
+        texel[3] = (uint8_t)alphas[( alpha_bits >> ( i * 3 ) ) & 7];
+      }
+    }
+
+    /// load an RGBA image with mipmaps, and again DXT5 compressed.
+    /// The chain must go down to 1x1, whose colour is the mean of level 0 as the filter is a box.
+    /// Each compressed block must be nearly as close to the uncompressed texels as the best
+    /// pair of the block's own colours would be.
+    static bool image_dxt(const char *path) {
+      ref<image> plain = new image(path);
+      plain->load();
+      ref<image> packed = new image(path);
+      packed->set_import_options(image::filter_box, false, true);
+      packed->load();
+
+      unsigned width = plain->get_width(), height = plain->get_height();
+      unsigned levels = 1;
+      while (( width | height ) >> levels) ++levels;
+      // GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+      if (
+        plain->get_format() != GL_RGBA || packed->get_format() != 0x83F3 ||
+        plain->get_mip_levels() != levels || packed->get_mip_levels() != levels
+      ) {
+        log("image %s: %dx%d format %04x/%04x with %d/%d levels, expected %d\n", path, width, height, plain->get_format(), packed->get_format(), plain->get_mip_levels(), packed->get_mip_levels(), levels);
+        return false;
+      }
+
+      // the last level is one texel.
+      const uint8_t *src = plain->get_bytes();
+      bool ok = true;
+      {
+        double sum[4] = { 0, 0, 0, 0 };
+        for (unsigned i = 0; i != width * height * 4; ++i) {
+          sum[i & 3] += src[i];
+        }
+        const uint8_t *last = src;
+        for (unsigned level = 0, w = width, h = height; level + 1 != levels; ++level) {
+          last += w * h * 4;
+          w = w > 1 ? w >> 1 : 1;
+          h = h > 1 ? h >> 1 : 1;
+        }
+        for (unsigned c = 0; c != 4; ++c) {
+          double mean = sum[c] / ( width * height );
+          log("image %s: 1x1 level %d, mean of level 0 %.1f\n", path, last[c], mean);
+          ok = ok && fabs(last[c] - mean) <= 2;
+        }
+      }
+
+      // each block decoded, against the uncompressed texels and against the best pair of its own colours
+      // as end points. Quantising the ends to 5:6:5 costs up to four levels.
+      const uint8_t *blocks = packed->get_bytes();
+      double worst_excess = -1e9;
+      unsigned alpha_error = 0;
+      for (unsigned level = 0, w = width, h = height; level != levels; ++level) {
+        double error2 = 0;
+        for (unsigned by = 0; by < h; by += 4) {
+          for (unsigned bx = 0; bx < w; bx += 4) {
+            unsigned bw = w - bx < 4 ? w - bx : 4, bh = h - by < 4 ? h - by : 4;
+            uint8_t decoded[64];
+            decode_dxt5_block(decoded, 16, bw, bh, blocks);
+            blocks += 16;
+
+            int texels[16][4];
+            unsigned num_texels = 0;
+            double block_error2 = 0;
+            for (unsigned j = 0; j != bh; ++j) {
+              for (unsigned i = 0; i != bw; ++i) {
+                const uint8_t *texel = src + ( ( by + j ) * w + bx + i ) * 4;
+                const uint8_t *dec = decoded + j * 16 + i * 4;
+                for (unsigned c = 0; c != 4; ++c) {
+                  int diff = dec[c] - texel[c];
+                  if (c == 3) {
+                    alpha_error = (unsigned)abs(diff) > alpha_error ? abs(diff) : alpha_error;
+                  } else {
+                    block_error2 += diff * diff;
+                  }
+                  texels[num_texels][c] = texel[c];
+                }
+                num_texels++;
+              }
+            }
+            error2 += block_error2;
+
+            double best2 = 1e37;
+            for (unsigned e0 = 0; e0 != num_texels; ++e0) {
+              for (unsigned e1 = e0; e1 != num_texels; ++e1) {
+                double pair2 = 0;
+                for (unsigned t = 0; t != num_texels; ++t) {
+                  int nearest = 0x7fffffff;
+                  for (int p = 0; p != 4; ++p) {
+                    int d2 = 0;
+                    for (unsigned c = 0; c != 3; ++c) {
+                      int diff = ( texels[e0][c] * ( 3 - p ) + texels[e1][c] * p ) / 3 - texels[t][c];
+                      d2 += diff * diff;
+                    }
+                    nearest = d2 < nearest ? d2 : nearest;
+                  }
+                  pair2 += nearest;
+                }
+                best2 = pair2 < best2 ? pair2 : best2;
+              }
+            }
+            double excess = sqrt(block_error2 / ( num_texels * 3 )) - 1.25 * sqrt(best2 / ( num_texels * 3 ));
+            worst_excess = excess > worst_excess ? excess : worst_excess;
+          }
+        }
+        if (level == 0) log("image %s: level 0 rms error %.2f\n", path, sqrt(error2 / ( w * h * 3 )));
+        src += w * h * 4;
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+      log("image %s: worst block rms error %.2f over 1.25 times the best pair's, alpha error %d\n", path, worst_excess, alpha_error);
+      return ok && worst_excess < 4 && alpha_error <= 2;
+    }
+
+    // compare two tinyxml trees: the same nodes with the same values, attributes and children.
+    static bool same_xml(const TiXmlNode *a, const TiXmlNode *b, unsigned &num_nodes) {
+      for (; a && b; a = a->NextSibling(), b = b->NextSibling()) {
+        num_nodes++;
+        if (a->Type() != b->Type() || strcmp(a->Value(), b->Value())) return false;
+        const TiXmlElement *ea = a->ToElement(), *eb = b->ToElement();
+        if (ea) {
+          const TiXmlAttribute *aa = ea->FirstAttribute(), *ab = eb->FirstAttribute();
+          for (; aa && ab; aa = aa->Next(), ab = ab->Next()) {
+            if (strcmp(aa->Name(), ab->Name()) || strcmp(aa->Value(), ab->Value())) return false;
+          }
+          if (aa || ab) return false;
+        }
+        if (!same_xml(a->FirstChild(), b->FirstChild(), num_nodes)) return false;
+      }
+      return !a && !b;
+    }
+
+    // parse text by copying and in place and compare the documents.
+    static bool parse_both_ways(const char *name, const char *text) {
+      size_t size = strlen(text) + 1;
+      dynarray<char> in_place((unsigned)size);
+      memcpy(in_place.data(), text, size);
+
+      TiXmlDocument copied, parsed_in_place;
+      double t0 = get_time_seconds();
+      copied.Parse(text);
+      double t1 = get_time_seconds();
+      parsed_in_place.ParseInSitu(in_place.data());
+      double t2 = get_time_seconds();
+      if (copied.Error() || parsed_in_place.Error()) {
+        log("xml %s: %s / %s\n", name, copied.ErrorDesc(), parsed_in_place.ErrorDesc());
+        return false;
+      }
+
+      unsigned num_nodes = 0;
+      bool ok = same_xml(copied.FirstChild(), parsed_in_place.FirstChild(), num_nodes);
+      log("xml %s: %d nodes, copying %.2fms, in place %.2fms with %d bytes of arena\n", name, num_nodes, ( t1 - t0 ) * 1000, ( t2 - t1 ) * 1000, (int)parsed_in_place.ArenaBytesUsed());
+      return ok && num_nodes > 1;
+    }
+
+    /// parse an XML file with tinyxml by copying the strings and in place (ParseInSitu).
+    /// The two documents must have the same nodes, attributes and text. So must those of a
+    /// small document with entities, CDATA and comments, which the in place parse decodes in the buffer.
+    static bool xml(const char *path) {
+      static const char tricky[] =
+        "<?xml version=\"1.0\"?>\n"
+        "<!-- a comment -->\n"
+        "<root a=\"1 &amp; 2\" b='&quot;q&quot;' c=\"&#65;&#x42;\">\n"
+        "  <empty/>\n"
+        "  <text>x &lt; y &gt; z&apos;s</text>\n"
+        "  <data><![CDATA[<not> &amp; markup]]></data>\n"
+        "  <float_array count=\"3\">1 2.5 -3e2</float_array>\n"
+        "</root>\n"
+      ;
+      if (!parse_both_ways("entities", tricky)) return false;
+
+      // the in place parse must decode as well as match.
+      char text[sizeof(tricky)];
+      memcpy(text, tricky, sizeof(tricky));
+      TiXmlDocument doc;
+      doc.ParseInSitu(text);
+      const TiXmlElement *root = doc.RootElement();
+      const char *expected[][2] = {
+        { root->Attribute("a"), "1 & 2" },
+        { root->Attribute("b"), "\"q\"" },
+        { root->Attribute("c"), "AB" },
+        { root->FirstChildElement("text")->GetText(), "x < y > z's" },
+        { root->FirstChildElement("data")->GetText(), "<not> &amp; markup" },
+      };
+      for (unsigned i = 0; i != sizeof(expected) / sizeof(expected[0]); ++i) {
+        if (!expected[i][0] || strcmp(expected[i][0], expected[i][1])) {
+          log("xml entities: got \"%s\" for \"%s\"\n", expected[i][0] ? expected[i][0] : "(null)", expected[i][1]);
+          return false;
+        }
+      }
+
+      dynarray<uint8_t> buffer;
+      app_utils::get_url(buffer, path);
+      buffer.push_back(0);
+      return parse_both_ways(path, (const char*)buffer.data());
+    }
+
+    // exact signed distance to the surface of a box, negative inside.
+    static float box_distance(const aabb &box, vec3_in pos) {
+      vec3 q = abs(pos - box.get_center()) - box.get_half_extent();
+      float inside = max(q.x(), max(q.y(), q.z()));
+      return length(max(q, vec3(0, 0, 0))) + min(inside, 0.0f);
+    }
+
+    // compare a field of a box with the exact distance at random points near the surface.
+    static bool check_box_field(const char *name, const signed_distance_field &field, const aabb &box) {
+      random rand;
+      aabb bounds = field.get_aabb();
+      float band = field.get_band(), cell = field.get_cell_size();
+      float worst = 0;
+      unsigned num_points = 0;
+      while (num_points != 10000) {
+        vec3 pos = bounds.get_min() + ( bounds.get_max() - bounds.get_min() ) * vec3(rand.get(0.0f, 1.0f), rand.get(0.0f, 1.0f), rand.get(0.0f, 1.0f));
+        float exact = box_distance(box, pos);
+        // further out the stored distances are clamped to the band.
+        if (fabsf(exact) > band * 0.75f) continue;
+        float error = fabsf(field.get_distance(pos) - exact);
+        worst = error > worst ? error : worst;
+        num_points++;
+      }
+      log("sdf %s: %d bricks of %d, worst error %.2f cells\n", name, field.get_num_surface_bricks(), field.get_num_bricks(), worst / cell);
+      return worst < cell;
+    }
+
+    /// bake a box into a signed distance field from an aabb and from a mesh_box.
+    /// Both must be within a cell of the exact distance near the surface, and collide must push
+    /// points just inside the box out of it in a few steps.
+    static bool sdf(const char *path) {
+      aabb box(vec3(0.5f), vec3(0.25f, 0.2f, 0.15f));
+      ref<signed_distance_field> from_set = new signed_distance_field();
+      from_set->bake(aabb(vec3(0.5f), vec3(0.4f)), 1.0f / 64, box);
+      bool ok = check_box_field("aabb", *from_set, box);
+
+      ref<mesh_box> mesh = new mesh_box(box.get_half_extent());
+      ref<signed_distance_field> from_mesh = new signed_distance_field();
+      ok = from_mesh->bake(mesh, 1.0f / 64) && ok;
+      ok = check_box_field("mesh_box", *from_mesh, aabb(vec3(0, 0, 0), box.get_half_extent())) && ok;
+
+      // points inside the box near its surface, where the field has a gradient.
+      random rand;
+      const float radius = 0.01f, band = from_set->get_band();
+      dynarray<float> x(3000), v(3000);
+      for (unsigned i = 0; i != 1000; ) {
+        vec3 pos = box.get_center() + box.get_half_extent() * vec3(rand.get(-1.0f, 1.0f), rand.get(-1.0f, 1.0f), rand.get(-1.0f, 1.0f));
+        if (box_distance(box, pos) < -band * 0.5f) continue;
+        x[i*3+0] = pos.x(); x[i*3+1] = pos.y(); x[i*3+2] = pos.z();
+        v[i*3+0] = v[i*3+1] = v[i*3+2] = 0;
+        ++i;
+      }
+      // near the edges the push is along the diagonal, so it takes a few steps, as in a fluid.
+      unsigned hits = from_set->collide(x.data(), v.data(), NULL, 1000, radius, 0.75f, false);
+      for (unsigned step = 0; step != 4; ++step) {
+        from_set->collide(x.data(), v.data(), NULL, 1000, radius, 0.75f, false);
+      }
+      float closest = 1e37f;
+      for (unsigned i = 0; i != 1000; ++i) {
+        float d = box_distance(box, vec3(x[i*3+0], x[i*3+1], x[i*3+2]));
+        closest = d < closest ? d : closest;
+      }
+      log("sdf %s: %d of 1000 points collided, closest after %.4f, radius %.4f\n", path, hits, closest, radius);
+      return ok && hits == 1000 && closest > 0;
+    }
+
+    // a sphere that only answers for points, so add_voxels must test every voxel.
+    struct sphere_points {
+      sphere s;
+      sphere_points(const sphere &s_) : s(s_) {}
+      bool intersects(vec3_in pos) const { return s.intersects(pos); }
+    };
+
+    // a 4x4x4 brick world with a box of voxels 16..79 and a sphere on the given number of threads.
+    static ref<mesh_voxels> make_voxels(unsigned num_threads, const aabb &box, const sphere &ball) {
+      thread_pool::get().set_num_threads(num_threads);
+      ref<mesh_voxels> voxels = new mesh_voxels(1.0f / 32, ivec3(4, 4, 4));
+      voxels->draw(mat4t(), box);
+      voxels->draw(mat4t(), ball);
+      voxels->update();
+      return voxels;
+    }
+
+    /// fill voxels from a box and a sphere in a 4x4x4 world of 32x32x32 bricks.
+    /// The bricks must be empty, mixed or full as the box covers them, the sphere must set the same voxels
+    /// with and without its bounds tests, the box must mesh to one quad per face per brick,
+    /// 1 and 8 threads must make the same mesh and a ray must stop on the box's face.
+    static bool voxels(const char *path) {
+      thread_pool &pool = thread_pool::get();
+      unsigned old_threads = pool.get_num_threads();
+
+      // with an identity voxelToWorld, voxel v is at v - 64 + 0.5, so this covers voxels 16..79 on each axis.
+      aabb box(vec3(-16.0f), vec3(32.0f));
+      ref<mesh_voxels> box_only = new mesh_voxels(1.0f / 32, ivec3(4, 4, 4));
+      box_only->draw(mat4t(), box);
+      box_only->update();
+      unsigned num_full = 0, num_bricks = 0;
+      for (int i = 0; i != 64; ++i) {
+        mesh_voxel_subcube *p = box_only->get_subcube(ivec3(i & 3, i >> 2 & 3, i >> 4));
+        num_bricks += p != NULL;
+        num_full += p && p->get_state() == mesh_voxel_subcube::state_full;
+      }
+      unsigned num_quads = box_only->get_num_indices() / 6;
+      log("voxels %s: box in %d bricks, %d full, %d quads\n", path, num_bricks, num_full, num_quads);
+      bool ok = num_bricks == 27 && num_full == 1 && num_quads == 6 * 9;
+
+      // the face at voxel 16 is at 16/32 - 2 in the mesh's space.
+      ivec3 voxel;
+      float distance = 0;
+      bool missed = !box_only->ray_cast(vec3(-1.9f, 0.9f, 0.02f), vec3(1, 0, 0), 4, voxel, distance);
+      bool hit = box_only->ray_cast(vec3(-1.9f, 0.01f, 0.02f), vec3(1, 0, 0), 4, voxel, distance);
+      log("voxels %s: ray hit voxel %d %d %d at %.4f\n", path, voxel.x(), voxel.y(), voxel.z(), distance);
+      ok = ok && hit && missed && all(voxel == ivec3(16, 64, 64)) && fabsf(distance - 0.4f) < 1e-4f;
+
+      sphere ball(vec3(7.3f, -3.1f, 11.7f), 37.3f);
+      ref<mesh_voxels> by_blocks = new mesh_voxels(1.0f / 32, ivec3(4, 4, 4));
+      by_blocks->draw(mat4t(), ball);
+      ref<mesh_voxels> by_points = new mesh_voxels(1.0f / 32, ivec3(4, 4, 4));
+      by_points->draw(mat4t(), sphere_points(ball));
+      unsigned num_set = 0, num_different = 0;
+      for (int z = 0; z != 128; ++z) {
+        for (int y = 0; y != 128; ++y) {
+          for (int x = 0; x != 128; ++x) {
+            unsigned a = by_blocks->is_any(ivec3(x, y, z), 0);
+            num_set += a;
+            num_different += a != by_points->is_any(ivec3(x, y, z), 0);
+          }
+        }
+      }
+      log("voxels %s: sphere sets %d voxels, %d different when tested one by one\n", path, num_set, num_different);
+      ok = ok && num_set != 0 && num_different == 0;
+
+      ref<mesh_voxels> one = make_voxels(1, box, ball);
+      ref<mesh_voxels> eight = make_voxels(8, box, ball);
+      pool.set_num_threads(old_threads);
+      bool same = one->get_num_vertices() == eight->get_num_vertices() && one->get_num_indices() == eight->get_num_indices();
+      if (same) {
+        gl_resource::rolock a(one->get_vertices()), b(eight->get_vertices());
+        same = memcmp(a.u8(), b.u8(), sizeof(mesh::vertex) * one->get_num_vertices()) == 0;
+      }
+      log("voxels %s: %d quads on 1 thread, %s on 8\n", path, one->get_num_indices() / 6, same ? "the same" : "different");
+      return ok && same;
+    }
+
+    // subdivide an icosahedron seen from pos on the given number of threads.
+    static ref<smooth> make_smooth(unsigned num_threads, vec3_in pos) {
+      thread_pool::get().set_num_threads(num_threads);
+      ref<smooth> sm = new smooth(new mesh_sphere(vec3(0, 0, 0), 1, 0));
+      sm->set_view_tolerance(0, 0);
+      sm->set_max_depth(3);
+      sm->set_view(pos, -normalize(pos), 512);
+      sm->update();
+      return sm;
+    }
+
+    // the worst distance of a vertex from the unit sphere and the number of edges not shared by
+    // exactly two triangles. Edges are matched by position, so a T junction counts as a crack.
+    static void check_smooth_surface(smooth *sm, float &worst, unsigned &num_cracks) {
+      unsigned stride = sm->get_stride();
+      unsigned pos_offset = sm->get_offset(sm->get_slot(attribute_pos));
+      gl_resource::rolock vtx_lock(sm->get_vertices());
+      gl_resource::rolock idx_lock(sm->get_indices());
+      const uint8_t *vtx = vtx_lock.u8();
+      const uint32_t *idx = idx_lock.u32();
+
+      worst = 0;
+      for (unsigned i = 0; i != sm->get_num_vertices(); ++i) {
+        float error = fabsf(length((vec3)(const vec3p&)vtx[i * stride + pos_offset]) - 1);
+        worst = error > worst ? error : worst;
+      }
+
+      // hash_map keys may not be zero.
+      hash_map<uint64_t, unsigned> edge_counts;
+      for (unsigned i = 0; i != sm->get_num_indices(); ++i) {
+        uint32_t ends[2] = { idx[i], idx[i % 3 == 2 ? i - 2 : i + 1] };
+        uint64_t hashes[2];
+        for (unsigned e = 0; e != 2; ++e) {
+          vec3 pos = (const vec3p&)vtx[ends[e] * stride + pos_offset];
+          hashes[e] = 0xcbf29ce484222325ull;
+          for (unsigned a = 0; a != 3; ++a) {
+            hashes[e] = ( hashes[e] ^ (uint32_t)(int)floorf(pos[a] * 65536 + 0.5f) ) * 0x100000001b3ull;
+          }
+        }
+        uint64_t key = hashes[0] < hashes[1] ? hashes[0] * 31 + hashes[1] : hashes[1] * 31 + hashes[0];
+        edge_counts[key | (uint64_t)1 << 63]++;
+      }
+      num_cracks = 0;
+      for (unsigned i = 0; i != edge_counts.size(); ++i) {
+        if (edge_counts.get_key(i)) num_cracks += edge_counts.get_value(i) != 2;
+      }
+    }
+
+    /// subdivide an icosahedron, whose normals are those of the unit sphere, seen from near, middling and far.
+    /// The new vertices must be much closer to the sphere than the middles of the icosahedron's edges,
+    /// the partly split middle view must have no cracks, further views must need fewer triangles and
+    /// 1 and 8 threads must make the same mesh.
+    static bool smooth_mesh(const char *path) {
+      thread_pool &pool = thread_pool::get();
+      unsigned old_threads = pool.get_num_threads();
+      ref<smooth> near = make_smooth(1, vec3(0, 0, 2));
+      ref<smooth> middle = make_smooth(1, vec3(0, 0, 20));
+      ref<smooth> far = make_smooth(1, vec3(0, 0, 40));
+      ref<smooth> eight = make_smooth(8, vec3(0, 0, 20));
+      pool.set_num_threads(old_threads);
+
+      unsigned near_tris = near->get_num_indices() / 3, middle_tris = middle->get_num_indices() / 3, far_tris = far->get_num_indices() / 3;
+      log("smooth %s: %d triangles near, %d in the middle, %d far\n", path, near_tris, middle_tris, far_tris);
+      bool ok = near_tris > middle_tris && middle_tris > far_tris && far_tris >= 20;
+
+      // the middle of an edge of the icosahedron is cos(31.7 degrees) from the centre.
+      float flat = 1 - cosf(atanf(2) * 0.5f);
+      float worst = 0, middle_worst = 0;
+      unsigned num_cracks = 0, middle_cracks = 0;
+      check_smooth_surface(near, worst, num_cracks);
+      check_smooth_surface(middle, middle_worst, middle_cracks);
+      log("smooth %s: %d and %d cracks, worst radius error %.4f, %.4f for flat edges\n", path, num_cracks, middle_cracks, worst, flat);
+      ok = ok && num_cracks == 0 && middle_cracks == 0 && worst < flat * 0.25f && middle_worst < flat * 0.25f;
+
+      bool same = middle->get_num_vertices() == eight->get_num_vertices() && middle->get_num_indices() == eight->get_num_indices();
+      if (same) {
+        gl_resource::rolock va(middle->get_vertices()), vb(eight->get_vertices());
+        gl_resource::rolock ia(middle->get_indices()), ib(eight->get_indices());
+        same = memcmp(va.u8(), vb.u8(), middle->get_stride() * middle->get_num_vertices()) == 0 &&
+          memcmp(ia.u8(), ib.u8(), sizeof(uint32_t) * middle->get_num_indices()) == 0;
+      }
+      log("smooth %s: %s mesh on 8 threads\n", path, same ? "the same" : "a different");
+      return ok && same;
+    }
+
+    // the first element called name with this id attribute.
+    static const TiXmlElement *find_element(const TiXmlElement *elem, const char *name, const char *id) {
+      for (; elem; elem = elem->NextSiblingElement()) {
+        const char *elem_id = elem->Attribute("id");
+        if (!strcmp(elem->Value(), name) && elem_id && !strcmp(elem_id, id)) return elem;
+        const TiXmlElement *found = find_element(elem->FirstChildElement(), name, id);
+        if (found) return found;
+      }
+      return NULL;
+    }
+
+    // load a COLLADA file through the cache, time it and return its first mesh.
+    static mesh *load_cached_mesh(const char *path, ref<resource_dict> &dict, double &seconds) {
+      collada_builder loader;
+      dict = new resource_dict();
+      double start = get_time_seconds();
+      bool ok = loader.load_resources(path, *dict);
+      seconds = get_time_seconds() - start;
+      dynarray<resource*> meshes;
+      dict->find_all(meshes, atom_mesh);
+      return ok && meshes.size() ? meshes[0]->get_mesh() : NULL;
+    }
+
+    // the bits of a position as a hash key, which may not be zero.
+    static uint64_t position_key(const float *xyz) {
+      uint32_t bits[3];
+      memcpy(bits, xyz, sizeof(bits));
+      return ( (uint64_t)bits[0] << 32 ^ (uint64_t)bits[1] << 11 ^ bits[2] ) | (uint64_t)1 << 63;
+    }
+
+    // the same vertices and indices.
+    static bool same_mesh(mesh *a, mesh *b) {
+      if (!a || !b) return false;
+      if (a->get_num_vertices() != b->get_num_vertices() || a->get_num_indices() != b->get_num_indices()) return false;
+      if (a->get_stride() != b->get_stride() || a->get_index_type() != b->get_index_type()) return false;
+      gl_resource::rolock va(a->get_vertices()), vb(b->get_vertices());
+      gl_resource::rolock ia(a->get_indices()), ib(b->get_indices());
+      unsigned index_size = a->get_index_type() == GL_UNSIGNED_INT ? 4 : 2;
+      return memcmp(va.u8(), vb.u8(), a->get_stride() * a->get_num_vertices()) == 0 &&
+        memcmp(ia.u8(), ib.u8(), index_size * a->get_num_indices()) == 0;
+    }
+
+    // read or write 64 bits of a cache file's header: its copy of the time at 8 and the hash at 24.
+    static uint64_t patch_cache(const char *cache_path, unsigned offset, uint64_t value, bool write) {
+      FILE *file = fopen(cache_path, "r+b");
+      if (!file) return 0;
+      fseek(file, offset, SEEK_SET);
+      if (write) {
+        fwrite(&value, 1, sizeof(value), file);
+      } else if (fread(&value, 1, sizeof(value), file) != sizeof(value)) {
+        value = 0;
+      }
+      fclose(file);
+      return value;
+    }
+
+    /// load a COLLADA file with the cache on, then again after touching the cache's copy of the time,
+    /// which must come from the cache as the file is the same, and again after damaging its hash as well,
+    /// which must convert the file again. All three must make the same mesh, whose positions must be
+    /// values of the positions array as strtod reads them.
+    static bool collada(const char *path) {
+      collada_builder::cache_dir(".");
+      string cache_path;
+      collada_builder::get_cache_path(cache_path, string(app_utils::get_path(path)));
+      remove(cache_path);
+
+      ref<resource_dict> first, cached, converted;
+      double convert_time = 0, cached_time = 0, reconvert_time = 0;
+      mesh *first_mesh = load_cached_mesh(path, first, convert_time);
+      uint64_t mtime = patch_cache(cache_path, 8, 0, false);
+
+      patch_cache(cache_path, 8, 1, true);
+      mesh *cached_mesh = load_cached_mesh(path, cached, cached_time);
+      bool from_cache = patch_cache(cache_path, 8, 0, false) == 1;
+
+      patch_cache(cache_path, 24, patch_cache(cache_path, 24, 0, false) ^ 1, true);
+      mesh *converted_mesh = load_cached_mesh(path, converted, reconvert_time);
+      bool rewritten = patch_cache(cache_path, 8, 0, false) == mtime;
+
+      remove(cache_path);
+      collada_builder::cache_dir("");
+      log("collada %s: converted in %.2fms, %.2fms from the cache, %.2fms after damaging it\n", path, convert_time * 1000, cached_time * 1000, reconvert_time * 1000);
+      bool same = same_mesh(first_mesh, cached_mesh) && same_mesh(first_mesh, converted_mesh);
+      log("collada %s: %s from the cache, %s after damage, %s meshes\n", path, from_cache ? "read" : "NOT read", rewritten ? "rewritten" : "NOT rewritten", same ? "the same" : "different");
+      if (!first_mesh || !mtime || !from_cache || !rewritten || !same) return false;
+
+      // every position in the mesh must be exactly one of the array's.
+      dynarray<uint8_t> text;
+      app_utils::get_url(text, path);
+      text.push_back(0);
+      TiXmlDocument doc;
+      doc.Parse((const char*)text.data());
+      const TiXmlElement *positions = find_element(doc.RootElement(), "float_array", "LOD3spShape-lib-positions-array");
+      if (!positions || !positions->GetText()) return false;
+      int count = 0;
+      positions->Attribute("count", &count);
+      hash_map<uint64_t, unsigned> known;
+      const char *src = positions->GetText();
+      for (int i = 0; i + 3 <= count; i += 3) {
+        float xyz[3];
+        for (unsigned a = 0; a != 3; ++a) {
+          char *end = NULL;
+          xyz[a] = (float)strtod(src, &end);
+          src = end;
+        }
+        known[position_key(xyz)] = 1;
+      }
+
+      unsigned stride = first_mesh->get_stride();
+      unsigned pos_offset = first_mesh->get_offset(first_mesh->get_slot(attribute_pos));
+      gl_resource::rolock vtx_lock(first_mesh->get_vertices());
+      unsigned num_unknown = 0;
+      for (unsigned i = 0; i != first_mesh->get_num_vertices(); ++i) {
+        num_unknown += !known.contains(position_key((const float*)(vtx_lock.u8() + i * stride + pos_offset)));
+      }
+      log("collada %s: %d of %d positions are not in the array of %d\n", path, num_unknown, first_mesh->get_num_vertices(), count / 3);
+      return count != 0 && num_unknown == 0;
+    }
+
+    // the voxels of the test volume.
+    static int16_t volume_voxel(unsigned x, unsigned y, unsigned z, unsigned t) {
+      return (int16_t)( x + y * 100 + z * 7 - t * 300 );
+    }
+
+    // write a 70x40x35 volume of two frames of 16 bit voxels, as .nii or as .nii.gz with stored (not deflated) blocks.
+    static bool write_volume(const char *path, bool gzip) {
+      static const unsigned dims[4] = { 70, 40, 35, 2 };
+      dynarray<uint8_t> nii(352 + dims[0] * dims[1] * dims[2] * dims[3] * 2);
+      memset(nii.data(), 0, nii.size());
+      nifti_decoder::nifti_header header;
+      memset(&header, 0, sizeof(header));
+      header.sizeof_hdr = 348;
+      header.dim[0] = 4;
+      for (unsigned i = 0; i != 4; ++i) header.dim[i+1] = (short)dims[i];
+      header.datatype = nifti_volume::type_int16;
+      header.bitpix = 16;
+      header.vox_offset = 352;
+      header.scl_slope = 0.5f;
+      header.scl_inter = 1;
+      memcpy(header.magic, "n+1", 4);
+      memcpy(nii.data(), &header, sizeof(header));
+      int16_t *voxels = (int16_t*)(nii.data() + 352);
+      for (unsigned t = 0; t != dims[3]; ++t) {
+        for (unsigned z = 0; z != dims[2]; ++z) {
+          for (unsigned y = 0; y != dims[1]; ++y) {
+            for (unsigned x = 0; x != dims[0]; ++x) {
+              *voxels++ = volume_voxel(x, y, z, t);
+            }
+          }
+        }
+      }
+
+      FILE *file = fopen(path, "wb");
+      if (!file) return false;
+      if (!gzip) {
+        fwrite(nii.data(), 1, nii.size(), file);
+      } else {
+        static const uint8_t gz_header[] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255 };
+        fwrite(gz_header, 1, sizeof(gz_header), file);
+        for (unsigned pos = 0; pos != nii.size(); ) {
+          unsigned len = nii.size() - pos < 0xffff ? nii.size() - pos : 0xffff;
+          uint8_t block[5] = { (uint8_t)( pos + len == nii.size() ), (uint8_t)len, (uint8_t)( len >> 8 ), (uint8_t)~len, (uint8_t)( ~len >> 8 ) };
+          fwrite(block, 1, 5, file);
+          fwrite(nii.data() + pos, 1, len, file);
+          pos += len;
+        }
+        // nifti_volume only checks the size in the trailer, not the crc.
+        uint8_t trailer[8] = { 0, 0, 0, 0, (uint8_t)nii.size(), (uint8_t)( nii.size() >> 8 ), (uint8_t)( nii.size() >> 16 ), (uint8_t)( nii.size() >> 24 ) };
+        fwrite(trailer, 1, 8, file);
+      }
+      fclose(file);
+      return true;
+    }
+
+    // slices across each axis of frame 1 must be the voxels we wrote, scaled by the header.
+    static unsigned check_volume_slices(nifti_volume &vol) {
+      static const unsigned indices[3] = { 45, 33, 34 };
+      unsigned num_wrong = 0;
+      for (unsigned axis = 0; axis != 3; ++axis) {
+        dynarray<float> values;
+        if (!vol.get_slice_float(values, axis, indices[axis], 1)) return ~0u;
+        unsigned u = axis == 0 ? 1 : 0, v = axis == 2 ? 1 : 2;
+        unsigned width = axis == 0 ? vol.get_height() : vol.get_width();
+        for (unsigned i = 0; i != values.size(); ++i) {
+          unsigned pos[3];
+          pos[axis] = indices[axis];
+          pos[u] = i % width;
+          pos[v] = i / width;
+          num_wrong += values[i] != volume_voxel(pos[0], pos[1], pos[2], 1) * 0.5f + 1;
+        }
+      }
+      return num_wrong;
+    }
+
+    /// write a small 4D volume as .nii and .nii.gz and read slices across each axis from the bricks.
+    /// The slices must be the voxels written, a slice read again must come from the brick cache,
+    /// and the .nii.gz must be unpacked next to itself.
+    static bool nifti(const char *path) {
+      string gz_path, unpacked_path;
+      gz_path.format("%s.gz", path);
+      unpacked_path.format("%s.gz.unpacked", path);
+      if (!write_volume(path, false) || !write_volume(gz_path, true)) return false;
+
+      nifti_volume vol;
+      bool ok = vol.open(path, 6);
+      ok = ok && vol.get_width() == 70 && vol.get_height() == 40 && vol.get_depth() == 35 && vol.get_frames() == 2;
+      unsigned num_wrong = ok ? check_volume_slices(vol) : ~0u;
+
+      // a slice across z crosses 3x2 bricks, which all fit in the cache.
+      dynarray<uint8_t> slice;
+      vol.get_slice(slice, 2, 3, 0);
+      unsigned hits = vol.get_hits(), misses = vol.get_misses();
+      vol.get_slice(slice, 2, 3, 0);
+      unsigned new_hits = vol.get_hits() - hits, new_misses = vol.get_misses() - misses;
+      log("nifti %s: %d wrong voxels, %d hits and %d misses reading a slice again\n", path, num_wrong, new_hits, new_misses);
+      ok = ok && num_wrong == 0 && new_hits == 6 && new_misses == 0;
+
+      nifti_volume gz_vol;
+      bool gz_ok = gz_vol.open(gz_path);
+      unsigned gz_wrong = gz_ok ? check_volume_slices(gz_vol) : ~0u;
+      bool unpacked = mapped_file::get_mtime(unpacked_path) != 0;
+      log("nifti %s: %d wrong voxels, %s\n", gz_path.c_str(), gz_wrong, unpacked ? "unpacked" : "NOT unpacked");
+      ok = ok && gz_ok && gz_wrong == 0 && unpacked;
+
+      remove(path);
+      remove(gz_path);
+      remove(unpacked_path);
+      return ok;
+    }
+
+    // the events of the test FCS file.
+    static float fcs_value(unsigned event, unsigned param) {
+      return ( event % 1000 ) * 0.25f + param * 100.0f - 50.0f;
+    }
+
+    // write num_events events of three 32 bit float parameters in either byte order.
+    static bool write_fcs(const char *path, unsigned num_events, bool big_endian) {
+      enum { num_params = 3, text_begin = 58 };
+      string text;
+      text.format(
+        "\f$PAR\f%d\f$DATATYPE\fF\f$BYTEORD\f%s\f$TOT\f%d"
+        "\f$P1B\f32\f$P1N\fFSC-A\f$P2B\f32\f$P2N\fSSC-A\f$P3B\f32\f$P3N\fFITC-A\f",
+        num_params, big_endian ? "4,3,2,1" : "1,2,3,4", num_events
+      );
+      unsigned text_end = text_begin + text.size() - 1;
+      unsigned data_begin = text_end + 1, data_end = data_begin + num_events * num_params * 4 - 1;
+      string header;
+      header.format("FCS3.0    %8u%8u%8u%8u%8u%8u", text_begin, text_end, data_begin, data_end, 0, 0);
+
+      dynarray<uint8_t> data(num_events * num_params * 4);
+      for (unsigned i = 0; i != num_events * num_params; ++i) {
+        float value = fcs_value(i / num_params, i % num_params);
+        uint8_t bytes[4];
+        memcpy(bytes, &value, 4);
+        for (unsigned b = 0; b != 4; ++b) {
+          data[i * 4 + b] = bytes[big_endian ? 3 - b : b];
+        }
+      }
+
+      FILE *file = fopen(path, "wb");
+      if (!file) return false;
+      fwrite(header.c_str(), 1, header.size(), file);
+      fwrite(text.c_str(), 1, text.size(), file);
+      fwrite(data.data(), 1, data.size(), file);
+      fclose(file);
+      return true;
+    }
+
+    /// write FCS files of 10000 events in both byte orders and load them into columns.
+    /// Every value must be the one written, the cached min, max and mean must match a simple
+    /// loop and the histogram, counted in parallel ranges, must match one counted in order.
+    static bool fcs(const char *path) {
+      enum { num_events = 10000, num_params = 3, num_bins = 256 };
+      bool ok = true;
+      for (unsigned big_endian = 0; big_endian != 2; ++big_endian) {
+        if (!write_fcs(path, num_events, big_endian != 0)) return false;
+        ref<fcs_file> file = new fcs_file(path, num_bins);
+        remove(path);
+        if (file->get_num_values() != num_events || file->get_num_params() != num_params) return false;
+
+        unsigned num_wrong = 0, num_wrong_stats = 0;
+        dynarray<float> mean;
+        file->get_mean(mean);
+        for (unsigned j = 0; j != num_params; ++j) {
+          float lo = fcs_value(0, j), hi = lo;
+          double sum = 0;
+          for (unsigned i = 0; i != num_events; ++i) {
+            float value = fcs_value(i, j);
+            num_wrong += file->get_value(i, j) != value;
+            lo = value < lo ? value : lo;
+            hi = value > hi ? value : hi;
+            sum += value;
+          }
+          num_wrong_stats += file->get_min(j) != lo || file->get_max(j) != hi || fabsf(mean[j] - (float)( sum / num_events )) > 1e-3f;
+
+          dynarray<unsigned> counts(num_bins);
+          memset(counts.data(), 0, counts.size() * sizeof(unsigned));
+          float scale = num_bins / ( hi - lo );
+          for (unsigned i = 0; i != num_events; ++i) {
+            unsigned bin = (unsigned)( ( fcs_value(i, j) - lo ) * scale );
+            counts[bin < num_bins - 1 ? bin : num_bins - 1]++;
+          }
+          const dynarray<unsigned> &histogram = file->get_histogram(j);
+          num_wrong_stats += histogram.size() != num_bins || memcmp(histogram.data(), counts.data(), num_bins * sizeof(unsigned));
+        }
+        log("fcs %s: %s, %d wrong values, %d wrong statistics\n", path, big_endian ? "big endian" : "little endian", num_wrong, num_wrong_stats);
+        ok = ok && num_wrong == 0 && num_wrong_stats == 0;
+      }
+      return ok;
+    }
+
+    /// fill a mesh_points with 40000 points of six channels from strided streams and again from a generator.
+    /// The vertices must hold the channels, zeros up to eight and the colours, and both ways must agree.
+    /// Three channels without colours must make shorter vertices with white points.
+    static bool points(const char *path) {
+      enum { num_points = 40000 };
+      struct event { float values[7]; };
+      dynarray<event> events(num_points);
+      dynarray<uint32_t> colors(num_points);
+      for (unsigned i = 0; i != num_points; ++i) {
+        for (unsigned c = 0; c != 7; ++c) events[i].values[c] = i * 0.5f + c;
+        colors[i] = i * 0x9e3779b1u;
+      }
+
+      mesh_points::stream streams[6];
+      for (unsigned c = 0; c != 6; ++c) {
+        streams[c] = mesh_points::stream(&events[0].values[c], sizeof(event));
+      }
+      ref<mesh_points> from_streams = new mesh_points();
+      from_streams->set_channels(num_points, 6, streams, mesh_points::stream(colors.data(), sizeof(uint32_t)));
+      ref<mesh_points> generated = new mesh_points();
+      generated->generate(num_points, 6, [&](unsigned i, float *values, uint8_t *color) {
+        for (unsigned c = 0; c != 6; ++c) values[c] = events[i].values[c];
+        memcpy(color, &colors[i], 4);
+      });
+
+      unsigned stride = from_streams->get_stride(), num_wrong = 0;
+      bool same = false;
+      if (stride == 36 && from_streams->get_num_vertices() == num_points && generated->get_stride() == stride) {
+        gl_resource::rolock a(from_streams->get_vertices()), b(generated->get_vertices());
+        for (unsigned i = 0; i != num_points; ++i) {
+          const float *values = (const float*)( a.u8() + i * stride );
+          for (unsigned c = 0; c != 8; ++c) num_wrong += values[c] != ( c < 6 ? events[i].values[c] : 0.0f );
+          num_wrong += memcmp(values + 8, &colors[i], 4) != 0;
+        }
+        same = memcmp(a.u8(), b.u8(), stride * num_points) == 0;
+      }
+      log("points %s: %d points of %d bytes, %d wrong values, %s from a generator\n", path, from_streams->get_num_vertices(), stride, num_wrong, same ? "the same" : "different");
+      bool ok = stride == 36 && num_wrong == 0 && same;
+
+      ref<mesh_points> three = new mesh_points();
+      three->set_channels(num_points, 3, streams);
+      unsigned short_stride = three->get_stride(), short_wrong = 0;
+      if (short_stride == 20) {
+        gl_resource::rolock a(three->get_vertices());
+        for (unsigned i = 0; i != num_points; ++i) {
+          const float *values = (const float*)( a.u8() + i * short_stride );
+          for (unsigned c = 0; c != 4; ++c) short_wrong += values[c] != ( c < 3 ? events[i].values[c] : 0.0f );
+          short_wrong += memcmp(values + 4, "\xff\xff\xff\xff", 4) != 0;
+        }
+      }
+      log("points %s: three channels in %d bytes, %d wrong values\n", path, short_stride, short_wrong);
+      return ok && short_stride == 20 && short_wrong == 0;
+    }
+
+    // send some bytes to a server's socket-free client and return what comes back as a string.
+    static bool http_answer(http_server &server, const char *request, string &response) {
+      dynarray<char> bytes;
+      bool open = server.answer(request, (unsigned)strlen(request), bytes);
+      bytes.push_back(0);
+      response = bytes.data();
+      return open;
+    }
+
+    // the number of times text appears in a response.
+    static unsigned count_text(const char *response, const char *text) {
+      unsigned count = 0;
+      for (const char *p = strstr(response, text); p; p = strstr(p + 1, text)) ++count;
+      return count;
+    }
+
+    /// send requests to an http_server through answer(), which runs the server's request code without sockets.
+    /// Pipelined and split requests must be answered in order on one connection, a graph request must wait
+    /// for update() and keep the requests after it waiting, a callback that is not a name must be refused,
+    /// HTTP/1.0 must close the connection and a stream must get each new frame.
+    static bool http(const char *path) {
+      http_server server;
+      ref<resource_dict> dict = new resource_dict();
+      dict->set_resource("box", new mesh_box(vec3(1)));
+      server.set_dict(dict);
+      int stats = server.add_channel("stats", "text/plain");
+      server.publish(stats, "frame 1");
+
+      string response;
+      bool open = http_answer(server, "GET /latest/stats HTTP/1.1\r\nHost: x\r\n\r\nGET /channels HTTP/1.1\r\n\r\nGET /lat", response);
+      const char *latest = strstr(response, "frame 1"), *list = strstr(response, "[\"stats\"]");
+      bool pipelined = open && count_text(response, "HTTP/1.1 200 OK") == 2 && latest && list && latest < list;
+      open = http_answer(server, "est/nothing HTTP/1.1\r\n\r\n", response);
+      bool split = open && count_text(response, "HTTP/1.1 404 Not Found") == 1;
+      log("http %s: pipelined requests %s, split request %s\n", path, pipelined ? "answered in order" : "FAILED", split ? "answered" : "FAILED");
+
+      open = http_answer(server, "GET /graph?operation=get_children&callback=alert(1) HTTP/1.1\r\n\r\n", response);
+      bool refused = open && count_text(response, "400 Bad Request") == 1;
+      open = http_answer(server, "GET /graph?operation=get_children&callback=cb HTTP/1.1\r\n\r\nGET /channels HTTP/1.1\r\n\r\n", response);
+      bool waited = open && response.size() == 0;
+      server.update();
+      open = http_answer(server, "", response);
+      const char *graph = strstr(response, "cb([");
+      list = strstr(response, "[\"stats\"]");
+      bool graphed = open && graph && strstr(response, "box") && list && graph < list;
+      log("http %s: bad callback %s, graph %s\n", path, refused ? "refused" : "NOT refused", waited && graphed ? "answered after update()" : "FAILED");
+
+      open = http_answer(server, "GET /latest/stats HTTP/1.0\r\n\r\n", response);
+      bool closed = !open && count_text(response, "Connection: close") == 1 && strstr(response, "frame 1");
+
+      open = http_answer(server, "GET /stream/stats HTTP/1.1\r\n\r\n", response);
+      bool streaming = open && strstr(response, "Transfer-Encoding: chunked") && strstr(response, "7\r\nframe 1\r\n") && server.has_subscribers(stats);
+      server.publish(stats, "frame 22");
+      open = http_answer(server, "", response);
+      streaming = streaming && open && response == "8\r\nframe 22\r\n";
+      log("http %s: HTTP/1.0 %s, stream %s\n", path, closed ? "closed" : "NOT closed", streaming ? "got each frame" : "FAILED");
+      return pipelined && split && refused && waited && graphed && closed && streaming;
+    }
+
+    // the starting state of billboard i in the particles test.
+    static void particle_start(int i, mesh_particle_system::billboard_particle &b, mesh_particle_system::particle_animator &a) {
+      b.pos = vec3p(i * 0.01f, (i % 13) * 0.5f, -(i % 7) * 0.25f);
+      b.size = vec2p(0.5f + (i % 3), 0.25f);
+      b.uv_bottom_left = vec2p(0, 0);
+      b.uv_top_right = vec2p(1, 1);
+      b.angle = (i % 5) * 0x10000000u;
+      b.enabled = true;
+      a.vel = vec3p((i % 11) * 0.1f, 1.0f, -0.5f);
+      a.acceleration = vec3p(0, -9.8f, (i % 4) * 0.125f);
+      a.lifetime = 5 + i % 20;
+      a.age = 0;
+      a.spin = (i % 9) * 1000000u;
+    }
+
+    // add num billboards to a system, drop every seventh and animate it for num_frames on the given number of threads.
+    static ref<mesh_particle_system> make_particles(unsigned num_threads, int num, unsigned num_frames, float dt, bool points) {
+      thread_pool::get().set_num_threads(num_threads);
+      ref<mesh_particle_system> system = new mesh_particle_system(aabb(vec3(0), vec3(100)), num, 0);
+      system->set_expand_in_shader(points);
+      for (int i = 0; i != num; ++i) {
+        mesh_particle_system::billboard_particle b;
+        mesh_particle_system::particle_animator a;
+        particle_start(i, b, a);
+        a.link = system->add_billboard_particle(b);
+        system->add_particle_animator(a);
+      }
+      for (int i = 0; i < num; i += 7) {
+        system->remove_billboard_particle(i);
+      }
+      for (unsigned f = 0; f != num_frames; ++f) {
+        system->animate(dt);
+      }
+      system->update();
+      return system;
+    }
+
+    /// animate billboards with lifetimes, with some removed, against a one-at-a-time reference.
+    /// The survivors must keep their ids and follow the reference on 1 and 8 threads, with and without
+    /// SSE tails, and the quads and shader points built by update() must match them.
+    static bool particles(const char *path) {
+      thread_pool &pool = thread_pool::get();
+      unsigned old_threads = pool.get_num_threads();
+      const int num = 3003;
+      const unsigned num_frames = 12;
+      const float dt = 1.0f / 30;
+      ref<mesh_particle_system> one = make_particles(1, num, num_frames, dt, false);
+      ref<mesh_particle_system> eight = make_particles(8, num, num_frames, dt, true);
+      pool.set_num_threads(old_threads);
+
+      // a particle is retired by the animate() after its age reaches its lifetime.
+      unsigned num_alive = 0, num_wrong = 0, num_wrong_vertices = 0;
+      float worst = 0;
+      gl_resource::rolock quads(one->get_vertices()), points(eight->get_vertices());
+      const mesh::vertex *vtx = (const mesh::vertex*)quads.u8();
+      const float *pts = (const float*)points.u8();
+      for (int i = 0; i != num; ++i) {
+        mesh_particle_system::billboard_particle b, b1, b8;
+        mesh_particle_system::particle_animator a;
+        particle_start(i, b, a);
+        bool alive = i % 7 != 0 && a.lifetime >= num_frames;
+        bool found1 = one->get_billboard_particle(i, b1), found8 = eight->get_billboard_particle(i, b8);
+        if (found1 != alive || found8 != alive) {
+          num_wrong++;
+          continue;
+        }
+        if (!alive) continue;
+        num_alive++;
+        vec3 pos = b.pos, vel = a.vel, acc = a.acceleration;
+        uint32_t angle = b.angle;
+        for (unsigned f = 0; f != num_frames; ++f) {
+          pos += vel * dt;
+          vel += acc * dt;
+          angle += (uint32_t)(int32_t)((float)a.spin * dt);
+        }
+        float error = max(length(pos - vec3(b1.pos)), length(pos - vec3(b8.pos)));
+        worst = max(worst, error);
+        num_wrong += error > 1e-4f || angle != b1.angle || angle != b8.angle;
+      }
+
+      // both systems made the same removals, so their slots match: each quad must be centred on its point
+      // and be twice the point's size across, whatever its angle.
+      for (unsigned q = 0; q != one->get_num_billboard_particles() && q < eight->get_num_billboard_particles(); ++q) {
+        const mesh::vertex *v = vtx + q * 4;
+        const float *p = pts + q * 10;
+        vec3 centre = (vec3(v[0].pos) + vec3(v[1].pos) + vec3(v[2].pos) + vec3(v[3].pos)) * 0.25f;
+        float width = length(vec3(v[1].pos) - vec3(v[0].pos)), height = length(vec3(v[0].pos) - vec3(v[3].pos));
+        num_wrong_vertices += length(centre - vec3(p[0], p[1], p[2])) > 1e-4f || fabsf(width - 2 * p[3]) > 1e-4f || fabsf(height - 2 * p[4]) > 1e-4f;
+      }
+      log("particles %s: %d of %d alive after %d frames, %d wrong, worst error %.3g\n", path, num_alive, num, num_frames, num_wrong, worst);
+      bool counted = one->get_num_billboard_particles() == num_alive && eight->get_num_billboard_particles() == num_alive;
+      bool built = one->get_num_vertices() == num_alive * 4 && one->get_num_indices() == num_alive * 6 &&
+        eight->get_num_vertices() == num_alive && eight->get_num_indices() == 0 && eight->get_stride() == 40;
+      log("particles %s: %d quads and %d points built, %d wrong\n", path, one->get_num_vertices() / 4, eight->get_num_vertices(), num_wrong_vertices);
+      return num_alive != 0 && num_wrong == 0 && counted && built && num_wrong_vertices == 0;
+    }
+
+    // the densest particle over rho0, less one.
+    static float fluid_compression(const particles_app &app) {
+      const sim_state_t *s = app.get_state();
+      float rho_max = 0;
+      for (int i = 0; i != s->n; ++i) {
+        rho_max = max(rho_max, s->rho[i]);
+      }
+      return rho_max / app.get_params().rho0 - 1;
+    }
+
+    /// run the fluid of examples/Metaballs with --deterministic on 1, 2 and 8 threads.
+    /// The state hash must be the same on every thread count every frame.
+    static bool deterministic(const char *path) {
+      enum { num_frames = 100 };
+      thread_pool &pool = thread_pool::get();
+      unsigned old_threads = pool.get_num_threads();
+      static const char *thread_counts[] = { "1", "2", "8" };
+      uint64_t hashes[num_frames];
+      unsigned num_different = 0;
+      for (unsigned t = 0; t != 3; ++t) {
+        char *argv[] = { (char*)"headless_tests", (char*)"--deterministic", (char*)"--threads", (char*)thread_counts[t] };
+        particles_app app(4, argv);
+        app.init();
+        for (int i = 0; i != num_frames; ++i) {
+          app.simulate_frame();
+          uint64_t hash = app.get_state_hash();
+          if (t == 0) hashes[i] = hash;
+          num_different += hash != hashes[i];
+        }
+        log("deterministic %s: %s threads, frame %d hash %016llx\n", path, thread_counts[t], num_frames, (unsigned long long)hashes[num_frames - 1]);
+      }
+      pool.set_num_threads(old_threads);
+      log("deterministic %s: %d frames differ from 1 thread\n", path, num_different);
+      return num_different == 0;
+    }
+
+    /// run the fluid of examples/Metaballs until the dropped bodies have landed.
+    /// The fluid must hold the bodies off the floor and the bodies must keep the fluid out of them.
+    static bool coupling(const char *path) {
+      char *argv[] = { (char*)"headless_tests" };
+      particles_app app(1, argv);
+      app.init();
+      for (int i = 0; i != 400; ++i) {
+        app.simulate_frame();
+      }
+
+      const sim_state_t *s = app.get_state();
+      float h = app.get_params().h;
+      unsigned num_dynamic = 0, num_held = 0, num_inside = 0;
+      for (unsigned b = 0; b != app.get_num_rigid_bodies(); ++b) {
+        const btRigidBody *body = app.get_rigid_body(b);
+        if (body->getInvMass() == 0) continue;
+        num_dynamic++;
+        const btCollisionShape *shape = body->getCollisionShape();
+        btVector3 half = shape->getShapeType() == SPHERE_SHAPE_PROXYTYPE ?
+          btVector3(1, 1, 1) * ((const btSphereShape*)shape)->getRadius() :
+          ((const btBoxShape*)shape)->getHalfExtentsWithMargin();
+
+        // resting on the floor, the centre would be half a height up. A particle of the fluid is at least h.
+        num_held += body->getCenterOfMassPosition().y() > half.y() + h;
+
+        // particles more than h/4 inside the surface have got through.
+        btTransform worldToBody = body->getCenterOfMassTransform().inverse();
+        for (int i = 0; i != s->n; ++i) {
+          btVector3 pos = worldToBody * btVector3(s->x[i*3], s->x[i*3+1], s->x[i*3+2]);
+          if (shape->getShapeType() == SPHERE_SHAPE_PROXYTYPE) {
+            num_inside += pos.length() < half.x() - h * 0.25f;
+          } else {
+            num_inside += fabsf(pos.x()) < half.x() - h * 0.25f && fabsf(pos.y()) < half.y() - h * 0.25f && fabsf(pos.z()) < half.z() - h * 0.25f;
+          }
+        }
+      }
+      log("coupling %s: %d of %d bodies held up by the fluid, %d particles inside them\n", path, num_held, num_dynamic, num_inside);
+      return num_dynamic != 0 && num_held == num_dynamic && num_inside == 0;
+    }
+
+    /// run the fluid of examples/Metaballs with --mixed_precision for a few frames.
+    /// The packed particles must give densities and forces close to the float ones.
+    static bool precision(const char *path) {
+      char *argv[] = { (char*)"headless_tests", (char*)"--mixed_precision" };
+      particles_app app(2, argv);
+      app.init();
+      for (int i = 0; i != 50; ++i) {
+        app.simulate_frame();
+      }
+      bool close = app.compare_precision();
+      log("precision %s: mixed precision %s\n", path, close ? "close to float" : "NOT close to float");
+      return close;
+    }
+
+    /// run the fluid of examples/Metaballs with --inflow, a tap and a drain.
+    /// Particles must come and go, and the ids of the live and the unused particles must stay a permutation.
+    static bool inflow(const char *path) {
+      char *argv[] = { (char*)"headless_tests", (char*)"--inflow" };
+      particles_app app(2, argv);
+      app.init();
+      const sim_state_t *s = app.get_state();
+      int start = s->n, most = s->n, least = s->n;
+      unsigned num_bad_ids = 0;
+      for (int i = 0; i != 400; ++i) {
+        app.simulate_frame();
+        most = max(most, s->n);
+        least = min(least, s->n);
+        for (int j = 0; j != s->capacity; ++j) {
+          num_bad_ids += s->id[j] >= (unsigned)s->capacity || s->slot[s->id[j]] != (unsigned)j;
+        }
+      }
+      log("inflow %s: %d particles at the start, between %d and %d, %d at the end, %d bad ids\n", path, start, least, most, s->n, num_bad_ids);
+      return most > start && least < start && num_bad_ids == 0;
+    }
+
+    /// run the fluid of examples/Metaballs with the equation of state and with --pcisph at the same time step.
+    /// The pressure solver must squash the fluid less than half as much.
+    static bool pcisph(const char *path) {
+      float worst[2] = { 0, 0 };
+      for (int pass = 0; pass != 2; ++pass) {
+        char *argv[] = { (char*)"headless_tests", (char*)"--pcisph" };
+        particles_app app(pass + 1, argv);
+        app.init();
+        for (int i = 0; i != 400; ++i) {
+          app.simulate_frame();
+          worst[pass] = max(worst[pass], fluid_compression(app));
+        }
+      }
+      log("pcisph %s: squashed by %.1f%% with the equation of state, %.1f%% with the solver\n", path, worst[0] * 100, worst[1] * 100);
+      return worst[1] < worst[0] * 0.5f;
+    }
+
+    /// run the fluid of examples/Metaballs for a few frames, then one step with OpenCL and one natively.
+    /// The density, forces, positions and velocities must agree within compare_backends' tolerance.
+    /// Skipped if the build has no OpenCL (make OPENCL=1) or no OpenCL driver (ICD) is installed.
+    static bool opencl(const char *path) {
+      #if OCTET_OPENCL
+        cl_uint num_platforms = 0;
+        if (clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS || num_platforms == 0) {
+          printf("opencl %s: skipped, no OpenCL driver\n", path);
+          log("opencl %s: skipped, no OpenCL driver\n", path);
+          return true;
+        }
+        char *argv[] = { (char*)"headless_tests" };
+        particles_app app(1, argv);
+        app.init();
+        for (int i = 0; i != 20; ++i) {
+          app.simulate_frame();
+        }
+        return app.start_opencl();
+      #else
+        printf("opencl %s: skipped, built without OCTET_OPENCL\n", path);
+        log("opencl %s: skipped, built without OCTET_OPENCL\n", path);
+        return true;
+      #endif
+    }
+
+    /// copy the first particle id of a checkpoint over the second and fix up the file's hash.
+    /// This knows the layout of sph_checkpoint: a 32 byte header ending in the hash of the rest,
+    /// then blocks with a 32 byte header starting with the name and size.
+    static bool damage_checkpoint_ids(const char *path) {
+      FILE *file = fopen(path, "rb");
+      if (!file) return false;
+      fseek(file, 0, SEEK_END);
+      dynarray<uint8_t> buf((unsigned)ftell(file));
+      fseek(file, 0, SEEK_SET);
+      bool ok = buf.size() >= 32 && fread(buf.data(), 1, buf.size(), file) == buf.size();
+      fclose(file);
+
+      bool found = false;
+      for (size_t offset = 32; ok && !found && offset + 32 <= buf.size(); ) {
+        uint64_t size = 0;
+        memcpy(&size, buf.data() + offset + 16, sizeof(size));
+        unsigned *ids = (unsigned*)( buf.data() + offset + 32 );
+        if (!strcmp((const char*)buf.data() + offset, "id") && size >= 2 * sizeof(unsigned)) {
+          ids[1] = ids[0];
+          found = true;
+        }
+        offset += 32 + ( ( size + 15 ) & ~15 );
+      }
+      if (!found) return false;
+
+      uint64_t hash = 0xcbf29ce484222325ull;
+      for (size_t i = 32; i != buf.size(); ++i) {
+        hash = ( hash ^ buf[i] ) * 0x100000001b3ull;
+      }
+      memcpy(buf.data() + 24, &hash, sizeof(hash));
+
+      file = fopen(path, "wb");
+      if (!file) return false;
+      ok = fwrite(buf.data(), 1, buf.size(), file) == buf.size();
+      return fclose(file) == 0 && ok;
+    }
+
+    /// run the fluid of examples/Metaballs straight through, then again saving a checkpoint in path
+    /// every few frames. Saving must not change the run, so the state hashes must be the same every frame.
+    /// The run is long enough for the bodies to land, as bullet's contacts are what a save used to upset.
+    /// A third run restarts from the last checkpoint, which must hold the state of that frame,
+    /// and a fourth from a copy with two particles in one slot, which must be refused.
+    static bool checkpoint(const char *path) {
+      enum { num_frames = 400 };
+      char *straight_argv[] = { (char*)"headless_tests" };
+      char *checkpoint_argv[] = { (char*)"headless_tests", (char*)"--checkpoint", (char*)path, (char*)"--checkpoint_every", (char*)"20" };
+      char *restart_argv[] = { (char*)"headless_tests", (char*)"--restart", (char*)path };
+      uint64_t straight[num_frames], start = 0;
+      {
+        particles_app app(1, straight_argv);
+        app.init();
+        start = app.get_state_hash();
+        for (int i = 0; i != num_frames; ++i) {
+          app.simulate_frame();
+          straight[i] = app.get_state_hash();
+        }
+      }
+
+      bool ok = true;
+      {
+        particles_app app(5, checkpoint_argv);
+        app.init();
+        for (int i = 0; i != num_frames; ++i) {
+          app.simulate_frame();
+          uint64_t hash = app.get_state_hash();
+          if (hash != straight[i]) {
+            log("checkpoint: frame %d hash %016llx, %016llx without checkpoints\n", i + 1, (unsigned long long)hash, (unsigned long long)straight[i]);
+            ok = false;
+            break;
+          }
+        }
+      }
+
+      {
+        particles_app app(3, restart_argv);
+        app.init();
+        uint64_t hash = app.get_state_hash();
+        log("checkpoint: restarted at frame %d hash %016llx, saved %016llx\n", num_frames, (unsigned long long)hash, (unsigned long long)straight[num_frames - 1]);
+        ok = ok && hash == straight[num_frames - 1];
+      }
+
+      // give two particles the same id. The restart must refuse the file and start afresh.
+      if (ok && damage_checkpoint_ids(path)) {
+        particles_app app(3, restart_argv);
+        app.init();
+        uint64_t hash = app.get_state_hash();
+        log("checkpoint: restarted from a bad file hash %016llx, start %016llx\n", (unsigned long long)hash, (unsigned long long)start);
+        ok = hash == start;
+      } else {
+        ok = false;
+      }
+      remove(path);
+      return ok;
+    }
+
+    /// run the test named by the first argument on the files after it, or all of them.
+    /// returns the number of failures.
+    static int run(int argc, char **argv) {
+      unsigned num_tests = 0;
+      const test_info *tests = get_tests(num_tests);
+      int failures = 0;
+      bool found = false;
+      for (unsigned i = 0; i != num_tests; ++i) {
+        const test_info &t = tests[i];
+        if (argc >= 2 && strcmp(argv[1], t.name)) continue;
+        found = true;
+        if (argc >= 3) {
+          for (int j = 2; j != argc; ++j) failures += !run_test(t, argv[j]);
+        } else {
+          failures += !run_test(t, t.default_path);
+        }
+      }
+      if (!found) {
+        printf("unknown test %s\n", argv[1]);
+        return 1;
+      }
+      return failures;
+    }
+  };
+}
@@ -0,0 +1,37 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Checks and benchmarks that run without a window
+//
+
+// mesh_voxels is only built on request.
+#define OCTET_VOXEL_TEST 1
+
+#include "../../octet.h"
+
+// the fluid simulation
+#include "../Metaballs/3D_Particle_App.h"
+
+// fcs_file
+#include "../flow_cytometry/flow_cytometry.h"
+
+#include "headless_tests.h"
+
+//
+// a C++ program starts here with the command line arguments in argv[]
+// argc is the number of arguments with argv[0] set to the command name.
+//
+// the exit code is the number of tests that failed.
+//
+int main(int argc, char **argv) {
+  // path from project dir to base octet directory.
+  octet::app_utils::prefix("../../../");
+
+  // set up the platform. No window is opened.
+  octet::app::init_all(argc, argv);
+
+  return octet::headless_tests::run(argc, argv);
+}
@@ -7,161 +7,839 @@
 //
 // HTTP server for debugging game code and building game editors.
 
+#if defined(__linux__) && !defined(__GENERIC__)
+  #include <sys/epoll.h>
+  #include <sys/socket.h>
+  #include <sys/ioctl.h>
+  #include <netinet/in.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #ifndef closesocket
+    #define ioctlsocket ioctl
+    #define closesocket close
+  #endif
+  #define OCTET_HTTP_EPOLL 1
+#elif defined(WIN32) || defined(__APPLE__)
+  #define OCTET_HTTP_SELECT 1
+#endif
+
+#include <errno.h>
+
 namespace octet { namespace helpers {
   /// Class for exposing game object to web browsers.
+  ///
+  /// The server runs on its own thread so that slow or stalled clients never hold up the frame.
+  /// Connections are kept alive between requests (HTTP/1.1). The server answers:
+  ///
+  ///     /graph?operation=get_children&callback=cb   JSONP tree of the resource_dict (built in update())
+  ///     /stream/name                               chunked stream of every frame published on a channel
+  ///     /latest/name                               the most recent frame on a channel
+  ///     /channels                                  JSON list of channel names
+  ///
+  /// The server listens on the loopback address only, unless init() is given another.
+  /// A graph request must have a callback that is a JavaScript name, as the response runs as script.
+  ///
+  /// Channels carry application data such as simulation statistics. publish() copies the frame
+  /// and returns at once; if a client falls behind, intermediate frames are dropped for that client.
+  ///
+  /// Example
+  ///
+  ///     server.init(app_scene->get_resource_dict());
+  ///     stats = server.add_channel("stats", "text/event-stream");
+  ///     ...
+  ///     server.update(); // once per frame
+  ///     if (server.has_subscribers(stats)) server.publish(stats, "data: {}\n\n");
   class http_server {
-    enum { port = 8888 };
-    int listen_socket;
+    enum {
+      port = 8888,
+      recv_size = 0x10000,
+
+      // stop queueing stream frames for a client with this much unsent data
+      max_queued_bytes = 0x400000,
+
+      // poll timeout when we have no way of waking the server thread
+      poll_ms = 10,
+
+      #if defined(MSG_NOSIGNAL)
+        // a client closing a stream must not kill the app with SIGPIPE
+        send_flags = MSG_NOSIGNAL,
+      #else
+        send_flags = 0,
+      #endif
+    };
+
+    struct connection {
+      int socket;
+      unsigned id;
+
+      // received but not yet parsed
+      dynarray<char> in;
+
+      // waiting to be sent, starting at out_pos
+      dynarray<char> out;
+      unsigned out_pos;
+
+      // channel we are streaming or -1 and the last frame we queued
+      int channel;
+      unsigned sequence;
+
+      // waiting for the main thread to answer a graph request
+      bool waiting;
+
+      // close when out is empty
+      bool close_after_send;
+
+      // dead, delete at the end of the poll
+      bool closed;
+
+      #if OCTET_HTTP_EPOLL
+        bool want_write;
+      #endif
+    };
+
+    struct channel {
+      string name;
+      string content_type;
+
+      // last published frame
+      dynarray<char> latest;
+
+      // frames published so far
+      unsigned num_published;
+
+      // copy of the latest frame used by the server thread, so that we can
+      // send it without holding the lock.
+      dynarray<char> sending;
+      unsigned sending_sequence;
+
+      unsigned num_subscribers;
+    };
 
-    struct session {
-      int client_socket;
+    // graph requests are answered on the main thread as they visit the game data.
+    struct graph_message {
+      unsigned connection_id;
+      string callback;
+      string response;
     };
 
     // The information we are serving. ie. the game data.
     ref<resource_dict> dict;
 
-    // client sessions active
-    dynarray<session> sessions;
+    int listen_socket;
 
-    // temporary buffer used for send/recieve
+    // owned by the server thread
+    dynarray<connection*> connections;
+    unsigned next_connection_id;
     dynarray<char> buf;
 
+    // shared with the main thread, protected by mutex
+    std::mutex mutex;
+    dynarray<channel*> channels;
+    dynarray<graph_message*> graph_requests;
+    dynarray<graph_message*> graph_responses;
+    bool quit;
+
+    std::thread *server_thread;
+
+    // the client of answer(), which has no socket.
+    connection local;
+
+    #if OCTET_HTTP_EPOLL
+      int epoll_fd;
+      int wake_fds[2];
+    #endif
+
+    static void append(dynarray<char> &dest, const void *src, unsigned bytes) {
+      unsigned pos = dest.size();
+      dest.resize(pos + bytes);
+      if (bytes) memcpy(&dest[pos], src, bytes);
+    }
+
+    static void append(dynarray<char> &dest, const char *str) {
+      append(dest, str, (unsigned)strlen(str));
+    }
+
     void set_non_blocking(int socket) {
       unsigned long mode = 1;
       ioctlsocket(socket, FIONBIO, &mode);
     }
 
-    void parse_http_request(session &s, char *p) {
-      string header(p);
+    // true if a failed recv or send will succeed later
+    static bool would_block() {
+      #if defined(WIN32)
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+      #else
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      #endif
+    }
+
+    // find the blank line at the end of the request header
+    static int find_header_end(const char *p, unsigned size, unsigned &terminator) {
+      for (unsigned i = 0; i + 1 < size; ++i) {
+        if (p[i] == '\n' && p[i+1] == '\n') {
+          terminator = 2;
+          return (int)i;
+        } else if (p[i] == '\n' && p[i+1] == '\r' && i + 2 < size && p[i+2] == '\n') {
+          terminator = 3;
+          return (int)i;
+        }
+      }
+      return -1;
+    }
+
+    // wake the server thread to send new data.
+    void wake() {
+      #if OCTET_HTTP_EPOLL
+        char c = 0;
+        if (write(wake_fds[1], &c, 1)) {}
+      #endif
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // responses (server thread)
+    //
+
+    void queue_response(connection *c, const char *status, const char *content_type, const void *data, unsigned bytes) {
+      string header;
+      header.format(
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %d\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "%s"
+        "\r\n",
+        status, content_type, bytes, c->close_after_send ? "Connection: close\r\n" : ""
+      );
+      append(c->out, header.c_str(), header.size());
+      append(c->out, data, bytes);
+    }
+
+    void queue_chunk(connection *c, const void *data, unsigned bytes) {
+      char size[16];
+      sprintf(size, "%x\r\n", bytes);
+      append(c->out, size);
+      append(c->out, data, bytes);
+      append(c->out, "\r\n", 2);
+    }
 
-      dynarray<string> lines;
-      lines.reserve(32);
-      header.split(lines, "\n");
-      if (lines.size() == 0) return;
+    int find_channel(const char *name) {
+      for (unsigned i = 0; i != channels.size(); ++i) {
+        if (channels[i]->name == name) return (int)i;
+      }
+      return -1;
+    }
 
-      dynarray<string> line0;
-      lines[0].split(line0, " ");
-      if (line0.size() < 3) return;
-      if (line0[0] != "GET") return;
+    void not_found(connection *c) {
+      static const char msg[] = "not found\n";
+      queue_response(c, "404 Not Found", "text/plain", msg, sizeof(msg)-1);
+    }
 
-      log("http get from: %s\n", line0[1].c_str());
+    // JSONP callbacks are names like jQuery1710_123 or a.b, never script: [A-Za-z_$][A-Za-z0-9_.$]*
+    static bool is_callback_name(const char *name) {
+      if (!isalpha((unsigned char)*name) && *name != '_' && *name != '$') return false;
+      for (const char *p = name + 1; *p; ++p) {
+        if (!isalnum((unsigned char)*p) && *p != '_' && *p != '.' && *p != '$') return false;
+      }
+      return true;
+    }
+
+    // returns false if the connection must wait for the main thread
+    bool handle_request(connection *c, const char *method, const char *target) {
+      if (strcmp(method, "GET")) {
+        static const char msg[] = "only GET is supported\n";
+        c->close_after_send = true;
+        queue_response(c, "405 Method Not Allowed", "text/plain", msg, sizeof(msg)-1);
+        return true;
+      }
 
       // /graph?operation=get_children&id=1
-      dynarray<string> url;
-      line0[1].split(url, "?");
-      if (url.size() < 2) return;
+      if (!strncmp(target, "/graph", 6)) {
+        const char *query = strchr(target, '?');
+        if (!query) { not_found(c); return true; }
 
-      dynarray<string> ops;
-      url[1].split(ops, "&");
-      string id;
-      string callback;
-      bool get_children = false;
-      for (unsigned i = 0; i != ops.size(); ++i) {
-        dynarray<string> lhsrhs;
-        ops[i].split(lhsrhs, "=");
-        if (lhsrhs[0] == "operation") {
-          get_children = lhsrhs[1] == "get_children";
-        } else if (lhsrhs[0] == "id") {
-          id = lhsrhs[1];
-        } else if (lhsrhs[0] == "callback") {
-          callback = lhsrhs[1];
-        }
-        //log("%s = %s\n", lhsrhs[0].c_str(), lhsrhs[1].c_str());
-      }
-
-      if (!get_children) return;
-
-      //dynarray<string> id_parts;
-      //id.split(id_parts, ".");
-
-      dynarray<string> response;
-      response.reserve(64);
-      int max_depth = 5;
-      http_writer writer(0, max_depth, response);
-      response.resize(response.size()+1);
-      response.back().format("%s([\n", callback.c_str());
-      dict->visit(writer);
-      response.resize(response.size()+1);
-      response.back().format("])\n");
-
-      // With HTTP 1.1 we can keep the connection open and respond to more
-      // feeds without the overhead of a new connection.
-      unsigned num_bytes = 0;
-      for (unsigned i = 0; i != response.size(); ++i) {
-        num_bytes += response[i].size();
-      }
-
-      string response_header;
-      response_header.format(
-        "HTTP/1.1 200 OK\n"
-        "Content-Type: application/json; charset=UTF-8\n"
-        "Content-Length: %d\n"
-        "\n",
-        num_bytes
-      );
+        dynarray<string> ops;
+        string(query + 1).split(ops, "&");
+        string callback;
+        bool get_children = false;
+        for (unsigned i = 0; i != ops.size(); ++i) {
+          dynarray<string> lhsrhs;
+          ops[i].split(lhsrhs, "=");
+          if (lhsrhs.size() < 2) continue;
+          if (lhsrhs[0] == "operation") {
+            get_children = lhsrhs[1] == "get_children";
+          } else if (lhsrhs[0] == "callback") {
+            callback = lhsrhs[1];
+          }
+        }
+
+        if (!get_children || !dict) { not_found(c); return true; }
+
+        if (!is_callback_name(callback.c_str())) {
+          static const char msg[] = "callback must be a JavaScript name\n";
+          queue_response(c, "400 Bad Request", "text/plain", msg, sizeof(msg)-1);
+          return true;
+        }
+
+        graph_message *msg = new graph_message();
+        msg->connection_id = c->id;
+        msg->callback = callback;
+        std::lock_guard<std::mutex> lock(mutex);
+        graph_requests.push_back(msg);
+        c->waiting = true;
+        return false;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!strcmp(target, "/channels")) {
+        dynarray<char> json;
+        append(json, "[");
+        for (unsigned i = 0; i != channels.size(); ++i) {
+          append(json, i ? ", \"" : "\"");
+          append(json, channels[i]->name.c_str());
+          append(json, "\"");
+        }
+        append(json, "]\n");
+        queue_response(c, "200 OK", "application/json", json.data(), json.size());
+      } else if (!strncmp(target, "/latest/", 8)) {
+        int ch = find_channel(target + 8);
+        if (ch < 0) { not_found(c); return true; }
+        channel *chan = channels[ch];
+        queue_response(c, "200 OK", chan->content_type.c_str(), chan->latest.data(), chan->latest.size());
+      } else if (!strncmp(target, "/stream/", 8)) {
+        int ch = find_channel(target + 8);
+        if (ch < 0) { not_found(c); return true; }
+        channel *chan = channels[ch];
+        string header;
+        header.format(
+          "HTTP/1.1 200 OK\r\n"
+          "Content-Type: %s\r\n"
+          "Transfer-Encoding: chunked\r\n"
+          "Cache-Control: no-cache\r\n"
+          "Access-Control-Allow-Origin: *\r\n"
+          "\r\n",
+          chan->content_type.c_str()
+        );
+        append(c->out, header.c_str(), header.size());
+        if (chan->num_published) queue_chunk(c, chan->latest.data(), chan->latest.size());
+        c->channel = ch;
+        c->sequence = chan->num_published;
+        chan->num_subscribers++;
+      } else {
+        not_found(c);
+      }
+      return true;
+    }
+
+    // parse as many complete requests as we have, keeping the order of responses.
+    void parse_requests(connection *c) {
+      while (!c->waiting && !c->closed && c->channel < 0 && !c->close_after_send) {
+        unsigned terminator = 0;
+        int header_size = find_header_end(c->in.data(), c->in.size(), terminator);
+        if (header_size < 0) {
+          // junk or an enormous header
+          if (c->in.size() >= recv_size) c->closed = true;
+          return;
+        }
+        char *p = c->in.data();
+        char *end = p + header_size;
+        *end = 0;
+
+        // request line: method target version
+        char method[16], target[1024], version[16];
+        method[0] = target[0] = version[0] = 0;
+        sscanf(p, "%15s %1023s %15s", method, target, version);
+
+        // HTTP/1.1 keeps the connection by default, HTTP/1.0 closes it.
+        bool keep_alive = !strcmp(version, "HTTP/1.1");
+        for (char *line = strchr(p, '\n'); line; line = strchr(line + 1, '\n')) {
+          if (!strncasecmp_(line + 1, "connection:", 11)) {
+            const char *value = line + 12;
+            while (*value == ' ') ++value;
+            if (!strncasecmp_(value, "close", 5)) keep_alive = false;
+            if (!strncasecmp_(value, "keep-alive", 10)) keep_alive = true;
+          }
+        }
+        c->close_after_send = !keep_alive;
 
-      send(s.client_socket, response_header.c_str(), response_header.size(), 0);
+        unsigned used = (unsigned)header_size + terminator;
+        handle_request(c, method, target);
 
-      for (unsigned i = 0; i != response.size(); ++i) {
-        log("send: %s", response[i].c_str());
-        send(s.client_socket, response[i].c_str(), response[i].size(), 0);
+        // remove the request from the input
+        unsigned remaining = c->in.size() - used;
+        memmove(c->in.data(), c->in.data() + used, remaining);
+        c->in.resize(remaining);
       }
     }
 
+    static int strncasecmp_(const char *a, const char *b, unsigned n) {
+      for (unsigned i = 0; i != n; ++i) {
+        int ca = tolower((unsigned char)a[i]), cb = tolower((unsigned char)b[i]);
+        if (ca != cb) return ca - cb;
+        if (!ca) return 0;
+      }
+      return 0;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // socket events (server thread)
+    //
+
+    connection *find_connection(unsigned id) {
+      for (unsigned i = 0; i != connections.size(); ++i) {
+        if (connections[i]->id == id) return connections[i];
+      }
+      return NULL;
+    }
+
+    static void reset_connection(connection *c, int socket, unsigned id) {
+      c->socket = socket;
+      c->id = id;
+      c->in.resize(0);
+      c->out.resize(0);
+      c->out_pos = 0;
+      c->channel = -1;
+      c->sequence = 0;
+      c->waiting = false;
+      c->close_after_send = false;
+      c->closed = false;
+    }
+
+    void accept_connections() {
+      for (;;) {
+        int client_socket = (int)accept(listen_socket, 0, 0);
+        if (client_socket < 0) return;
+        set_non_blocking(client_socket);
+        connection *c = new connection();
+        reset_connection(c, client_socket, next_connection_id++);
+        connections.push_back(c);
+        #if OCTET_HTTP_EPOLL
+          c->want_write = false;
+          epoll_event ev;
+          ev.events = EPOLLIN;
+          ev.data.ptr = c;
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev);
+        #endif
+      }
+    }
+
+    void on_readable(connection *c) {
+      for (;;) {
+        int bytes = (int)recv(c->socket, &buf[0], (size_t)buf.size(), 0);
+        if (bytes > 0) {
+          // streams do not take requests, but we drain the socket anyway.
+          if (c->channel < 0) append(c->in, &buf[0], (unsigned)bytes);
+        } else {
+          if (bytes == 0 || !would_block()) c->closed = true;
+          break;
+        }
+      }
+      parse_requests(c);
+    }
+
+    void on_writable(connection *c) {
+      while (c->out_pos < c->out.size()) {
+        int bytes = (int)send(c->socket, &c->out[c->out_pos], (size_t)(c->out.size() - c->out_pos), send_flags);
+        if (bytes <= 0) {
+          if (!would_block()) c->closed = true;
+          break;
+        }
+        c->out_pos += bytes;
+      }
+      if (c->out_pos == c->out.size()) {
+        c->out.resize(0);
+        c->out_pos = 0;
+        if (c->close_after_send) c->closed = true;
+      } else if (c->out_pos >= recv_size) {
+        // compact the queue now and again
+        unsigned remaining = c->out.size() - c->out_pos;
+        memmove(c->out.data(), c->out.data() + c->out_pos, remaining);
+        c->out.resize(remaining);
+        c->out_pos = 0;
+      }
+
+      #if OCTET_HTTP_EPOLL
+        bool want_write = c->out.size() != 0;
+        if (want_write != c->want_write && !c->closed) {
+          epoll_event ev;
+          ev.events = want_write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+          ev.data.ptr = c;
+          epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->socket, &ev);
+          c->want_write = want_write;
+        }
+      #endif
+    }
+
+    // move graph responses and new channel frames to the connections.
+    void dispatch() {
+      dynarray<graph_message*> responses;
+      dynarray<channel*> chans;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (unsigned i = 0; i != graph_responses.size(); ++i) {
+          responses.push_back(graph_responses[i]);
+        }
+        graph_responses.resize(0);
+
+        for (unsigned ch = 0; ch != channels.size(); ++ch) {
+          channel *chan = channels[ch];
+          chans.push_back(chan);
+          if (chan->num_subscribers && chan->sending_sequence != chan->num_published) {
+            chan->sending.resize(chan->latest.size());
+            if (chan->latest.size()) memcpy(chan->sending.data(), chan->latest.data(), chan->latest.size());
+            chan->sending_sequence = chan->num_published;
+          }
+        }
+      }
+
+      // slow clients skip frames and catch up with the latest one.
+      for (unsigned i = 0; i != connections.size(); ++i) {
+        connection *c = connections[i];
+        if (c->channel < 0) continue;
+        channel *chan = chans[c->channel];
+        if ((int)(chan->sending_sequence - c->sequence) > 0 && c->out.size() - c->out_pos < max_queued_bytes) {
+          queue_chunk(c, chan->sending.data(), chan->sending.size());
+          c->sequence = chan->sending_sequence;
+        }
+      }
+
+      // pipelined requests may follow the graph request
+      for (unsigned i = 0; i != responses.size(); ++i) {
+        graph_message *msg = responses[i];
+        connection *c = find_connection(msg->connection_id);
+        if (c) {
+          queue_response(c, "200 OK", "application/json; charset=UTF-8", msg->response.c_str(), msg->response.size());
+          c->waiting = false;
+          parse_requests(c);
+        }
+        delete msg;
+      }
+    }
+
+    void remove_closed() {
+      for (unsigned i = 0; i < connections.size(); ) {
+        connection *c = connections[i];
+        if (c->closed) {
+          if (c->channel >= 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            channels[c->channel]->num_subscribers--;
+          }
+          #if OCTET_HTTP_EPOLL
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->socket, NULL);
+          #endif
+          closesocket(c->socket);
+          delete c;
+          connections[i] = connections.back();
+          connections.pop_back();
+        } else {
+          ++i;
+        }
+      }
+    }
+
+    // wait for socket events and call the handlers
+    void poll() {
+      #if OCTET_HTTP_EPOLL
+        epoll_event events[64];
+        int num_events = epoll_wait(epoll_fd, events, 64, 100);
+        for (int i = 0; i < num_events; ++i) {
+          connection *c = (connection*)events[i].data.ptr;
+          if (c == NULL) {
+            accept_connections();
+          } else if ((void*)c == (void*)wake_fds) {
+            char tmp[64];
+            while (read(wake_fds[0], tmp, sizeof(tmp)) > 0) {}
+          } else if (!c->closed) {
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) on_readable(c);
+            if (events[i].events & EPOLLOUT) on_writable(c);
+          }
+        }
+      #elif OCTET_HTTP_SELECT
+        fd_set read_set, write_set;
+        FD_ZERO(&read_set);
+        FD_ZERO(&write_set);
+        FD_SET(listen_socket, &read_set);
+        int max_fd = listen_socket;
+        for (unsigned i = 0; i != connections.size(); ++i) {
+          connection *c = connections[i];
+          FD_SET(c->socket, &read_set);
+          if (c->out.size()) FD_SET(c->socket, &write_set);
+          if (c->socket > max_fd) max_fd = c->socket;
+        }
+        timeval timeout = { 0, poll_ms * 1000 };
+        if (select(max_fd + 1, &read_set, &write_set, NULL, &timeout) > 0) {
+          if (FD_ISSET(listen_socket, &read_set)) accept_connections();
+          for (unsigned i = 0; i != connections.size(); ++i) {
+            connection *c = connections[i];
+            if (FD_ISSET(c->socket, &read_set)) on_readable(c);
+            if (FD_ISSET(c->socket, &write_set)) on_writable(c);
+          }
+        }
+      #endif
+    }
+
+    void run() {
+      for (;;) {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (quit) break;
+        }
+        poll();
+        dispatch();
+        for (unsigned i = 0; i != connections.size(); ++i) {
+          connection *c = connections[i];
+          if (!c->closed && c->out.size()) on_writable(c);
+        }
+        remove_closed();
+      }
+
+      for (unsigned i = 0; i != connections.size(); ++i) {
+        connections[i]->closed = true;
+      }
+      remove_closed();
+    }
+
+    static void server_entry(http_server *server) {
+      server->run();
+    }
+
   public:
-    void init(resource_dict *dict_) {
+    http_server() {
+      listen_socket = -1;
+      next_connection_id = 1;
+      quit = false;
+      server_thread = NULL;
+      #if OCTET_HTTP_EPOLL
+        epoll_fd = -1;
+        wake_fds[0] = wake_fds[1] = -1;
+      #endif
+      // socket connections are numbered from 1.
+      reset_connection(&local, -1, 0);
+    }
+
+    ~http_server() {
+      stop();
+      for (unsigned i = 0; i != channels.size(); ++i) {
+        delete channels[i];
+      }
+      for (unsigned i = 0; i != graph_requests.size(); ++i) {
+        delete graph_requests[i];
+      }
+      for (unsigned i = 0; i != graph_responses.size(); ++i) {
+        delete graph_responses[i];
+      }
+    }
+
+    /// Start the server thread. dict_ may be NULL if you only use channels.
+    /// address is the IPv4 address to listen on in host byte order, by default 127.0.0.1 so that
+    /// only this machine can connect. Use INADDR_ANY to serve other machines.
+    void init(resource_dict *dict_, uint32_t address = INADDR_LOOPBACK) {
       dict = dict_;
 
-      // create a socket to listen for connections
-      listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+      #if OCTET_HTTP_EPOLL || OCTET_HTTP_SELECT
+        // create a socket to listen for connections
+        listen_socket = (int)socket(AF_INET, SOCK_STREAM, 0);
 
-      // bind the socket to a specific port
-      sockaddr_in addr;
-      memset(&addr, 0, sizeof(addr));
-      addr.sin_family = AF_INET;
-      addr.sin_addr.s_addr = htonl(INADDR_ANY);
-      addr.sin_port = htons(port);
-      bind(listen_socket, (sockaddr *)&addr, sizeof(addr));
+        int reuse = 1;
+        setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
 
-      // start listening for connections (only one connection at a time)
-      listen(listen_socket, 1);
+        // bind the socket to a specific port
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(address);
+        addr.sin_port = htons(port);
+        if (bind(listen_socket, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_socket, 16) < 0) {
+          log("http: could not listen on port %d\n", port);
+          closesocket(listen_socket);
+          listen_socket = -1;
+          return;
+        }
 
-      // set the socket to non-blocking so we don't need to use a thread
-      set_non_blocking(listen_socket);
+        // the server thread never blocks on a socket
+        set_non_blocking(listen_socket);
+
+        #if OCTET_HTTP_EPOLL
+          epoll_fd = epoll_create(64);
+          if (pipe(wake_fds) == 0) {
+            fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+            fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+          }
+          epoll_event ev;
+          ev.events = EPOLLIN;
+          ev.data.ptr = NULL;
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_socket, &ev);
+          ev.data.ptr = wake_fds;
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fds[0], &ev);
+        #endif
+
+        // 64k buffer
+        buf.resize(recv_size);
+
+        quit = false;
+        server_thread = new std::thread(server_entry, this);
+
+        printf("connect a web browser to webui/index.html\n");
+      #endif
+    }
 
-      // 64k buffer
-      buf.resize(0x10000);
+    /// Stop the server thread and close all connections.
+    void stop() {
+      if (!server_thread) return;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+      }
+      wake();
+      server_thread->join();
+      delete server_thread;
+      server_thread = NULL;
+
+      closesocket(listen_socket);
+      listen_socket = -1;
+      #if OCTET_HTTP_EPOLL
+        ::close(epoll_fd);
+        ::close(wake_fds[0]);
+        ::close(wake_fds[1]);
+        epoll_fd = wake_fds[0] = wake_fds[1] = -1;
+      #endif
+    }
+
+    /// Add a channel which clients can read from /stream/name and /latest/name.
+    /// Returns the channel number for publish()
+    int add_channel(const char *name, const char *content_type = "application/octet-stream") {
+      channel *chan = new channel();
+      chan->name = name;
+      chan->content_type = content_type;
+      chan->num_published = 0;
+      chan->sending_sequence = 0;
+      chan->num_subscribers = 0;
+      std::lock_guard<std::mutex> lock(mutex);
+      channels.push_back(chan);
+      return (int)channels.size() - 1;
+    }
+
+    /// True if any client is streaming a channel.
+    /// Use this to avoid building frames that nobody will read.
+    bool has_subscribers(int ch) {
+      std::lock_guard<std::mutex> lock(mutex);
+      return ch >= 0 && ch < (int)channels.size() && channels[ch]->num_subscribers != 0;
+    }
+
+    /// Publish a frame on a channel. The data is copied and sent by the server thread.
+    void publish(int ch, const void *data, unsigned bytes) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ch < 0 || ch >= (int)channels.size()) return;
+        channel *chan = channels[ch];
+        // frames that grow a little at a time would otherwise reallocate every time.
+        if (chan->latest.capacity() < bytes) chan->latest.reserve(bytes + bytes / 2);
+        chan->latest.resize(bytes);
+        if (bytes) memcpy(chan->latest.data(), data, bytes);
+        chan->num_published++;
+      }
+      wake();
+    }
 
-      printf("connect a web browser to webui/index.html\n");
+    /// Publish a text frame on a channel.
+    void publish(int ch, const char *text) {
+      publish(ch, text, (unsigned)strlen(text));
     }
 
-    // called once per frame
+    /// Set the resources for /graph requests without starting the server, see answer().
+    void set_dict(resource_dict *dict_) {
+      dict = dict_;
+    }
+
+    /// Answer requests in a block of bytes as the server thread would for one client,
+    /// on platforms without sockets or in tests. Don't use it once init() has started the server.
+    /// The responses, and new frames on a stream, are appended to response.
+    /// A graph request waits for update(), so call answer() with no bytes after that for the rest.
+    /// Returns false if the client would now be closed; the next call starts a new client.
+    bool answer(const void *bytes, unsigned size, dynarray<char> &response) {
+      connection *c = &local;
+      if (size) append(c->in, bytes, size);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (unsigned i = 0; i < graph_responses.size(); ) {
+          graph_message *msg = graph_responses[i];
+          if (msg->connection_id == c->id) {
+            queue_response(c, "200 OK", "application/json; charset=UTF-8", msg->response.c_str(), msg->response.size());
+            c->waiting = false;
+            delete msg;
+            graph_responses[i] = graph_responses.back();
+            graph_responses.pop_back();
+          } else {
+            ++i;
+          }
+        }
+        if (c->channel >= 0) {
+          channel *chan = channels[c->channel];
+          if (chan->num_published != c->sequence) {
+            queue_chunk(c, chan->latest.data(), chan->latest.size());
+            c->sequence = chan->num_published;
+          }
+        }
+      }
+      parse_requests(c);
+
+      append(response, c->out.data(), c->out.size());
+      c->out.resize(0);
+      if (!c->closed && !c->close_after_send) return true;
+
+      if (c->channel >= 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        channels[c->channel]->num_subscribers--;
+      }
+      reset_connection(c, -1, 0);
+      return false;
+    }
+
+    /// called once per frame to answer requests that visit the game data.
     void update() {
-      // establish new sessions
-      int client_socket = accept(listen_socket, 0, 0);
-      if (client_socket >= 0) {
-        log("http: new connection socket %d\n", client_socket);
-        set_non_blocking(client_socket);
-        session s;
-        s.client_socket = client_socket;
-        sessions.push_back(s);
+      dynarray<graph_message*> requests;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (graph_requests.size() == 0) return;
+        for (unsigned i = 0; i != graph_requests.size(); ++i) {
+          requests.push_back(graph_requests[i]);
+        }
+        graph_requests.resize(0);
       }
 
-      // poll the sessions
-      for (unsigned i = 0; i < sessions.size(); ++i) {
-        session &s = sessions[i];
-        int bytes = (int)recv(s.client_socket, &buf[0], (size_t)buf.size()-1, 0);
-        if (bytes > 0) {
-          log("http: recieved from %d\n", s.client_socket);
-          buf[bytes] = 0;
-          parse_http_request(s, &buf[0]);
-        } else if (bytes == 0) {
-          log("http: close connection %d\n", s.client_socket);
-          closesocket(s.client_socket); 
-          sessions.erase(i);
+      for (unsigned i = 0; i != requests.size(); ++i) {
+        graph_message *msg = requests[i];
+        dynarray<string> response;
+        response.reserve(64);
+        int max_depth = 5;
+        http_writer writer(0, max_depth, response);
+        response.resize(response.size()+1);
+        response.back().format("%s([\n", msg->callback.c_str());
+        dict->visit(writer);
+        response.resize(response.size()+1);
+        response.back().format("])\n");
+
+        unsigned num_bytes = 0;
+        for (unsigned j = 0; j != response.size(); ++j) {
+          num_bytes += response[j].size();
         }
+        dynarray<char> body;
+        body.reserve(num_bytes + 1);
+        for (unsigned j = 0; j != response.size(); ++j) {
+          append(body, response[j].c_str(), response[j].size());
+        }
+        body.push_back(0);
+        msg->response = body.data();
       }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (unsigned i = 0; i != requests.size(); ++i) {
+          graph_responses.push_back(requests[i]);
+        }
+      }
+      wake();
     }
   };
 }}
-
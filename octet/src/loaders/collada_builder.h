@@ -15,6 +15,9 @@
 // On the surface it looks like a GL model, but adds many unresolvable abstractions.
 // A new standard, glTF looks more tractable with a more GL-like model. Unfortunately,
 // there are very few direct exporters as yet.
+//
+// Numeric arrays are pulled out of the text before tinyxml parses it in place, and load_resources()
+// can keep a binary copy of the result so that unchanged files skip the XML altogether.
 
 // mesh builder class for standard meshes.
 namespace octet { namespace loaders {
@@ -28,6 +31,8 @@ namespace octet { namespace loaders {
     enum { debug = 0 };
 
     TiXmlDocument doc;
+    // the doc is parsed in place, so its strings point into this.
+    dynarray<char> doc_text;
     string doc_path;
     dictionary<TiXmlElement *, allocator> ids;
     dynarray<float> temp_floats;
@@ -100,34 +105,150 @@ namespace octet { namespace loaders {
       return 8;
     }
 
+    // true if the next eight characters are all digits.
+    // the eight characters are tested at once in a 64 bit word, so there must be eight to read.
+    static bool is_eight_digits(const char *src) {
+      uint64_t v;
+      memcpy(&v, src, 8);
+      return ( ( v & 0xf0f0f0f0f0f0f0f0ull ) | ( ( ( v + 0x0606060606060606ull ) & 0xf0f0f0f0f0f0f0f0ull ) >> 4 ) ) == 0x3333333333333333ull;
+    }
+
+    // convert eight digits to an integer with three multiplies (little endian only).
+    // each step joins pairs of neighbouring lanes: 8x1 digit -> 4x2 -> 2x4 -> 1x8.
+    static uint32_t parse_eight_digits(const char *src) {
+      uint64_t v;
+      memcpy(&v, src, 8);
+      v = ( ( v & 0x0f0f0f0f0f0f0f0full ) * 2561 ) >> 8;
+      v = ( ( v & 0x00ff00ff00ff00ffull ) * 6553601 ) >> 16;
+      return (uint32_t)( ( ( v & 0x0000ffff0000ffffull ) * 42949672960001ull ) >> 32 );
+    }
+
+    // read digits into a mantissa, eight at a time where possible.
+    // digits after the first 19 only change the exponent.
+    // end limits the eight byte reads; the text must also stop at a non-digit before it.
+    static const char *parse_digits(const char *src, const char *end, uint64_t &mantissa, int &num_digits, int &exponent, int exponent_step) {
+      while (num_digits <= 11 && end - src >= 8 && is_eight_digits(src)) {
+        mantissa = mantissa * 100000000 + parse_eight_digits(src);
+        num_digits += mantissa ? 8 : 0;
+        exponent -= exponent_step * 8;
+        src += 8;
+      }
+      while (*src >= '0' && *src <= '9') {
+        if (num_digits < 19) {
+          mantissa = mantissa * 10 + (*src - '0');
+          num_digits += mantissa != 0;
+          exponent -= exponent_step;
+        } else {
+          exponent += 1 - exponent_step;
+        }
+        src++;
+      }
+      return src;
+    }
+
+    // parse a float from text ending at or before end, returns NULL if there isn't one.
+    // Most numbers are exact in double precision, others use strtod.
+    static const char *parse_float(const char *src, const char *end, float &result) {
+      static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+      };
+      const char *start = src;
+      bool negative = *src == '-';
+      if (*src == '-' || *src == '+') src++;
+
+      uint64_t mantissa = 0;
+      int num_digits = 0, exponent = 0;
+      const char *digits = src;
+      src = parse_digits(src, end, mantissa, num_digits, exponent, 0);
+      if (*src == '.') {
+        src = parse_digits(src + 1, end, mantissa, num_digits, exponent, 1);
+      }
+      bool ok = src != digits && !( src == digits + 1 && *digits == '.' );
+      if (ok && ( *src == 'e' || *src == 'E' )) {
+        src++;
+        int esign = 1, exp = 0;
+        if (*src == '-') { esign = -1; src++; }
+        else if (*src == '+') src++;
+        while (*src >= '0' && *src <= '9' && exp < 10000) { exp = exp * 10 + (*src++ - '0'); }
+        exponent += exp * esign;
+      }
+
+      if (ok && mantissa < ((uint64_t)1 << 53) && exponent >= -22 && exponent <= 22) {
+        double value = exponent < 0 ? (double)mantissa / powers[-exponent] : (double)mantissa * powers[exponent];
+        result = (float)( negative ? -value : value );
+        return src;
+      }
+
+      // rare: very long or large numbers, nan and inf.
+      char *value_end = 0;
+      double value = strtod(start, &value_end);
+      if (value_end == start) return NULL;
+      result = (float)value;
+      return value_end;
+    }
+
+    // parse an integer from text ending at or before end, returns NULL if there isn't one.
+    static const char *parse_int(const char *src, const char *end, int &result) {
+      bool negative = *src == '-';
+      if (*src == '-' || *src == '+') src++;
+      if (!( *src >= '0' && *src <= '9' )) return NULL;
+      uint32_t value = 0;
+      if (end - src >= 8 && is_eight_digits(src)) {
+        value = parse_eight_digits(src);
+        src += 8;
+      }
+      while (*src >= '0' && *src <= '9') value = value * 10 + (*src++ - '0');
+      result = negative ? -(int)value : (int)value;
+      return src;
+    }
+
+    static const char *skip_space(const char *src) {
+      while (*src > 0 && *src <= ' ') ++src;
+      return src;
+    }
+
+    // numbers from a block of text that load_xml has already parsed.
+    // load_xml replaces the text with "@<block number>".
+    struct number_block {
+      const char *begin;
+      const char *end;
+      unsigned first;
+      unsigned count;
+      bool is_float;
+    };
+
+    dynarray<number_block> blocks;
+    dynarray<float> block_floats;
+    dynarray<int> block_ints;
+
+    const number_block *get_block(const char *src) {
+      if (!src || src[0] != '@') return NULL;
+      unsigned index = (unsigned)atoi(src + 1);
+      return index < blocks.size() ? &blocks[index] : NULL;
+    }
+
     // convert a string like "1.2 3.4 43.12" into an array of float values
     void atofv(dynarray<float> &values, const char *src) {  
       values.resize(0);
       if (!src) return;
 
-      while (*src > 0 && *src <= ' ') ++src;
-      while(*src != 0) {
-        double whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        if( !(*src >= '0' && *src <= '9') && *src != '.' ) break;
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        if (*src == '.') {
-          src++;
-          double frac = 0, v = 1;
-          while (*src >= '0' && *src <= '9') { frac = frac * 10 + (*src++ - '0'); v *= 10; }
-          whole += frac / v;
-        }
-        if (*src == 'e' || *src == 'E') {
-          int esign = 1;
-          src++;
-          if (*src == '-') { esign = -1; src++; }
-          else if (*src == '+') src++;
-          int exp = 0;
-          while (*src >= '0' && *src <= '9') { exp = exp * 10 + (*src++ - '0'); }
-          whole = whole * pow(10.0, exp * esign);
+      if (const number_block *block = get_block(src)) {
+        values.resize(block->count);
+        for (unsigned i = 0; i != block->count; ++i) {
+          values[i] = block->is_float ? block_floats[block->first + i] : (float)block_ints[block->first + i];
         }
-        values.push_back((float)(whole * msign));
-        while (*src > 0 && *src <= ' ') ++src;
+        return;
+      }
+
+      const char *end = src + strlen(src);
+      src = skip_space(src);
+      while(*src != 0) {
+        float value;
+        src = parse_float(src, end, value);
+        if (!src) break;
+        values.push_back(value);
+        src = skip_space(src);
       }
     }
 
@@ -136,14 +257,112 @@ namespace octet { namespace loaders {
       //values.resize(0);
       if (!src) return;
 
-      while (*src > 0 && *src <= ' ') ++src;
+      if (const number_block *block = get_block(src)) {
+        unsigned size = values.size();
+        values.resize(size + block->count);
+        for (unsigned i = 0; i != block->count; ++i) {
+          values[size + i] = block->is_float ? (int)block_floats[block->first + i] : block_ints[block->first + i];
+        }
+        return;
+      }
+
+      const char *end = src + strlen(src);
+      src = skip_space(src);
       while(*src != 0) {
-        int whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        values.push_back(whole * msign);
-        while (*src > 0 && *src <= ' ') ++src;
+        int value;
+        src = parse_int(src, end, value);
+        if (!src) break;
+        values.push_back(value);
+        src = skip_space(src);
+      }
+    }
+
+    // count the numbers in some text
+    static unsigned count_numbers(const char *src, const char *end) {
+      unsigned count = 0;
+      bool in_space = true;
+      for (; src != end; ++src) {
+        bool space = *src > 0 && *src <= ' ';
+        count += in_space & !space;
+        in_space = space;
+      }
+      return count;
+    }
+
+    // Pull the numeric arrays out of a COLLADA file before tinyxml sees it.
+    // A quick scan of the tags finds the blocks and the blocks are parsed in parallel.
+    // This saves tinyxml from copying the text, which is most of a big file.
+    void parse_number_blocks(char *text, size_t size) {
+      blocks.resize(0);
+      char *end = text + size;
+      for (char *src = (char*)memchr(text, '<', size); src; src = (char*)memchr(src, '<', end - src)) {
+        char *name = ++src;
+        while (src != end && *src > ' ' && *src != '>' && *src != '/') src++;
+        size_t len = src - name;
+        bool is_float = len == 11 && !memcmp(name, "float_array", 11);
+        bool is_int =
+          ( len == 1 && ( *name == 'p' || *name == 'v' ) ) ||
+          ( len == 6 && !memcmp(name, "vcount", 6) ) ||
+          ( len == 9 && !memcmp(name, "int_array", 9) )
+        ;
+        if (!is_float && !is_int) continue;
+
+        char *close = (char*)memchr(src, '>', end - src);
+        if (!close || close[-1] == '/') continue;
+        char *content = close + 1;
+        char *content_end = (char*)memchr(content, '<', end - content);
+        if (!content_end) break;
+        // leave short blocks for tinyxml.
+        if (content_end - content >= 12) {
+          number_block block = { content, content_end, 0, 0, is_float };
+          blocks.push_back(block);
+        }
+        src = content_end;
+      }
+
+      thread_pool &pool = thread_pool::get();
+      pool.parallel_for(blocks.size(), [&](unsigned i) {
+        blocks[i].count = count_numbers(blocks[i].begin, blocks[i].end);
+      });
+
+      unsigned num_floats = 0, num_ints = 0;
+      for (unsigned i = 0; i != blocks.size(); ++i) {
+        number_block &block = blocks[i];
+        unsigned &total = block.is_float ? num_floats : num_ints;
+        block.first = total;
+        total += block.count;
       }
+      block_floats.resize(num_floats);
+      block_ints.resize(num_ints);
+
+      pool.parallel_for(blocks.size(), [&](unsigned i) {
+        number_block &block = blocks[i];
+        const char *src = skip_space(block.begin);
+        unsigned count = 0;
+        if (block.is_float) {
+          float *dest = block_floats.data() + block.first;
+          while (src < block.end && count != block.count) {
+            const char *next = parse_float(src, block.end, dest[count]);
+            if (!next) break;
+            count++;
+            src = skip_space(next);
+          }
+        } else {
+          int *dest = block_ints.data() + block.first;
+          while (src < block.end && count != block.count) {
+            const char *next = parse_int(src, block.end, dest[count]);
+            if (!next) break;
+            count++;
+            src = skip_space(next);
+          }
+        }
+        block.count = count;
+
+        // replace the text with a reference to the block.
+        char *dest = (char*)block.begin;
+        int len = sprintf(dest, "@%u", i);
+        memset(dest + len, ' ', block.end - block.begin - len);
+      });
     }
 
     // convert an ascii sequence of integers like "fred bert harry" into an array of strings
@@ -1209,10 +1428,154 @@ namespace octet { namespace loaders {
 
     }
 
+    // the header of a file in the cache, followed by a snapshot of the resources.
+    // The COLLADA file is the same if it has the same time and size or, failing that, the same hash.
+    // The size is a multiple of 16 to keep the arrays of the snapshot aligned.
+    struct cache_header {
+      char magic[4];
+      uint32_t version;
+      uint64_t mtime;
+      uint64_t size;
+      uint64_t hash;
+    };
+
+    enum {
+      // change this when the conversion changes to invalidate the cache.
+      cache_version = 2,
+    };
+
+    // a 64 bit hash of a file. 64k chunks are hashed in parallel and then combined.
+    static uint64_t get_file_hash(const uint8_t *src, size_t size) {
+      enum { chunk_size = 0x10000 };
+      unsigned num_chunks = (unsigned)( ( size + chunk_size - 1 ) / chunk_size );
+      dynarray<uint64_t> chunk_hashes(num_chunks);
+      uint64_t *hashes = chunk_hashes.data();
+      thread_pool::get().parallel_for(num_chunks, [=](unsigned c) {
+        const uint8_t *p = src + (size_t)c * chunk_size;
+        size_t bytes = min((size_t)chunk_size, size - (size_t)c * chunk_size);
+        uint64_t hash = 0xcbf29ce484222325ull;
+        size_t i = 0;
+        for (; i + 8 <= bytes; i += 8) {
+          uint64_t word;
+          memcpy(&word, p + i, 8);
+          hash = ( hash ^ word ) * 0x100000001b3ull;
+          hash ^= hash >> 29;
+        }
+        for (; i != bytes; ++i) {
+          hash = ( hash ^ p[i] ) * 0x100000001b3ull;
+        }
+        hashes[c] = hash;
+      });
+
+      uint64_t hash = 0xcbf29ce484222325ull ^ size;
+      for (unsigned c = 0; c != num_chunks; ++c) {
+        hash = ( hash ^ hashes[c] ) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+      }
+      return hash;
+    }
+
+    // read the resources of an unchanged COLLADA file from the cache.
+    bool read_cache(const char *path, resource_dict &dict) {
+      string cache_path;
+      if (!get_cache_path(cache_path, path)) return false;
+
+      FILE *file = fopen(cache_path, "rb");
+      if (!file) return false;
+
+      cache_header header;
+      bool ok = fread(&header, 1, sizeof(header), file) == sizeof(header) && !memcmp(header.magic, "OCTC", 4) && header.version == cache_version;
+      if (ok && header.mtime != mapped_file::get_mtime(path)) {
+        // touched, but maybe not changed.
+        mapped_file src(path);
+        ok = src.size() == header.size && get_file_hash(src.data(), src.size()) == header.hash;
+      }
+
+      fclose(file);
+
+      if (ok) {
+        ref<resource_dict> cached;
+        cached = new resource_dict();
+        snapshot_reader reader(cache_path, sizeof(cache_header));
+        cached->visit(reader);
+        ok = !reader.get_error();
+        if (ok) {
+          dict.add_resources(*cached);
+        }
+      }
+      return ok;
+    }
+
+    // write the resources to the cache.
+    void write_cache(const char *path, resource_dict &dict) {
+      string cache_path;
+      if (!get_cache_path(cache_path, path)) return;
+
+      mapped_file src(path);
+      cache_header header;
+      memcpy(header.magic, "OCTC", 4);
+      header.version = cache_version;
+      header.mtime = mapped_file::get_mtime(path);
+      header.size = src.size();
+      header.hash = get_file_hash(src.data(), src.size());
+      src.close();
+
+      FILE *file = fopen(cache_path, "wb");
+      if (!file) return;
+      fwrite(&header, 1, sizeof(header), file);
+      snapshot_writer writer;
+      dict.visit(writer);
+      writer.save(file);
+      fclose(file);
+    }
+
   public:
     collada_builder() {
     }
 
+    /// Directory for converted COLLADA files. NULL (the default) turns the cache off.
+    /// Passing an empty string turns it off again.
+    static const char *cache_dir(const char *new_dir=NULL) {
+      static const char *value = NULL;
+      if (new_dir) {
+        value = *new_dir ? new_dir : NULL;
+      }
+      return value;
+    }
+
+    /// Name of the cache file for a path, false if the cache is off.
+    static bool get_cache_path(string &result, const char *path) {
+      const char *dir = cache_dir();
+      if (!dir) return false;
+      uint64_t hash = 0xcbf29ce484222325ull;
+      for (const char *p = path; *p; ++p) {
+        hash = ( hash ^ (uint8_t)*p ) * 0x100000001b3ull;
+      }
+      result.format("%s/%016llx.dae.snap", dir, (unsigned long long)hash);
+      return true;
+    }
+
+    /// Load all the resources of a collada file.
+    /// If the file has been loaded before, and has not changed, the resources come from the cache without reading any XML.
+    bool load_resources(const char *url, resource_dict &dict) {
+      // get_path uses a static buffer.
+      string path(app_utils::get_path(url));
+      if (read_cache(path, dict)) {
+        return true;
+      }
+
+      if (!load_xml(url)) {
+        return false;
+      }
+
+      ref<resource_dict> converted;
+      converted = new resource_dict();
+      get_resources(*converted);
+      write_cache(path, *converted);
+      dict.add_resources(*converted);
+      return true;
+    }
+
     // public function to load a collada file
     bool load_xml(const char *url) {
       doc_path = url;
@@ -1220,7 +1583,23 @@ namespace octet { namespace loaders {
       const char *path = app_utils::get_path(url);
       char buf[256];
       getcwd(buf, sizeof(buf));
-      doc.LoadFile(path);
+
+      mapped_file file(path);
+      if (!file.is_open()) {
+        printf("file %s not found\n", path);
+        return false;
+      }
+
+      // tinyxml needs a terminator.
+      // the mapping is read only and the in situ parse writes terminators, so copy it.
+      doc.Clear();
+      doc_text.resize((unsigned)file.size() + 1);
+      memcpy(doc_text.data(), file.data(), file.size());
+      doc_text[(unsigned)file.size()] = 0;
+      file.close();
+
+      parse_number_blocks(doc_text.data(), doc_text.size() - 1);
+      doc.ParseInSitu(doc_text.data());
 
       TiXmlElement *top = doc.RootElement();
       if (!top) {
@@ -8,8 +8,16 @@
 // jpeg file decoder - tiny and fast
 //
 // See http://en.wikipedia.org/wiki/JPEG
-// 
+//
 namespace octet { namespace loaders {
+  /// Baseline JPEG decoder for YCbCr images.
+  ///
+  /// The IDCT and colour conversion are fixed point, with SSE2 versions when OCTET_SSE
+  /// is set. Blocks that only have a DC term skip the IDCT altogether.
+  /// If the file has restart markers, the restart intervals are decoded in parallel
+  /// on the thread pool.
+  ///
+  /// The original floating point path is kept as a reference for benchmark().
   class jpeg_decoder {
     enum { debug = 0 };
 
@@ -32,22 +40,65 @@ namespace octet { namespace loaders {
     unsigned num_mcu_blocks;
     unsigned num_components_in_scan;
 
-    // skip a number of bits in the file.
+    // MCUs between restart markers (zero for none)
+    unsigned restart_interval;
+
+    // size of the image in MCUs
+    unsigned mcus_x;
+    unsigned mcus_y;
+
+    // use the floating point IDCT and colour conversion
+    bool use_reference;
+
+    // reads bits from the entropy coded data.
     // there is a special case where every 0xff byte is followed by 0x00
-    static void skip_bits(unsigned bits, unsigned &acc, const uint8_t *&src, int &shift) {
-      shift -= bits;
-      while (shift < 0) {
-        // grab more bytes
-        uint8_t byte = *src++;
-        acc = acc * 256 + byte;
-        if (byte == 0xff) {
-          // in JPEG, an 0xff byte is followed by a zero
-          // do not advance past any other 0xff marker
-          src += src[0] == 0x00 ? 1 : -1;
+    struct bit_reader {
+      unsigned acc;
+      int shift;
+      const uint8_t *src;
+      const uint8_t *src_max;
+
+      void init(const uint8_t *src_, const uint8_t *src_max_) {
+        acc = 0;
+        shift = 0;
+        src = src_;
+        src_max = src_max_;
+        skip(16);
+      }
+
+      // the next 16 bits of the stream
+      unsigned peek16() const {
+        return ( acc >> shift ) & 0xffff;
+      }
+
+      // skip a number of bits in the file.
+      void skip(unsigned bits) {
+        shift -= bits;
+        while (shift < 0) {
+          // grab more bytes. At the end of the data we read ones.
+          uint8_t byte = 0xff;
+          if (src < src_max) {
+            byte = *src++;
+            if (byte == 0xff) {
+              // in JPEG, an 0xff byte is followed by a zero
+              // do not advance past any other 0xff marker
+              src += src < src_max && src[0] == 0x00 ? 1 : -1;
+            }
+          }
+          acc = acc * 256 + byte;
+          shift += 8;
         }
-        shift += 8;
       }
-    }
+
+      // read a value of "bits" bits.
+      // negative numbers need to be twiddled as all numbers coming in are positive.
+      int extend(unsigned bits) {
+        if (bits == 0) return 0;
+        unsigned v = peek16() >> (16 - bits);
+        skip(bits);
+        return v < ( 1u << ( bits-1 ) ) ? (int)v - ( 1 << bits ) + 1 : (int)v;
+      }
+    };
 
     // this is a component usually Y (brightness), Cb (blueness) and Cr (redness)
     // from the file.
@@ -69,13 +120,12 @@ namespace octet { namespace loaders {
       uint8_t dc_table;
       unsigned width_in_blocks;
       unsigned height_in_blocks;
-      int last_dc;
     } scan_components[4];
 
     // quantisation table. We multiply the dc and ac coefficients by these numbers.
     // this is the lossy part of the compression
     struct quant_table {
-      float table[64];
+      uint16_t table[64];
     } quant_tables[4];
 
     // A huffman table maps variable length codes to lengths and values.
@@ -92,16 +142,22 @@ namespace octet { namespace loaders {
       // we grab the next 16 bits and look in the maxcodes table to see how many
       // bits the code has. After that, we strip the right hand bits and
       // look up the code in a table.
-      unsigned decode(unsigned &acc, const uint8_t *&src, int &shift) {
+      unsigned decode(bit_reader &bits) const {
         unsigned i = min_len;
-        unsigned short acc16 = acc >> shift;
+        unsigned acc16 = bits.peek16();
 
         // find the shortest code that this could be
         for (; acc16 > maxcodes[i]; ++i) {
         }
 
-        unsigned code = ( acc16 >> (15-i) ) - offset[i];
-        skip_bits(i + 1, acc, src, shift);
+        // no code is longer than 16 bits
+        if (i >= 16) {
+          bits.skip(16);
+          return 0;
+        }
+
+        unsigned code = ( ( acc16 >> (15-i) ) - offset[i] ) & 0xff;
+        bits.skip(i + 1);
         return huffval[code];
       }
     } huffman_tables[2][4];
@@ -113,19 +169,16 @@ namespace octet { namespace loaders {
       huffman_table *dc_table;
       huffman_table *ac_table;
       quant_table *quant;
-      scan_component *scan_comp;
+      unsigned scan_comp;
     } mcu_blocks[8];
 
-    float dct_coeffs[8*64];
-    float ycrcb_values[8*64];
-
     unsigned u2(const uint8_t *src) {
       return src[0] * 256 + src[1];
     }
 
     // dct coefficients are stored in zig-zag order because the top
     // left is far more common.
-    uint8_t zig_zag(unsigned i) {
+    static uint8_t zig_zag(unsigned i) {
       static const uint8_t zig_zag_[64] = {
         0, 1, 8, 16, 9, 2, 3, 10,
         17, 24, 32, 25, 18, 11, 4, 5,
@@ -139,40 +192,35 @@ namespace octet { namespace loaders {
       return i < 63 ? zig_zag_[i] : 63;
     }
 
-    // negative numbers need to be twiddled as all numbers coming in are positive.
-    static int extend(unsigned bits, unsigned &acc, const uint8_t *&src, int &shift) {
-      uint16_t acc16 = acc >> shift;
-      unsigned v = acc16 >> (16 - bits);
-      return v < ( 1u << ( bits-1 ) ) ? (int)v + ( -1 << bits ) + 1 : (int)v;
+    // multiply by the quantisation value, saturating to 16 bits for broken files.
+    static int16_t dequantise(int value, unsigned quant) {
+      int result = value * (int)quant;
+      return (int16_t)( result < -32768 ? -32768 : result > 32767 ? 32767 : result );
     }
 
     // decode one block of an MCU which may contain many blocks
     // The Y component may have four blocks, for example, and only one each of Cr, Cb
-    void decode_mcu_block(unsigned block_num, unsigned &acc, const uint8_t *&src, int &shift, float *outptr) {
-      mcu_block &block = mcu_blocks[block_num];
-
-      unsigned value = block.dc_table->decode(acc, src, shift);
-
-      int dc = 0;
-      if (value) {
-        dc = extend(value, acc, src, shift);
-        skip_bits(value, acc, src, shift);
-        //if (debug) printf("dc=%d\n", dc);
-      }
-      int abs_dc = block.scan_comp->last_dc += dc;
-      outptr[0] = abs_dc * block.quant->table[0];
-
-      for (int ac_coef = 1; ac_coef < 64; ++ac_coef) {
-        unsigned value = block.ac_table->decode(acc, src, shift);
+    // Coefficients are written in natural order. Returns false if there was only a DC term.
+    bool decode_mcu_block(const mcu_block &block, bit_reader &bits, int *last_dc, int16_t *outptr) const {
+      unsigned value = block.dc_table->decode(bits) & 0x0f;
+      int dc = bits.extend(value);
+      //if (debug) printf("dc=%d\n", dc);
+      int abs_dc = last_dc[block.scan_comp] += dc;
+      outptr[0] = dequantise(abs_dc, block.quant->table[0]);
+
+      bool has_ac = false;
+      for (unsigned ac_coef = 1; ac_coef < 64; ++ac_coef) {
+        unsigned value = block.ac_table->decode(bits);
         unsigned skip = value >> 4;
         value &= 0x0f;
         ac_coef += skip;
+        if (ac_coef > 63) break;
 
         if (value) {
-          int ac = extend(value, acc, src, shift);
-          skip_bits(value, acc, src, shift);
+          int ac = bits.extend(value);
           //if (debug) printf("ac=%d,%d coef=%d zig_zag=%d\n", skip, ac, ac_coef, zig_zag(ac_coef));
-          outptr[zig_zag(ac_coef)] = (float)ac * block.quant->table[ac_coef];
+          outptr[zig_zag(ac_coef)] = dequantise(ac, block.quant->table[ac_coef]);
+          has_ac = true;
         } else if (skip != 15) {
           break;
         }
@@ -180,36 +228,343 @@ namespace octet { namespace loaders {
       if (debug) {
         for (int j = 0; j != 8; ++j) {
           for (int i = 0; i != 8; ++i) {
-            printf("%3.0f ", outptr[i+j*8]);
+            printf("%4d ", outptr[i+j*8]);
           }
           printf("\n");
         }
       }
+      return has_ac;
+    }
+
+    // fixed point constant with 12 bits of fraction.
+    static int fix(float x) {
+      return (int)( x * 4096 + 0.5f );
+    }
+
+    // clamp to 0..255
+    static uint8_t clamp_byte(int v) {
+      return (uint8_t)( (unsigned)v > 255 ? ( v < 0 ? 0 : 255 ) : v );
+    }
+
+    // one dimensional inverse DCT in fixed point, the same factorisation as idct_reference.
+    // c0 is the DC term and c1..c7 increase in frequency
+    // The results are scaled by 4096 and need a bias and shift.
+    static OCTET_HOT void idct(int c0, int c1, int c2, int c3, int c4, int c5, int c6, int c7, int *out) {
+      int c2c6_1 = (c2 + c6) * fix(0.541196100f);
+      int c2c6_2 = c2c6_1 + c6 * fix(-1.847759065f);
+      int c2c6_3 = c2c6_1 + c2 * fix(0.765366865f);
+
+      int c0c4_1 = (c0 + c4) * 4096;
+      int c0c4_2 = (c0 - c4) * 4096;
+
+      int ceven_1 = c0c4_1 + c2c6_3;
+      int ceven_2 = c0c4_1 - c2c6_3;
+      int ceven_3 = c0c4_2 + c2c6_2;
+      int ceven_4 = c0c4_2 - c2c6_2;
+
+      int c1c7 = c7 + c1;
+      int c3c5 = c5 + c3;
+      int c7c3 = c7 + c3;
+      int c5c1 = c5 + c1;
+      int codd_0 = (c7c3 + c5c1) * fix(1.175875602f);
+
+      int codd_4 = c7 * fix(0.298631336f);
+      int codd_3 = c5 * fix(2.053119869f);
+      int codd_2 = c3 * fix(3.072711026f);
+      int codd_1 = c1 * fix(1.501321110f);
+      c1c7 = c1c7 * fix(-0.899976223f);
+      c3c5 = c3c5 * fix(-2.562915447f);
+      c7c3 = c7c3 * fix(-1.961570560f);
+      c5c1 = c5c1 * fix(-0.390180644f);
+
+      c7c3 += codd_0;
+      c5c1 += codd_0;
+
+      codd_4 += c1c7 + c7c3;
+      codd_3 += c3c5 + c5c1;
+      codd_2 += c3c5 + c7c3;
+      codd_1 += c1c7 + c5c1;
+
+      out[0] = ceven_1 + codd_1;
+      out[7] = ceven_1 - codd_1;
+      out[1] = ceven_3 + codd_2;
+      out[6] = ceven_3 - codd_2;
+      out[2] = ceven_4 + codd_3;
+      out[5] = ceven_4 - codd_3;
+      out[3] = ceven_2 + codd_4;
+      out[4] = ceven_2 - codd_4;
+    }
+
+  #if OCTET_SSE
+    // pairs of 32 bit vectors for the SSE2 IDCT
+    struct wide {
+      __m128i l, h;
+    };
+
+    static wide wadd(const wide &a, const wide &b) {
+      wide r = { _mm_add_epi32(a.l, b.l), _mm_add_epi32(a.h, b.h) };
+      return r;
+    }
+
+    static wide wsub(const wide &a, const wide &b) {
+      wide r = { _mm_sub_epi32(a.l, b.l), _mm_sub_epi32(a.h, b.h) };
+      return r;
+    }
+
+    // 16 bit values to 32 bit values scaled by 4096
+    static wide widen(__m128i x) {
+      wide r = {
+        _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), x), 4),
+        _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), x), 4)
+      };
+      return r;
+    }
+
+    // out0 = x * k0.x + y * k0.y, out1 = x * k1.x + y * k1.y with 16 bit inputs and 32 bit outputs.
+    static void rotate(wide &out0, wide &out1, __m128i x, __m128i y, __m128i k0, __m128i k1) {
+      __m128i lo = _mm_unpacklo_epi16(x, y);
+      __m128i hi = _mm_unpackhi_epi16(x, y);
+      out0.l = _mm_madd_epi16(lo, k0);
+      out0.h = _mm_madd_epi16(hi, k0);
+      out1.l = _mm_madd_epi16(lo, k1);
+      out1.h = _mm_madd_epi16(hi, k1);
+    }
+
+    // out0 = (a + b + bias) >> shift, out1 = (a - b + bias) >> shift packed to 16 bits
+    static void butterfly(__m128i &out0, __m128i &out1, const wide &a, const wide &b, __m128i bias, __m128i shift) {
+      wide ab = { _mm_add_epi32(a.l, bias), _mm_add_epi32(a.h, bias) };
+      wide sum = wadd(ab, b);
+      wide dif = wsub(ab, b);
+      out0 = _mm_packs_epi32(_mm_sra_epi32(sum.l, shift), _mm_sra_epi32(sum.h, shift));
+      out1 = _mm_packs_epi32(_mm_sra_epi32(dif.l, shift), _mm_sra_epi32(dif.h, shift));
+    }
+
+    static __m128i pair(int x, int y) {
+      return _mm_setr_epi16((short)x, (short)y, (short)x, (short)y, (short)x, (short)y, (short)x, (short)y);
+    }
+
+    // idct() on eight columns at once. row[i] holds coefficient i of each column.
+    static OCTET_HOT void idct_pass(__m128i *row, __m128i bias, __m128i shift) {
+      // even part
+      wide t2e, t3e;
+      rotate(t2e, t3e, row[2], row[6],
+        pair(fix(0.541196100f), fix(0.541196100f) + fix(-1.847759065f)),
+        pair(fix(0.541196100f) + fix(0.765366865f), fix(0.541196100f))
+      );
+      wide t0e = widen(_mm_add_epi16(row[0], row[4]));
+      wide t1e = widen(_mm_sub_epi16(row[0], row[4]));
+      wide x0 = wadd(t0e, t3e);
+      wide x3 = wsub(t0e, t3e);
+      wide x1 = wadd(t1e, t2e);
+      wide x2 = wsub(t1e, t2e);
+
+      // odd part
+      wide y0o, y1o, y2o, y3o, y4o, y5o;
+      rotate(y0o, y2o, row[7], row[3],
+        pair(fix(-1.961570560f) + fix(0.298631336f), fix(-1.961570560f)),
+        pair(fix(-1.961570560f), fix(-1.961570560f) + fix(3.072711026f))
+      );
+      rotate(y1o, y3o, row[5], row[1],
+        pair(fix(-0.390180644f) + fix(2.053119869f), fix(-0.390180644f)),
+        pair(fix(-0.390180644f), fix(-0.390180644f) + fix(1.501321110f))
+      );
+      rotate(y4o, y5o, _mm_add_epi16(row[1], row[7]), _mm_add_epi16(row[3], row[5]),
+        pair(fix(1.175875602f) + fix(-0.899976223f), fix(1.175875602f)),
+        pair(fix(1.175875602f), fix(1.175875602f) + fix(-2.562915447f))
+      );
+      wide x4 = wadd(y0o, y4o);
+      wide x5 = wadd(y1o, y5o);
+      wide x6 = wadd(y2o, y5o);
+      wide x7 = wadd(y3o, y4o);
+
+      butterfly(row[0], row[7], x0, x7, bias, shift);
+      butterfly(row[1], row[6], x1, x6, bias, shift);
+      butterfly(row[2], row[5], x2, x5, bias, shift);
+      butterfly(row[3], row[4], x3, x4, bias, shift);
+    }
+
+    static void interleave16(__m128i &a, __m128i &b) {
+      __m128i tmp = a;
+      a = _mm_unpacklo_epi16(a, b);
+      b = _mm_unpackhi_epi16(tmp, b);
+    }
+
+    static void interleave8(__m128i &a, __m128i &b) {
+      __m128i tmp = a;
+      a = _mm_unpacklo_epi8(a, b);
+      b = _mm_unpackhi_epi8(tmp, b);
+    }
+
+    // Two dimensional inverse DCT of 16 bit coefficients to 8 bit pixels, columns then rows.
+    static void inverse_dct(const int16_t *inptr, uint8_t *outptr) {
+      __m128i row[8];
+      for (unsigned i = 0; i != 8; ++i) {
+        row[i] = _mm_loadu_si128((const __m128i*)(inptr + i * 8));
+      }
+
+      // columns
+      idct_pass(row, _mm_set1_epi32(512), _mm_cvtsi32_si128(10));
+
+      // 16 bit 8x8 transpose
+      interleave16(row[0], row[4]);
+      interleave16(row[1], row[5]);
+      interleave16(row[2], row[6]);
+      interleave16(row[3], row[7]);
+      interleave16(row[0], row[2]);
+      interleave16(row[1], row[3]);
+      interleave16(row[4], row[6]);
+      interleave16(row[5], row[7]);
+      interleave16(row[0], row[1]);
+      interleave16(row[2], row[3]);
+      interleave16(row[4], row[5]);
+      interleave16(row[6], row[7]);
+
+      // rows, with rounding and the +128 level shift
+      idct_pass(row, _mm_set1_epi32(65536 + (128 << 17)), _mm_cvtsi32_si128(17));
+
+      // pack to bytes and transpose back
+      __m128i p0 = _mm_packus_epi16(row[0], row[1]);
+      __m128i p1 = _mm_packus_epi16(row[2], row[3]);
+      __m128i p2 = _mm_packus_epi16(row[4], row[5]);
+      __m128i p3 = _mm_packus_epi16(row[6], row[7]);
+      interleave8(p0, p2);
+      interleave8(p1, p3);
+      interleave8(p0, p1);
+      interleave8(p2, p3);
+      interleave8(p0, p2);
+      interleave8(p1, p3);
+
+      _mm_storel_epi64((__m128i*)(outptr + 0), p0);
+      _mm_storel_epi64((__m128i*)(outptr + 8), _mm_shuffle_epi32(p0, 0x4e));
+      _mm_storel_epi64((__m128i*)(outptr + 16), p2);
+      _mm_storel_epi64((__m128i*)(outptr + 24), _mm_shuffle_epi32(p2, 0x4e));
+      _mm_storel_epi64((__m128i*)(outptr + 32), p1);
+      _mm_storel_epi64((__m128i*)(outptr + 40), _mm_shuffle_epi32(p1, 0x4e));
+      _mm_storel_epi64((__m128i*)(outptr + 48), p3);
+      _mm_storel_epi64((__m128i*)(outptr + 56), _mm_shuffle_epi32(p3, 0x4e));
+    }
+  #else
+    // Two dimensional inverse DCT of 16 bit coefficients to 8 bit pixels.
+    // we can do the columns and rows separately.
+    // Columns with only a DC term are very common and are done with a multiply.
+    static void inverse_dct(const int16_t *inptr, uint8_t *outptr) {
+      int tmp[64];
+      int v[8];
+
+      // do columns
+      for (unsigned i = 0; i != 8; ++i) {
+        const int16_t *c = inptr + i;
+        int *t = tmp + i;
+        if (!(c[8] | c[16] | c[24] | c[32] | c[40] | c[48] | c[56])) {
+          int dc = c[0] * 4;
+          t[0] = t[8] = t[16] = t[24] = t[32] = t[40] = t[48] = t[56] = dc;
+        } else {
+          idct(c[0], c[8], c[16], c[24], c[32], c[40], c[48], c[56], v);
+          for (unsigned j = 0; j != 8; ++j) {
+            t[j*8] = ( v[j] + 512 ) >> 10;
+          }
+        }
+      }
+
+      // do rows, with rounding and the +128 level shift
+      for (unsigned j = 0; j != 8; ++j) {
+        const int *t = tmp + j * 8;
+        idct(t[0], t[1], t[2], t[3], t[4], t[5], t[6], t[7], v);
+        for (unsigned i = 0; i != 8; ++i) {
+          outptr[j*8+i] = clamp_byte(( v[i] + 65536 + (128 << 17) ) >> 17);
+        }
+      }
+    }
+  #endif
+
+    // convert from YCrCb to RGB
+    // See http://en.wikipedia.org/wiki/YCbCr
+    // inptr has 8x8 Y, Cb and Cr blocks. Only the top left w x h pixels are written.
+    static void color_convert_444(uint8_t *outptr, int stride, const uint8_t *inptr, unsigned w, unsigned h) {
+      unsigned j = 0;
+    #if OCTET_SSE
+      if (w == 8) {
+        // 16 bit fixed point, after stb_image.
+        __m128i signflip = _mm_set1_epi8(-0x80);
+        __m128i cr_const0 = _mm_set1_epi16((short)( 1.40200f*4096.0f+0.5f));
+        __m128i cr_const1 = _mm_set1_epi16(-(short)( 0.71414f*4096.0f+0.5f));
+        __m128i cb_const0 = _mm_set1_epi16(-(short)( 0.34414f*4096.0f+0.5f));
+        __m128i cb_const1 = _mm_set1_epi16((short)( 1.77200f*4096.0f+0.5f));
+        __m128i y_bias = _mm_set1_epi8((char)(unsigned char)128);
+        __m128i alpha = _mm_set1_epi16(255);
+        for (; j != h; ++j) {
+          const uint8_t *src = inptr + j * 8;
+          __m128i y_bytes = _mm_loadl_epi64((const __m128i*)src);
+          __m128i cb_bytes = _mm_loadl_epi64((const __m128i*)(src + 64));
+          __m128i cr_bytes = _mm_loadl_epi64((const __m128i*)(src + 128));
+
+          // y * 256 + 128, and (cb - 128) * 256, (cr - 128) * 256
+          __m128i yw = _mm_unpacklo_epi8(y_bias, y_bytes);
+          __m128i cbw = _mm_unpacklo_epi8(_mm_setzero_si128(), _mm_xor_si128(cb_bytes, signflip));
+          __m128i crw = _mm_unpacklo_epi8(_mm_setzero_si128(), _mm_xor_si128(cr_bytes, signflip));
+
+          // everything is scaled by 16 here
+          __m128i yws = _mm_srli_epi16(yw, 4);
+          __m128i rws = _mm_add_epi16(yws, _mm_mulhi_epi16(cr_const0, crw));
+          __m128i gws = _mm_add_epi16(_mm_add_epi16(yws, _mm_mulhi_epi16(cb_const0, cbw)), _mm_mulhi_epi16(crw, cr_const1));
+          __m128i bws = _mm_add_epi16(yws, _mm_mulhi_epi16(cbw, cb_const1));
+
+          __m128i rb = _mm_packus_epi16(_mm_srai_epi16(rws, 4), _mm_srai_epi16(bws, 4));
+          __m128i ga = _mm_packus_epi16(_mm_srai_epi16(gws, 4), alpha);
+
+          // interleave to RGBA
+          __m128i rg = _mm_unpacklo_epi8(rb, ga);
+          __m128i ba = _mm_unpackhi_epi8(rb, ga);
+          _mm_storeu_si128((__m128i*)outptr, _mm_unpacklo_epi16(rg, ba));
+          _mm_storeu_si128((__m128i*)(outptr + 16), _mm_unpackhi_epi16(rg, ba));
+          outptr += stride;
+        }
+      }
+    #endif
+      // 16 bits of fraction
+      const int cr_r = (int)( 1.40200f * 65536 + 0.5f );
+      const int cr_g = (int)( 0.71414f * 65536 + 0.5f );
+      const int cb_g = (int)( 0.34414f * 65536 + 0.5f );
+      const int cb_b = (int)( 1.77200f * 65536 + 0.5f );
+      for (; j != h; ++j) {
+        const uint8_t *src = inptr + j * 8;
+        uint8_t *dest = outptr;
+        for (unsigned i = 0; i != w; ++i) {
+          int y = ( src[i] << 16 ) + 32768;
+          int cb = src[i + 64] - 128;
+          int cr = src[i + 128] - 128;
+          dest[0] = clamp_byte(( y + cr * cr_r ) >> 16);
+          dest[1] = clamp_byte(( y - cb * cb_g - cr * cr_g ) >> 16);
+          dest[2] = clamp_byte(( y + cb * cb_b ) >> 16);
+          dest[3] = 0xff;
+          dest += 4;
+        }
+        outptr += stride;
+      }
     }
 
     // one dimensional inverse DCT.
     // c0 is the DC term and c1..c7 increase in frequency
     // example: c0 = 128, c1..c7 = 0 -> 128, 128, 128, 128, 128, 128, 128, 128
-    // todo: improve this!
-    OCTET_HOT void idct(float &c0, float &c1, float &c2, float &c3, float &c4, float &c5, float &c6, float &c7) {
+    OCTET_HOT static void idct_reference(float &c0, float &c1, float &c2, float &c3, float &c4, float &c5, float &c6, float &c7) {
       float c2c6_1 = (c2 + c6) * 0.541196100f;
       float c2c6_2 = c2c6_1 + c6 * -1.847759065f;
       float c2c6_3 = c2c6_1 + c2 * 0.765366865f;
-    
+
       float c0c4_1 = c0 + c4;
       float c0c4_2 = c0 - c4;
-    
+
       float ceven_1 = c0c4_1 + c2c6_3;
       float ceven_2 = c0c4_1 - c2c6_3;
       float ceven_3 = c0c4_2 + c2c6_2;
       float ceven_4 = c0c4_2 - c2c6_2;
-    
+
       float c1c7 = c7 + c1;
       float c3c5 = c5 + c3;
       float c7c3 = c7 + c3;
       float c5c1 = c5 + c1;
       float codd_0 = (c7c3 + c5c1) * 1.175875602f;
-    
+
       float codd_4 = c7 * 0.298631336f;
       float codd_3 = c5 * 2.053119869f;
       float codd_2 = c3 * 3.072711026f;
@@ -218,15 +573,15 @@ namespace octet { namespace loaders {
       c3c5 = c3c5 * -2.562915447f;
       c7c3 = c7c3 * -1.961570560f;
       c5c1 = c5c1 * -0.390180644f;
-    
+
       c7c3 += codd_0;
       c5c1 += codd_0;
-    
+
       codd_4 += c1c7 + c7c3;
       codd_3 += c3c5 + c5c1;
       codd_2 += c3c5 + c7c3;
       codd_1 += c1c7 + c5c1;
-    
+
       c0 = ceven_1 + codd_1;
       c7 = ceven_1 - codd_1;
       c1 = ceven_3 + codd_2;
@@ -239,32 +594,22 @@ namespace octet { namespace loaders {
 
     // Two dimensional inverse DCT
     // we can do the rows and columns separately.
-    // Optimisations include spotting blank rows and columns, but this
-    // is just a reference design.
-    void inverse_dct(float *inptr) {
+    // This is the reference design.
+    static void inverse_dct_reference(float *inptr) {
       // do rows
       for (unsigned i = 0; i != 8; ++i) {
-        idct(inptr[8*0+i], inptr[8*1+i], inptr[8*2+i], inptr[8*3+i], inptr[8*4+i], inptr[8*5+i], inptr[8*6+i], inptr[8*7+i]);
+        idct_reference(inptr[8*0+i], inptr[8*1+i], inptr[8*2+i], inptr[8*3+i], inptr[8*4+i], inptr[8*5+i], inptr[8*6+i], inptr[8*7+i]);
       }
 
       // do columns
       for (unsigned i = 0; i != 8; ++i) {
-        idct(inptr[8*i+0], inptr[8*i+1], inptr[8*i+2], inptr[8*i+3], inptr[8*i+4], inptr[8*i+5], inptr[8*i+6], inptr[8*i+7]);
-      }
-
-      if (debug) {
-        for (int j = 0; j != 8; ++j) {
-          for (int i = 0; i != 8; ++i) {
-            printf("%f ", inptr[i+j*8]);
-          }
-          printf("\n");
-        }
+        idct_reference(inptr[8*i+0], inptr[8*i+1], inptr[8*i+2], inptr[8*i+3], inptr[8*i+4], inptr[8*i+5], inptr[8*i+6], inptr[8*i+7]);
       }
     }
 
     // clamp to 0..255 range without using branches.
     // fabsf is usually implemented in hardware (with fast math options)
-    OCTET_HOT uint8_t clamp(float v) {
+    OCTET_HOT static uint8_t clamp(float v) {
       // v + fabsf(v) = 2v when v > 0
       // v + fabsf(v) = 0  when v < 0
       float clamp0 = v + fabsf(v);
@@ -274,30 +619,85 @@ namespace octet { namespace loaders {
       return (uint8_t)( ( clamp0 - fabsf( clamp0 - (255.999f * 2) ) ) * 0.25f + 128 );
     }
 
-    // convert from YCrCb to RGB
-    // See http://en.wikipedia.org/wiki/YCbCr
+    // convert from YCrCb to RGB, reference design.
     // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_444(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y = inptr[0];
-          float cb = inptr[64];
-          float cr = inptr[128];
-          inptr++;
-          outptr[0] = clamp(128 + y * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y * 0.125f + cb * (1.772f * 0.125f));
-          //static int times;
-          //if (++times < 100) printf("cr=%f y=%f cb=%f  r=%d g=%d b=%d\n", cr * 0.125 + 128, y * 0.125 + 128, cb * 0.125 + 128, outptr[0], outptr[1], outptr[2]);
-          outptr[3] = 0xff;
-          outptr += 4;
+    static void color_convert_reference(uint8_t *outptr, int stride, const float *inptr, unsigned w, unsigned h) {
+      for (unsigned j = 0; j != h; ++j) {
+        for (unsigned i = 0; i != w; ++i) {
+          float y = inptr[j*8+i];
+          float cb = inptr[j*8+i+64];
+          float cr = inptr[j*8+i+128];
+          outptr[i*4+0] = clamp(128 + y * 0.125f + cr * (1.402f * 0.125f));
+          outptr[i*4+1] = clamp(128 + y * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
+          outptr[i*4+2] = clamp(128 + y * 0.125f + cb * (1.772f * 0.125f));
+          outptr[i*4+3] = 0xff;
         }
-        outptr += stride - 32;
+        outptr += stride;
       }
     }
 
+    // decode MCUs [mcu_begin, mcu_end) from the entropy coded data between src and src_max.
+    // the DC predictors start at zero, as they do after a restart marker.
+    void decode_interval(unsigned mcu_begin, unsigned mcu_end, const uint8_t *src, const uint8_t *src_max, uint8_t *image) const {
+      bit_reader bits;
+      bits.init(src, src_max);
+      int last_dc[4] = { 0, 0, 0, 0 };
+      int stride = width * 4;
+
+      int16_t coeffs[3*64];
+      uint8_t pixels[3*64];
+      float ref_coeffs[3*64];
+
+      for (unsigned mcu = mcu_begin; mcu != mcu_end; ++mcu) {
+        memset(coeffs, 0, sizeof(coeffs));
+        for (unsigned b = 0; b != num_mcu_blocks; ++b) {
+          bool has_ac = decode_mcu_block(mcu_blocks[b], bits, last_dc, coeffs + b * 64);
+          if (use_reference) {
+            for (unsigned i = 0; i != 64; ++i) ref_coeffs[b*64+i] = coeffs[b*64+i];
+            inverse_dct_reference(ref_coeffs + b * 64);
+          } else if (!has_ac) {
+            // a flat block
+            memset(pixels + b * 64, clamp_byte(( ( coeffs[b*64] + 4 ) >> 3 ) + 128), 64);
+          } else {
+            inverse_dct(coeffs + b * 64, pixels + b * 64);
+          }
+        }
+
+        // the image is upside down, clip blocks at the right and bottom.
+        unsigned x = mcu % mcus_x * 8;
+        unsigned y = mcu / mcus_x * 8;
+        unsigned w = width - x < 8 ? width - x : 8;
+        unsigned h = height - y < 8 ? height - y : 8;
+        uint8_t *dest = image + ( height - 1 - y ) * stride + x * 4;
+        if (use_reference) {
+          color_convert_reference(dest, -stride, ref_coeffs, w, h);
+        } else {
+          color_convert_444(dest, -stride, pixels, w, h);
+        }
+      }
+    }
+
+    // find the end of the entropy coded data and any restart markers in it.
+    static const uint8_t *find_markers(const uint8_t *src, const uint8_t *src_max, dynarray<const uint8_t*> &restarts) {
+      while (src + 1 < src_max) {
+        const uint8_t *ff = (const uint8_t*)memchr(src, 0xff, src_max - 1 - src);
+        if (!ff) break;
+        uint8_t code = ff[1];
+        if (code >= 0xd0 && code <= 0xd7) {
+          restarts.push_back(ff);
+          src = ff + 2;
+        } else if (code == 0x00 || code == 0xff) {
+          // stuffed zero or fill byte
+          src = ff + 1;
+        } else {
+          return ff;
+        }
+      }
+      return src_max;
+    }
+
     // JPEG files are split up into chunks starting with 0xff
-    unsigned decode_chunk(const uint8_t *src, dynarray<uint8_t> &image, uint16_t &format) {
+    unsigned decode_chunk(const uint8_t *src, const uint8_t *file_max, dynarray<uint8_t> &image, uint16_t &format) {
       if (debug) printf("decode_chunk %02x\n", src[1]);
 
       unsigned length = 2;
@@ -332,14 +732,14 @@ namespace octet { namespace loaders {
             c.quantisation_table = src[10 + i*3 + 2] & 3;
             if (debug) printf("id=%d h=%d v=%d q=%d\n", c.id, c.hsamp, c.vsamp, c.quantisation_table);
           }
-          
+
         } break;
 
         // huffman tables
         case 0xc4: {
           length = u2(src + 2) + 2;
-          src += 4;
           const uint8_t *src_max = src + length;
+          src += 4;
           while (src + 17 <= src_max) {
             unsigned index = src[0];
             unsigned is_ac = (index >> 4) & 1;
@@ -375,7 +775,7 @@ namespace octet { namespace loaders {
               if (debug) printf("h.maxcodes[%d] = %04x\n", len-1, h.maxcodes[len-1]);
             }
             h.maxcodes[16] = 0xffff;
-            
+
             if (debug) printf("DHT %d\n", index);
           }
         } break;
@@ -400,11 +800,12 @@ namespace octet { namespace loaders {
           unsigned max_vsamp = 1;
           num_mcu_blocks = 0;
           const uint8_t *src_max = src + length;
+          if (num_components_in_scan > 4) return 0;
           for (unsigned i = 0; i != num_components_in_scan; ++i) {
             scan_component &sc = scan_components[i];
             unsigned id = *src++;
-            sc.ac_table = *src & 0x0f;
-            sc.dc_table = *src++ >> 4;
+            sc.ac_table = *src & 0x03;
+            sc.dc_table = ( *src++ >> 4 ) & 0x03;
             unsigned comp = 0;
             while (comp < num_components) {
               if (components[comp].id == id) break;
@@ -425,10 +826,8 @@ namespace octet { namespace loaders {
               m.dc_table = &huffman_tables[0][sc.dc_table];
               m.ac_table = &huffman_tables[1][sc.ac_table];
               m.quant = &quant_tables[c.quantisation_table];
-              m.scan_comp = &sc;
+              m.scan_comp = i;
             }
-
-            sc.last_dc = 0;
           }
 
           // at present, we only support YCrCb
@@ -449,36 +848,35 @@ namespace octet { namespace loaders {
             sc.height_in_blocks = height * c.hsamp / max_hsamp;
           }
 
-          unsigned xmax = ( width + max_hsamp * 8 - 1 ) / (max_hsamp * 8);
-          unsigned ymax = ( height + max_vsamp * 8 - 1 ) / (max_vsamp * 8);
-
-          unsigned acc = 0;
-          int shift = 0;
-          skip_bits(16, acc, src, shift);
-          
-          int stride = width * 4;
-          if (num_mcu_blocks == 3) {
-            unsigned size = width * height * 4;
-            image.resize(size);
-            format = 0x1908; // GL_RGBA
-          }
-          for (unsigned y = 0; y != ymax; ++y) {
-            for (unsigned x = 0; x != xmax; ++x) {
-              float *coeffs = dct_coeffs;
-              memset(coeffs, 0, 64 * num_mcu_blocks * sizeof(float));
-              for (unsigned b = 0; b < num_mcu_blocks; ++b) {
-                decode_mcu_block(b, acc, src, shift, coeffs);
-                inverse_dct(coeffs);
-                coeffs += 64;
-              }
-              if (num_mcu_blocks == 3) {
-                // assume 4:4:4 YCbCr
-                color_convert_444(&image[( ( height - 1 - y * 8 ) * stride ) + ( x * 8 * 4 )], -stride, dct_coeffs);
-              }
-            }
+          mcus_x = ( width + max_hsamp * 8 - 1 ) / (max_hsamp * 8);
+          mcus_y = ( height + max_vsamp * 8 - 1 ) / (max_vsamp * 8);
+          unsigned num_mcus = mcus_x * mcus_y;
+
+          unsigned size = width * height * 4;
+          image.resize(size);
+          format = 0x1908; // GL_RGBA
+
+          // each restart interval starts on a byte boundary with fresh DC predictors,
+          // so we can find them all up front and decode them at the same time.
+          dynarray<const uint8_t*> restarts;
+          const uint8_t *data_max = find_markers(src, file_max, restarts);
+          unsigned interval = restart_interval ? restart_interval : num_mcus;
+          unsigned num_intervals = ( num_mcus + interval - 1 ) / interval;
+          if (num_intervals > restarts.size() + 1) {
+            // missing markers, the last interval we have decodes the rest.
+            num_intervals = restarts.size() + 1;
           }
-          skip_bits(shift, acc, src, shift);
-          length = (unsigned)(src - src0);
+
+          uint8_t *dest = image.data();
+          thread_pool::get().parallel_for(num_intervals, [&](unsigned i) {
+            const uint8_t *begin = i == 0 ? src : restarts[i-1] + 2;
+            const uint8_t *end = i < restarts.size() ? restarts[i] : data_max;
+            unsigned mcu_begin = i * interval;
+            unsigned mcu_end = i == num_intervals - 1 ? num_mcus : mcu_begin + interval;
+            decode_interval(mcu_begin, mcu_end, begin, end, dest);
+          });
+
+          length = (unsigned)(data_max - src0);
         } break;
 
         // quantisation tables (the lossy bit)
@@ -491,13 +889,20 @@ namespace octet { namespace loaders {
             unsigned n = src[0] & 0x0f;
             src++;
             for (unsigned i = 0; i != 64; ++i) {
-              quant_tables[n&3].table[i] = (float)( prec ? u2(src) : *src );
+              quant_tables[n&3].table[i] = (uint16_t)( prec ? u2(src) : *src );
               src += prec + 1;
             }
             if (debug) printf("DQT %d %d\n", prec, n);
           }
         } break;
 
+        // restart interval
+        case 0xdd: {
+          length = u2(src + 2) + 2;
+          restart_interval = u2(src + 4);
+          if (debug) printf("DRI %d\n", restart_interval);
+        } break;
+
         // JFIF stubset of JPEG
         case 0xe0: {
           length = u2(src + 2) + 2;
@@ -513,14 +918,29 @@ namespace octet { namespace loaders {
       return length;
     }
   public:
+    jpeg_decoder() {
+      memset(components, 0, sizeof(components));
+      memset(scan_components, 0, sizeof(scan_components));
+      memset(quant_tables, 0, sizeof(quant_tables));
+      memset(huffman_tables, 0, sizeof(huffman_tables));
+      for (unsigned i = 0; i != 8; ++i) {
+        huffman_tables[i/4][i%4].maxcodes[16] = 0xffff;
+      }
+      width = height = num_components = 0;
+      restart_interval = 0;
+      mcus_x = mcus_y = 0;
+      use_reference = false;
+    }
+
     // get an opengl texture from a file in memory
     void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width_, uint16_t &height_, const uint8_t *src, const uint8_t *src_max) {
-      while (src < src_max) {
+      restart_interval = 0;
+      while (src + 2 <= src_max) {
         if (src[0] != 0xff) {
           printf("warning: bad JPEG file\n");
           return;
         }
-        unsigned length = decode_chunk(src, image, format);
+        unsigned length = decode_chunk(src, src_max, image, format);
         if (!length) {
           printf("warning: bad JPEG file\n");
           return;
@@ -531,6 +951,65 @@ namespace octet { namespace loaders {
       height_ = height;
       num_components = 3;
     }
+
+    /// Measure decoding speed in megapixels per second with the fast path
+    /// and with the floating point reference path.
+    /// returns false if the file does not decode or the two paths differ by more than max_error in any byte.
+    /// The fast path rounds in fixed point and clamps the IDCT output to a byte before colour
+    /// conversion, so most bytes differ by one or two and a few near-white ones by up to six.
+    bool benchmark(const uint8_t *src, const uint8_t *src_max, double &fast_mpps, double &reference_mpps, unsigned max_error = 8) {
+      dynarray<uint8_t> image, expected;
+      uint16_t format = 0, w = 0, h = 0;
+
+      use_reference = true;
+      get_image(expected, format, w, h, src, src_max);
+      use_reference = false;
+      get_image(image, format, w, h, src, src_max);
+      if (w == 0 || h == 0 || image.size() == 0 || image.size() != expected.size()) {
+        return false;
+      }
+      unsigned error = 0;
+      for (unsigned i = 0; i != image.size(); ++i) {
+        unsigned diff = image[i] > expected[i] ? image[i] - expected[i] : expected[i] - image[i];
+        error = diff > error ? diff : error;
+      }
+      if (error > max_error) {
+        log("jpeg: fast and reference paths differ by %d\n", error);
+        return false;
+      }
+
+      // repeat each decoder until we have a measurable time.
+      const double min_time = 0.25;
+      for (unsigned pass = 0; pass != 2; ++pass) {
+        use_reference = pass == 1;
+        unsigned runs = 0;
+        double start = get_time_seconds(), elapsed = 0;
+        do {
+          get_image(image, format, w, h, src, src_max);
+          runs++;
+          elapsed = get_time_seconds() - start;
+        } while (elapsed < min_time);
+        double mpps = w * h * 1e-6 * runs / elapsed;
+        if (pass == 0) fast_mpps = mpps; else reference_mpps = mpps;
+      }
+      use_reference = false;
+      return true;
+    }
+
+    /// check and log the decoding speed of a JPEG file, eg. one in assets/.
+    /// returns false if it can't be opened or benchmark() fails.
+    static bool benchmark_file(const char *path) {
+      mapped_file file;
+      if (!file.open(path)) {
+        log("jpeg: can't open %s\n", path);
+        return false;
+      }
+      jpeg_decoder dec;
+      double fast_mpps = 0, reference_mpps = 0;
+      bool ok = dec.benchmark(file.data(), file.data() + file.size(), fast_mpps, reference_mpps);
+      log("jpeg %s %dx%d: fast %.1f MPixels/s reference %.1f MPixels/s\n", path, dec.width, dec.height, fast_mpps, reference_mpps);
+      return ok;
+    }
   };
 }}
 
@@ -13,6 +13,8 @@ namespace octet { namespace loaders {
     unsigned layer_stride;
     unsigned frame_stride;
 
+  public:
+    /// The 348 byte header at the start of a .nii file.
     struct nifti_header {
       int      sizeof_hdr;    /// MUST be 348
       char     data_type[10]; /// ++UNUSED++
@@ -67,7 +69,6 @@ namespace octet { namespace loaders {
       char    magic[4] ;      /// MUST be "ni1\0" or "n+1\0".
     };
 
-  public:
     /// get data for a texture in memory.
     void get_image(dynarray<uint8_t> &bytes, uint16_t &format, uint16_t &width, uint16_t &height, uint16_t &depth, uint32_t &frames, const uint8_t *src, const uint8_t *src_max) {
       // convert the data
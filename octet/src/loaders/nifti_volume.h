@@ -0,0 +1,445 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Bricked access to large NIFTI volumes
+//
+
+namespace octet { namespace loaders {
+  /// A NIFTI volume (3D or 4D) that is read on demand in 32x32x32 bricks.
+  ///
+  /// The .nii file is memory mapped, so only the parts we look at are paged in.
+  /// Bricks are copied out of the mapping into a fixed size cache with least recently
+  /// used replacement, so memory use does not depend on the size of the scan.
+  ///
+  /// A .nii.gz file can not be read at random, so it is inflated once into
+  /// "name.nii.gz.unpacked" next to it and that file is mapped. Later opens reuse it.
+  /// Sizes and offsets are 64 bit, so scans of 4GiB and more work on 64 bit builds.
+  ///
+  /// Voxels are returned in the file's type (see get_datatype()) but in native byte order.
+  ///
+  /// Example
+  ///
+  ///     nifti_volume vol;
+  ///     if (vol.open("scan.nii.gz")) {
+  ///       dynarray<float> slice;
+  ///       vol.get_slice_float(slice, 2, vol.get_depth()/2, frame);
+  ///     }
+  class nifti_volume {
+  public:
+    enum {
+      brick_size = 32,
+      brick_voxels = brick_size * brick_size * brick_size,
+
+      // voxel types (see nifti1.h)
+      type_uint8 = 2,
+      type_int16 = 4,
+      type_int32 = 8,
+      type_float32 = 16,
+      type_float64 = 64,
+      type_rgb24 = 128,
+      type_int8 = 256,
+      type_uint16 = 512,
+      type_uint32 = 768,
+      type_rgba32 = 2304,
+    };
+
+  private:
+    typedef nifti_decoder::nifti_header nifti_header;
+
+    mapped_file file;
+
+    // used if we can not write the unpacked file
+    dynarray<uint8_t> unpacked;
+
+    // header in native byte order
+    nifti_header header;
+
+    const uint8_t *voxels;
+    unsigned dim[4];
+    unsigned num_bricks[3];
+    unsigned bytes_per_voxel;
+    unsigned datatype;
+    bool swap_bytes;
+
+    // cache slots in a doubly linked list, most recently used first.
+    struct slot {
+      int brick;
+      int prev;
+      int next;
+    };
+    dynarray<slot> slots;
+    dynarray<uint8_t> brick_data;
+    int lru_head;
+    int lru_tail;
+
+    // brick number to cache slot or -1
+    dynarray<int> brick_to_slot;
+
+    unsigned num_hits;
+    unsigned num_misses;
+
+    static uint32_t u4(const uint8_t *p) {
+      return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    static void swap(void *ptr, unsigned size, unsigned count) {
+      uint8_t *p = (uint8_t*)ptr;
+      for (unsigned i = 0; i != count; ++i, p += size) {
+        for (unsigned j = 0; j != size/2; ++j) {
+          uint8_t t = p[j]; p[j] = p[size-1-j]; p[size-1-j] = t;
+        }
+      }
+    }
+
+    // the header fields we use, in native order.
+    void swap_header() {
+      swap(&header.sizeof_hdr, 4, 1);
+      swap(header.dim, 2, 8);
+      swap(&header.datatype, 2, 1);
+      swap(&header.bitpix, 2, 1);
+      swap(header.pixdim, 4, 8);
+      swap(&header.vox_offset, 4, 1);
+      swap(&header.scl_slope, 4, 1);
+      swap(&header.scl_inter, 4, 1);
+      swap(&header.cal_max, 4, 1);
+      swap(&header.cal_min, 4, 1);
+    }
+
+    // inflate a .nii.gz file into a mapped file (or memory if we can't write one)
+    // returns the unpacked data or NULL.
+    const uint8_t *unpack_gzip(const char *path, size_t &size) {
+      const uint8_t *src = file.data();
+      const uint8_t *src_max = src + file.size();
+
+      // header: 1f 8b 08 flags mtime(4) xfl os
+      if (file.size() < 18 || src[2] != 8) return NULL;
+      unsigned flags = src[3];
+      const uint8_t *p = src + 10;
+      if (flags & 4) { p += 2 + (p[0] | (p[1] << 8)); }
+      if (flags & 8) { while (p < src_max && *p) ++p; ++p; }
+      if (flags & 16) { while (p < src_max && *p) ++p; ++p; }
+      if (flags & 2) { p += 2; }
+
+      // trailer: crc32, size mod 2^32
+      const uint8_t *trailer = src_max - 8;
+      if (p >= trailer) return NULL;
+      uint32_t size_mod_4g = u4(trailer + 4);
+
+      // the unpacked file ends with a copy of the trailer so we know it matches.
+      string cache_path;
+      cache_path.format("%s.unpacked", path);
+      mapped_file cache;
+      if (
+        cache.open(cache_path) && cache.size() >= 8 && (uint32_t)(cache.size() - 8) == size_mod_4g &&
+        !memcmp(cache.data() + cache.size() - 8, trailer, 8)
+      ) {
+        size = cache.size() - 8;
+        file.close();
+        file.open(cache_path);
+        return file.data();
+      }
+
+      // deflate makes at most 1032 bytes from each byte, so small files fit in 32 bits.
+      // Bigger ones may have wrapped around, so count the output with a decode that does not write.
+      zip_decoder *dec = new zip_decoder();
+      uint64_t usize = size_mod_4g;
+      if ((uint64_t)(trailer - p) * 1032 >= 0x100000000ull) {
+        if (!dec->get_inflated_size(p, trailer, usize) || (uint32_t)usize != size_mod_4g || usize + 8 > (size_t)-1) {
+          log("nifti: %s is corrupt\n", path);
+          delete dec;
+          return NULL;
+        }
+      }
+      size = (size_t)usize;
+
+      uint8_t *dest = NULL;
+      if (cache.create(cache_path, size + 8)) {
+        log("nifti: unpacking %s to %s\n", path, cache_path.c_str());
+        dest = cache.writable_data();
+      } else if (size + 8 <= 0xffffffffu) {
+        log("nifti: unpacking %s in memory\n", path);
+        unpacked.resize((unsigned)size + 8);
+        dest = unpacked.data();
+      } else {
+        // dynarray sizes are 32 bit.
+        log("nifti: can't write %s and %s is too big to unpack in memory\n", cache_path.c_str(), path);
+        delete dec;
+        return NULL;
+      }
+
+      bool ok = dec->inflate(dest, dest + size, p, trailer);
+      delete dec;
+      if (!ok) {
+        log("nifti: %s is corrupt\n", path);
+        cache.close();
+        remove(cache_path);
+        unpacked.reset();
+        return NULL;
+      }
+      memcpy(dest + size, trailer, 8);
+
+      if (unpacked.size()) {
+        file.close();
+        return unpacked.data();
+      }
+
+      // map the new file read only
+      cache.close();
+      file.close();
+      file.open(cache_path);
+      return file.data();
+    }
+
+    void unlink(int s) {
+      slot &sl = slots[s];
+      if (sl.prev >= 0) slots[sl.prev].next = sl.next; else lru_head = sl.next;
+      if (sl.next >= 0) slots[sl.next].prev = sl.prev; else lru_tail = sl.prev;
+    }
+
+    void push_front(int s) {
+      slot &sl = slots[s];
+      sl.prev = -1;
+      sl.next = lru_head;
+      if (lru_head >= 0) slots[lru_head].prev = s; else lru_tail = s;
+      lru_head = s;
+    }
+
+    // copy a brick out of the mapped file, zero padding at the edges.
+    void load_brick(uint8_t *dest, unsigned bx, unsigned by, unsigned bz, unsigned frame) {
+      unsigned x0 = bx * brick_size, y0 = by * brick_size, z0 = bz * brick_size;
+      unsigned nx = dim[0] - x0 < brick_size ? dim[0] - x0 : brick_size;
+      unsigned ny = dim[1] - y0 < brick_size ? dim[1] - y0 : brick_size;
+      unsigned nz = dim[2] - z0 < brick_size ? dim[2] - z0 : brick_size;
+      unsigned row_bytes = brick_size * bytes_per_voxel;
+      unsigned copy_bytes = nx * bytes_per_voxel;
+
+      if (nx != brick_size || ny != brick_size || nz != brick_size) {
+        memset(dest, 0, brick_voxels * bytes_per_voxel);
+      }
+
+      for (unsigned z = 0; z != nz; ++z) {
+        for (unsigned y = 0; y != ny; ++y) {
+          size_t voxel = (( (size_t)frame * dim[2] + z0 + z ) * dim[1] + y0 + y) * dim[0] + x0;
+          uint8_t *row = dest + (z * brick_size + y) * row_bytes;
+          memcpy(row, voxels + voxel * bytes_per_voxel, copy_bytes);
+          if (swap_bytes) {
+            unsigned elem = datatype == type_rgb24 || datatype == type_rgba32 ? 1 : bytes_per_voxel;
+            swap(row, elem, copy_bytes / elem);
+          }
+        }
+      }
+    }
+
+  public:
+    nifti_volume() {
+      voxels = NULL;
+      dim[0] = dim[1] = dim[2] = dim[3] = 0;
+      num_bricks[0] = num_bricks[1] = num_bricks[2] = 0;
+      bytes_per_voxel = 0;
+      datatype = 0;
+      swap_bytes = false;
+      lru_head = lru_tail = -1;
+      num_hits = num_misses = 0;
+    }
+
+    /// Map a .nii or .nii.gz file. max_bricks sets the size of the cache
+    /// (a 32^3 brick of 16 bit voxels is 64k). returns false on failure.
+    bool open(const char *path, unsigned max_bricks = 256) {
+      voxels = NULL;
+      unpacked.reset();
+      if (!file.open(path)) {
+        log("nifti: can't open %s\n", path);
+        return false;
+      }
+
+      const uint8_t *src = file.data();
+      size_t size = file.size();
+      if (size >= 2 && src[0] == 0x1f && src[1] == 0x8b) {
+        src = unpack_gzip(path, size);
+        if (!src) return false;
+      }
+
+      if (size < sizeof(nifti_header)) {
+        log("nifti: %s is too small\n", path);
+        return false;
+      }
+
+      memcpy(&header, src, sizeof(header));
+      swap_bytes = header.sizeof_hdr != 348;
+      if (swap_bytes) swap_header();
+
+      if (header.sizeof_hdr != 348 || (memcmp(header.magic, "n+1", 4) && memcmp(header.magic, "ni1", 4))) {
+        log("nifti: bad header in %s\n", path);
+        return false;
+      }
+
+      for (unsigned i = 0; i != 4; ++i) {
+        dim[i] = (int)i < header.dim[0] && header.dim[i+1] > 0 ? header.dim[i+1] : 1;
+      }
+      datatype = (unsigned short)header.datatype;
+      bytes_per_voxel = header.bitpix / 8;
+      size_t vox_offset = (size_t)header.vox_offset;
+      size_t bytes = (size_t)dim[0] * dim[1] * dim[2] * dim[3] * bytes_per_voxel;
+      if (bytes_per_voxel == 0 || vox_offset > size || bytes > size - vox_offset) {
+        log("nifti: %s is truncated\n", path);
+        return false;
+      }
+      voxels = src + vox_offset;
+
+      for (unsigned i = 0; i != 3; ++i) {
+        num_bricks[i] = ( dim[i] + brick_size - 1 ) / brick_size;
+      }
+
+      // direct table from brick to cache slot, one int per 32k voxels.
+      brick_to_slot.resize(num_bricks[0] * num_bricks[1] * num_bricks[2] * dim[3]);
+      for (unsigned i = 0; i != brick_to_slot.size(); ++i) {
+        brick_to_slot[i] = -1;
+      }
+
+      if (max_bricks == 0) max_bricks = 1;
+      slots.resize(max_bricks);
+      brick_data.resize(max_bricks * brick_voxels * bytes_per_voxel);
+      lru_head = lru_tail = -1;
+      for (unsigned i = 0; i != max_bricks; ++i) {
+        slots[i].brick = -1;
+        push_front((int)i);
+      }
+      num_hits = num_misses = 0;
+      return true;
+    }
+
+    /// true if open() succeeded
+    bool is_open() const {
+      return voxels != NULL;
+    }
+
+    unsigned get_width() const { return dim[0]; }
+    unsigned get_height() const { return dim[1]; }
+    unsigned get_depth() const { return dim[2]; }
+
+    /// number of time points
+    unsigned get_frames() const { return dim[3]; }
+
+    /// voxel type, eg. type_int16
+    unsigned get_datatype() const { return datatype; }
+    unsigned get_bytes_per_voxel() const { return bytes_per_voxel; }
+
+    /// bricks along x, y or z
+    unsigned get_num_bricks(unsigned axis) const { return num_bricks[axis]; }
+
+    /// header in native byte order (for pixdim, scl_slope etc.)
+    const nifti_header &get_header() const { return header; }
+
+    /// cache statistics
+    unsigned get_hits() const { return num_hits; }
+    unsigned get_misses() const { return num_misses; }
+
+    /// Get a brick of brick_size^3 voxels, x fastest. Voxels outside the volume are zero.
+    /// The pointer is valid until brick_cache_size() other bricks have been fetched.
+    const uint8_t *get_brick(unsigned bx, unsigned by, unsigned bz, unsigned frame) {
+      if (!voxels || bx >= num_bricks[0] || by >= num_bricks[1] || bz >= num_bricks[2] || frame >= dim[3]) {
+        return NULL;
+      }
+
+      unsigned brick = ((frame * num_bricks[2] + bz) * num_bricks[1] + by) * num_bricks[0] + bx;
+      int s = brick_to_slot[brick];
+      if (s >= 0) {
+        num_hits++;
+      } else {
+        num_misses++;
+        s = lru_tail;
+        if (slots[s].brick >= 0) brick_to_slot[slots[s].brick] = -1;
+        slots[s].brick = (int)brick;
+        brick_to_slot[brick] = s;
+        load_brick(&brick_data[s * brick_voxels * bytes_per_voxel], bx, by, bz, frame);
+      }
+
+      if (s != lru_head) {
+        unlink(s);
+        push_front(s);
+      }
+      return &brick_data[s * brick_voxels * bytes_per_voxel];
+    }
+
+    /// number of bricks held in memory
+    unsigned brick_cache_size() const {
+      return slots.size();
+    }
+
+    /// Get a slice through the volume at a right angle to an axis (0=x, 1=y, 2=z).
+    /// The slice is assembled from the bricks that cross it. Voxels are in file format.
+    ///
+    /// axis 0 gives height x depth voxels, axis 1 width x depth, axis 2 width x height.
+    bool get_slice(dynarray<uint8_t> &bytes, unsigned axis, unsigned index, unsigned frame) {
+      if (!voxels || axis > 2 || index >= dim[axis] || frame >= dim[3]) return false;
+
+      // u and v are the axes of the slice
+      unsigned u = axis == 0 ? 1 : 0;
+      unsigned v = axis == 2 ? 1 : 2;
+      unsigned width = dim[u], height = dim[v];
+      unsigned bpv = bytes_per_voxel;
+      bytes.resize(width * height * bpv);
+
+      // voxel strides within a brick
+      unsigned stride[3] = { 1, brick_size, brick_size * brick_size };
+      unsigned b[3];
+      b[axis] = index / brick_size;
+      unsigned offset = (index % brick_size) * stride[axis];
+
+      for (b[v] = 0; b[v] != num_bricks[v]; ++b[v]) {
+        for (b[u] = 0; b[u] != num_bricks[u]; ++b[u]) {
+          const uint8_t *brick = get_brick(b[0], b[1], b[2], frame);
+          unsigned u0 = b[u] * brick_size, v0 = b[v] * brick_size;
+          unsigned nu = width - u0 < brick_size ? width - u0 : brick_size;
+          unsigned nv = height - v0 < brick_size ? height - v0 : brick_size;
+          for (unsigned j = 0; j != nv; ++j) {
+            uint8_t *dest = &bytes[((v0 + j) * width + u0) * bpv];
+            const uint8_t *src = brick + (offset + j * stride[v]) * bpv;
+            if (u == 0) {
+              memcpy(dest, src, nu * bpv);
+            } else {
+              for (unsigned i = 0; i != nu; ++i) {
+                memcpy(dest + i * bpv, src + i * stride[u] * bpv, bpv);
+              }
+            }
+          }
+        }
+      }
+      return true;
+    }
+
+    /// Convert one voxel to float, applying the scale from the header.
+    /// Colour voxels give the average of the channels.
+    float to_float(const uint8_t *p) const {
+      float value = 0;
+      switch (datatype) {
+        case type_uint8: value = *p; break;
+        case type_int8: value = *(int8_t*)p; break;
+        case type_int16: { int16_t x; memcpy(&x, p, 2); value = x; } break;
+        case type_uint16: { uint16_t x; memcpy(&x, p, 2); value = x; } break;
+        case type_int32: { int32_t x; memcpy(&x, p, 4); value = (float)x; } break;
+        case type_uint32: { uint32_t x; memcpy(&x, p, 4); value = (float)x; } break;
+        case type_float32: memcpy(&value, p, 4); break;
+        case type_float64: { double x; memcpy(&x, p, 8); value = (float)x; } break;
+        case type_rgb24: value = (p[0] + p[1] + p[2]) * (1.0f/3); break;
+        case type_rgba32: value = (p[0] + p[1] + p[2]) * (1.0f/3); break;
+      }
+      return header.scl_slope != 0 ? value * header.scl_slope + header.scl_inter : value;
+    }
+
+    /// Get a slice as floats (see get_slice).
+    bool get_slice_float(dynarray<float> &values, unsigned axis, unsigned index, unsigned frame) {
+      dynarray<uint8_t> bytes;
+      if (!get_slice(bytes, axis, index, frame)) return false;
+      unsigned num_voxels = bytes.size() / bytes_per_voxel;
+      values.resize(num_voxels);
+      for (unsigned i = 0; i != num_voxels; ++i) {
+        values[i] = to_float(&bytes[i * bytes_per_voxel]);
+      }
+      return true;
+    }
+  };
+}}
@@ -9,7 +9,7 @@
 // 
 namespace octet { namespace loaders {
   class zip_decoder {
-    enum { debug = 1 };
+    enum { debug = 0 };
 
     struct huffman_table {
       uint8_t min_lit_length;
@@ -31,6 +31,39 @@ namespace octet { namespace loaders {
     huffman_table fixed_;
     huffman_table var_;
 
+    // fast path tables.
+    // Each entry decodes one symbol in a single probe of the low bits of the bit buffer:
+    //   bits 0-4   number of bits to consume for the code
+    //   bits 5-7   kind of entry (see below)
+    //   bits 8-11  number of extra bits following the code (or sub-table bits for links)
+    //   bits 16-31 literal, base length, base distance or sub-table offset
+    // Codes longer than the primary bits chain to a second-level table.
+    enum {
+      fast_lit_bits = 10,
+      fast_dist_bits = 8,
+      fast_len_bits = 7,
+
+      // worst case sizes for complete codes (see zlib's "enough" utility)
+      fast_lit_size = 1536,
+      fast_dist_size = 512,
+      fast_len_size = 1 << fast_len_bits,
+
+      kind_literal = 0 << 5,
+      kind_length = 1 << 5,
+      kind_end = 2 << 5,
+      kind_link = 3 << 5,
+      kind_invalid = 4 << 5,
+      kind_mask = 7 << 5,
+    };
+
+    struct fast_huffman_table {
+      uint32_t lit[fast_lit_size];
+      uint32_t dist[fast_dist_size];
+    };
+
+    fast_huffman_table fast_fixed_;
+    fast_huffman_table fast_var_;
+
     // on ARM we can do this faster with the "rev" instruction
     inline static uint16_t rev16(uint16_t value) {
       // small table version.
@@ -139,7 +172,7 @@ namespace octet { namespace loaders {
     unsigned peek(const uint8_t *src, unsigned bitptr, unsigned bits, const char *name) {
       unsigned i = bitptr >> 3, j = bitptr & 7;
       unsigned value = ( (unsigned&)src[i] >> j ) & ( (1u << bits) - 1 );
-      if (name) dump_bits(value, bits, name);
+      if (debug && name) dump_bits(value, bits, name);
       return value;
     }
 
@@ -316,6 +349,374 @@ namespace octet { namespace loaders {
       }
       return decode_lz77(dest, dest_max, src, src_max, bitptr, &var_);
     }
+
+    enum alphabet_t {
+      alphabet_lit,
+      alphabet_dist,
+      alphabet_len,
+    };
+
+    /// kind, extra bits and value for one symbol of a fast table.
+    static uint32_t symbol_entry(alphabet_t alphabet, unsigned sym) {
+      static const uint8_t length_extra[] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+      };
+      static const uint16_t length_base[] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+      };
+      static const uint8_t dist_extra[] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+      };
+      static const uint16_t dist_base[] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+      };
+
+      if (alphabet == alphabet_lit) {
+        if (sym < 256) return sym << 16 | kind_literal;
+        if (sym == 256) return kind_end;
+        if (sym < 286) return length_base[sym-257] << 16 | length_extra[sym-257] << 8 | kind_length;
+        return kind_invalid;
+      } else if (alphabet == alphabet_dist) {
+        if (sym < 30) return dist_base[sym] << 16 | dist_extra[sym] << 8 | kind_length;
+        return kind_invalid;
+      } else {
+        return sym << 16 | kind_literal;
+      }
+    }
+
+    /// build a fast decoding table from a set of code lengths.
+    /// short codes are replicated through the primary table, long codes get a sub-table per prefix.
+    static bool build_fast_table(const uint8_t *lengths, unsigned num_symbols, alphabet_t alphabet, unsigned primary_bits, uint32_t *table, unsigned table_size) {
+      unsigned count[16];
+      memset(count, 0, sizeof(count));
+      for (unsigned i = 0; i != num_symbols; ++i) {
+        if (lengths[i] > 15) return false;
+        count[lengths[i]]++;
+      }
+      count[0] = 0;
+
+      // over-subscribed codes are broken, incomplete codes just leave invalid entries.
+      int left = 1;
+      for (unsigned length = 1; length <= 15; ++length) {
+        left = left * 2 - (int)count[length];
+        if (left < 0) return false;
+      }
+
+      unsigned next_code[16];
+      unsigned code = 0;
+      next_code[0] = 0;
+      for (unsigned length = 1; length <= 15; ++length) {
+        code = ( code + count[length-1] ) << 1;
+        next_code[length] = code;
+      }
+
+      unsigned primary_size = 1u << primary_bits;
+      unsigned primary_mask = primary_size - 1;
+      if (left != 0) {
+        // a complete code covers every entry, so we only need this for incomplete ones.
+        for (unsigned i = 0; i != primary_size; ++i) {
+          table[i] = kind_invalid;
+        }
+      }
+
+      unsigned num_long = 0;
+      for (unsigned length = primary_bits + 1; length <= 15; ++length) {
+        num_long += count[length];
+      }
+
+      // first pass: fill in short codes and find the longest code behind each long prefix.
+      uint16_t rcodes[288];
+      uint8_t sub_length[1 << fast_lit_bits];
+      if (num_long) memset(sub_length, 0, primary_size);
+      for (unsigned sym = 0; sym != num_symbols; ++sym) {
+        unsigned length = lengths[sym];
+        if (!length) continue;
+
+        // the bitstream delivers codes msb first, so index the table by the reversed code.
+        unsigned rcode = rev16((uint16_t)next_code[length]++) >> (16 - length);
+        rcodes[sym] = (uint16_t)rcode;
+        if (length <= primary_bits) {
+          uint32_t entry = symbol_entry(alphabet, sym) | length;
+          for (unsigned i = rcode; i < primary_size; i += 1u << length) {
+            table[i] = entry;
+          }
+        } else if (sub_length[rcode & primary_mask] < length) {
+          sub_length[rcode & primary_mask] = (uint8_t)length;
+        }
+      }
+
+      if (!num_long) return true;
+
+      // allocate sub-tables after the primary table.
+      unsigned next = primary_size;
+      for (unsigned prefix = 0; prefix != primary_size; ++prefix) {
+        if (sub_length[prefix]) {
+          unsigned sub_bits = sub_length[prefix] - primary_bits;
+          if (next + (1u << sub_bits) > table_size) return false;
+          table[prefix] = next << 16 | sub_bits << 8 | kind_link | primary_bits;
+          for (unsigned i = 0; i != 1u << sub_bits; ++i) {
+            table[next + i] = kind_invalid;
+          }
+          next += 1u << sub_bits;
+        }
+      }
+
+      // second pass: fill in the long codes.
+      for (unsigned sym = 0; sym != num_symbols; ++sym) {
+        unsigned length = lengths[sym];
+        if (length <= primary_bits) continue;
+        unsigned rcode = rcodes[sym];
+        uint32_t link = table[rcode & primary_mask];
+        unsigned start = link >> 16;
+        unsigned sub_bits = (link >> 8) & 15;
+        unsigned sub_length = length - primary_bits;
+        uint32_t entry = symbol_entry(alphabet, sym) | sub_length;
+        for (unsigned i = rcode >> primary_bits; i < (1u << sub_bits); i += 1u << sub_length) {
+          table[start + i] = entry;
+        }
+      }
+      return true;
+    }
+
+    /// 64 bit little-endian bit buffer for the fast path.
+    /// Reads past the end of the source deliver zeros and are detected by overrun().
+    struct bit_reader {
+      uint64_t bits;
+      unsigned count;
+      const uint8_t *src;
+      const uint8_t *src_max;
+
+      void init(const uint8_t *src_, const uint8_t *src_max_) {
+        bits = 0;
+        count = 0;
+        src = src_;
+        src_max = src_max_;
+      }
+
+      /// make sure there are at least 56 bits in the buffer.
+      /// In the common case this is one unaligned load and no branches on the bit count.
+      /// Bits above "count" are the start of the next byte and get or-ed in again on the next refill.
+      void refill() {
+        if (src + 8 <= src_max) {
+          uint64_t word;
+          memcpy(&word, src, 8);
+          bits |= word << count;
+          src += (63 - count) >> 3;
+          count |= 56;
+        } else {
+          while (count <= 56) {
+            uint64_t byte = src < src_max ? *src : 0;
+            bits |= byte << count;
+            src++;
+            count += 8;
+          }
+        }
+      }
+
+      unsigned peek(unsigned n) const {
+        return (unsigned)bits & ( (1u << n) - 1 );
+      }
+
+      void consume(unsigned n) {
+        bits >>= n;
+        count -= n;
+      }
+
+      unsigned get(unsigned n) {
+        unsigned value = peek(n);
+        consume(n);
+        return value;
+      }
+
+      /// true if we have consumed bits beyond the end of the source.
+      bool overrun() const {
+        return src > src_max && (size_t)(src - src_max) * 8 > count;
+      }
+
+      /// skip to a byte boundary and return the next byte to read; the buffer is emptied.
+      const uint8_t *align() {
+        consume(count & 7);
+        src -= count >> 3;
+        bits = 0;
+        count = 0;
+        return src;
+      }
+    };
+
+    bool inflate_uncompressed(uint8_t *&dest, uint8_t *dest_max, bit_reader &br) {
+      const uint8_t *p = br.align();
+      if (p + 4 > br.src_max) return false;
+      unsigned bytes_to_copy = p[0] | p[1] << 8;
+      unsigned clength = p[2] | p[3] << 8;
+      p += 4;
+
+      if (bytes_to_copy != (clength^0xffff)) return false;
+      if (bytes_to_copy > (size_t)(dest_max - dest)) return false;
+      if (bytes_to_copy > (size_t)(br.src_max - p)) return false;
+
+      memcpy(dest, p, bytes_to_copy);
+      dest += bytes_to_copy;
+      br.src = p + bytes_to_copy;
+      return true;
+    }
+
+    OCTET_HOT bool inflate_lz77(uint8_t *&dest, uint8_t *dest_min, uint8_t *dest_max, bit_reader &br, const fast_huffman_table *table) {
+      const unsigned lit_mask = (1u << fast_lit_bits) - 1;
+      const unsigned dist_mask = (1u << fast_dist_bits) - 1;
+      uint8_t *d = dest;
+      for(;;) {
+        // a length/distance pair is at most 15+5+15+13 = 48 bits, so one refill covers it.
+        br.refill();
+        uint32_t entry = table->lit[br.bits & lit_mask];
+        if ((entry & kind_mask) == kind_link) {
+          br.consume(entry & 31);
+          entry = table->lit[(entry >> 16) + br.peek((entry >> 8) & 15)];
+        }
+        br.consume(entry & 31);
+
+        uint32_t kind = entry & kind_mask;
+        if (kind == kind_literal) {
+          if (d == dest_max) return false;
+          *d++ = (uint8_t)(entry >> 16);
+
+          // there are at least 41 bits left, enough for a second short literal without a refill.
+          entry = table->lit[br.bits & lit_mask];
+          if ((entry & kind_mask) == kind_literal) {
+            if (d == dest_max) return false;
+            br.consume(entry & 31);
+            *d++ = (uint8_t)(entry >> 16);
+          }
+          continue;
+        } else if (kind != kind_length) {
+          dest = d;
+          return kind == kind_end && !br.overrun();
+        }
+
+        unsigned block_length = (entry >> 16) + br.get((entry >> 8) & 15);
+
+        entry = table->dist[br.bits & dist_mask];
+        if ((entry & kind_mask) == kind_link) {
+          br.consume(entry & 31);
+          entry = table->dist[(entry >> 16) + br.peek((entry >> 8) & 15)];
+        }
+        br.consume(entry & 31);
+        if ((entry & kind_mask) != kind_length) return false;
+
+        unsigned distance = (entry >> 16) + br.get((entry >> 8) & 15);
+        // outputs can be bigger than 4GiB, so keep the distances to the ends as size_t.
+        if (distance > (size_t)(d - dest_min)) return false;
+        if (block_length > (size_t)(dest_max - d)) return false;
+
+        const uint8_t *s = d - distance;
+        uint8_t *end = d + block_length;
+        if (distance >= 8 && end + 8 <= dest_max) {
+          // copy eight bytes at a time, this may write up to seven bytes past the end.
+          do {
+            uint64_t word;
+            memcpy(&word, s, 8);
+            memcpy(d, &word, 8);
+            s += 8;
+            d += 8;
+          } while (d < end);
+          d = end;
+        } else if (distance == 1) {
+          memset(d, s[0], block_length);
+          d = end;
+        } else {
+          while (d != end) *d++ = *s++;
+        }
+      }
+    }
+
+    // decode the symbols of a block without writing them, adding the bytes they make to size.
+    bool measure_lz77(uint64_t &size, bit_reader &br, const fast_huffman_table *table) {
+      const unsigned lit_mask = (1u << fast_lit_bits) - 1;
+      const unsigned dist_mask = (1u << fast_dist_bits) - 1;
+      for(;;) {
+        br.refill();
+        uint32_t entry = table->lit[br.bits & lit_mask];
+        if ((entry & kind_mask) == kind_link) {
+          br.consume(entry & 31);
+          entry = table->lit[(entry >> 16) + br.peek((entry >> 8) & 15)];
+        }
+        br.consume(entry & 31);
+
+        uint32_t kind = entry & kind_mask;
+        if (kind == kind_literal) {
+          size++;
+          continue;
+        } else if (kind != kind_length) {
+          return kind == kind_end && !br.overrun();
+        }
+
+        unsigned block_length = (entry >> 16) + br.get((entry >> 8) & 15);
+
+        entry = table->dist[br.bits & dist_mask];
+        if ((entry & kind_mask) == kind_link) {
+          br.consume(entry & 31);
+          entry = table->dist[(entry >> 16) + br.peek((entry >> 8) & 15)];
+        }
+        br.consume(entry & 31);
+        if ((entry & kind_mask) != kind_length) return false;
+
+        unsigned distance = (entry >> 16) + br.get((entry >> 8) & 15);
+        if (distance > size) return false;
+        size += block_length;
+      }
+    }
+
+    bool read_dynamic_tables(bit_reader &br) {
+      br.refill();
+      unsigned num_lit_codes = br.get(5) + 257;
+      unsigned num_dist_codes = br.get(5) + 1;
+      unsigned num_length_codes = br.get(4) + 4;
+
+      uint8_t len_lengths[19];
+      memset(len_lengths, 0, sizeof(len_lengths));
+      for (unsigned i = 0; i != num_length_codes; ++i) {
+        static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        br.refill();
+        len_lengths[order[i]] = (uint8_t)br.get(3);
+      }
+
+      uint32_t len_table[fast_len_size];
+      if (!build_fast_table(len_lengths, 19, alphabet_len, fast_len_bits, len_table, fast_len_size)) return false;
+
+      uint8_t lengths[288 + 32];
+      unsigned todo = num_lit_codes + num_dist_codes;
+      for (unsigned done = 0; done < todo;) {
+        br.refill();
+        uint32_t entry = len_table[br.peek(fast_len_bits)];
+        if ((entry & kind_mask) != kind_literal) return false;
+        br.consume(entry & 31);
+
+        unsigned code = entry >> 16;
+        unsigned copy = 1;
+        if (code == 16) {
+          if (done == 0) return false;
+          copy = br.get(2) + 3;
+          code = lengths[done-1];
+        } else if (code == 17) {
+          copy = br.get(3) + 3;
+          code = 0;
+        } else if (code == 18) {
+          copy = br.get(7) + 11;
+          code = 0;
+        }
+        if (done + copy > todo) return false;
+        do {
+          lengths[done++] = (uint8_t)code;
+        } while( --copy );
+      }
+
+      if (br.overrun() || lengths[256] == 0) return false;
+
+      return
+        build_fast_table(lengths, num_lit_codes, alphabet_lit, fast_lit_bits, fast_var_.lit, fast_lit_size) &&
+        build_fast_table(lengths + num_lit_codes, num_dist_codes, alphabet_dist, fast_dist_bits, fast_var_.dist, fast_dist_size)
+      ;
+    }
   public:
     zip_decoder() {
       uint8_t lit_lengths[288];
@@ -327,9 +728,72 @@ namespace octet { namespace loaders {
       memset(dist_lengths, 5, 32);
       build_huffman(lit_lengths, 288, fixed_.min_lit_length, fixed_.max_lit_length, fixed_.lit_codes, fixed_.lit_limits, fixed_.lit_base);
       build_huffman(dist_lengths, 32, fixed_.min_dist_length, fixed_.max_dist_length, fixed_.dist_codes, fixed_.dist_limits, fixed_.dist_base);
+      build_fast_table(lit_lengths, 288, alphabet_lit, fast_lit_bits, fast_fixed_.lit, fast_lit_size);
+      build_fast_table(dist_lengths, 32, alphabet_dist, fast_dist_bits, fast_fixed_.dist, fast_dist_size);
     }
 
+    /// decode a deflate stream into [dest, dest_max)
     void decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
+      inflate(dest, dest_max, src, src_max);
+    }
+
+    /// table driven inflate: one table probe per symbol, 64 bit bit buffer and wide match copies.
+    /// returns false if the stream is corrupt or does not fit in [dest, dest_max)
+    bool inflate(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
+      uint8_t *dest_min = dest;
+      bit_reader br;
+      br.init(src, src_max);
+      unsigned is_last_block;
+
+      // for each "deflate" block:
+      do {
+        br.refill();
+        is_last_block = br.get(1);
+        unsigned kind = br.get(2);
+        switch (kind) {
+          case 0: if (!inflate_uncompressed(dest, dest_max, br)) return false; break;
+          case 1: if (!inflate_lz77(dest, dest_min, dest_max, br, &fast_fixed_)) return false; break;
+          case 2: if (!read_dynamic_tables(br) || !inflate_lz77(dest, dest_min, dest_max, br, &fast_var_)) return false; break;
+          default: return false;
+        }
+      } while (!is_last_block);
+      return true;
+    }
+
+    /// find the size of the output of a deflate stream by decoding it without writing anything.
+    /// Use this when a stored size may be wrong, eg. the gzip trailer only has the size mod 2^32.
+    /// returns false if the stream is corrupt.
+    bool get_inflated_size(const uint8_t *src, const uint8_t *src_max, uint64_t &size) {
+      size = 0;
+      bit_reader br;
+      br.init(src, src_max);
+      unsigned is_last_block;
+
+      do {
+        br.refill();
+        is_last_block = br.get(1);
+        unsigned kind = br.get(2);
+        switch (kind) {
+          case 0: {
+            const uint8_t *p = br.align();
+            if (p + 4 > br.src_max) return false;
+            unsigned bytes_to_copy = p[0] | p[1] << 8;
+            unsigned clength = p[2] | p[3] << 8;
+            p += 4;
+            if (bytes_to_copy != (clength^0xffff) || bytes_to_copy > (size_t)(br.src_max - p)) return false;
+            size += bytes_to_copy;
+            br.src = p + bytes_to_copy;
+          } break;
+          case 1: if (!measure_lz77(size, br, &fast_fixed_)) return false; break;
+          case 2: if (!read_dynamic_tables(br) || !measure_lz77(size, br, &fast_var_)) return false; break;
+          default: return false;
+        }
+      } while (!is_last_block);
+      return true;
+    }
+
+    /// the original limit/base decoder, kept as a reference for the fast path.
+    void decode_reference(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
       unsigned bitptr = 0;
       unsigned is_last_block;
 
@@ -352,6 +816,42 @@ namespace octet { namespace loaders {
         }
       } while( !is_last_block && bitptr != ~0);
     }
+
+    /// time both decoders on one deflate stream and return the throughput in MB/s of output.
+    /// returns false if the two decoders give different bytes.
+    bool benchmark(const uint8_t *src, const uint8_t *src_max, unsigned usize, double &fast_mbps, double &reference_mbps) {
+      dynarray<uint8_t> dest(usize + 1), expected(usize + 1);
+      double mbytes = usize / 1000000.0;
+
+      // the reference decoder's output is what the fast path must give.
+      memset(dest.data(), 0, usize);
+      memset(expected.data(), 0, usize);
+      decode_reference(expected.data(), expected.data() + usize, src, src_max);
+      if (!inflate(dest.data(), dest.data() + usize, src, src_max) || memcmp(dest.data(), expected.data(), usize)) {
+        return false;
+      }
+
+      // repeat each decoder until we have a measurable time.
+      const double min_time = 0.25;
+      unsigned runs = 0;
+      double start = get_time_seconds(), elapsed = 0;
+      do {
+        inflate(dest.data(), dest.data() + usize, src, src_max);
+        runs++;
+        elapsed = get_time_seconds() - start;
+      } while (elapsed < min_time);
+      fast_mbps = mbytes * runs / elapsed;
+
+      runs = 0;
+      start = get_time_seconds();
+      do {
+        decode_reference(dest.data(), dest.data() + usize, src, src_max);
+        runs++;
+        elapsed = get_time_seconds() - start;
+      } while (elapsed < min_time);
+      reference_mbps = mbytes * runs / elapsed;
+      return true;
+    }
   };
 }}
 
@@ -85,6 +85,12 @@ namespace octet { namespace math {
       return all(diff <= limit);
     }
 
+    // return true if the object is entirely inside this AABB
+    bool contains(const aabb &rhs) const {
+      vec3 diff = abs(center - rhs.center) + rhs.half_extent;
+      return all(diff <= half_extent);
+    }
+
     // Obb collision test.
     // Deprecated.
     // <a href="http://www.jkh.me/files/tutorials/Separating%20Axis%20Theorem%20for%20Oriented%20Bounding%20Boxes.pdf">based on this</a>
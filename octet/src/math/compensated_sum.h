@@ -0,0 +1,52 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Compensated (Kahan-Babuska) summation
+//
+// Adding many floats loses the low bits of each one. This keeps the
+// rounding error in a second float and adds it back at the end, so the
+// result is nearly as good as adding in double precision.
+//
+// Note that fast math compiler options (/fp:fast, -ffast-math) may remove the compensation.
+//
+
+namespace octet { namespace math {
+  class compensated_sum {
+    float sum;
+    float error;
+  public:
+    // start at zero
+    compensated_sum(float value = 0) {
+      sum = value;
+      error = 0;
+    }
+
+    // add a value, keeping the bits that do not fit in the sum.
+    compensated_sum &operator+=(float value) {
+      float t = sum + value;
+      if (fabsf(sum) >= fabsf(value)) {
+        error += ( sum - t ) + value;
+      } else {
+        error += ( value - t ) + sum;
+      }
+      sum = t;
+      return *this;
+    }
+
+    // join two partial sums, eg. from two ranges of a parallel_reduce.
+    compensated_sum operator+(compensated_sum_in rhs) const {
+      compensated_sum result = *this;
+      result += rhs.sum;
+      result.error += rhs.error;
+      return result;
+    }
+
+    // the sum so far
+    float get() const {
+      return sum + error;
+    }
+  };
+} }
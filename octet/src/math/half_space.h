@@ -28,6 +28,13 @@ namespace octet { namespace math {
       return distance >= -fatness;
     }
 
+    /// Is aabb entirely on positive side of plane?
+    bool contains(const aabb &rhs) const {
+      float fatness = sum(abs(get_normal() * rhs.get_half_extent()));
+      float distance = dot(get_normal(), rhs.get_center()) + get_offset();
+      return distance >= fatness;
+    }
+
     /// Is sphere partly on positive side of plane?
     /// equivalent to a point - fat plane test
     bool intersects(const sphere &rhs) const {
@@ -37,6 +37,7 @@ namespace octet {
     OCTET_HUNGARIANS_NC(uint32_t)
 
     OCTET_HUNGARIANS(rational)
+    OCTET_HUNGARIANS(compensated_sum)
     OCTET_HUNGARIANS(vec2)
     OCTET_HUNGARIANS(vec3)
     OCTET_HUNGARIANS(vec3p)
@@ -64,6 +65,7 @@ namespace octet {
 #include "scalar.h"
 #include "random.h"
 #include "rational.h"
+#include "compensated_sum.h"
 #include "vec2.h"
 #include "vec3.h"
 #include "vec4.h"
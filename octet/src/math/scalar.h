@@ -193,6 +193,11 @@ namespace octet { namespace math {
     return res;
   }
 
+  /// count trailing zeros. Examples: 0x00000001 -> 0, 0x00000100 -> 8, 0x00000000 -> 32
+  inline static int ctz(uint32_t v) {
+    return v ? pop_count((v & (0 - v)) - 1) : 32;
+  }
+
   /// floor(log(2, v))
   inline static int ilog2(uint32_t v) {
     return 31 - (int)clz(v);
@@ -214,6 +219,42 @@ namespace octet { namespace math {
     return (a | a >> 8) & 0x0000ffff;
   }
 
+  /// IEEE half precision (float16) bits of a float, rounded to the nearest even.
+  /// Numbers too big for a half become infinity.
+  inline static uint16_t float_to_half(float value) {
+    union { float f; uint32_t u; } f, denorm_magic;
+    f.f = value;
+    denorm_magic.u = ( ( 127 - 15 ) + ( 23 - 10 ) + 1 ) << 23;
+    uint32_t sign = f.u & 0x80000000;
+    uint32_t result;
+    f.u ^= sign;
+    if (f.u >= ( 127 + 16 ) << 23) {
+      // infinity or NaN
+      result = f.u > 0x7f800000 ? 0x7e00 : 0x7c00;
+    } else if (f.u < 113 << 23) {
+      // the float adds up the denormal, rounding the mantissa for us.
+      f.f += denorm_magic.f;
+      result = f.u - denorm_magic.u;
+    } else {
+      uint32_t mantissa_odd = ( f.u >> 13 ) & 1;
+      f.u += ( ( 15 - 127 ) << 23 ) + 0xfff + mantissa_odd;
+      result = f.u >> 13;
+    }
+    return (uint16_t)( result | sign >> 16 );
+  }
+
+  /// float value of IEEE half precision (float16) bits.
+  inline static float half_to_float(uint16_t value) {
+    union { float f; uint32_t u; } f, magic;
+    // multiplying by 2^112 moves the exponent bias and makes denormals normal.
+    magic.u = ( 254 - 15 ) << 23;
+    f.u = ( value & 0x7fff ) << 13;
+    f.f *= magic.f;
+    if (f.f >= 65536.0f) f.u |= 255 << 23;
+    f.u |= ( value & 0x8000 ) << 16;
+    return f.f;
+  }
+
   /// a pair of objects, like std::pair
   template <typename first_t, typename second_t> class pair {
   public:
@@ -231,9 +272,19 @@ namespace octet { namespace math {
         assert(clz(0x00ffffff) == 8);
         assert(clz(0x00000040) == 25);
         assert(clz(0x00000000) == 32);
+        assert(ctz(0x00000001) == 0);
+        assert(ctz(0x00000140) == 6);
+        assert(ctz(0x80000000) == 31);
+        assert(ctz(0x00000000) == 32);
         assert(ilog2(1<<7) == 7);
         assert(ilog2((1<<7)+1) == 7);
         assert(ilog2((1<<7)-1) == 6);
+        assert(float_to_half(1.0f) == 0x3c00);
+        assert(float_to_half(-2.5f) == 0xc100);
+        assert(float_to_half(65520.0f) == 0x7c00);
+        assert(half_to_float(0x3555) == 0.333251953125f);
+        assert(half_to_float(0x0001) == 5.9604644775390625e-8f);
+        assert(half_to_float(float_to_half(0.1f)) == 0.0999755859375f);
       }
     };
     static scalar_unit_test scalar_unit_test;
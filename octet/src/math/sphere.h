@@ -59,10 +59,16 @@ namespace octet { namespace math {
     bool intersects(const aabb &rhs) const {
       vec3 diff = abs(get_center() - rhs.get_center());
       vec3 closest = min(diff, rhs.get_half_extent());
-      float d2 = squared(get_center() - closest);
+      float d2 = squared(diff - closest);
       return d2 <= squared(get_radius());
     }
 
+    // true if the furthest corner of the box is inside the sphere.
+    bool contains(const aabb &rhs) const {
+      vec3 furthest = abs(get_center() - rhs.get_center()) + rhs.get_half_extent();
+      return squared(furthest) <= squared(get_radius());
+    }
+
     // equivalent to point and large sphere
     bool intersects(const sphere &rhs) const {
       float d2 = squared(get_center() - rhs.get_center());
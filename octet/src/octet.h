@@ -98,6 +98,10 @@
   // target specific support: Windows, Mac, Linux, PS Vita
   #include "platform/machine_specific.h"
 
+  // worker threads and memory mapped files
+  #include "platform/thread_pool.h"
+  #include "platform/mapped_file.h"
+
   // math library
   #include "math/math.h"
 
@@ -22,6 +22,8 @@ namespace octet {
     attribute_blendindices = 7,
     attribute_texcoord = 8,
     attribute_uv = 8,
+    attribute_channels_lo = 9,
+    attribute_channels_hi = 10,
     attribute_tangent = 14,
     attribute_bitangent = 15,
     attribute_binormal = 15,
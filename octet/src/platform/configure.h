@@ -49,6 +49,7 @@
 #include <stdarg.h>
 #include <math.h>
 #include <assert.h>
+#include <chrono>
 #if defined(WIN32)
   #include <direct.h>
 #endif
@@ -65,5 +66,11 @@ namespace octet {
     //fflush(file);
     return file;
   }
+
+  /// wall clock time in seconds from an arbitrary start, for timing and benchmarks
+  inline static double get_time_seconds() {
+    using namespace std::chrono;
+    return duration_cast<duration<double> >(steady_clock::now().time_since_epoch()).count();
+  }
 }
 
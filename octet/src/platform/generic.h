@@ -24,6 +24,11 @@ typedef float float_t;
 #include "gl_skeleton.h"
 #include "al_defs.h"
 
+// compute - opencl
+#if OCTET_OPENCL
+  #include "CL/cl.h"
+#endif
+
 // include cross platform app helpers, such as texture loaders
 #include "video_capture.h"
 #include "app_common.h"
@@ -36,6 +41,7 @@ inline void ioctlsocket(int socket, unsigned kind, unsigned long *up) {
 #define AF_INET 0
 #define SOCK_STREAM 0
 #define INADDR_ANY 0
+#define INADDR_LOOPBACK 0x7f000001
 
 struct sockaddr {
 };
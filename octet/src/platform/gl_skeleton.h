@@ -61,6 +61,8 @@ typedef struct __GLsync *GLsync;
 #define GL_TRIANGLES                                     0x0004
 #define GL_TRIANGLE_STRIP                                0x0005
 #define GL_TRIANGLE_FAN                                  0x0006
+/* not in OpenGL ES, but mesh::set_mode accepts it */
+#define GL_POLYGON                                       0x0009
 
 /* BlendingFactorDest */
 #define GL_ZERO                                          0
@@ -2129,3 +2131,15 @@ GL_APICALL void GL_APIENTRY glGetInternalformativ (GLenum target, GLenum interna
   gl_context *ctxt = gl_ctxt();
 }
 
+/* OpenGL 1.x calls and tokens that some examples use on the desktop. Like the rest, they do nothing here. */
+#define GL_ALPHA_TEST                                    0x0BC0
+#define GL_POINT_SMOOTH                                  0x0B10
+
+GL_APICALL void GL_APIENTRY glAlphaFunc (GLenum func, GLclampf ref) {
+  gl_context *ctxt = gl_ctxt();
+}
+
+
+GL_APICALL void GL_APIENTRY glPointSize (GLfloat size) {
+  gl_context *ctxt = gl_ctxt();
+}
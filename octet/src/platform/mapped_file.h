@@ -0,0 +1,232 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Memory mapped files
+//
+
+#if !defined(WIN32) && !OCTET_VITA
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#endif
+
+namespace octet {
+  /// A whole file mapped into memory.
+  ///
+  /// Pages are read by the OS on demand, so opening a large file is cheap and
+  /// only the parts we touch use memory. On platforms without mapping the file
+  /// is read into a buffer instead.
+  ///
+  /// A copy-on-write mapping can be patched in place without changing the file.
+  /// create() makes a new file of a given size whose mapping is written back to disk,
+  /// so we can build files larger than memory.
+  ///
+  /// Example
+  ///
+  ///     mapped_file file("assets/big.zip");
+  ///     if (file.size() >= 4) printf("%08x\n", *(uint32_t*)file.data());
+  class mapped_file {
+    uint8_t *data_;
+    size_t size_;
+
+    // used if the platform cannot map the file
+    dynarray<uint8_t> buffer;
+
+    #if defined(WIN32)
+      HANDLE file_handle;
+      HANDLE mapping_handle;
+    #elif !OCTET_VITA
+      bool is_mapped;
+    #endif
+
+    // copying would unmap twice
+    mapped_file(const mapped_file &rhs);
+    mapped_file &operator=(const mapped_file &rhs);
+
+    bool read_whole_file(const char *path) {
+      FILE *file = fopen(path, "rb");
+      if (!file) return false;
+      fseek(file, 0, SEEK_END);
+      buffer.resize((unsigned)ftell(file));
+      fseek(file, 0, SEEK_SET);
+      fread(buffer.data(), 1, buffer.size(), file);
+      fclose(file);
+      data_ = buffer.data();
+      size_ = buffer.size();
+      return true;
+    }
+
+  public:
+    mapped_file() {
+      data_ = 0;
+      size_ = 0;
+      #if defined(WIN32)
+        file_handle = INVALID_HANDLE_VALUE;
+        mapping_handle = 0;
+      #elif !OCTET_VITA
+        is_mapped = false;
+      #endif
+    }
+
+    mapped_file(const char *path, bool copy_on_write = false) {
+      data_ = 0;
+      size_ = 0;
+      #if defined(WIN32)
+        file_handle = INVALID_HANDLE_VALUE;
+        mapping_handle = 0;
+      #elif !OCTET_VITA
+        is_mapped = false;
+      #endif
+      open(path, copy_on_write);
+    }
+
+    ~mapped_file() {
+      close();
+    }
+
+    /// Map a file read-only, or copy-on-write if we want to modify it in memory.
+    /// returns false if the file does not exist.
+    bool open(const char *path, bool copy_on_write = false) {
+      close();
+      #if defined(WIN32)
+        file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file_handle == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER file_size;
+        GetFileSizeEx(file_handle, &file_size);
+        size_ = (size_t)file_size.QuadPart;
+        if (size_ == 0) return true;
+        mapping_handle = CreateFileMappingA(file_handle, NULL, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+        if (mapping_handle) {
+          data_ = (uint8_t*)MapViewOfFile(mapping_handle, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+        }
+        if (data_) return true;
+        close();
+      #elif !OCTET_VITA
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+          size_ = (size_t)st.st_size;
+          if (size_ == 0) {
+            ::close(fd);
+            return true;
+          }
+          int prot = copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ;
+          void *addr = mmap(NULL, size_, prot, MAP_PRIVATE, fd, 0);
+          if (addr != MAP_FAILED) {
+            data_ = (uint8_t*)addr;
+            is_mapped = true;
+          }
+        }
+        ::close(fd);
+        if (is_mapped) return true;
+        size_ = 0;
+      #endif
+      return read_whole_file(path);
+    }
+
+    /// Create (or replace) a file of a given size and map it for writing.
+    /// Changes to writable_data() go to the file. returns false if the file could not be made.
+    bool create(const char *path, size_t size) {
+      close();
+      #if defined(WIN32)
+        file_handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file_handle == INVALID_HANDLE_VALUE) return false;
+        size_ = size;
+        if (size_ == 0) return true;
+        LARGE_INTEGER file_size;
+        file_size.QuadPart = (LONGLONG)size;
+        mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READWRITE, file_size.HighPart, file_size.LowPart, NULL);
+        if (mapping_handle) {
+          data_ = (uint8_t*)MapViewOfFile(mapping_handle, FILE_MAP_WRITE, 0, 0, 0);
+        }
+        if (data_) return true;
+      #elif !OCTET_VITA
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        size_ = size;
+        if (size_ == 0) {
+          ::close(fd);
+          return true;
+        }
+        if (ftruncate(fd, (off_t)size) == 0) {
+          void *addr = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+          if (addr != MAP_FAILED) {
+            data_ = (uint8_t*)addr;
+            is_mapped = true;
+          }
+        }
+        ::close(fd);
+        if (is_mapped) return true;
+      #endif
+      close();
+      return false;
+    }
+
+    /// Unmap the file. Any pointers into it become invalid.
+    void close() {
+      #if defined(WIN32)
+        if (data_ && data_ != buffer.data()) UnmapViewOfFile(data_);
+        if (mapping_handle) CloseHandle(mapping_handle);
+        if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+        file_handle = INVALID_HANDLE_VALUE;
+        mapping_handle = 0;
+      #elif !OCTET_VITA
+        if (is_mapped) munmap(data_, size_);
+        is_mapped = false;
+      #endif
+      buffer.reset();
+      data_ = 0;
+      size_ = 0;
+    }
+
+    /// Tell the OS that we are about to read a range, so that it can start paging it in.
+    void will_need(size_t offset, size_t bytes) {
+      #if !defined(WIN32) && !OCTET_VITA
+        if (!is_mapped || offset >= size_) return;
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = offset & ~(page - 1);
+        if (bytes > size_ - offset) bytes = size_ - offset;
+        madvise(data_ + start, offset + bytes - start, MADV_WILLNEED);
+      #endif
+    }
+
+    /// true if there is a file in memory (empty files do not count)
+    bool is_open() const {
+      return data_ != 0;
+    }
+
+    /// the start of the file in memory
+    const uint8_t *data() const {
+      return data_;
+    }
+
+    /// writable memory for copy-on-write mappings, changes are not written to the file.
+    uint8_t *writable_data() {
+      return data_;
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    /// Time the file was last written, or zero if it does not exist. Only useful for comparisons.
+    static uint64_t get_mtime(const char *path) {
+      #if defined(WIN32)
+        WIN32_FILE_ATTRIBUTE_DATA attr;
+        if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attr)) return 0;
+        return (uint64_t)attr.ftLastWriteTime.dwHighDateTime << 32 | attr.ftLastWriteTime.dwLowDateTime;
+      #elif !OCTET_VITA
+        struct stat st;
+        if (stat(path, &st) != 0) return 0;
+        return (uint64_t)st.st_mtime;
+      #else
+        return 0;
+      #endif
+    }
+  };
+}
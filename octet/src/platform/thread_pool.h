@@ -0,0 +1,242 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Worker threads for data-parallel loops
+//
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace octet {
+  /// A pool of worker threads for data-parallel loops.
+  ///
+  /// The calling thread joins in with the workers, so a pool with no workers
+  /// (eg. on a single core machine) simply runs the loop in the caller.
+  ///
+  /// Example
+  ///
+  ///     thread_pool::get().parallel_for(num_items, [&](unsigned i) {
+  ///       process(items[i]);
+  ///     });
+  ///
+  /// Only one loop runs on a pool at a time. A parallel_for issued from inside
+  /// another one (or from another thread while the pool is busy) runs serially.
+  /// set_num_threads can't be called from inside a loop.
+  ///
+  /// Which thread runs an item varies from run to run, so results must not depend on it.
+  /// parallel_ranges always makes the same ranges and parallel_reduce combines them in
+  /// the same order whatever the number of threads, so results are bitwise reproducible.
+  class thread_pool {
+    typedef void (*kernel_t)(void *context, unsigned index);
+
+    dynarray<std::thread*> workers;
+
+    // protects the batch state below
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+
+    // held for the duration of a batch
+    std::mutex batch_mutex;
+
+    // current batch
+    kernel_t kernel;
+    void *context;
+    unsigned count;
+    std::atomic<unsigned> next;
+    unsigned num_busy;
+    unsigned generation;
+    bool quit;
+
+    template <class fn_t> static void call_index(void *context, unsigned index) {
+      (*(fn_t*)context)(index);
+    }
+
+    // the pool whose loop this thread is running, if any.
+    static thread_pool *&current_pool() {
+      static thread_local thread_pool *pool = 0;
+      return pool;
+    }
+
+    // call a kernel for [begin, end) as part of this pool's loop.
+    void run_serial(kernel_t serial_kernel, void *serial_context, unsigned begin, unsigned end) {
+      thread_pool *outer = current_pool();
+      current_pool() = this;
+      for (unsigned i = begin; i != end; ++i) {
+        serial_kernel(serial_context, i);
+      }
+      current_pool() = outer;
+    }
+
+    void run_batch() {
+      thread_pool *outer = current_pool();
+      current_pool() = this;
+      for (unsigned i = next++; i < count; i = next++) {
+        kernel(context, i);
+      }
+      current_pool() = outer;
+    }
+
+    void worker(unsigned seen) {
+      std::unique_lock<std::mutex> lock(mutex);
+      for (;;) {
+        while (!quit && generation == seen) work_ready.wait(lock);
+        if (quit) return;
+        seen = generation;
+
+        lock.unlock();
+        run_batch();
+        lock.lock();
+
+        if (--num_busy == 0) work_done.notify_one();
+      }
+    }
+
+    static void worker_entry(thread_pool *pool, unsigned seen) {
+      pool->worker(seen);
+    }
+
+    void start_workers(unsigned num_threads) {
+      if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+      if (num_threads == 0) num_threads = 1;
+      for (unsigned i = 1; i < num_threads; ++i) {
+        workers.push_back(new std::thread(worker_entry, this, generation));
+      }
+    }
+
+    void stop_workers() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+      }
+      work_ready.notify_all();
+      for (unsigned i = 0; i != workers.size(); ++i) {
+        workers[i]->join();
+        delete workers[i];
+      }
+      workers.resize(0);
+      quit = false;
+    }
+
+    void run(unsigned new_count, kernel_t new_kernel, void *new_context) {
+      if (new_count == 0) return;
+
+      // a loop inside one of ours runs in this thread: the caller of the outer loop
+      // already holds batch_mutex and the workers are busy.
+      if (workers.size() == 0 || new_count == 1 || current_pool() == this || !batch_mutex.try_lock()) {
+        run_serial(new_kernel, new_context, 0, new_count);
+        return;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        kernel = new_kernel;
+        context = new_context;
+        count = new_count;
+        next = 0;
+        num_busy = workers.size();
+        generation++;
+      }
+      work_ready.notify_all();
+
+      run_batch();
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (num_busy != 0) work_done.wait(lock);
+      }
+      batch_mutex.unlock();
+    }
+
+  public:
+    /// Make a pool with num_threads threads including the caller.
+    /// Zero uses one thread per hardware core.
+    thread_pool(unsigned num_threads = 0) {
+      kernel = 0;
+      context = 0;
+      count = 0;
+      next = 0;
+      num_busy = 0;
+      generation = 0;
+      quit = false;
+      start_workers(num_threads);
+    }
+
+    ~thread_pool() {
+      stop_workers();
+    }
+
+    /// The shared pool, one thread per core.
+    static thread_pool &get() {
+      static thread_pool pool;
+      return pool;
+    }
+
+    /// Number of threads that run a loop, including the caller.
+    unsigned get_num_threads() const {
+      return workers.size() + 1;
+    }
+
+    /// Change the number of threads, including the caller. Zero uses one thread per hardware core.
+    /// Waits for any loop that is running. Returns false, and changes nothing, if called from
+    /// inside one of this pool's loops, which would never finish.
+    bool set_num_threads(unsigned num_threads) {
+      if (current_pool() == this) {
+        assert(0 && "thread_pool::set_num_threads called from inside a loop");
+        return false;
+      }
+      std::lock_guard<std::mutex> lock(batch_mutex);
+      stop_workers();
+      start_workers(num_threads);
+      return true;
+    }
+
+    /// Call fn(i) for every i in [0, count) and return when all calls are complete.
+    template <class fn_t> void parallel_for(unsigned count, fn_t fn) {
+      run(count, &call_index<fn_t>, (void*)&fn);
+    }
+
+    /// Split [0, count) into ranges of at most grain items and call fn(begin, end) for each.
+    /// Use this when the work per item is too small to schedule one at a time.
+    template <class fn_t> void parallel_ranges(unsigned count, unsigned grain, fn_t fn) {
+      if (grain == 0) grain = 1;
+      unsigned num_ranges = ( count + grain - 1 ) / grain;
+      parallel_for(num_ranges, [&](unsigned r) {
+        unsigned begin = r * grain;
+        unsigned end = begin + grain < count ? begin + grain : count;
+        fn(begin, end);
+      });
+    }
+
+    /// Reduce [0, count) to one value: fn(begin, end) returns the value of a range of at most grain
+    /// items and combine(a, b) joins two values. The ranges are combined in pairs in a fixed order,
+    /// so the result is the same for any number of threads. Returns zero if count is zero.
+    ///
+    ///     float total = thread_pool::get().parallel_reduce(n, 1024, 0.0f,
+    ///       [&](unsigned begin, unsigned end) { float s = 0; for (unsigned i = begin; i != end; ++i) s += x[i]; return s; },
+    ///       [](float a, float b) { return a + b; }
+    ///     );
+    template <class value_t, class fn_t, class combine_t>
+    value_t parallel_reduce(unsigned count, unsigned grain, const value_t &zero, fn_t fn, combine_t combine) {
+      if (grain == 0) grain = 1;
+      unsigned num_ranges = ( count + grain - 1 ) / grain;
+      if (num_ranges == 0) return zero;
+      dynarray<value_t> values(num_ranges);
+      parallel_ranges(count, grain, [&](unsigned begin, unsigned end) {
+        values[begin / grain] = fn(begin, end);
+      });
+      // pairwise: ((0 1) (2 3)) ((4 5) 6) ...
+      for (unsigned stride = 1; stride < num_ranges; stride *= 2) {
+        for (unsigned i = 0; i + stride < num_ranges; i += stride * 2) {
+          values[i] = combine(values[i], values[i + stride]);
+        }
+      }
+      return values[0];
+    }
+  };
+}
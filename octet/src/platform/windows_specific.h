@@ -71,6 +71,7 @@
 #define OCTET_HOT __forceinline
 
 #include <xmmintrin.h>
+#include <emmintrin.h>
 #define snprintf sprintf_s
 
 namespace octet {
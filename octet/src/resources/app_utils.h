@@ -38,11 +38,12 @@ namespace octet { namespace resources {
     }
 
     /// open a zip file for a given URL
+    /// archives are memory mapped so that members can be extracted in parallel with zip_file::get_files()
     static zip_file *get_zip_file(const char *url) {
       static dictionary<ref<zip_file> > zip_files;
       int index = zip_files.get_index(url);
       if (index == -1) {
-        return zip_files[url] = new zip_file(get_path(url));
+        return zip_files[url] = new zip_file(get_path(url), true);
       } else {
         return zip_files.get_value(index);
       }
@@ -115,6 +115,7 @@ OCTET_ATOM(mip_levels)
 OCTET_ATOM(cube_faces)
 OCTET_ATOM(src)
 OCTET_ATOM(view_pos)
+OCTET_ATOM(view_dir)
 OCTET_ATOM(font)
 OCTET_ATOM(font_info)
 OCTET_ATOM(text)
@@ -143,3 +144,12 @@ OCTET_ATOM(nnormal)
 OCTET_ATOM(npos)
 OCTET_ATOM(diffuse_light)
 OCTET_ATOM(specular_light)
+OCTET_ATOM(channels_lo)
+OCTET_ATOM(channels_hi)
+OCTET_ATOM(projection_lo)
+OCTET_ATOM(projection_hi)
+OCTET_ATOM(projection_offset)
+OCTET_ATOM(saturation_lo)
+OCTET_ATOM(saturation_hi)
+OCTET_ATOM(psize)
+OCTET_ATOM(point_scale)
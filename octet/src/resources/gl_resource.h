@@ -157,6 +157,12 @@ namespace octet { namespace resources {
       //glUnmapBuffer(target);
     }
 
+    /// release a write-only lock, sending only the first size bytes to OpenGL.
+    void unlock_write_only(unsigned size) const {
+      glBindBuffer(target, buffer);
+      glBufferSubData(target, 0, size < bytes.size() ? size : bytes.size(), &bytes[0]);
+    }
+
     /// bind the resource to the target
     void bind() const {
       glBindBuffer(target, buffer);
@@ -45,7 +45,7 @@ namespace octet { namespace resources {
     }
 
     bool begin_ref(void *ref, const char *sid, atom_t type) {
-      if (depth == max_depth) {
+      if (depth == max_depth || ref == NULL) {
         next().format("%*s{ \"data\": \"%s\" },\n", depth*2, "", sid);
         return false;
       } else {
@@ -60,8 +60,8 @@ namespace octet { namespace resources {
     }
 
     bool begin_ref(void *ref, int index, atom_t type) {
-      if (depth == max_depth) {
-        next().format("%*s{ \"data\": \"%d\",\n", depth*2, "", index);
+      if (depth == max_depth || ref == NULL) {
+        next().format("%*s{ \"data\": \"%d\" },\n", depth*2, "", index);
         return false;
       } else {
         next().format("%*s{ \"data\": \"%d\", children: [\n", depth*2, "", index);
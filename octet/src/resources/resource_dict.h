@@ -78,6 +78,19 @@ namespace octet { namespace resources {
       dict.reset();
     }
 
+    /// Add all the resources of another dictionary to this one.
+    void add_resources(resource_dict &rhs) {
+      for (unsigned i = 0; i != rhs.dict.get_num_indices(); ++i) {
+        const char *key = rhs.dict.get_key(i);
+        if (key) {
+          dict[key] = rhs.dict.get_value(i);
+        }
+      }
+      if (!active_scene) {
+        active_scene = rhs.active_scene;
+      }
+    }
+
     /// does the dictionary have this resource?
     bool has_resource(const char *name) {
       return dict.contains(name);
@@ -22,6 +22,8 @@
   #include "../resources/visitor.h"
   #include "../resources/binary_writer.h"
   #include "../resources/binary_reader.h"
+  #include "../resources/snapshot_writer.h"
+  #include "../resources/snapshot_reader.h"
   #include "../resources/xml_writer.h"
   #include "../resources/http_writer.h"
   #include "../resources/resource.h"
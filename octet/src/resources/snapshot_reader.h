@@ -0,0 +1,287 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// visitor for reading snapshot files.
+//
+
+namespace octet { namespace resources {
+  /// The snapshot reader is a visitor that loads a file written by snapshot_writer.
+  ///
+  /// The file is memory mapped and the structure is decoded straight from memory,
+  /// so there is no per-field file i/o. Runs of scalar fields are checked once and
+  /// each field is then a compare of its tag and a copy. POD arrays are 16 byte
+  /// aligned in the mapping and are copied in slices on the thread pool, or can be
+  /// used in place with get_blob() while the reader exists.
+  ///
+  /// Example
+  ///
+  ///     resource_dict dict;
+  ///     snapshot_reader reader("scene.snap");
+  ///     dict.visit(reader);
+  ///     if (reader.get_error()) ...
+  class snapshot_reader : public visitor {
+    dynarray<void *> id_to_ref;
+    mapped_file file;
+
+    const uint8_t *src;
+    const uint8_t *src_max;
+    const uint8_t *blobs;
+    unsigned blob_size;
+
+    // the run of scalar fields being read: type, sid and size of each field, then their data.
+    const uint8_t *run_tags;
+    const uint8_t *run_data;
+    unsigned run_left;
+
+    static unsigned u4(const uint8_t *p) {
+      return p[0] + (p[1] << 8) + (p[2] << 16) + ((unsigned)p[3] << 24);
+    }
+
+    int read_int() {
+      // a run must be used up before the next part of the structure.
+      if (src_max - src < 4 || run_left) {
+        set_error(true);
+        return 0;
+      }
+      int value = (int)u4(src);
+      src += 4;
+      return value;
+    }
+
+    atom_t read_atom() {
+      return (atom_t)read_int();
+    }
+
+    // strings are used in place, they are zero terminated in the file.
+    const char *read_string() {
+      unsigned len = (unsigned)read_int();
+      if (get_error() || len >= (unsigned)(src_max - src) || src[len] != 0) {
+        set_error(true);
+        return "";
+      }
+      const char *result = (const char*)src;
+      src += len + 1;
+      return result;
+    }
+
+    // check the header, tags and size of a run once, so that its fields need no bounds checks.
+    bool begin_run() {
+      int marker = read_int();
+      unsigned count = (unsigned)read_int();
+      unsigned bytes = (unsigned)read_int();
+      size_t left = (size_t)(src_max - src);
+      if (get_error() || marker != snapshot_writer::field_run || !count || count > left / 12 || bytes > left - count * 12) {
+        log("snapshot error: expected fields\n");
+        set_error(true);
+        return false;
+      }
+      size_t total = 0;
+      for (unsigned i = 0; i != count; ++i) {
+        total += u4(src + i * 12 + 8);
+      }
+      if (total != bytes) {
+        log("snapshot error: bad field sizes\n");
+        set_error(true);
+        return false;
+      }
+      run_tags = src;
+      run_data = src + count * 12;
+      run_left = count;
+      src = run_data + bytes;
+      return true;
+    }
+
+    bool check_atom(atom_t sid) {
+      if (!get_error()) {
+        atom_t test = read_atom();
+        if (test != sid) {
+          log("snapshot error: expected %s\n", app_utils::get_atom_name(sid));
+          set_error(true);
+        }
+      }
+      return get_error();
+    }
+
+    void *get_ref(int id) {
+      if (id == (int)id_to_ref.size()) {
+        return NULL;
+      } else if (id < 0 || id > (int)id_to_ref.size()) {
+        log("snapshot error: id overflow\n");
+        set_error(true);
+        return NULL;
+      } else {
+        return id_to_ref[id];
+      }
+    }
+
+    // dynarray currently being read
+    unsigned dynarray_offset;
+
+  public:
+    /// Map a snapshot file for reading.
+    /// offset skips a header of the caller's, as written by snapshot_writer::save(FILE*).
+    snapshot_reader(const char *path, unsigned offset = 0) {
+      id_to_ref.reserve(256);
+      id_to_ref.push_back(NULL);
+      src = src_max = blobs = NULL;
+      blob_size = 0;
+      run_tags = run_data = NULL;
+      run_left = 0;
+      dynarray_offset = 0;
+
+      const uint8_t *p = file.open(path) && file.size() >= offset ? file.data() + offset : NULL;
+      size_t size = p ? file.size() - offset : 0;
+      if (
+        !p || size < snapshot_writer::header_size ||
+        memcmp(p, "octsnap", 8) || u4(p + 8) != 0x01020304 || u4(p + 12) != snapshot_writer::version
+      ) {
+        log("snapshot error: %s is not a snapshot\n", path);
+        set_error(true);
+        return;
+      }
+
+      unsigned structure_offset = u4(p + 16);
+      unsigned structure_size = u4(p + 20);
+      unsigned blob_offset = u4(p + 24);
+      blob_size = u4(p + 28);
+      if (
+        structure_offset > size || structure_size > size - structure_offset ||
+        blob_offset > size || blob_size > size - blob_offset ||
+        (blob_offset & (snapshot_writer::blob_alignment-1))
+      ) {
+        log("snapshot error: %s is truncated\n", path);
+        set_error(true);
+        return;
+      }
+
+      src = p + structure_offset;
+      src_max = src + structure_size;
+      blobs = p + blob_offset;
+
+      // start reading the array data while we decode the structure.
+      file.will_need(offset + blob_offset, blob_size);
+    }
+
+    /// This function returns true to indicate that this is a reader
+    bool is_reader() {
+      return true;
+    }
+
+    /// register a reference after creating a new object
+    void add_new_ref(void *ref) {
+      id_to_ref.push_back(ref);
+    }
+
+    /// Read an aggregate object such as a struct or array.
+    bool begin_ref(void *ref, atom_t sid, atom_t type) {
+      return !check_atom(type) && !check_atom(sid);
+    }
+
+    /// When loading a reference in an array, call this function
+    bool begin_ref(void *ref, int index, atom_t type) { return false; }
+
+    /// When loading a reference in a dictionary, call this function
+    bool begin_ref(void *ref, const char *sid, atom_t type) { return false; }
+
+    /// Read a regular reference embeded in a class.
+    bool begin_read_ref(void *&ref, atom_t &sid, atom_t &type) {
+      type = read_atom();
+      sid = read_atom();
+      ref = get_ref(read_int());
+      return !get_error();
+    }
+
+    /// Read an array reference
+    bool begin_read_ref(void *&ref, int index, atom_t &type) {
+      type = read_atom();
+      ref = get_ref(read_int());
+      return !get_error();
+    }
+
+    /// Read a dictionary reference
+    bool begin_read_ref(void *&ref, const char *&sid, atom_t &type) {
+      type = read_atom();
+      sid = read_string();
+      ref = get_ref(read_int());
+      return !get_error();
+    }
+
+    /// Read an aggregate such as an array or struct.
+    bool begin_agg(void *ref, atom_t sid, atom_t type) {
+      return !check_atom(type) && !check_atom(sid);
+    }
+
+    /// Begin reading a dynarray
+    unsigned begin_read_dynarray(unsigned elem_size, atom_t &sid) {
+      if (!check_atom(atom_dynarray) && !check_atom(sid)) {
+        unsigned bytes = (unsigned)read_int();
+        dynarray_offset = (unsigned)read_int();
+        if (get_error() || dynarray_offset > blob_size || bytes > blob_size - dynarray_offset) {
+          set_error(true);
+          return 0;
+        }
+        return bytes / elem_size;
+      }
+      return 0;
+    }
+
+    /// finish reading a dynarray from the mapped blob.
+    /// big arrays are copied in slices on the thread pool, which also shares out the page faults of the new memory.
+    void end_read_dynarray(void *ptr, unsigned bytes) {
+      if (!get_error() && bytes) {
+        const uint8_t *blob = blobs + dynarray_offset;
+        thread_pool::get().parallel_ranges(bytes, 1 << 18, [=](unsigned begin, unsigned end) {
+          memcpy((uint8_t*)ptr + begin, blob + begin, end - begin);
+        });
+      }
+    }
+
+    /// called after visiting a new object
+    void end_ref() {
+      check_atom(atom_end_ref);
+    }
+
+    /// called before reading an array or dictionary
+    bool begin_refs(atom_t sid, int &size, bool is_dict) {
+      if (!check_atom(sid) && !check_atom(atom_begin_refs)) {
+        size = read_int();
+        return !get_error();
+      }
+      return false;
+    }
+
+    /// called after reading an array or dictionary
+    void end_refs(bool is_dict) {
+    }
+
+    /// Read a scalar field from the current run. The contents are opaque.
+    void visit_bin(void *value, size_t size, atom_t sid, atom_t type) {
+      if (get_error() || (!run_left && !begin_run())) return;
+      if (u4(run_tags) != (unsigned)type || u4(run_tags + 4) != (unsigned)sid || u4(run_tags + 8) != size) {
+        log("snapshot error: expected %s\n", app_utils::get_atom_name(sid));
+        set_error(true);
+        return;
+      }
+      memcpy(value, run_data, size);
+      run_tags += 12;
+      run_data += size;
+      run_left--;
+    }
+
+    /// Read a string object.
+    void visit_string(string &value, atom_t sid) {
+      if (!check_atom(atom_string) && !check_atom(sid)) {
+        value = read_string();
+      }
+    }
+
+    /// Get a pointer to the blob section of the mapped file.
+    /// Offsets are those written by snapshot_writer and are 16 byte aligned.
+    const uint8_t *get_blob(unsigned offset) const {
+      return offset < blob_size ? blobs + offset : NULL;
+    }
+  };
+} }
@@ -0,0 +1,260 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// visitor for writing snapshot files.
+//
+
+namespace octet { namespace resources {
+  /// The snapshot writer is a visitor that writes a file for fast loading with snapshot_reader.
+  ///
+  /// The file has the same structure as a binary_writer file, but POD arrays such
+  /// as vertex, index and animation data are moved out of the structure into a
+  /// blob section with every array 16 byte aligned. The reader maps the file and
+  /// copies each array in one go, or uses the blob directly.
+  ///
+  /// Scalar fields that are visited one after another (vectors, matrices, ints)
+  /// are written as a run: a header, the type, sid and size of each field, then
+  /// the data of all of them, so that the reader checks the run once and then
+  /// copies each field straight out of it.
+  ///
+  /// Layout (little endian 32 bit words):
+  ///
+  ///     "octsnap\0"   magic
+  ///     0x01020304    byte order check
+  ///     version
+  ///     structure offset, structure size
+  ///     blob offset, blob size
+  ///     ... structure ...       runs are field_run, count, bytes, count * (type, sid, size), data
+  ///     ... blobs, 16 byte aligned ...
+  ///
+  /// Example
+  ///
+  ///     snapshot_writer writer;
+  ///     dict->visit(writer);
+  ///     writer.save("scene.snap");
+  class snapshot_writer : public visitor {
+    hash_map<void *, int> refs;
+    int next_id;
+
+    dynarray<uint8_t> structure;
+    dynarray<uint8_t> blobs;
+
+    // scalar fields waiting to be written as one run.
+    dynarray<uint8_t> run_tags;
+    dynarray<uint8_t> run_data;
+    unsigned run_count;
+
+    static void append(dynarray<uint8_t> &dest, const void *src, size_t bytes) {
+      unsigned pos = dest.size();
+      dest.resize(pos + (unsigned)bytes);
+      if (bytes) memcpy(&dest[pos], src, bytes);
+    }
+
+    static void append_int(dynarray<uint8_t> &dest, int value) {
+      uint8_t b[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+      append(dest, b, 4);
+    }
+
+    // anything other than a scalar field ends the run.
+    void write(const void *src, size_t bytes) {
+      flush_run();
+      append(structure, src, bytes);
+    }
+
+    void write_int(int value) {
+      flush_run();
+      append_int(structure, value);
+    }
+
+    void flush_run() {
+      if (!run_count) return;
+      append_int(structure, field_run);
+      append_int(structure, (int)run_count);
+      append_int(structure, (int)run_data.size());
+      append(structure, run_tags.data(), run_tags.size());
+      append(structure, run_data.data(), run_data.size());
+      run_tags.resize(0);
+      run_data.resize(0);
+      run_count = 0;
+    }
+
+    void write_atom(atom_t value) {
+      write_int((int)value);
+    }
+
+    void write_string(const char *value) {
+      unsigned len = (unsigned)strlen(value);
+      write_int((int)len);
+      write(value, len + 1);
+    }
+
+    /// add a blob at a 16 byte aligned offset in the blob section and return the offset.
+    unsigned write_blob(const void *src, size_t bytes) {
+      unsigned old_size = blobs.size();
+      unsigned pos = ( old_size + (blob_alignment-1) ) & ~(blob_alignment-1);
+      blobs.resize(pos + (unsigned)bytes);
+      if (pos != old_size) memset(&blobs[old_size], 0, pos - old_size);
+      if (bytes) memcpy(&blobs[pos], src, bytes);
+      return pos;
+    }
+
+    int get_id(void *ref, bool &is_new) {
+      int &id = refs[ref];
+      is_new = id == 0;
+      if (is_new) {
+        id = next_id++;
+      }
+      return id;
+    }
+
+  public:
+    enum {
+      version = 2,
+      header_size = 32,
+      blob_alignment = 16,
+      field_run = -2,
+    };
+
+    /// Construct a snapshot writer. Visit the root object, then call save().
+    snapshot_writer() {
+      next_id = 1;
+      run_count = 0;
+      structure.reserve(4096);
+    }
+
+    /// write the header, structure and blobs to a file.
+    /// returns false if the file could not be written.
+    bool save(const char *path) {
+      FILE *file = fopen(path, "wb");
+      if (!file) return false;
+      bool ok = save(file);
+      fclose(file);
+      return ok;
+    }
+
+    /// write the snapshot at the current position of an open file, after any header of the caller's.
+    /// Offsets in the snapshot are from its start, which should be a multiple of blob_alignment in the file.
+    bool save(FILE *file) {
+      flush_run();
+
+      unsigned structure_offset = header_size;
+      unsigned blob_offset = ( structure_offset + structure.size() + (blob_alignment-1) ) & ~(blob_alignment-1);
+
+      uint8_t header[header_size];
+      memset(header, 0, sizeof(header));
+      memcpy(header, "octsnap", 8);
+      uint32_t words[] = { 0x01020304, version, structure_offset, structure.size(), blob_offset, blobs.size() };
+      for (unsigned i = 0; i != 6; ++i) {
+        uint32_t w = words[i];
+        uint8_t *p = header + 8 + i * 4;
+        p[0] = (uint8_t)w; p[1] = (uint8_t)(w >> 8); p[2] = (uint8_t)(w >> 16); p[3] = (uint8_t)(w >> 24);
+      }
+
+      static const uint8_t zeros[blob_alignment] = { 0 };
+      bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+      if (structure.size()) ok = ok && fwrite(&structure[0], 1, structure.size(), file) == structure.size();
+      ok = ok && fwrite(zeros, 1, blob_offset - (structure_offset + structure.size()), file) == blob_offset - (structure_offset + structure.size());
+      if (blobs.size()) ok = ok && fwrite(&blobs[0], 1, blobs.size(), file) == blobs.size();
+      return ok;
+    }
+
+    /// Write a dictionary entry.
+    bool begin_ref(void *ref, const char *sid, atom_t type) {
+      if (ref == NULL) {
+        write_atom(atom_);
+        write_string(sid);
+        write_int(0);
+        return false;
+      } else {
+        bool is_new;
+        int id = get_id(ref, is_new);
+        write_atom(type);
+        write_string(sid);
+        write_int(id);
+        return is_new;
+      }
+    }
+
+    /// Write an ordinary ref embedded in a class.
+    bool begin_ref(void *ref, atom_t sid, atom_t type) {
+      if (ref == NULL) {
+        write_atom(atom_);
+        write_atom(sid);
+        write_int(0);
+        return false;
+      } else {
+        bool is_new;
+        int id = get_id(ref, is_new);
+        write_atom(type);
+        write_atom(sid);
+        write_int(id);
+        return is_new;
+      }
+    }
+
+    /// Write an array entry
+    bool begin_ref(void *ref, int index, atom_t type) {
+      if (ref == NULL) {
+        write_atom(atom_);
+        write_int(0);
+        return false;
+      } else {
+        bool is_new;
+        int id = get_id(ref, is_new);
+        write_atom(type);
+        write_int(id);
+        return is_new;
+      }
+    }
+
+    /// finish writing a reference
+    void end_ref() {
+      write_atom(atom_end_ref);
+    }
+
+    /// Begin writing an aggregate
+    bool begin_agg(void *ref, atom_t sid, atom_t type) {
+      write_atom(type);
+      write_atom(sid);
+      return true;
+    }
+
+    /// Begin writing array or dictionary references
+    bool begin_refs(atom_t sid, int &size, bool is_dict) {
+      write_atom(sid);
+      write_atom(atom_begin_refs);
+      write_int(size);
+      return true;
+    }
+
+    /// End writing array or dictionary references
+    void end_refs(bool is_dict) {
+    }
+
+    /// Write an opaque binary object. POD arrays go to the blob section, other fields to the current run.
+    void visit_bin(void *value, size_t size, atom_t sid, atom_t type) {
+      if (type == atom_dynarray) {
+        write_atom(type);
+        write_atom(sid);
+        write_int((int)size);
+        write_int((int)write_blob(value, size));
+      } else {
+        append_int(run_tags, (int)type);
+        append_int(run_tags, (int)sid);
+        append_int(run_tags, (int)size);
+        append(run_data, value, size);
+        run_count++;
+      }
+    }
+
+    /// Write a string
+    void visit_string(string &value, atom_t sid) {
+      write_atom(atom_string);
+      write_atom(sid);
+      write_string(value);
+    }
+  };
+} }
@@ -41,49 +41,130 @@ namespace octet { namespace resources {
       return (int16_t)(src[0] + src[1] * 256);
     }
 
-  public:
-    /// Open a zip file for reading
-    zip_file(const char *filename) {
-      ref_cnt = 0;
-      the_file = fopen(filename, "rb");
-      if (!the_file) {
-        printf("file %s not found\n", filename);
+    /// in mapped mode, the whole archive is in memory
+    mapped_file mapping;
+
+    /// copy bytes from the archive, returns false if out of range.
+    bool read_bytes(void *dest, long offset, unsigned size) {
+      if (mapping.is_open()) {
+        if (offset < 0 || (size_t)offset + size > mapping.size()) return false;
+        memcpy(dest, mapping.data() + offset, size);
+        return true;
       } else {
-        uint8_t tmp[256];
-        unsigned tmp_size = (unsigned)sizeof(tmp);
-        fseek(the_file, 0, SEEK_END);
-        long file_size = ftell(the_file);
-        long search_offset = file_size - (long)tmp_size;
-        search_offset = search_offset < 0 ? 0 : search_offset;
-        fseek(the_file, search_offset, SEEK_SET);
-        fread(&tmp, 1, tmp_size, the_file);
-        for( unsigned i = 0; i != tmp_size; ++i) {
-          if (u4(tmp + i) == 0x06054b50) {
-            dynarray<uint8_t> dir;
-            dir.resize(u4(tmp + i + 12));
-            fseek(the_file, (long)u4(tmp + i + 16), SEEK_SET);
-            fread(&dir[0], 1, dir.size(), the_file);
-            for (unsigned i = 0; i + 4 < dir.size();) {
-              uint8_t *p = &dir[i];
-              if (u4(p) != 0x02014b50) break;
-              struct dir_entry d;
-              d.compression = u2(p + 10);
-              d.csize = u4(p + 20);
-              d.usize = u4(p + 24);
-              unsigned file_name_len = u2(p + 28);
-              unsigned extra_len = u2(p + 30);
-              string file;
-              file.set((const char*)(p + 46), file_name_len);
-              i += 46 + file_name_len + extra_len;
-              d.offset = u4(p + 42);// + (46 + file_name_len + extra_len);
-              for (unsigned i = 0; file[i]; ++i) {
-                if (file[i] == '\\') file[i] = '/';
-              }
-              //printf("%s\n", file.c_str());
-              directory[file] = d;
+        fseek(the_file, offset, SEEK_SET);
+        return fread(dest, 1, size, the_file) == size;
+      }
+    }
+
+    /// find the central directory at the end of the file and read it.
+    void read_directory(long file_size) {
+      uint8_t tmp[256];
+      unsigned tmp_size = (unsigned)sizeof(tmp);
+      long search_offset = file_size - (long)tmp_size;
+      search_offset = search_offset < 0 ? 0 : search_offset;
+      tmp_size = (unsigned)(file_size - search_offset);
+      if (!read_bytes(tmp, search_offset, tmp_size)) return;
+      for( unsigned i = 0; i + 20 <= tmp_size; ++i) {
+        if (u4(tmp + i) == 0x06054b50) {
+          dynarray<uint8_t> dir;
+          dir.resize(u4(tmp + i + 12));
+          if (!read_bytes(dir.data(), (long)u4(tmp + i + 16), dir.size())) return;
+          for (unsigned i = 0; i + 46 <= dir.size();) {
+            uint8_t *p = &dir[i];
+            if (u4(p) != 0x02014b50) break;
+            struct dir_entry d;
+            d.compression = u2(p + 10);
+            d.csize = u4(p + 20);
+            d.usize = u4(p + 24);
+            unsigned file_name_len = u2(p + 28);
+            unsigned extra_len = u2(p + 30);
+            unsigned comment_len = u2(p + 32);
+            // a truncated directory would have us read the name past the end.
+            if (i + 46 + file_name_len + extra_len + comment_len > dir.size()) break;
+            string file;
+            file.set((const char*)(p + 46), file_name_len);
+            i += 46 + file_name_len + extra_len + comment_len;
+            d.offset = u4(p + 42);// + (46 + file_name_len + extra_len);
+            for (unsigned i = 0; file[i]; ++i) {
+              if (file[i] == '\\') file[i] = '/';
             }
-            break;
+            //printf("%s\n", file.c_str());
+            directory[file] = d;
           }
+          break;
+        }
+      }
+    }
+
+    /// offset of the first byte of member data, skipping the local header, or -1 if broken.
+    long data_offset(const dir_entry &d) {
+      /*local file header signature     4 bytes  (0x04034b50) 0
+      version needed to extract       2 bytes 4
+      general purpose bit flag        2 bytes 6
+      compression method              2 bytes 8
+      last mod file time              2 bytes 10
+      last mod file date              2 bytes 12
+      crc-32                          4 bytes 14
+      compressed size                 4 bytes 18
+      uncompressed size               4 bytes 22
+      file name length                2 bytes 26
+      extra field length              2 bytes 28 / 30*/
+
+      uint8_t tmp[30];
+      if (!read_bytes(tmp, d.offset, sizeof(tmp))) return -1;
+      if (u4(tmp) != 0x04034b50) return -1;
+      unsigned extra = u2(tmp + 26) + u2(tmp + 28);
+      long offset = d.offset + 30 + extra;
+      if (mapping.is_open() && (size_t)offset + d.csize > mapping.size()) return -1;
+      return offset;
+    }
+
+    /// read the compressed bytes of a member, returns false if the entry is broken.
+    bool read_member(dynarray<uint8_t> &comp, const dir_entry &d) {
+      long offset = data_offset(d);
+      if (offset < 0) return false;
+      comp.resize(d.csize + 4); // note: + 4 bytes prevents decode() overflowing
+      return read_bytes(comp.data(), offset, d.csize);
+    }
+
+    /// the compressed bytes of a member in the mapping, or NULL.
+    const uint8_t *mapped_member(const dir_entry &d) {
+      long offset = data_offset(d);
+      return offset < 0 ? NULL : mapping.data() + offset;
+    }
+
+    static bool uncompress(zip_decoder &dec, dynarray<uint8_t> &buffer, const dir_entry &d, const uint8_t *src) {
+      buffer.resize(d.usize);
+      if (d.compression == 0) {
+        if (d.csize != d.usize) return false;
+        memcpy(buffer.data(), src, d.usize);
+        return true;
+      } else if (d.compression == 8) {
+        return dec.inflate(buffer.data(), buffer.data() + d.usize, src, src + d.csize);
+      }
+      return false;
+    }
+
+  public:
+    /// Open a zip file for reading.
+    /// A mapped archive is read directly from memory; stored members can be used
+    /// without copying (see get_view) and members can be extracted in parallel (see get_files).
+    zip_file(const char *filename, bool mapped = false) {
+      ref_cnt = 0;
+      the_file = NULL;
+      if (mapped) {
+        if (!mapping.open(filename)) {
+          printf("file %s not found\n", filename);
+        } else {
+          read_directory((long)mapping.size());
+        }
+      } else {
+        the_file = fopen(filename, "rb");
+        if (!the_file) {
+          printf("file %s not found\n", filename);
+        } else {
+          fseek(the_file, 0, SEEK_END);
+          read_directory(ftell(the_file));
         }
       }
     }
@@ -100,43 +181,159 @@ namespace octet { namespace resources {
 
     /// allow ref<zip_file>
     void release() {
-      if (--ref_cnt) {
+      if (--ref_cnt == 0) {
         delete this;
       }
     }
 
+    /// true if the archive was opened in mapped mode
+    bool is_mapped() const {
+      return mapping.is_open();
+    }
+
+    /// true if the archive contains this file.
+    bool contains(const char *file) {
+      return directory.get_index(file) >= 0;
+    }
+
     /// get a file from a zip file, this is called from get_url with a zip:// prefix.
+    /// Note: uses a shared decoder, so call from one thread at a time.
     void get_file(dynarray<uint8_t> &buffer, const char *file) {
       int index = directory.get_index(file);
       if (index < 0) return;
-      if (!the_file) return;
+      if (!the_file && !mapping.is_open()) return;
       const dir_entry &d = directory.get_value(index);
-      buffer.resize(d.usize);
-      fseek(the_file, d.offset, SEEK_SET);
-      /*local file header signature     4 bytes  (0x04034b50) 0
-      version needed to extract       2 bytes 4
-      general purpose bit flag        2 bytes 6
-      compression method              2 bytes 8
-      last mod file time              2 bytes 10
-      last mod file date              2 bytes 12
-      crc-32                          4 bytes 14
-      compressed size                 4 bytes 18
-      uncompressed size               4 bytes 22
-      file name length                2 bytes 26
-      extra field length              2 bytes 28 / 30*/
+      if (mapping.is_open()) {
+        const uint8_t *src = mapped_member(d);
+        if (src) uncompress(decoder, buffer, d, src);
+      } else {
+        dynarray<uint8_t> comp;
+        if (read_member(comp, d)) uncompress(decoder, buffer, d, comp.data());
+      }
+    }
 
-      uint8_t tmp[30];
-      fread(tmp, 1, sizeof(tmp), the_file);
-      if (u4(tmp) != 0x04034b50) return;
-      unsigned extra = u2(tmp + 26) + u2(tmp + 28);
-      fseek(the_file, d.offset + 30 + extra, SEEK_SET);
-      if (d.compression == 0) {
-        fread(buffer.data(), 1, d.usize, the_file);
-      } else if (d.compression == 8) {
-        dynarray<uint8_t> uncomp(d.csize + 4); // note: + 4 bytes prevents decode() overflowing
-        fread(uncomp.data(), 1, d.csize, the_file);
-        decoder.decode(buffer.data(), buffer.data() + d.usize, uncomp.data(), uncomp.data() + d.csize);
+    /// In mapped mode, get a stored (uncompressed) file without copying it.
+    /// The data is valid for as long as the zip_file exists.
+    /// returns false if the file is compressed, missing or the archive is not mapped.
+    bool get_view(const char *file, const uint8_t *&data, unsigned &size) {
+      int index = directory.get_index(file);
+      if (index < 0 || !mapping.is_open()) return false;
+      const dir_entry &d = directory.get_value(index);
+      if (d.compression != 0 || d.csize != d.usize) return false;
+      data = mapped_member(d);
+      size = d.usize;
+      return data != NULL;
+    }
+
+    /// Get a batch of files, inflating them on the thread pool.
+    /// buffers[i] receives files[i]; missing or broken files give an empty buffer.
+    ///
+    /// Example
+    ///
+    ///     const char *files[] = { "big.fnt", "big_0.gif" };
+    ///     dynarray<uint8_t> buffers[2];
+    ///     zip->get_files(buffers, files, 2);
+    void get_files(dynarray<uint8_t> *buffers, const char *const *files, unsigned num_files) {
+      if (!the_file && !mapping.is_open()) return;
+
+      // find the sources serially: file reads share one FILE and the directory is not thread safe.
+      dynarray<const dir_entry*> entries(num_files);
+      dynarray<const uint8_t*> sources(num_files);
+      dynarray<dynarray<uint8_t> > comp(mapping.is_open() ? 0 : num_files);
+      for (unsigned i = 0; i != num_files; ++i) {
+        int index = directory.get_index(files[i]);
+        entries[i] = index < 0 ? NULL : &directory.get_value(index);
+        sources[i] = NULL;
+        buffers[i].resize(0);
+        if (!entries[i]) continue;
+        if (mapping.is_open()) {
+          sources[i] = mapped_member(*entries[i]);
+          mapping.will_need(sources[i] ? sources[i] - mapping.data() : 0, entries[i]->csize);
+        } else if (read_member(comp[i], *entries[i])) {
+          sources[i] = comp[i].data();
+        }
+      }
+
+      thread_pool::get().parallel_for(num_files, [&](unsigned i) {
+        if (!sources[i]) return;
+        zip_decoder *dec = new zip_decoder();
+        if (!uncompress(*dec, buffers[i], *entries[i], sources[i])) buffers[i].resize(0);
+        delete dec;
+      });
+    }
+
+    /// log the inflate throughput of the fast and reference decoders for each compressed member.
+    /// returns false if the archive is missing or the decoders disagree on any member.
+    bool benchmark() {
+      if (!the_file && !mapping.is_open()) return false;
+      bool ok = true;
+      double total_fast = 0, total_reference = 0, total_bytes = 0;
+      for (unsigned i = 0; i != directory.get_num_indices(); ++i) {
+        const char *name = directory.get_key(i);
+        if (!name) continue;
+        const dir_entry &d = directory.get_value(i);
+        dynarray<uint8_t> comp;
+        if (d.compression != 8 || !d.usize || !read_member(comp, d)) continue;
+        double fast_mbps = 0, reference_mbps = 0;
+        if (!decoder.benchmark(comp.data(), comp.data() + d.csize, d.usize, fast_mbps, reference_mbps)) {
+          log("inflate %s: fast and reference decoders differ\n", name);
+          ok = false;
+          continue;
+        }
+        log("inflate %s %d->%d bytes: fast %.1f MB/s reference %.1f MB/s\n", name, d.csize, d.usize, fast_mbps, reference_mbps);
+
+        // accumulate seconds per byte so that the totals are a size weighted average.
+        total_bytes += d.usize;
+        total_fast += d.usize / fast_mbps;
+        total_reference += d.usize / reference_mbps;
+      }
+      if (total_bytes) {
+        log("inflate total: fast %.1f MB/s reference %.1f MB/s\n", total_bytes / total_fast, total_bytes / total_reference);
+      }
+      return ok;
+    }
+
+    /// log the time to extract every member one at a time with get_file and as one batch with get_files.
+    /// returns false if the archive is missing or the two give different bytes.
+    bool benchmark_batch() {
+      if (!the_file && !mapping.is_open()) return false;
+      dynarray<const char*> files;
+      for (unsigned i = 0; i != directory.get_num_indices(); ++i) {
+        const char *name = directory.get_key(i);
+        if (name) files.push_back(name);
+      }
+      unsigned num_files = files.size();
+      dynarray<dynarray<uint8_t> > serial(num_files), batch(num_files);
+
+      // repeat each way until we have a measurable time.
+      const double min_time = 0.25;
+      double seconds[2];
+      for (unsigned pass = 0; pass != 2; ++pass) {
+        unsigned runs = 0;
+        double start = get_time_seconds(), elapsed = 0;
+        do {
+          if (pass == 0) {
+            for (unsigned i = 0; i != num_files; ++i) get_file(serial[i], files[i]);
+          } else {
+            get_files(batch.data(), files.data(), num_files);
+          }
+          runs++;
+          elapsed = get_time_seconds() - start;
+        } while (elapsed < min_time);
+        seconds[pass] = elapsed / runs;
+      }
+
+      bool ok = true;
+      for (unsigned i = 0; i != num_files; ++i) {
+        if (serial[i].size() != batch[i].size() || memcmp(serial[i].data(), batch[i].data(), serial[i].size())) {
+          log("extract %s: get_file and get_files differ\n", files[i]);
+          ok = false;
+        }
       }
+      log("extract %d files on %d threads: get_file %.3fms get_files %.3fms\n",
+        num_files, thread_pool::get().get_num_threads(), seconds[0] * 1000, seconds[1] * 1000
+      );
+      return ok;
     }
   };
 } }
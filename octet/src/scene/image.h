@@ -13,6 +13,11 @@
 
 namespace octet { namespace scene {
   /// Image from a file. Stored as an array of bytes for later conversion to GL resource.
+  ///
+  /// On load, 2D RGB and RGBA images get a full mip chain and are optionally DXT compressed
+  /// (see set_import_options). Both run on the thread pool. If cache_dir() or memory_cache_limit()
+  /// is set, the results are cached by a hash of the pixels and options, so loading the same
+  /// texture again skips the processing. Neither is set by default.
   class image : public resource {
     // primary attributes (to save)
 
@@ -46,6 +51,9 @@ namespace octet { namespace scene {
       mip_levels = 1;
       cube_faces = 1;
       format = 0;
+      filter = filter_box;
+      srgb = false;
+      compress = false;
     }
 
     // these are here to avoid including glext.h which may be platform dependent.
@@ -63,153 +71,541 @@ namespace octet { namespace scene {
       COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
     };
 
-    /// Make mipmaps for this image.
+    // how load() processes the image
+    uint8_t filter;
+    bool srgb;
+    bool compress;
+
+    enum {
+      // texels per task when filtering and compressing.
+      texels_per_task = 65536,
+
+      // change this when the processing changes to invalidate the cache.
+      cache_version = 1,
+    };
+
+    // a filter tap: source texel offset from 2x and a weight in 1/256 units.
+    struct filter_tap {
+      int offset;
+      int weight;
+    };
+
+    // taps for downsampling by two.
+    // The lanczos taps are a=2 lanczos sampled at 0.5, 1.5 and 2.5 texels.
+    static const filter_tap *get_taps(unsigned filter, unsigned &num_taps) {
+      static const filter_tap box[] = { { 0, 128 }, { 1, 128 } };
+      static const filter_tap lanczos[] = { { -2, -10 }, { -1, 29 }, { 0, 109 }, { 1, 109 }, { 2, 29 }, { 3, -10 } };
+      if (filter == filter_lanczos) {
+        num_taps = 6;
+        return lanczos;
+      } else {
+        num_taps = 2;
+        return box;
+      }
+    }
+
+    // tables between 8 bit colour and 12 bit linear light, either sRGB or a plain shift.
+    struct linear_tables {
+      uint16_t to_srgb[256];
+      uint16_t to_linear[256];
+      uint8_t from_srgb[4096];
+      uint8_t from_linear[4096];
+
+      linear_tables() {
+        for (unsigned i = 0; i != 256; ++i) {
+          float c = i * (1.0f/255);
+          float l = c <= 0.04045f ? c * (1.0f/12.92f) : powf((c + 0.055f) * (1.0f/1.055f), 2.4f);
+          to_srgb[i] = (uint16_t)( l * 4095 + 0.5f );
+          to_linear[i] = (uint16_t)( i * 16 + ( i >> 4 ) );
+        }
+        for (unsigned i = 0; i != 4096; ++i) {
+          float l = i * (1.0f/4095);
+          float c = l <= 0.0031308f ? l * 12.92f : 1.055f * powf(l, 1.0f/2.4f) - 0.055f;
+          from_srgb[i] = (uint8_t)( c * 255 + 0.5f );
+          from_linear[i] = (uint8_t)( ( i * 255 + 2047 ) / 4095 );
+        }
+      }
+    };
+
+    // the tables are built by the first caller; a local static is initialised once even if
+    // two threads get here together.
+    static const linear_tables &get_linear_tables() {
+      static const linear_tables tables;
+      return tables;
+    }
+
+    // 8 bit colour to 12 bit linear light.
+    static const uint16_t *get_to_linear(bool srgb) {
+      const linear_tables &tables = get_linear_tables();
+      return srgb ? tables.to_srgb : tables.to_linear;
+    }
+
+    // 12 bit linear light to 8 bit colour.
+    static const uint8_t *get_from_linear(bool srgb) {
+      const linear_tables &tables = get_linear_tables();
+      return srgb ? tables.from_srgb : tables.from_linear;
+    }
+
+    // Halve a level, writing 12 bit linear values for the next level and 8 bit values for the texture.
+    // The taps are separable, the vertical pass is done first on whole rows.
+    // Rows of the destination are done in parallel.
+    static void downsample(
+      uint16_t *lin_dest, uint8_t *dest, unsigned dw, unsigned dh,
+      const uint16_t *lin_src, unsigned w, unsigned h, unsigned num_comps,
+      const filter_tap *taps, unsigned num_taps, const uint8_t *from_linear_color
+    ) {
+      const uint8_t *from_linear_alpha = get_from_linear(false);
+      unsigned src_stride = w * num_comps;
+      unsigned dest_stride = dw * num_comps;
+
+      // source texels for each destination column, clamped at the edges.
+      dynarray<unsigned> columns(dw * num_taps);
+      for (unsigned x = 0; x != dw; ++x) {
+        for (unsigned k = 0; k != num_taps; ++k) {
+          int sx = (int)x * 2 + taps[k].offset;
+          columns[x * num_taps + k] = ( sx < 0 ? 0 : sx >= (int)w ? w - 1 : sx ) * num_comps;
+        }
+      }
+
+      unsigned grain = texels_per_task / (w * 2) + 1;
+      thread_pool::get().parallel_ranges(dh, grain, [&](unsigned begin, unsigned end) {
+        dynarray<int> row(src_stride);
+        int *acc = row.data();
+        for (unsigned y = begin; y != end; ++y) {
+          // vertical pass
+          for (unsigned i = 0; i != src_stride; ++i) acc[i] = 0;
+          for (unsigned k = 0; k != num_taps; ++k) {
+            int sy = (int)y * 2 + taps[k].offset;
+            sy = sy < 0 ? 0 : sy >= (int)h ? h - 1 : sy;
+            const uint16_t *src = lin_src + sy * src_stride;
+            int weight = taps[k].weight;
+            for (unsigned i = 0; i != src_stride; ++i) {
+              acc[i] += src[i] * weight;
+            }
+          }
+
+          // horizontal pass
+          uint16_t *ld = lin_dest + y * dest_stride;
+          uint8_t *d = dest + y * dest_stride;
+          const unsigned *cols = columns.data();
+          for (unsigned x = 0; x != dw; ++x) {
+            for (unsigned c = 0; c != num_comps; ++c) {
+              int sum = 32768;
+              for (unsigned k = 0; k != num_taps; ++k) {
+                sum += acc[cols[k] + c] * taps[k].weight;
+              }
+              sum >>= 16;
+              sum = sum < 0 ? 0 : sum > 4095 ? 4095 : sum;
+              *ld++ = (uint16_t)sum;
+              *d++ = c == 3 ? from_linear_alpha[sum] : from_linear_color[sum];
+            }
+            cols += num_taps;
+          }
+        }
+      });
+    }
+
+    /// Make mipmaps for this image, down to 1x1.
     void make_mipmaps() {
       if (format != RGB && format != RGBA) return;
-
-      bytes.resize(bytes.size() * 4 / 3);
+      if (gl_target != GL_TEXTURE_2D || mip_levels != 1) return;
 
       unsigned num_comps = format == RGB ? 3 : 4;
-      uint8_t *src = &bytes[0];
-      uint8_t *dest = &bytes[width * height * num_comps];
+      unsigned total = 0;
+      unsigned levels = 0;
+      for (unsigned w = width, h = height; ; w = w > 1 ? w >> 1 : 1, h = h > 1 ? h >> 1 : 1) {
+        total += w * h * num_comps;
+        levels++;
+        if (w == 1 && h == 1) break;
+      }
+      if (levels == 1) return;
+
+      bytes.resize(total);
+
+      // work in 12 bit linear light, so that the small levels are not quantised twice.
+      const uint16_t *to_linear_color = get_to_linear(srgb);
+      const uint16_t *to_linear_alpha = get_to_linear(false);
+      const uint8_t *from_linear_color = get_from_linear(srgb);
+      unsigned num_texels = width * height;
+      dynarray<uint16_t> lin_src(num_texels * num_comps);
+      dynarray<uint16_t> lin_dest((width / 2 + 1) * (height / 2 + 1) * num_comps);
+      const uint8_t *base = bytes.data();
+      uint16_t *lin = lin_src.data();
+      uint16_t *next = lin_dest.data();
+      thread_pool::get().parallel_ranges(num_texels, texels_per_task, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin * num_comps; i != end * num_comps; ++i) {
+          lin[i] = ( num_comps == 4 && ( i & 3 ) == 3 ? to_linear_alpha : to_linear_color )[base[i]];
+        }
+      });
+
+      unsigned num_taps = 0;
+      const filter_tap *taps = get_taps(filter, num_taps);
+      uint8_t *dest = bytes.data();
       unsigned w = width;
       unsigned h = height;
-      unsigned stride = w * num_comps;
-      mip_levels = 0;
-      while (w > 1 && h > 1) {
-        for (unsigned y = 0; y < h/2; ++y) {
-          for (unsigned x = 0; x < w/2; ++x) {
-            // this is a rather dreadful box filter, it is simple to make, but introduces
-            // artifacts. We can do better than this.
-            for (unsigned i = 0; i != num_comps; ++i) {
-              *dest++ = ( src[0] + src[num_comps] + src[stride] + src[stride+num_comps] + 3 ) >> 2;
-              src++;
-            }
-            src += num_comps;
+      for (unsigned level = 1; level != levels; ++level) {
+        dest += w * h * num_comps;
+        unsigned dw = w > 1 ? w >> 1 : 1;
+        unsigned dh = h > 1 ? h >> 1 : 1;
+        downsample(next, dest, dw, dh, lin, w, h, num_comps, taps, num_taps, from_linear_color);
+        uint16_t *tmp = lin; lin = next; next = tmp;
+        w = dw;
+        h = dh;
+      }
+      assert(dest + w * h * num_comps == bytes.data() + bytes.size());
+      mip_levels = levels;
+    }
+
+    // quantise a 0..1 colour to 5:6:5
+    static unsigned to_565(const vec4 &c) {
+      return
+        ( (unsigned)( c.x() * 31 + 0.5f ) << 11 ) |
+        ( (unsigned)( c.y() * 63 + 0.5f ) << 5 ) |
+        ( (unsigned)( c.z() * 31 + 0.5f ) << 0 )
+      ;
+    }
+
+    static vec4 from_565(unsigned c) {
+      return vec4(( c >> 11 ) * (1.0f/31), ( ( c >> 5 ) & 63 ) * (1.0f/63), ( c & 31 ) * (1.0f/31), 0);
+    }
+
+    // encode the colour part of a 4x4 block as DXT1.
+    // colours are 0..1 with zero alpha, so vec4 arithmetic (SSE with OCTET_SSE) only sees RGB.
+    static void encode_color_block(uint8_t *dest, const vec4 *colours) {
+      // ye olde covariance method http://en.wikipedia.org/wiki/Linear_discriminant_analysis
+      vec4 tot(0, 0, 0, 0);
+      for (unsigned i = 0; i != 16; ++i) {
+        tot += colours[i];
+      }
+
+      // calculate the covariance matrix
+      vec4 mean = tot * 0.0625f;
+      mat4t covariance(0);
+      for (unsigned i = 0; i != 16; ++i) {
+        vec4 colour = colours[i] - mean;
+        covariance += outer(colour, colour);
+      }
+
+      // power method to find largest eigenvector (axis).
+      // normalise as we go: the covariance of a low contrast block is tiny and its powers vanish.
+      vec4 axis = covariance.trace();
+      for (unsigned i = 0; i != 4; ++i) {
+        axis = axis * covariance;
+        float len = axis.length();
+        if (len < 1e-20f) break;
+        axis = axis / len;
+      }
+      float len = axis.length();
+      axis = len >= 0.5f ? axis : vec4(0.57735f, 0.57735f, 0.57735f, 0);
+
+      // the end points are the extremes of the colours on the axis.
+      float pmin = dot(colours[0] - mean, axis);
+      float pmax = pmin;
+      for (unsigned i = 1; i != 16; ++i) {
+        float proj = dot(colours[i] - mean, axis);
+        pmin = pmin < proj ? pmin : proj;
+        pmax = pmax > proj ? pmax : proj;
+      }
+      vec4 zero(0, 0, 0, 0), one(1, 1, 1, 0);
+      unsigned c0 = to_565(min(max(mean + axis * pmax, zero), one));
+      unsigned c1 = to_565(min(max(mean + axis * pmin, zero), one));
+
+      // c0 > c1 selects four colour mode.
+      if (c0 < c1) {
+        unsigned t = c0; c0 = c1; c1 = t;
+      }
+
+      // choose the nearest of the four colours the decoder will make.
+      unsigned indices = 0;
+      if (c0 != c1) {
+        vec4 e0 = from_565(c0);
+        vec4 e1 = from_565(c1);
+        vec4 palette[4] = { e0, e1, e0 * (2.0f/3) + e1 * (1.0f/3), e0 * (1.0f/3) + e1 * (2.0f/3) };
+        for (unsigned i = 0; i != 16; ++i) {
+          unsigned best = 0;
+          float best_d = 1e37f;
+          for (unsigned p = 0; p != 4; ++p) {
+            vec4 diff = colours[i] - palette[p];
+            float d = dot(diff, diff);
+            if (d < best_d) { best_d = d; best = p; }
           }
-          src += stride;
+          indices |= best << (i * 2);
+        }
+      }
+
+      dest[0] = ( c0 >> 0 ) & 0xff;
+      dest[1] = ( c0 >> 8 ) & 0xff;
+      dest[2] = ( c1 >> 0 ) & 0xff;
+      dest[3] = ( c1 >> 8 ) & 0xff;
+      dest[4] = ( indices >> 0 ) & 0xff;
+      dest[5] = ( indices >> 8 ) & 0xff;
+      dest[6] = ( indices >> 16 ) & 0xff;
+      dest[7] = ( indices >> 24 ) & 0xff;
+    }
+
+    // encode the alpha part of a 4x4 block as DXT5 with eight alpha values.
+    static void encode_alpha_block(uint8_t *dest, const uint8_t *alphas) {
+      unsigned amin = alphas[0], amax = alphas[0];
+      for (unsigned i = 1; i != 16; ++i) {
+        amin = alphas[i] < amin ? alphas[i] : amin;
+        amax = alphas[i] > amax ? alphas[i] : amax;
+      }
+
+      // index 0 is amax, 1 is amin and 2..7 are 6/7 amax + 1/7 amin ... 1/7 amax + 6/7 amin
+      uint64_t indices = 0;
+      if (amax != amin) {
+        unsigned range = amax - amin;
+        for (unsigned i = 0; i != 16; ++i) {
+          unsigned t = ( ( alphas[i] - amin ) * 14 + range ) / ( range * 2 );
+          uint64_t index = t == 7 ? 0 : t == 0 ? 1 : 8 - t;
+          indices |= index << (i * 3);
         }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        mip_levels++;
       }
-      assert(dest - &bytes[0] < (int)bytes.size());
-      //printf("%d %d\n", dest - &bytes[0], bytes.size());
+
+      dest[0] = (uint8_t)amax;
+      dest[1] = (uint8_t)amin;
+      for (unsigned i = 0; i != 6; ++i) {
+        dest[i+2] = (uint8_t)( indices >> (i * 8) );
+      }
     }
 
-    /// DXT encode the image, making it smaller and grainier.
-    /// Todo: do standard error-diffusion and other improvements.
+    /// DXT encode the image and its mipmaps, making it smaller and grainier.
+    /// RGB images become DXT1, RGBA images DXT5. Blocks are encoded in parallel.
     void dxt_encode() {
       if (format != RGB && format != RGBA) return;
+      if (gl_target != GL_TEXTURE_2D) return;
 
       unsigned num_comps = format == RGB ? 3 : 4;
-      dynarray<uint8_t> result;
-      result.resize(bytes.size() / num_comps);
-      uint8_t *src = &bytes[0];
-      uint8_t *dest = &result[0];
+      unsigned block_size = num_comps == 4 ? 16 : 8;
+
+      // size of the compressed chain
+      unsigned total = 0;
+      for (unsigned level = 0, w = width, h = height; level != mip_levels; ++level) {
+        total += ( ( w + 3 ) / 4 ) * ( ( h + 3 ) / 4 ) * block_size;
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+
+      dynarray<uint8_t> result(total);
+      const uint8_t *src = bytes.data();
+      uint8_t *dest = result.data();
       unsigned w = width;
       unsigned h = height;
-      unsigned stride = w * num_comps;
-      unsigned new_mip_levels = 0;
-      while (w > 4 && h > 4 && new_mip_levels < mip_levels) {
-        for (unsigned y = 0; y < h/4; ++y) {
-          log("w=%d y=%d src=%08x\n", w, y, src - &bytes[0]);
-          for (unsigned x = 0; x < w/4; ++x) {
-            // ye olde covariance method http://en.wikipedia.org/wiki/Linear_discriminant_analysis
-            vec4 tot(0, 0, 0, 0);
-            vec4 colours[16];
+      for (unsigned level = 0; level != mip_levels; ++level) {
+        unsigned bw = ( w + 3 ) / 4;
+        unsigned bh = ( h + 3 ) / 4;
+        unsigned grain = texels_per_task / 16 + 1;
+        thread_pool::get().parallel_ranges(bw * bh, grain, [&](unsigned begin, unsigned end) {
+          vec4 colours[16];
+          uint8_t alphas[16];
+          for (unsigned b = begin; b != end; ++b) {
+            unsigned bx = b % bw * 4;
+            unsigned by = b / bw * 4;
+
+            // blocks at the edges repeat the last row or column.
             for (unsigned j = 0; j != 4; ++j) {
+              unsigned y = by + j < h ? by + j : h - 1;
               for (unsigned i = 0; i != 4; ++i) {
-                //vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), (num_comps == 4 ? src[3] * (1.0f/255) : 1.0f));
-                vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), 1.0f);
-                colours[i+j*4] = colour;
-                tot += colour;
-                src += num_comps;
+                unsigned x = bx + i < w ? bx + i : w - 1;
+                const uint8_t *texel = src + ( y * w + x ) * num_comps;
+                colours[j*4+i] = vec4(texel[0] * (1.0f/255), texel[1] * (1.0f/255), texel[2] * (1.0f/255), 0);
+                alphas[j*4+i] = num_comps == 4 ? texel[3] : 0xff;
               }
-              src += ( w - 4 ) * num_comps;
-            }
-            src -= ( w - 1 ) * 4 * num_comps;
-
-            // calculate the covariance matrix
-            vec4 mean = tot * 0.0625f;
-            mat4t covariance(0);
-            for (unsigned i = 0; i != 16; ++i) {
-              vec4 colour = colours[i] -= mean;
-              covariance += outer(colour, colour);
             }
 
-            // power method to find largest eigenvector (axis)
-            vec4 axis = covariance.trace();
-            for (unsigned i = 0; i != 4; ++i) {
-              axis = axis * covariance;
-            }
-            float len = axis.length();
-            if (abs(len) >= 0.001f) axis = axis / len;
-            //if (y == 27) log("%s %s %s\n", mean.toString(), axis.toString(), covariance.toString(tmp, sizeof(tmp)));
-
-            // our colours all have to live on the axis.
-            // in practice, we can ignore "odd man out" colours
-            // for better compression. But for now, do all the colours.
-            float pmin = dot(colours[0], axis);
-            float pmax = pmin;
-            float projs[16];
-            projs[0] = pmin;
-            for (unsigned i = 1; i != 16; ++i) {
-              float proj = dot(colours[i], axis);
-              projs[i] = proj;
-              pmin = pmin < proj ? pmin : proj;
-              pmax = pmax > proj ? pmax : proj;
-            }
-            vec4 cmin = mean + axis * pmin;
-            vec4 cmax = mean + axis * pmax;
-            //if (y == 27) log("%s -> %s\n", cmin.toString(), cmax.toString(tmp, sizeof(tmp)));
-            cmin = min(max(cmin, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-            cmax = min(max(cmax, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-
-            unsigned c0 =
-              ( (unsigned)(cmin.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmin.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmin.z() * 31.999f) << 0 )
-            ;
-            unsigned c1 =
-              ( (unsigned)(cmax.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmax.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmax.z() * 31.999f) << 0 )
-            ;
-
-            if (c0 < c1) {
-              unsigned t = c0; c0 = c1; c1 = t;
-              float p = pmin; pmin = pmax; pmax = p;
+            uint8_t *block = dest + b * block_size;
+            if (num_comps == 4) {
+              encode_alpha_block(block, alphas);
+              block += 8;
             }
+            encode_color_block(block, colours);
+          }
+        });
+        src += w * h * num_comps;
+        dest += bw * bh * block_size;
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+      assert(dest == result.data() + result.size());
+      bytes.resize(result.size());
+      memcpy(bytes.data(), result.data(), result.size());
+      format = num_comps == 4 ? COMPRESSED_RGBA_S3TC_DXT5_EXT : COMPRESSED_RGB_S3TC_DXT1_EXT;
+    }
 
-            float pscale = abs(pmax - pmin) > 0.001f ? 3.999f / (pmax - pmin) : 0;
-            uint8_t pal[16];
-            for (unsigned i = 0; i != 16; ++i) {
-              pal[i] = (unsigned)( ( projs[i] - pmin ) * pscale );
-            }
+    // a 64 bit hash of the pixels and the processing options.
+    // 64k chunks are hashed in parallel and then combined.
+    uint64_t get_content_hash() const {
+      enum { chunk_size = 0x10000 };
+      const uint8_t *data = bytes.data();
+      unsigned size = bytes.size();
+      unsigned num_chunks = ( size + chunk_size - 1 ) / chunk_size;
+      dynarray<uint64_t> chunk_hashes(num_chunks);
+      uint64_t *hashes = chunk_hashes.data();
+      thread_pool::get().parallel_for(num_chunks, [&](unsigned c) {
+        const uint8_t *p = data + c * chunk_size;
+        unsigned n = size - c * chunk_size < chunk_size ? size - c * chunk_size : chunk_size;
+        uint64_t hash = 0xcbf29ce484222325ull;
+        unsigned i = 0;
+        for (; i + 8 <= n; i += 8) {
+          uint64_t word;
+          memcpy(&word, p + i, 8);
+          hash = ( hash ^ word ) * 0x100000001b3ull;
+          hash ^= hash >> 29;
+        }
+        for (; i != n; ++i) {
+          hash = ( hash ^ p[i] ) * 0x100000001b3ull;
+        }
+        hashes[c] = hash;
+      });
 
-            dest[0] = ( c0 >> 0 ) & 0xff;
-            dest[1] = ( c0 >> 8 ) & 0xff;
-            dest[2] = ( c1 >> 0 ) & 0xff;
-            dest[3] = ( c1 >> 8 ) & 0xff;
-            for (int i = 0; i != 4; ++i) {
-              dest[i+4] = pal[i*4+0] + pal[i*4+1] * 4 + pal[i*4+2] * 16 + pal[i*4+3] * 64;
-            }
-            dest += 8;
+      uint64_t hash = 0xcbf29ce484222325ull;
+      uint64_t params[] = { cache_version, width, height, format, filter, srgb, compress, size };
+      for (unsigned i = 0; i != sizeof(params)/sizeof(params[0]); ++i) {
+        hash = ( hash ^ params[i] ) * 0x100000001b3ull;
+      }
+      for (unsigned c = 0; c != num_chunks; ++c) {
+        hash = ( hash ^ hashes[c] ) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+      }
+      return hash ? hash : 1;
+    }
+
+    // images that have been processed, by content hash, oldest first in "order".
+    // Evicted images leave a null entry in the map as it has no erase.
+    struct memory_cache {
+      std::mutex mutex;
+      hash_map<uint64_t, ref<image> > images;
+      dynarray<uint64_t> order;
+      size_t bytes;
+      size_t limit;
+
+      memory_cache() : bytes(0), limit(0) {}
+
+      // drop the oldest images until there is room for new_bytes more.
+      void evict(size_t new_bytes) {
+        unsigned num_evicted = 0;
+        while (num_evicted != order.size() && bytes + new_bytes > limit) {
+          ref<image> &old = images[order[num_evicted++]];
+          bytes -= old->bytes.size();
+          old = NULL;
+        }
+        if (num_evicted) {
+          for (unsigned i = num_evicted; i != order.size(); ++i) {
+            order[i - num_evicted] = order[i];
           }
-          src += stride * 3;
+          order.resize(order.size() - num_evicted);
+        }
+      }
+    };
+
+    static memory_cache &get_cache() {
+      static memory_cache cache;
+      return cache;
+    }
+
+    struct cache_header {
+      char magic[4];
+      uint32_t size;
+      uint64_t hash;
+      uint16_t width;
+      uint16_t height;
+      uint16_t format;
+      uint8_t mip_levels;
+      uint8_t pad;
+    };
+
+    // take the processed pixels from the memory or disk cache.
+    bool read_cache(uint64_t hash) {
+      memory_cache &cache = get_cache();
+      {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        if (cache.images.contains(hash) && cache.images[hash]) {
+          const image *cached = cache.images[hash];
+          bytes.resize(cached->bytes.size());
+          memcpy(bytes.data(), cached->bytes.data(), bytes.size());
+          format = cached->format;
+          mip_levels = cached->mip_levels;
+          return true;
         }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        new_mip_levels++;
       }
-      assert(dest - &result[0] < (int)result.size());
-      bytes.resize((int)(dest - &result[0]));
-      memcpy(&bytes[0], &result[0], dest - &result[0]);
-      format = COMPRESSED_RGB_S3TC_DXT1_EXT;
-      mip_levels = new_mip_levels;
+
+      const char *dir = cache_dir();
+      if (!dir) return false;
+
+      string path;
+      path.format("%s/%016llx.img", dir, (unsigned long long)hash);
+      mapped_file file;
+      if (!file.open(path)) return false;
+
+      cache_header header;
+      if (file.size() < sizeof(header)) return false;
+      memcpy(&header, file.data(), sizeof(header));
+      if (memcmp(header.magic, "OCTI", 4) || header.hash != hash || file.size() != sizeof(header) + header.size) {
+        return false;
+      }
+      if (header.width != width || header.height != height) return false;
+
+      bytes.resize(header.size);
+      memcpy(bytes.data(), file.data() + sizeof(header), header.size);
+      format = header.format;
+      mip_levels = header.mip_levels;
+      write_cache(hash, false);
+      return true;
+    }
+
+    // store the processed pixels in the memory cache, if it is big enough, and optionally the disk cache.
+    void write_cache(uint64_t hash, bool to_disk) {
+      memory_cache &cache = get_cache();
+      {
+        std::lock_guard<std::mutex> lock(cache.mutex);
+        if (bytes.size() <= cache.limit && !(cache.images.contains(hash) && cache.images[hash])) {
+          cache.evict(bytes.size());
+          image *cached = new image();
+          cached->bytes.resize(bytes.size());
+          memcpy(cached->bytes.data(), bytes.data(), bytes.size());
+          cached->format = format;
+          cached->width = width;
+          cached->height = height;
+          cached->mip_levels = mip_levels;
+          cache.images[hash] = cached;
+          cache.order.push_back(hash);
+          cache.bytes += bytes.size();
+        }
+      }
+
+      const char *dir = cache_dir();
+      if (!to_disk || !dir) return;
+
+      string path;
+      path.format("%s/%016llx.img", dir, (unsigned long long)hash);
+      FILE *file = fopen(path, "wb");
+      if (!file) return;
+      cache_header header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, "OCTI", 4);
+      header.size = bytes.size();
+      header.hash = hash;
+      header.width = width;
+      header.height = height;
+      header.format = format;
+      header.mip_levels = mip_levels;
+      fwrite(&header, 1, sizeof(header), file);
+      fwrite(bytes.data(), 1, bytes.size(), file);
+      fclose(file);
+    }
+
+    // make mipmaps and compress, or fetch the result from the cache.
+    void process() {
+      if (format != RGB && format != RGBA) return;
+
+      // hashing is a pass over the pixels, so only do it if there is a cache to look in.
+      bool use_cache = cache_dir() || memory_cache_limit() != 0;
+      uint64_t hash = use_cache ? get_content_hash() : 0;
+      if (use_cache && read_cache(hash)) return;
+
+      make_mipmaps();
+      if (compress) dxt_encode();
+      if (use_cache) write_cache(hash, true);
     }
 
     void add_texture() {
@@ -229,12 +625,11 @@ namespace octet { namespace scene {
         unsigned w = width;
         unsigned h = height;
         uint8_t *src = &bytes[0];
-        unsigned level = 0;
-        while (w != 0 && h != 0) {
-          glTexImage2D(gl_target, level++, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)src);
+        for (unsigned level = 0; level != mip_levels; ++level) {
+          glTexImage2D(gl_target, level, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)src);
           src += w * h * num_comps;
-          w >>= 1;
-          h >>= 1;
+          w = w > 1 ? w >> 1 : 1;
+          h = h > 1 ? h >> 1 : 1;
         }
       }
     }
@@ -242,6 +637,35 @@ namespace octet { namespace scene {
   public:
     RESOURCE_META(image)
 
+    /// filters for making mipmaps.
+    enum mip_filter {
+      /// average of 2x2 texels.
+      filter_box,
+      /// six tap separable lanczos filter, sharper with less aliasing.
+      filter_lanczos,
+    };
+
+    /// Directory for compressed images, keyed by content hash. NULL (the default) caches in memory only.
+    static const char *cache_dir(const char *new_dir=NULL) {
+      static const char *value = NULL;
+      if (new_dir) {
+        value = new_dir;
+      }
+      return value;
+    }
+
+    /// Most bytes of processed images to keep in memory, oldest dropped first.
+    /// 0 (the default) keeps none. Pass ~0 to read the limit without changing it.
+    static size_t memory_cache_limit(size_t new_limit=~(size_t)0) {
+      memory_cache &cache = get_cache();
+      std::lock_guard<std::mutex> lock(cache.mutex);
+      if (new_limit != ~(size_t)0) {
+        cache.limit = new_limit;
+        cache.evict(0);
+      }
+      return cache.limit;
+    }
+
     /// default constructor makes a blank image.
     image() {
       init("");
@@ -256,6 +680,22 @@ namespace octet { namespace scene {
     ~image() {
     }
 
+    /// Replace the pixels with a single 2D level, eg. a slice of a volume.
+    /// If the texture has been made already, it is updated.
+    void set_pixels(unsigned new_format, unsigned new_width, unsigned new_height, const uint8_t *data) {
+      unsigned num_comps = new_format == RGBA ? 4 : new_format == RGB ? 3 : 1;
+      format = new_format;
+      width = new_width;
+      height = new_height;
+      depth = 1;
+      frames = 1;
+      mip_levels = 1;
+      gl_target = GL_TEXTURE_2D;
+      bytes.resize(width * height * num_comps);
+      memcpy(&bytes[0], data, bytes.size());
+      if (gl_texture) add_texture();
+    }
+
     /// width in pixels
     unsigned get_width() const {
       return width;
@@ -281,6 +721,29 @@ namespace octet { namespace scene {
       return frames;
     }
 
+    /// format of the pixels, eg. RGB, RGBA or a compressed format.
+    unsigned get_format() const {
+      return format;
+    }
+
+    /// pixels of level 0, followed by the other mip levels. NULL until the image is loaded.
+    const uint8_t *get_bytes() const {
+      return bytes.size() ? bytes.data() : NULL;
+    }
+
+    /// number of levels in get_bytes(), down to 1x1 once a 2D RGB or RGBA image is loaded.
+    unsigned get_mip_levels() const {
+      return mip_levels;
+    }
+
+    /// Choose how load() makes mipmaps and whether it DXT compresses the result.
+    /// srgb filters in linear light, for colour textures.
+    void set_import_options(mip_filter new_filter, bool new_srgb, bool new_compress) {
+      filter = (uint8_t)new_filter;
+      srgb = new_srgb;
+      compress = new_compress;
+    }
+
     /// access attributes by name
     void visit(visitor &v) {
       v.visit(url, atom_url);
@@ -298,6 +761,7 @@ namespace octet { namespace scene {
       app_utils::get_url(buffer, url);
       const unsigned char *src = &buffer[0];
       const unsigned char *src_max = src + buffer.size();
+      mip_levels = 1;
       if (buffer.size() >= 6 && !memcmp(&buffer[0], "GIF89a", 6)) {
         gif_decoder dec;
         dec.get_image(bytes, format, width, height, src, src_max);
@@ -319,8 +783,7 @@ namespace octet { namespace scene {
         return;
       }
 
-      make_mipmaps();
-      //dxt_encode();
+      process();
     }
 
     /// get the OpenGL texture handle for this image.
@@ -342,17 +805,19 @@ namespace octet { namespace scene {
           unsigned w = width;
           unsigned h = height;
           uint8_t *src = &bytes[0];
-          unsigned level = 0;
-          unsigned shift = ( format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ) ? 1 : 0;
-          while (w != 0 && h != 0) {
-            unsigned wmin = w < 4 ? 4 : w;
-            unsigned hmin = h < 4 ? 4 : h;
-            unsigned size = ( wmin * hmin ) >> shift;
-            glCompressedTexImage2D(gl_target, level++, format, w, h, 0, size, (void*)src);
+          unsigned block_size = ( format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ) ? 8 : 16;
+          uint8_t *src_max = src + bytes.size();
+
+          // DDS files may have any number of levels, so upload what we have down to 1x1.
+          for (unsigned level = 0; ; ++level) {
+            unsigned size = ( ( w + 3 ) / 4 ) * ( ( h + 3 ) / 4 ) * block_size;
+            if (src + size > src_max) break;
+            glCompressedTexImage2D(gl_target, level, format, w, h, 0, size, (void*)src);
             //printf("%d\n", glGetError());
             src += size;
-            w >>= 1;
-            h >>= 1;
+            if (w == 1 && h == 1) break;
+            w = w > 1 ? w >> 1 : 1;
+            h = h > 1 ? h >> 1 : 1;
           }
           //printf("%d %d\n", src - image_, size);
         }
@@ -176,6 +176,99 @@ namespace octet { namespace scene {
       custom_shader = new param_shader(params);
     }
 
+    /// Create a material for mesh_points with channels (see mesh_points::set_channels).
+    /// The position is projection_lo * channels_lo + projection_hi * channels_hi + projection_offset,
+    /// computed in the vertex shader, so use set_projection() to show different channels.
+    /// Points are coloured by their colour channel multiplied by "color", and points with zero alpha are hidden.
+    /// Points are also hidden if a channel is at or above its saturation level, see set_saturation().
+    material(const vec4 &color, unsigned num_channels) {
+      params.reserve(16);
+
+      create_dynamic_params();
+
+      param_buffer_info static_pbi(static_buffer, 1);
+      params.push_back(new param_color(static_pbi, color, atom_diffuse, param::stage_fragment));
+
+      // the projection matrices start as the identity on channels 0-2.
+      mat4t identity;
+      mat4t zero = identity * 0.0f;
+      vec4 offset(0, 0, 0, 1);
+      vec4 no_saturation(1e30f, 1e30f, 1e30f, 1e30f);
+      params.push_back(new param_attribute(atom_channels_lo, GL_FLOAT_VEC4));
+      params.push_back(new param_uniform(static_pbi, identity.get(), atom_projection_lo, GL_FLOAT_MAT4, 1, param::stage_vertex));
+      params.push_back(new param_uniform(static_pbi, &no_saturation, atom_saturation_lo, GL_FLOAT_VEC4, 1, param::stage_vertex));
+      const char *code = "  vec4 pos = vec4((projection_lo * channels_lo + projection_offset).xyz, 1.0);\n";
+      const char *color_code = "  color_ = any(greaterThanEqual(channels_lo, saturation_lo)) ? vec4(0.0) : color;\n";
+      if (num_channels > 4) {
+        params.push_back(new param_attribute(atom_channels_hi, GL_FLOAT_VEC4));
+        params.push_back(new param_uniform(static_pbi, zero.get(), atom_projection_hi, GL_FLOAT_MAT4, 1, param::stage_vertex));
+        params.push_back(new param_uniform(static_pbi, &no_saturation, atom_saturation_hi, GL_FLOAT_VEC4, 1, param::stage_vertex));
+        code = "  vec4 pos = vec4((projection_lo * channels_lo + projection_hi * channels_hi + projection_offset).xyz, 1.0);\n";
+        color_code =
+          "  bool saturated = any(greaterThanEqual(channels_lo, saturation_lo)) || any(greaterThanEqual(channels_hi, saturation_hi));\n"
+          "  color_ = saturated ? vec4(0.0) : color;\n"
+        ;
+      }
+      params.push_back(new param_uniform(static_pbi, &offset, atom_projection_offset, GL_FLOAT_VEC4, 1, param::stage_vertex));
+      params.push_back(new param_custom(atom_pos, GL_FLOAT_VEC4, "", code, param::stage_vertex));
+      params.push_back(new param_attribute(atom_color, GL_FLOAT_VEC4));
+      params.push_back(new param_custom(atom_, GL_FLOAT_VEC4, "varying vec4 color_;\n", color_code, param::stage_vertex));
+
+      create_transform();
+
+      params.push_back(
+        new param_custom(atom_gl_FragColor, GL_FLOAT_VEC4, "varying vec4 color_;\n", "  if (color_.a == 0.0) discard;\n  gl_FragColor = diffuse * color_;\n", param::stage_fragment)
+      );
+
+      custom_shader = new param_shader(params);
+    }
+
+    /// Create a material for mesh_particle_system billboards expanded in the shader (see mesh_particle_system::set_expand_in_shader).
+    /// Each billboard is a point sprite sized to hold the rotated quad; the fragment shader cuts out the quad
+    /// and maps it to the uv rectangle. point_scale is the height of the viewport in pixels over the height
+    /// of the view one unit in front of the camera, see set_point_scale().
+    material(image *img, float point_scale) {
+      params.reserve(16);
+
+      create_dynamic_params();
+
+      param_buffer_info static_pbi(static_buffer, 1);
+      params.push_back(new param_attribute(atom_pos, GL_FLOAT_VEC4));
+      params.push_back(new param_attribute(atom_psize, GL_FLOAT_VEC3));
+      params.push_back(new param_attribute(atom_uv, GL_FLOAT_VEC4));
+      params.push_back(new param_uniform(static_pbi, &point_scale, atom_point_scale, GL_FLOAT, 1, param::stage_vertex));
+
+      create_transform();
+
+      params.push_back(
+        new param_custom(
+          atom_,
+          GL_FLOAT_VEC4,
+          "varying vec4 uv_rect_;\nvarying vec4 billboard_;\n",
+          "  float extent = 2.0 * length(psize.xy);\n"
+          "  gl_PointSize = extent * point_scale / gl_Position.w;\n"
+          "  uv_rect_ = uv;\n"
+          "  billboard_ = vec4(cos(psize.z), sin(psize.z), extent / (2.0 * max(psize.xy, vec2(1e-6, 1e-6))));\n",
+          param::stage_vertex
+        )
+      );
+      params.push_back(new param_sampler(static_pbi, atom_diffuse_sampler, img, new sampler(), param::stage_fragment));
+      params.push_back(
+        new param_custom(
+          atom_gl_FragColor,
+          GL_FLOAT_VEC4,
+          "varying vec4 uv_rect_;\nvarying vec4 billboard_;\n",
+          "  vec2 p = vec2(gl_PointCoord.x - 0.5, 0.5 - gl_PointCoord.y);\n"
+          "  vec2 q = vec2(billboard_.x * p.x + billboard_.y * p.y, billboard_.x * p.y - billboard_.y * p.x) * billboard_.zw + 0.5;\n"
+          "  if (q.x < 0.0 || q.x > 1.0 || q.y < 0.0 || q.y > 1.0) discard;\n"
+          "  gl_FragColor = vec4(texture2D(diffuse_sampler, mix(uv_rect_.xy, uv_rect_.zw, q)).xyz, 1.0);\n",
+          param::stage_fragment
+        )
+      );
+
+      custom_shader = new param_shader(params);
+    }
+
     material(param *diffuse, param *ambient, param *emission, param *specular, param *bump, param *shininess) {
     }
 
@@ -227,12 +320,72 @@ namespace octet { namespace scene {
       }
     }
 
+    /// Set the channel projection of a material made with material(color, num_channels).
+    /// Column i of lo (hi) is the position contributed by channel i (i+4).
+    void set_projection(const mat4t &lo, const mat4t &hi, const vec3 &offset) {
+      vec4 offset4(offset, 1);
+      gl_resource::wolock static_lock(static_buffer);
+      param_uniform *lo_param = get_param_uniform(atom_projection_lo);
+      if (lo_param) lo_param->set_value(static_lock.u8(), lo.get(), sizeof(lo));
+      param_uniform *hi_param = get_param_uniform(atom_projection_hi);
+      if (hi_param) hi_param->set_value(static_lock.u8(), hi.get(), sizeof(hi));
+      param_uniform *offset_param = get_param_uniform(atom_projection_offset);
+      if (offset_param) offset_param->set_value(static_lock.u8(), &offset4, sizeof(offset4));
+    }
+
+    /// Set the saturation levels of a material made with material(color, num_channels).
+    /// A point is hidden if channel i (i+4) is at or above lo[i] (hi[i]).
+    /// Use a large value for channels that are not shown so that they do not hide anything.
+    void set_saturation(const vec4 &lo, const vec4 &hi) {
+      gl_resource::wolock static_lock(static_buffer);
+      param_uniform *lo_param = get_param_uniform(atom_saturation_lo);
+      if (lo_param) lo_param->set_value(static_lock.u8(), &lo, sizeof(lo));
+      param_uniform *hi_param = get_param_uniform(atom_saturation_hi);
+      if (hi_param) hi_param->set_value(static_lock.u8(), &hi, sizeof(hi));
+    }
+
+    /// Set the point scale of a material made with material(img, point_scale),
+    /// eg. viewport_height * 0.5f * cameraToProjection[1][1] for a perspective camera.
+    void set_point_scale(float point_scale) {
+      gl_resource::wolock static_lock(static_buffer);
+      param_uniform *scale_param = get_param_uniform(atom_point_scale);
+      if (scale_param) scale_param->set_value(static_lock.u8(), &point_scale, sizeof(point_scale));
+    }
+
     /// Set the uniforms for this material on skinned meshes.
     void render_skinned(const mat4t &cameraToProjection, const mat4t *modelToCamera, int num_nodes, vec4 *light_uniforms, int num_light_uniforms, int num_lights) const {
       //shader.render_skinned(cameraToProjection, modelToCamera, num_nodes, light_uniforms, num_light_uniforms, num_lights);
       //bind_textures();
     }
 
+    /// Get the diffuse colour, diffuse texture and lighting of this material for soft_renderer.
+    /// Returns false for materials built from custom shader code, such as the channel projection and point sprites.
+    bool get_software_shading(vec4 &diffuse, image *&diffuse_image, bool &is_lit) {
+      diffuse = vec4(0.5f, 0.5f, 0.5f, 1);
+      diffuse_image = NULL;
+      is_lit = true;
+      if (get_param(atom_channels_lo) || get_param(atom_psize)) return false;
+      if (!static_buffer) return true;
+
+      param *diffuse_param = get_param(atom_diffuse);
+      param_color *color = diffuse_param ? diffuse_param->get_param_color() : NULL;
+      if (color) {
+        gl_resource::rolock static_lock(static_buffer);
+        diffuse = color->get_value(static_lock.u8());
+      }
+
+      param *sampler_param = get_param(atom_diffuse_sampler);
+      param_sampler *smp = sampler_param ? sampler_param->get_param_sampler() : NULL;
+      if (smp && smp->get_image()) {
+        diffuse_image = smp->get_image();
+        if (!diffuse_image->get_bytes()) diffuse_image->load();
+        diffuse = vec4(1, 1, 1, 1);
+      }
+
+      is_lit = get_param(atom_diffuse_light) != NULL;
+      return true;
+    }
+
     param *get_param(atom_t name) {
       for (unsigned i = 0; i != params.size(); ++i) {
         if (params[i]->get_name() == name) {
@@ -171,6 +171,8 @@ namespace octet { namespace scene {
 
     /// reset the mesh to empty.
     void clear_attributes() {
+      memset(format, 0, sizeof(format));
+      normalized = 0;
       num_slots = 0;
     }
 
@@ -73,35 +73,83 @@ namespace octet { namespace scene {
       sphere geom;
     };
   private:
+    enum {
+      // billboards per task when animating and building vertices.
+      chunk_size = 1024,
 
-    // POD (plain-old-data) structure dynarray of camera-facing particles
-    dynarray<billboard_particle> billboard_particles;
-    int free_billboard_particle;
+      // size of a billboard record when expanding in the vertex shader: pos, size and angle, uv rectangle.
+      point_stride = 40,
+    };
+
+    // camera-facing particles as a structure of arrays.
+    // the first num_billboards entries are live, with no holes, so loops run over
+    // contiguous floats. Dead particles are swapped with the last live one.
+    dynarray<float> pos_x, pos_y, pos_z;
+    dynarray<float> vel_x, vel_y, vel_z;
+    dynarray<float> acc_x, acc_y, acc_z;
+    dynarray<float> size_x, size_y;
+    dynarray<float> uv_left, uv_bottom, uv_right, uv_top;
+    dynarray<float> spin;
+    dynarray<uint32_t> angle;
+    dynarray<uint32_t> age;
+    dynarray<uint32_t> lifetime;
+    unsigned num_billboards;
+
+    // particles keep their id when they move in the arrays.
+    dynarray<int> slot_to_id;
+    dynarray<int> id_to_slot;
+    dynarray<int> free_ids;
 
     // POD structure dynarray of trail particles.
     dynarray<trail_particle> trail_particles;
     int free_trail_particle;
 
-    // POD structure dynarray of animators for particles.
-    dynarray<particle_animator> particle_animators;
-    int free_particle_animator;
-
     // camera matrix
     mat4t cameraToWorld;
 
-    void init(const aabb &size, int bbcap, int tpcap, int pacap) {
+    // one point per billboard, expanded by the shader of material(img, point_scale)
+    bool expand_in_shader;
+
+    void init(const aabb &size, int bbcap, int tpcap) {
       set_default_attributes();
       set_aabb(size);
-      billboard_particles.reserve(bbcap);
+
+      dynarray<float> *floats[] = {
+        &pos_x, &pos_y, &pos_z, &vel_x, &vel_y, &vel_z, &acc_x, &acc_y, &acc_z,
+        &size_x, &size_y, &uv_left, &uv_bottom, &uv_right, &uv_top, &spin
+      };
+      for (unsigned i = 0; i != sizeof(floats)/sizeof(floats[0]); ++i) {
+        floats[i]->resize(bbcap);
+      }
+      angle.resize(bbcap);
+      age.resize(bbcap);
+      lifetime.resize(bbcap);
+      slot_to_id.resize(bbcap);
+      id_to_slot.resize(bbcap);
+      free_ids.resize(bbcap);
+      for (int i = 0; i != bbcap; ++i) {
+        id_to_slot[i] = -1;
+        free_ids[i] = bbcap - 1 - i;
+      }
+      num_billboards = 0;
+
       trail_particles.reserve(tpcap);
-      particle_animators.reserve(pacap);
-      free_billboard_particle = -1;
       free_trail_particle = -1;
-      free_particle_animator = -1;
+      expand_in_shader = false;
 
       unsigned vsize = (bbcap * 4 + tpcap * 2) * sizeof(vertex);
       unsigned isize = (bbcap * 6 + tpcap * 6) * sizeof(uint32_t);
       mesh::allocate(vsize, isize);
+
+      // the live billboards are contiguous, so the indices never change.
+      gl_resource::wolock ilock(get_indices());
+      uint32_t *idx = ilock.u32();
+      for (int i = 0; i != bbcap; ++i) {
+        unsigned v = i * 4;
+        idx[0] = v; idx[1] = v+1; idx[2] = v+2;
+        idx[3] = v; idx[4] = v+2; idx[5] = v+3;
+        idx += 6;
+      }
     }
 
     // pool allocation of particles.
@@ -117,39 +165,122 @@ namespace octet { namespace scene {
       return result;
     }
 
-    // return to pool
-    template <class Type> void free(dynarray<Type> &array, int &free, int element) {
-      array[free].link = free;
-      free = element;
+    // move the last live billboard into slot and give back the id of the particle in slot.
+    void remove_billboard_slot(unsigned slot) {
+      unsigned last = --num_billboards;
+      free_ids.push_back(slot_to_id[slot]);
+      id_to_slot[slot_to_id[slot]] = -1;
+      if (slot != last) {
+        pos_x[slot] = pos_x[last]; pos_y[slot] = pos_y[last]; pos_z[slot] = pos_z[last];
+        vel_x[slot] = vel_x[last]; vel_y[slot] = vel_y[last]; vel_z[slot] = vel_z[last];
+        acc_x[slot] = acc_x[last]; acc_y[slot] = acc_y[last]; acc_z[slot] = acc_z[last];
+        size_x[slot] = size_x[last]; size_y[slot] = size_y[last];
+        uv_left[slot] = uv_left[last]; uv_bottom[slot] = uv_bottom[last];
+        uv_right[slot] = uv_right[last]; uv_top[slot] = uv_top[last];
+        spin[slot] = spin[last]; angle[slot] = angle[last];
+        age[slot] = age[last]; lifetime[slot] = lifetime[last];
+        slot_to_id[slot] = slot_to_id[last];
+        id_to_slot[slot_to_id[slot]] = (int)slot;
+      }
+    }
+
+    // newtonian motion of billboards [begin, end)
+    void integrate(unsigned begin, unsigned end, float time_step) {
+      float *px = pos_x.data(), *py = pos_y.data(), *pz = pos_z.data();
+      float *vx = vel_x.data(), *vy = vel_y.data(), *vz = vel_z.data();
+      const float *ax = acc_x.data(), *ay = acc_y.data(), *az = acc_z.data();
+      const float *sp = spin.data();
+      uint32_t *ang = angle.data();
+      uint32_t *ag = age.data();
+      unsigned i = begin;
+      #if OCTET_SSE
+        __m128 dt = _mm_set1_ps(time_step);
+        __m128i one = _mm_set1_epi32(1);
+        for (; i + 4 <= end; i += 4) {
+          __m128 vx4 = _mm_loadu_ps(vx + i), vy4 = _mm_loadu_ps(vy + i), vz4 = _mm_loadu_ps(vz + i);
+          _mm_storeu_ps(px + i, _mm_add_ps(_mm_loadu_ps(px + i), _mm_mul_ps(vx4, dt)));
+          _mm_storeu_ps(py + i, _mm_add_ps(_mm_loadu_ps(py + i), _mm_mul_ps(vy4, dt)));
+          _mm_storeu_ps(pz + i, _mm_add_ps(_mm_loadu_ps(pz + i), _mm_mul_ps(vz4, dt)));
+          _mm_storeu_ps(vx + i, _mm_add_ps(vx4, _mm_mul_ps(_mm_loadu_ps(ax + i), dt)));
+          _mm_storeu_ps(vy + i, _mm_add_ps(vy4, _mm_mul_ps(_mm_loadu_ps(ay + i), dt)));
+          _mm_storeu_ps(vz + i, _mm_add_ps(vz4, _mm_mul_ps(_mm_loadu_ps(az + i), dt)));
+          __m128i turn = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(sp + i), dt));
+          _mm_storeu_si128((__m128i*)(ang + i), _mm_add_epi32(_mm_loadu_si128((__m128i*)(ang + i)), turn));
+          _mm_storeu_si128((__m128i*)(ag + i), _mm_add_epi32(_mm_loadu_si128((__m128i*)(ag + i)), one));
+        }
+      #endif
+      // simple enough for the compiler to vectorise.
+      for (; i < end; ++i) {
+        px[i] += vx[i] * time_step;
+        py[i] += vy[i] * time_step;
+        pz[i] += vz[i] * time_step;
+        vx[i] += ax[i] * time_step;
+        vy[i] += ay[i] * time_step;
+        vz[i] += az[i] * time_step;
+        ang[i] += (uint32_t)(int32_t)(sp[i] * time_step);
+        ag[i]++;
+      }
+    }
+
+    // four camera-facing corners for each of billboards [begin, end)
+    void build_quads(vertex *vtx, unsigned begin, unsigned end) const {
+      vec3 cx = cameraToWorld.x().xyz();
+      vec3 cy = cameraToWorld.y().xyz();
+      vec3p n = cameraToWorld.z().xyz();
+      const float to_radians = 3.14159265f * 2 / 4294967296.0f;
+      vtx += begin * 4;
+      for (unsigned i = begin; i != end; ++i) {
+        vec3 pos(pos_x[i], pos_y[i], pos_z[i]);
+        vec3 ax = cx, ay = cy;
+        if (angle[i]) {
+          float c = cosf(angle[i] * to_radians), s = sinf(angle[i] * to_radians);
+          ax = c * cx + s * cy;
+          ay = c * cy - s * cx;
+        }
+        vec3 dx = size_x[i] * ax;
+        vec3 dy = size_y[i] * ay;
+        float l = uv_left[i], b = uv_bottom[i], r = uv_right[i], t = uv_top[i];
+        vtx->pos = pos - dx + dy; vtx->normal = n; vtx->uv = vec2(l, t); vtx++;
+        vtx->pos = pos + dx + dy; vtx->normal = n; vtx->uv = vec2(r, t); vtx++;
+        vtx->pos = pos + dx - dy; vtx->normal = n; vtx->uv = vec2(r, b); vtx++;
+        vtx->pos = pos - dx - dy; vtx->normal = n; vtx->uv = vec2(l, b); vtx++;
+      }
+    }
+
+    // one record for each of billboards [begin, end): pos, size and angle, uv rectangle.
+    void build_points(float *dest, unsigned begin, unsigned end) const {
+      const float to_radians = 3.14159265f * 2 / 4294967296.0f;
+      dest += begin * ( point_stride / sizeof(float) );
+      for (unsigned i = begin; i != end; ++i) {
+        dest[0] = pos_x[i]; dest[1] = pos_y[i]; dest[2] = pos_z[i];
+        dest[3] = size_x[i]; dest[4] = size_y[i]; dest[5] = (int32_t)angle[i] * to_radians;
+        dest[6] = uv_left[i]; dest[7] = uv_bottom[i]; dest[8] = uv_right[i]; dest[9] = uv_top[i];
+        dest += point_stride / sizeof(float);
+      }
     }
 
   public:
     RESOURCE_META(mesh_particle_system)
 
-    /// Default constructor
-    mesh_particle_system(aabb_in size=aabb(vec3(0, 0, 0), vec3(1, 1, 1)), int bbcap=256, int tpcap=256, int pacap=256) {
-      init(size, bbcap, tpcap, pacap);
+    /// Default constructor.
+    mesh_particle_system(aabb_in size=aabb(vec3(0, 0, 0), vec3(1, 1, 1)), int bbcap=256, int tpcap=256) {
+      init(size, bbcap, tpcap);
     }
 
     /// Update the vertices for newtonian physics.
     void animate(float time_step) {
-      for (unsigned i = 0; i != particle_animators.size(); ++i) {
-        particle_animator &g = particle_animators[i];
-        if (g.link >= 0) {
-          billboard_particle &p = billboard_particles[g.link];
-          if (g.age >= g.lifetime) {
-            p.enabled = false;
-            free(billboard_particles, free_billboard_particle, g.link);
-            g.link = -1;
-            free(particle_animators, free_particle_animator, i);
-          } else {
-            p.pos = (vec3)p.pos + (vec3)g.vel * time_step;
-            g.vel = (vec3)g.vel + (vec3)g.acceleration * time_step;
-            p.angle += (uint32_t)(g.spin * time_step);
-            g.age++;
-          }
+      // retire particles that have reached their lifetime.
+      for (unsigned i = 0; i < num_billboards; ) {
+        if (age[i] >= lifetime[i]) {
+          remove_billboard_slot(i);
+        } else {
+          ++i;
         }
       }
+
+      thread_pool::get().parallel_ranges(num_billboards, chunk_size, [&](unsigned begin, unsigned end) {
+        integrate(begin, end, time_step);
+      });
     }
 
     /// camera-facing particles need the camera matrix to generate world space geometry.
@@ -157,66 +288,82 @@ namespace octet { namespace scene {
       cameraToWorld = mx;
     }
 
-    /// Generate mesh from particles
-    virtual void update() {
-      //unsigned np = billboard_particles.size();
-      //unsigned vsize = billboard_particles.capacity() * sizeof(vertex) * 4;
-      //unsigned isize = billboard_particles.capacity() * sizeof(uint32_t) * 4;
+    /// Upload one point per billboard and expand it to a quad in the shader instead of on the CPU.
+    /// Use a material made with material(img, point_scale) to draw the points.
+    void set_expand_in_shader(bool value) {
+      expand_in_shader = value;
+      clear_attributes();
+      if (value) {
+        add_attribute(attribute_pos, 3, GL_FLOAT, 0);
+        add_attribute(attribute_psize, 3, GL_FLOAT, 12);
+        add_attribute(attribute_uv, 4, GL_FLOAT, 24);
+        set_params(point_stride, 0, 0, GL_POINTS, 0);
+      } else {
+        set_default_attributes();
+      }
+    }
 
-      gl_resource::wolock vlock(get_vertices());
-      vertex *vtx = (vertex*)vlock.u8();
-      gl_resource::wolock ilock(get_indices());
-      uint32_t *idx = ilock.u32();
-      unsigned num_vertices = 0;
-      unsigned num_indices = 0;
+    /// True if billboards are expanded in the shader.
+    bool get_expand_in_shader() const {
+      return expand_in_shader;
+    }
 
-      vec3 cx = cameraToWorld.x().xyz();
-      vec3 cy = cameraToWorld.y().xyz();
-      vec3p n = cameraToWorld.z().xyz();
+    /// Generate mesh from particles
+    virtual void update() {
+      gl_resource *vertices = get_vertices();
+      uint8_t *vtx = (uint8_t*)vertices->lock_write_only();
 
-      for (unsigned i = 0; i != billboard_particles.size(); ++i) {
-        billboard_particle &p = billboard_particles[i];
-        if (p.enabled) {
-          vec2 size = p.size;
-          vec3 dx = size.x() * cx;
-          vec3 dy = size.y() * cy;
-          vec2 bl = p.uv_bottom_left;
-          vec2 tr = p.uv_top_right;
-          vec2 tl = vec2(bl.x(), tr.y());
-          vec2 br = vec2(tr.x(), bl.y());
-          vtx->pos = (vec3)p.pos - dx + dy; vtx->normal = n; vtx->uv = tl; vtx++;
-          vtx->pos = (vec3)p.pos + dx + dy; vtx->normal = n; vtx->uv = tr; vtx++;
-          vtx->pos = (vec3)p.pos + dx - dy; vtx->normal = n; vtx->uv = br; vtx++;
-          vtx->pos = (vec3)p.pos - dx - dy; vtx->normal = n; vtx->uv = bl; vtx++;
-          idx[0] = num_vertices; idx[1] = num_vertices+1; idx[2] = num_vertices+2;
-          idx[3] = num_vertices; idx[4] = num_vertices+2; idx[5] = num_vertices+3;
-          idx += 6;
-          num_vertices += 4;
-          num_indices += 6;
+      thread_pool::get().parallel_ranges(num_billboards, chunk_size, [&](unsigned begin, unsigned end) {
+        if (expand_in_shader) {
+          build_points((float*)vtx, begin, end);
+        } else {
+          build_quads((vertex*)vtx, begin, end);
         }
-      }
+      });
 
-      set_num_vertices(num_vertices);
-      set_num_indices(num_indices);
+      // only send the live part of the buffer.
+      if (expand_in_shader) {
+        set_num_vertices(num_billboards);
+        set_num_indices(0);
+        vertices->unlock_write_only(num_billboards * point_stride);
+      } else {
+        set_num_vertices(num_billboards * 4);
+        set_num_indices(num_billboards * 6);
+        vertices->unlock_write_only(num_billboards * 4 * sizeof(vertex));
+      }
       //dump(log("mesh\n"));
     }
 
-    /// Add a billboard particle. Returns -1 if capacity reached.
+    /// Add a billboard particle. Returns an id, or -1 if capacity reached.
+    /// The particle stays still until an animator is added for it.
     int add_billboard_particle(const billboard_particle &p) {
-      int i = allocate(billboard_particles, free_billboard_particle);
-      if (i != -1) {
-        billboard_particles[i] = p;
-      }
-      return i;
+      if (free_ids.size() == 0) return -1;
+      int id = free_ids.back();
+      free_ids.pop_back();
+      unsigned slot = num_billboards++;
+      id_to_slot[id] = (int)slot;
+      slot_to_id[slot] = id;
+      set_billboard_particle(id, p);
+      vel_x[slot] = vel_y[slot] = vel_z[slot] = 0;
+      acc_x[slot] = acc_y[slot] = acc_z[slot] = 0;
+      spin[slot] = 0;
+      age[slot] = 0;
+      lifetime[slot] = ~0u;
+      return id;
     }
 
-    /// Add a particle animator. Returns -1 if capacity reached.
+    /// Animate a billboard particle; p.link is the id of the billboard.
+    /// Returns the id of the billboard, or -1 if there is no such billboard.
     int add_particle_animator(const particle_animator &p) {
-      int i = allocate(particle_animators, free_particle_animator);
-      if (i != -1) {
-        particle_animators[i] = p;
-      }
-      return i;
+      int slot = p.link >= 0 && p.link < (int)id_to_slot.size() ? id_to_slot[p.link] : -1;
+      if (slot == -1) return -1;
+      vec3 vel = p.vel, acc = p.acceleration;
+      vel_x[slot] = vel.x(); vel_y[slot] = vel.y(); vel_z[slot] = vel.z();
+      acc_x[slot] = acc.x(); acc_y[slot] = acc.y(); acc_z[slot] = acc.z();
+      spin[slot] = (float)p.spin;
+      age[slot] = p.age;
+      lifetime[slot] = p.lifetime;
+      return p.link;
     }
 
     /// Add a trail particle. Returns -1 if capacity reached.
@@ -228,20 +375,66 @@ namespace octet { namespace scene {
       return i;
     }
 
-    billboard_particle &access_billboard_particle(int i) { return billboard_particles[i]; }
+    /// Remove a billboard particle and its animator.
+    void remove_billboard_particle(int id) {
+      int slot = id >= 0 && id < (int)id_to_slot.size() ? id_to_slot[id] : -1;
+      if (slot != -1) remove_billboard_slot(slot);
+    }
+
+    /// Read a billboard particle. Returns false if the particle has gone.
+    bool get_billboard_particle(int id, billboard_particle &p) const {
+      int slot = id >= 0 && id < (int)id_to_slot.size() ? id_to_slot[id] : -1;
+      if (slot == -1) return false;
+      p.link = -1;
+      p.pos = vec3p(pos_x[slot], pos_y[slot], pos_z[slot]);
+      p.size = vec2p(size_x[slot], size_y[slot]);
+      p.uv_bottom_left = vec2p(uv_left[slot], uv_bottom[slot]);
+      p.uv_top_right = vec2p(uv_right[slot], uv_top[slot]);
+      p.angle = angle[slot];
+      p.enabled = size_x[slot] != 0 || size_y[slot] != 0;
+      return true;
+    }
+
+    /// Change a billboard particle. Disabled billboards have zero size.
+    void set_billboard_particle(int id, const billboard_particle &p) {
+      int slot = id >= 0 && id < (int)id_to_slot.size() ? id_to_slot[id] : -1;
+      if (slot == -1) return;
+      vec3 pos = p.pos;
+      vec2 size = p.size, bl = p.uv_bottom_left, tr = p.uv_top_right;
+      pos_x[slot] = pos.x(); pos_y[slot] = pos.y(); pos_z[slot] = pos.z();
+      size_x[slot] = p.enabled ? size.x() : 0;
+      size_y[slot] = p.enabled ? size.y() : 0;
+      uv_left[slot] = bl.x(); uv_bottom[slot] = bl.y();
+      uv_right[slot] = tr.x(); uv_top[slot] = tr.y();
+      angle[slot] = p.angle;
+    }
+
+    /// Read the animator of a billboard particle. Returns false if the particle has gone.
+    bool get_particle_animator(int id, particle_animator &p) const {
+      int slot = id >= 0 && id < (int)id_to_slot.size() ? id_to_slot[id] : -1;
+      if (slot == -1) return false;
+      p.link = id;
+      p.vel = vec3p(vel_x[slot], vel_y[slot], vel_z[slot]);
+      p.acceleration = vec3p(acc_x[slot], acc_y[slot], acc_z[slot]);
+      p.lifetime = lifetime[slot];
+      p.age = age[slot];
+      p.spin = (uint32_t)spin[slot];
+      return true;
+    }
+
+    /// Number of live billboard particles.
+    unsigned get_num_billboard_particles() const {
+      return num_billboards;
+    }
+
     trail_particle &access_trail_particle(int i) { return trail_particles[i]; }
-    particle_animator &access_particle_animator(int i) { return particle_animators[i]; }
 
     /// Serialise
     void visit(visitor &v) {
       mesh::visit(v);
       /*
-      v.visit(billboard_particles);
-      v.visit(free_billboard_particle);
       v.visit(trail_particles);
       v.visit(free_trail_particle);
-      v.visit(particle_animators);
-      v.visit(free_particle_animator);
       v.visit(cameraToWorld);
       */
     }
@@ -9,30 +9,110 @@
 
 namespace octet { namespace scene {
   /// A mesh class for making prcedural geometry of various kinds.
+  ///
+  /// Points can be added one at a time with add_point() and update(), or in bulk
+  /// with set_channels() and generate(), which write straight into the vertex
+  /// buffer in parallel chunks.
+  ///
+  /// In bulk mode every point has up to eight float channels (eg. the parameters
+  /// of a flow cytometry event) and a colour. The first three channels are also
+  /// the position for ordinary materials. With a material made by
+  /// material(color, num_channels) the position is a projection of the channels
+  /// done in the vertex shader, so choosing different axes is a uniform change.
+  ///
+  /// Example
+  ///
+  ///     mesh_points::stream streams[] = {
+  ///       mesh_points::stream(xs, sizeof(float)), mesh_points::stream(ys, sizeof(float))
+  ///     };
+  ///     points->set_channels(num_points, 2, streams);
   class mesh_points : public mesh {
     dynarray<vec3p> points;
 
+    // zero for points added with add_point, otherwise the number of channels
+    unsigned num_channels;
+
+    enum {
+      // points per task when filling the vertex buffer.
+      chunk_points = 16384,
+    };
+
     void init() {
+      num_channels = 0;
       set_default_attributes();
       set_params(32, 0, 0, GL_POINTS, 0);
       update();
     }
 
+    // set the vertex format for bulk points and allocate the buffer.
+    // channels 0-3 at offset 0, channels 4-7 at offset 16 and a colour at the end.
+    unsigned begin_channels(unsigned count, unsigned num_channels_) {
+      assert(num_channels_ >= 1 && num_channels_ <= max_channels);
+      num_channels = num_channels_;
+      points.reset();
+
+      unsigned color_offset = num_channels > 4 ? 32 : 16;
+      unsigned stride = color_offset + 4;
+      clear_attributes();
+      add_attribute(attribute_pos, 3, GL_FLOAT, 0);
+      add_attribute(attribute_channels_lo, 4, GL_FLOAT, 0);
+      if (num_channels > 4) add_attribute(attribute_channels_hi, 4, GL_FLOAT, 16);
+      add_attribute(attribute_color, 4, GL_UNSIGNED_BYTE, color_offset, 1);
+      set_params(stride, 0, count, GL_POINTS, 0);
+      allocate(stride * count, 0);
+      return stride;
+    }
+
   public:
     RESOURCE_META(mesh_points)
 
+    enum {
+      max_channels = 8,
+    };
+
+    /// A caller's array of values, one every stride bytes.
+    /// Channel streams are floats, colour streams are RGBA bytes.
+    struct stream {
+      const void *data;
+      unsigned stride;
+
+      stream(const void *data = 0, unsigned stride = 0) : data(data), stride(stride) {
+      }
+    };
+
     /// make a new, empty mesh.
     mesh_points() {
       init();
     }
 
-    /// add a point to the mesh.
-    void add_point(vec3_in pos, vec4_in color) {
+    /// add a point to the mesh. These points are drawn in the colour of the material;
+    /// use set_channels() for a colour per point.
+    void add_point(vec3_in pos, vec4_in /*color*/) {
       points.push_back(pos);
     }
 
+    /// remove all the points.
+    void clear() {
+      points.reset();
+      if (num_channels) {
+        num_channels = 0;
+        clear_attributes();
+        set_default_attributes();
+        set_params(32, 0, 0, GL_POINTS, 0);
+      }
+      update();
+    }
+
+    /// Number of channels per point in bulk mode, zero for points added with add_point.
+    unsigned get_num_channels() const {
+      return num_channels;
+    }
+
     /// Build the OpenGL geometry.
     void update() {
+      // bulk points are already in the vertex buffer.
+      if (num_channels) return;
+
       allocate(sizeof(vertex)*points.size(), 0);
 
       gl_resource::wolock vtx_lock(get_vertices());
@@ -49,6 +129,73 @@ namespace octet { namespace scene {
       set_num_vertices(points.size());
     }
 
+    /// Replace the points with count points read from strided channel streams.
+    /// Missing channels up to the next multiple of four are zero. If colors.data
+    /// is NULL the points are white.
+    void set_channels(unsigned count, unsigned num_channels_, const stream *channels, const stream &colors = stream()) {
+      unsigned stride = begin_channels(count, num_channels_);
+      unsigned lanes = num_channels > 4 ? 8 : 4;
+      unsigned nc = num_channels;
+
+      gl_resource::wolock vtx_lock(get_vertices());
+      uint8_t *vtx = vtx_lock.u8();
+
+      thread_pool::get().parallel_ranges(count, chunk_points, [&](unsigned begin, unsigned end) {
+        for (unsigned c = 0; c != lanes; ++c) {
+          float *dest = (float*)(vtx + begin * stride) + c;
+          if (c < nc) {
+            const uint8_t *src = (const uint8_t*)channels[c].data + begin * channels[c].stride;
+            unsigned src_stride = channels[c].stride;
+            for (unsigned i = begin; i != end; ++i) {
+              *dest = *(const float*)src;
+              dest = (float*)((uint8_t*)dest + stride);
+              src += src_stride;
+            }
+          } else {
+            for (unsigned i = begin; i != end; ++i) {
+              *dest = 0;
+              dest = (float*)((uint8_t*)dest + stride);
+            }
+          }
+        }
+
+        uint8_t *dest = vtx + begin * stride + lanes * 4;
+        const uint8_t *src = (const uint8_t*)colors.data + begin * colors.stride;
+        for (unsigned i = begin; i != end; ++i) {
+          if (colors.data) {
+            memcpy(dest, src, 4);
+            src += colors.stride;
+          } else {
+            memset(dest, 0xff, 4);
+          }
+          dest += stride;
+        }
+      });
+    }
+
+    /// Replace the points with count points made by a generator.
+    /// fn(index, values, color) fills num_channels floats and an RGBA colour,
+    /// and is called from several threads at once.
+    template <class fn_t> void generate(unsigned count, unsigned num_channels_, fn_t fn) {
+      unsigned stride = begin_channels(count, num_channels_);
+      unsigned lanes = num_channels > 4 ? 8 : 4;
+
+      gl_resource::wolock vtx_lock(get_vertices());
+      uint8_t *vtx = vtx_lock.u8();
+
+      thread_pool::get().parallel_ranges(count, chunk_points, [&](unsigned begin, unsigned end) {
+        uint8_t *dest = vtx + begin * stride;
+        for (unsigned i = begin; i != end; ++i) {
+          float *values = (float*)dest;
+          uint8_t *color = dest + lanes * 4;
+          for (unsigned c = 0; c != lanes; ++c) values[c] = 0;
+          memset(color, 0xff, 4);
+          fn(i, values, color);
+          dest += stride;
+        }
+      });
+    }
+
     /// Serialize.
     void visit(visitor &v) {
       mesh::visit(v);
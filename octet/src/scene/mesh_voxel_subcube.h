@@ -8,132 +8,6 @@
 //
 
 namespace octet { namespace scene {
-  template <class interface_t, int dim> class mesh_iterate_faces : public interface_t {
-  public:
-    void iterate(const uint32_t *opaque) {
-      for (int z = 0; z != dim; ++z) {
-        for (int y = 0; y != dim; ++y) {
-          uint32_t p00 = opaque[z*dim+y];
-          interface_t::add_lefts( p00 & ~(p00 << 1), y, z );
-          interface_t::add_rights( p00 & ~(p00 >> 1), y, z );
-        }
-      }
-
-      for (int z = 0; z != dim; ++z) {
-        interface_t::add_bottoms( opaque[z*dim+0], 0, z );
-        for (int y = 0; y != dim-1; ++y) {
-          uint32_t p00 = opaque[z*dim+y];
-          uint32_t p01 = opaque[z*dim+(y+1)];
-          interface_t::add_bottoms( p01 & ~p00, y, z );
-          interface_t::add_tops( p00 & ~p01, y, z );
-        }
-        interface_t::add_tops( opaque[z*dim+(dim-1)], dim-1, z );
-      }
-
-      for (int y = 0; y != dim; ++y) {
-        interface_t::add_backs( opaque[0*dim+y], y, 0 );
-        for (int z = 0; z != dim-1; ++z) {
-          uint32_t p00 = opaque[z*dim+y];
-          uint32_t p10 = opaque[(z+1)*dim+y];
-          interface_t::add_backs( p10 & ~p00, y, z );
-          interface_t::add_fronts( p00 & ~p10, y, z );
-        }
-        interface_t::add_fronts( opaque[(dim-1)*dim+y], y, dim-1 );
-      }
-    }
-  };
-
-  class face_counter {
-  public:
-    unsigned num_faces;
-    face_counter() { num_faces = 0; }
-    void add_lefts(uint32_t v, int, int) { num_faces += pop_count(v); }
-    void add_rights(uint32_t v, int, int) { num_faces += pop_count(v); }
-    void add_tops(uint32_t v, int, int) { num_faces += pop_count(v); }
-    void add_bottoms(uint32_t v, int, int) { num_faces += pop_count(v); }
-    void add_fronts(uint32_t v, int, int) { num_faces += pop_count(v); }
-    void add_backs(uint32_t v, int, int) { num_faces += pop_count(v); }
-  };
-
-  class face_adder {
-  public:
-    vec3 origin;
-    vec3 dx;
-    vec3 dy;
-    vec3 dz;
-    mesh::vertex *vtx;
-    uint32_t *idx;
-    float voxel_size;
-    unsigned num_faces;
-
-    face_adder() { num_faces = 0; }
-
-    void add_faces(uint32_t v, vec3_in base, vec3_in du, vec3_in dv, const vec3p &normal) {
-      unsigned idx_val = num_faces * 4;
-      for (int i = 0; i < 32; v >>= 1, i++) {
-        if ((v & 0xff) == 0) { v >>= 8; i += 8; }
-        if ((v & 0x3) == 0) { v >>= 2; i += 2; }
-        if (v & 1) {
-          vec3 pos = base + (float)(i) * dx;
-          vtx->pos = pos; vtx->normal = normal; vtx->uv = vec2p(0, 0); vtx++;
-          vtx->pos = pos + du; vtx->normal = normal; vtx->uv = vec2p(1, 0); vtx++;
-          vtx->pos = pos + du + dv; vtx->normal = normal; vtx->uv = vec2p(1, 1); vtx++;
-          vtx->pos = pos + dv; vtx->normal = normal; vtx->uv = vec2p(0, 1); vtx++;
-          idx[0] = idx_val + 0;
-          idx[3] = idx[1] = idx_val + 1;
-          idx[5] = idx[2] = idx_val + 3;
-          idx[4] = idx_val + 2;
-          idx += 6;
-          num_faces++;
-          idx_val += 4;
-        }
-      }
-    }
-
-    void add_lefts(uint32_t v, int y, int z) {
-      if (v) add_faces(
-        v,
-        origin + vec3((float)(0), (float)(y), (float)(z))*voxel_size,
-        dy, dz, vec3p(-1.0f, 0.0f, 0.0f)
-      );
-    }
-    void add_rights(uint32_t v, int y, int z) {
-      if (v) add_faces(
-        v,
-        origin + vec3((float)(1), (float)(y+1), (float)(z+1))*voxel_size,
-        -dy, -dz, vec3p(1.0f, 0.0f, 0.0f)
-      );
-    }
-    void add_bottoms(uint32_t v, int y, int z) {
-      if (v) add_faces(
-        v,
-        origin + vec3((float)(0), (float)(y+1), (float)(z))*voxel_size,
-        dx, dz, vec3p(0.0f, -1.0f, 0.0f)
-      );
-    }
-    void add_tops(uint32_t v, int y, int z) {
-      if (v) add_faces(
-        v,
-        origin + vec3((float)(1), (float)(y+1), (float)(z+1))*voxel_size,
-        -dx, -dz, vec3p(0.0f, 1.0f, 0.0f)
-      );
-    }
-    void add_backs(uint32_t v, int y, int z) {
-      if (v) add_faces(
-        v,
-        origin + vec3((float)(0), (float)(y), (float)(z+1))*voxel_size,
-        dx, dy, vec3p(0.0f, 0.0f, -1.0f)
-      );
-    }
-    void add_fronts(uint32_t v, int y, int z) {
-      if (v) add_faces(
-        v,
-        origin + vec3((float)(1), (float)(y+1), (float)(z+1))*voxel_size,
-        -dx, -dy, vec3p(0.0f, 0.0f, 1.0f)
-      );
-    }
-  };
-
   /// experimental voxel world subcube class.
   class mesh_voxel_subcube : public resource {
     enum {
@@ -147,9 +21,19 @@ namespace octet { namespace scene {
       num_lod = d2 + 1
     };
 
-    uint32_t opaque[dim*dim];
-    uint32_t any_opaque[num_lod];
-    uint32_t all_opaque[num_lod];
+    // Rows of voxels and their LODs.
+    // Empty and full subcubes share constant tables and only mixed ones have storage.
+    uint32_t *opaque;
+    uint32_t *any_opaque;
+    uint32_t *all_opaque;
+    dynarray<uint32_t> storage;
+    uint8_t state;
+
+    // opaque has changed since the last build_mesh
+    bool dirty;
+
+    // quads from the last build_mesh, four vertices each
+    dynarray<mesh::vertex> vertices;
 
 
     static unsigned off32(unsigned x, unsigned y, unsigned z) { return z*32+y; }
@@ -164,7 +48,7 @@ namespace octet { namespace scene {
     static unsigned shift4(unsigned x, unsigned y, unsigned z) { return x+y*4+(z&1)*16; }
     static unsigned shift2(unsigned x, unsigned y, unsigned z) { return x+y*2+z*4; }
 
-    unsigned get32(uint32_t *src, unsigned x, unsigned y, unsigned z) { return (opaque[z*32+y] >> x) & 1; }
+    unsigned get32(uint32_t *src, unsigned x, unsigned y, unsigned z) const { return (opaque[z*32+y] >> x) & 1; }
     static unsigned get16(uint32_t *src, unsigned x, unsigned y, unsigned z) { return (src[off16(x,y,z)] >> shift16(x,y,z)) & 1; }
     static unsigned get8(uint32_t *src, unsigned x, unsigned y, unsigned z) { return (src[off8(x,y,z)] >> shift8(x,y,z)) & 1; }
     static unsigned get4(uint32_t *src, unsigned x, unsigned y, unsigned z) { return (src[off4(x,y,z)] >> shift4(x,y,z)) & 1; }
@@ -175,15 +59,343 @@ namespace octet { namespace scene {
     // abcd -> acbd
     static unsigned cswap(unsigned x) { return (x & 0xff0000ff) | ( x >> 8 ) & 0xff00 | ( x << 8 ) & 0xff0000; }
 
+    // constant rows and LODs for homogeneous subcubes. LOD bits are all set except the top level, which has 8.
+    static uint32_t *get_table(unsigned state, bool lod) {
+      static uint32_t tables[2][dim*dim + num_lod];
+      static bool init = false;
+      if (!init) {
+        for (unsigned i = 0; i != dim*dim + num_lod; ++i) {
+          tables[1][i] = i == dim*dim + d2 ? 0xff : ~0u;
+        }
+        init = true;
+      }
+      return tables[state == state_full] + (lod ? dim*dim : 0);
+    }
+
+    // point at the shared tables for an empty or full subcube.
+    void set_homogeneous(unsigned new_state) {
+      state = (uint8_t)new_state;
+      storage.reset();
+      opaque = get_table(new_state, false);
+      any_opaque = all_opaque = get_table(new_state, true);
+    }
+
+    // give this subcube its own rows before changing them.
+    void make_mixed() {
+      if (state == state_mixed) return;
+      storage.resize(dim*dim + num_lod*2);
+      memcpy(storage.data(), opaque, dim*dim*sizeof(uint32_t));
+      memcpy(storage.data() + dim*dim, any_opaque, num_lod*sizeof(uint32_t));
+      memcpy(storage.data() + dim*dim + num_lod, all_opaque, num_lod*sizeof(uint32_t));
+      opaque = storage.data();
+      any_opaque = opaque + dim*dim;
+      all_opaque = any_opaque + num_lod;
+      state = state_mixed;
+    }
+
+    // transpose a 32x32 bit matrix: bit x of rows[y] becomes bit y of rows[x]
+    static void transpose(uint32_t *rows) {
+      uint32_t mask = 0x0000ffff;
+      for (unsigned j = 16; j != 0; j >>= 1, mask ^= mask << j) {
+        for (unsigned k = 0; k < 32; k = ( k + j + 1 ) & ~j) {
+          uint32_t t = ( ( rows[k] >> j ) ^ rows[k+j] ) & mask;
+          rows[k] ^= t << j;
+          rows[k+j] ^= t;
+        }
+      }
+    }
+
+    // Merge the set bits of a 32x32 bit plane (bit c of rows[r]) into rectangles.
+    // Take the lowest run of bits in a row, then grow it over the following rows
+    // that have the same run. Calls fn(c, r, width, height) for each rectangle.
+    template <class fn_t> static void greedy_quads(uint32_t *rows, fn_t fn) {
+      for (unsigned r = 0; r != dim; ++r) {
+        while (rows[r]) {
+          unsigned c = ctz(rows[r]);
+          unsigned width = ctz(~(rows[r] >> c));
+          uint32_t run = ( width == 32 ? ~0u : ( 1u << width ) - 1 ) << c;
+          unsigned height = 1;
+          while (r + height != dim && ( rows[r + height] & run ) == run) {
+            rows[r + height] &= ~run;
+            height++;
+          }
+          rows[r] &= ~run;
+          fn(c, r, width, height);
+        }
+      }
+    }
+
+    // add a quad of four vertices. du x dv points along the normal.
+    void add_quad(vec3_in pos, vec3_in du, vec3_in dv, float ulen, float vlen, const vec3p &normal) {
+      unsigned v = vertices.size();
+      if (vertices.capacity() < v + 4) vertices.reserve(v * 2 + 64);
+      vertices.resize(v + 4);
+      mesh::vertex *vtx = &vertices[v];
+      vtx->pos = pos; vtx->normal = normal; vtx->uv = vec2p(0, 0); vtx++;
+      vtx->pos = pos + du; vtx->normal = normal; vtx->uv = vec2p(ulen, 0); vtx++;
+      vtx->pos = pos + du + dv; vtx->normal = normal; vtx->uv = vec2p(ulen, vlen); vtx++;
+      vtx->pos = pos + dv; vtx->normal = normal; vtx->uv = vec2p(0, vlen); vtx++;
+    }
+
+    // Optional bounds tests on a set, found with SFINAE.
+    // intersects(aabb) may only be false if no point of the box is in the set and
+    // contains(aabb) may only be true if all of them are. Sets without them are tested voxel by voxel.
+    template <class set> static auto set_intersects(const set &set_in, const aabb &box, int) -> decltype(set_in.intersects(box)) {
+      return set_in.intersects(box);
+    }
+
+    template <class set> static bool set_intersects(const set &set_in, const aabb &box, long) {
+      return true;
+    }
+
+    template <class set> static auto set_contains(const set &set_in, const aabb &box, int) -> decltype(set_in.contains(box)) {
+      return set_in.contains(box);
+    }
+
+    template <class set> static bool set_contains(const set &set_in, const aabb &box, long) {
+      return false;
+    }
+
+    enum {
+      block_outside,
+      block_inside,
+      block_mixed
+    };
+
+    // Test the voxel centres of a size x size x size block against the bounds of the set.
+    template <class set> static unsigned classify_block(mat4t_in voxelToWorld, const set &set_in, int x0, int y0, int z0, int size) {
+      // pad by a fraction of a voxel so that rounding in the transform can't lose a centre.
+      float half = ( size - 1 ) * 0.5f;
+      aabb box = aabb(vec3(x0 + half, y0 + half, z0 + half), vec3(half + 1.0f/256)).get_transform(voxelToWorld);
+      if (!set_intersects(set_in, box, 0)) return block_outside;
+      if (set_contains(set_in, box, 0)) return block_inside;
+      return block_mixed;
+    }
+
+    // World positions of the voxels x0..x0+7 of a row, rounded exactly as vec3(x, y, z) * voxelToWorld.
+    static void row_positions(float *px, float *py, float *pz, mat4t_in voxelToWorld, int x0, int y, int z) {
+      const vec4 &mx = voxelToWorld[0], &my = voxelToWorld[1], &mz = voxelToWorld[2], &mw = voxelToWorld[3];
+      float yx = my[0] * y, yy = my[1] * y, yz = my[2] * y;
+      float zx = mz[0] * z, zy = mz[1] * z, zz = mz[2] * z;
+      for (unsigned i = 0; i != 8; ++i) {
+        float x = (float)(x0 + (int)i);
+        px[i] = mx[0] * x + yx + zx + mw[0];
+        py[i] = mx[1] * x + yy + zy + mw[1];
+        pz[i] = mx[2] * x + yz + zz + mw[2];
+      }
+    }
+
+    // Bits of the voxels x0..x0+7 of a row that are in the set, for the bits set in mask.
+    template <class set> static unsigned test_row(const set &set_in, mat4t_in voxelToWorld, int x0, int y, int z, unsigned mask) {
+      unsigned result = 0;
+      for (; mask; mask &= mask - 1) {
+        int i = ctz(mask);
+        if (set_in.intersects(vec3((float)(x0 + i), (float)y, (float)z) * voxelToWorld)) {
+          result |= 1 << i;
+        }
+      }
+      return result;
+    }
+
+    // spheres test eight voxels at a time.
+    static unsigned test_row(const sphere &set_in, mat4t_in voxelToWorld, int x0, int y, int z, unsigned mask) {
+      float px[8], py[8], pz[8];
+      row_positions(px, py, pz, voxelToWorld, x0, y, z);
+      vec3 c = set_in.get_center();
+      float r2 = squared(set_in.get_radius());
+      unsigned result = 0;
+      #if OCTET_SSE
+        for (unsigned i = 0; i != 8; i += 4) {
+          __m128 dx = _mm_sub_ps(_mm_loadu_ps(px + i), _mm_set1_ps(c.x()));
+          __m128 dy = _mm_sub_ps(_mm_loadu_ps(py + i), _mm_set1_ps(c.y()));
+          __m128 dz = _mm_sub_ps(_mm_loadu_ps(pz + i), _mm_set1_ps(c.z()));
+          __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+          result |= _mm_movemask_ps(_mm_cmple_ps(d2, _mm_set1_ps(r2))) << i;
+        }
+      #else
+        for (unsigned i = 0; i != 8; ++i) {
+          float dx = px[i] - c.x(), dy = py[i] - c.y(), dz = pz[i] - c.z();
+          result |= ( dx * dx + dy * dy + dz * dz <= r2 ) << i;
+        }
+      #endif
+      return result & mask;
+    }
+
+    // boxes test eight voxels at a time.
+    static unsigned test_row(const aabb &set_in, mat4t_in voxelToWorld, int x0, int y, int z, unsigned mask) {
+      float px[8], py[8], pz[8];
+      row_positions(px, py, pz, voxelToWorld, x0, y, z);
+      vec3 c = set_in.get_center();
+      vec3 h = set_in.get_half_extent();
+      unsigned result = 0;
+      #if OCTET_SSE
+        __m128 sign = _mm_set1_ps(-0.0f);
+        for (unsigned i = 0; i != 8; i += 4) {
+          __m128 dx = _mm_andnot_ps(sign, _mm_sub_ps(_mm_set1_ps(c.x()), _mm_loadu_ps(px + i)));
+          __m128 dy = _mm_andnot_ps(sign, _mm_sub_ps(_mm_set1_ps(c.y()), _mm_loadu_ps(py + i)));
+          __m128 dz = _mm_andnot_ps(sign, _mm_sub_ps(_mm_set1_ps(c.z()), _mm_loadu_ps(pz + i)));
+          __m128 in = _mm_and_ps(_mm_and_ps(_mm_cmple_ps(dx, _mm_set1_ps(h.x())), _mm_cmple_ps(dy, _mm_set1_ps(h.y()))), _mm_cmple_ps(dz, _mm_set1_ps(h.z())));
+          result |= _mm_movemask_ps(in) << i;
+        }
+      #else
+        for (unsigned i = 0; i != 8; ++i) {
+          bool in = fabsf(c.x() - px[i]) <= h.x() && fabsf(c.y() - py[i]) <= h.y() && fabsf(c.z() - pz[i]) <= h.z();
+          result |= in << i;
+        }
+      #endif
+      return result & mask;
+    }
+
   public:
     RESOURCE_META(mesh_voxel_subcube)
 
+    /// what a subcube contains. Empty and full subcubes have no storage of their own.
+    enum {
+      state_empty,
+      state_full,
+      state_mixed
+    };
+
     mesh_voxel_subcube() {
-      memset(opaque, 0, sizeof(opaque));
+      set_homogeneous(state_empty);
+      dirty = true;
       //update_lod();
     }
 
+    /// state_empty, state_full or state_mixed
+    unsigned get_state() const {
+      return state;
+    }
+
+    /// Release the storage of a subcube that has become all empty or all full.
+    void compact() {
+      if (state != state_mixed) return;
+      uint32_t all = ~0u, any = 0;
+      for (unsigned i = 0; i != dim*dim; ++i) {
+        all &= opaque[i];
+        any |= opaque[i];
+      }
+      if (!any) {
+        set_homogeneous(state_empty);
+      } else if (all == ~0u) {
+        set_homogeneous(state_full);
+      }
+    }
+
+    /// Bytes used by this subcube's voxels and quads.
+    unsigned get_memory_used() const {
+      return sizeof(*this) + storage.capacity() * sizeof(uint32_t) + vertices.capacity() * sizeof(mesh::vertex);
+    }
+
+    /// Has this subcube changed since the last build_mesh?
+    bool is_dirty() const {
+      return dirty;
+    }
+
+    /// Mesh this subcube again, for example when a neighbour has changed.
+    void mark_dirty() {
+      dirty = true;
+    }
+
+    /// Make greedy quads for the visible faces of this subcube.
+    /// neighbours are the subcubes at -x, +x, -y, +y, -z and +z, NULL at the edge of the world.
+    /// Voxels in neighbours hide the faces on the boundary.
+    /// This only writes to this subcube, so subcubes can be meshed on different threads.
+    void build_mesh(const mesh_voxel_subcube *const *neighbours, vec3_in origin, float voxel_size) {
+      static const uint32_t empty[dim*dim] = { 0 };
+      const uint32_t *nb[6];
+      for (unsigned i = 0; i != 6; ++i) {
+        nb[i] = neighbours[i] ? neighbours[i]->opaque : empty;
+      }
+
+      vertices.resize(0);
+      dirty = false;
+
+      vec3 dx(voxel_size, 0, 0);
+      vec3 dy(0, voxel_size, 0);
+      vec3 dz(0, 0, voxel_size);
+
+      // faces in the same plane, [plane][row]
+      uint32_t lo[dim*dim];
+      uint32_t hi[dim*dim];
+
+      // x faces: rows are bits in x, so transpose each z slice to get rows in y for each x plane.
+      for (int z = 0; z != dim; ++z) {
+        uint32_t lefts[dim], rights[dim];
+        for (int y = 0; y != dim; ++y) {
+          uint32_t p = opaque[z*dim+y];
+          lefts[y] = p & ~( p << 1 | nb[0][z*dim+y] >> 31 );
+          rights[y] = p & ~( p >> 1 | nb[1][z*dim+y] << 31 );
+        }
+        transpose(lefts);
+        transpose(rights);
+        for (int x = 0; x != dim; ++x) {
+          lo[x*dim+z] = lefts[x];
+          hi[x*dim+z] = rights[x];
+        }
+      }
+      for (int x = 0; x != dim; ++x) {
+        greedy_quads(lo + x*dim, [&](unsigned y, unsigned z, unsigned w, unsigned h) {
+          add_quad(origin + vec3((float)x, (float)y, (float)z) * voxel_size, dz * (float)h, dy * (float)w, (float)h, (float)w, vec3p(-1, 0, 0));
+        });
+        greedy_quads(hi + x*dim, [&](unsigned y, unsigned z, unsigned w, unsigned h) {
+          add_quad(origin + vec3((float)(x+1), (float)y, (float)z) * voxel_size, dy * (float)w, dz * (float)h, (float)w, (float)h, vec3p(1, 0, 0));
+        });
+      }
+
+      // y faces: rows in z for each y plane.
+      for (int z = 0; z != dim; ++z) {
+        for (int y = 0; y != dim; ++y) {
+          uint32_t p = opaque[z*dim+y];
+          uint32_t below = y != 0 ? opaque[z*dim+y-1] : nb[2][z*dim+dim-1];
+          uint32_t above = y != dim-1 ? opaque[z*dim+y+1] : nb[3][z*dim];
+          lo[y*dim+z] = p & ~below;
+          hi[y*dim+z] = p & ~above;
+        }
+      }
+      for (int y = 0; y != dim; ++y) {
+        greedy_quads(lo + y*dim, [&](unsigned x, unsigned z, unsigned w, unsigned h) {
+          add_quad(origin + vec3((float)x, (float)y, (float)z) * voxel_size, dx * (float)w, dz * (float)h, (float)w, (float)h, vec3p(0, -1, 0));
+        });
+        greedy_quads(hi + y*dim, [&](unsigned x, unsigned z, unsigned w, unsigned h) {
+          add_quad(origin + vec3((float)x, (float)(y+1), (float)z) * voxel_size, dz * (float)h, dx * (float)w, (float)h, (float)w, vec3p(0, 1, 0));
+        });
+      }
+
+      // z faces: rows in y for each z plane.
+      for (int z = 0; z != dim; ++z) {
+        for (int y = 0; y != dim; ++y) {
+          uint32_t p = opaque[z*dim+y];
+          uint32_t back = z != 0 ? opaque[(z-1)*dim+y] : nb[4][(dim-1)*dim+y];
+          uint32_t front = z != dim-1 ? opaque[(z+1)*dim+y] : nb[5][y];
+          lo[z*dim+y] = p & ~back;
+          hi[z*dim+y] = p & ~front;
+        }
+      }
+      for (int z = 0; z != dim; ++z) {
+        greedy_quads(lo + z*dim, [&](unsigned x, unsigned y, unsigned w, unsigned h) {
+          add_quad(origin + vec3((float)x, (float)y, (float)z) * voxel_size, dy * (float)h, dx * (float)w, (float)h, (float)w, vec3p(0, 0, -1));
+        });
+        greedy_quads(hi + z*dim, [&](unsigned x, unsigned y, unsigned w, unsigned h) {
+          add_quad(origin + vec3((float)x, (float)y, (float)(z+1)) * voxel_size, dx * (float)w, dy * (float)h, (float)w, (float)h, vec3p(0, 0, 1));
+        });
+      }
+    }
+
+    /// Number of quads made by the last build_mesh.
+    unsigned get_num_quads() const {
+      return vertices.size() / 4;
+    }
+
+    /// Vertices made by the last build_mesh, four per quad.
+    const mesh::vertex *get_vertices() const {
+      return vertices.data();
+    }
+
     void update_lod() {
+      // the shared tables are already right.
+      if (state != state_mixed) return;
+
       uint32_t *any = any_opaque + d16;
       uint32_t *all = all_opaque + d16;
 
@@ -263,25 +475,73 @@ namespace octet { namespace scene {
       assert(any - any_opaque == num_lod);
     }
 
-    void count_faces(mesh_iterate_faces<face_counter, dim> &count) {
-      count.iterate(opaque);
-    }
-
-    void add_faces(mesh_iterate_faces<face_adder, dim> &add) {
-      add.iterate(opaque);
+    /// Could the set add any voxels to a subcube with this voxelToWorld?
+    /// Always true unless the set has an intersects(aabb) test.
+    template <class set> static bool may_intersect(mat4t_in voxelToWorld, const set &set_in) {
+      return classify_block(voxelToWorld, set_in, 0, 0, 0, dim) != block_outside;
     }
 
+    /// Add the voxels whose centres, transformed by voxelToWorld, are in the set.
+    /// The subcube and then its 8x8x8 and 4x4x4 blocks are tested against the set's bounds
+    /// (see set_intersects and set_contains) to skip or fill them whole, and only the
+    /// blocks on the boundary test their voxels, a row of eight at a time.
     template <class set> void add_voxels(mat4t_in voxelToWorld, const set &set_in) {
-      for (int z = 0; z != dim; ++z) {
-        for (int y = 0; y != dim; ++y) {
-          for (int x = 0; x != dim; ++x) {
-            vec3 txyz = vec3(x, y, z) * voxelToWorld;
-            if (set_in.intersects(txyz)) {
-              opaque[z*dim+y] |= 1 << x;
+      // adding to a full subcube changes nothing.
+      if (state == state_full) return;
+
+      unsigned whole = classify_block(voxelToWorld, set_in, 0, 0, 0, dim);
+      if (whole == block_outside) return;
+      if (whole == block_inside) {
+        set_homogeneous(state_full);
+        dirty = true;
+        return;
+      }
+
+      uint32_t added[dim*dim];
+      memset(added, 0, sizeof(added));
+      for (int bz = 0; bz != dim; bz += 8) {
+        for (int by = 0; by != dim; by += 8) {
+          for (int bx = 0; bx != dim; bx += 8) {
+            unsigned block = classify_block(voxelToWorld, set_in, bx, by, bz, 8);
+            if (block == block_outside) continue;
+
+            // bits of the rows to fill or test for each 4x4x4 sub-block, by [z/4][y/4] in the block.
+            uint32_t fill[2][2] = { { 0, 0 }, { 0, 0 } };
+            uint32_t test[2][2] = { { 0, 0 }, { 0, 0 } };
+            for (int sub = 0; sub != 8; ++sub) {
+              int sx = sub & 1, sy = ( sub >> 1 ) & 1, sz = sub >> 2;
+              unsigned sub_block = block == block_inside ? block_inside : classify_block(voxelToWorld, set_in, bx + sx*4, by + sy*4, bz + sz*4, 4);
+              uint32_t bits = 0xfu << ( bx + sx*4 );
+              if (sub_block == block_inside) {
+                fill[sz][sy] |= bits;
+              } else if (sub_block == block_mixed) {
+                test[sz][sy] |= bits;
+              }
+            }
+
+            for (int z = bz; z != bz + 8; ++z) {
+              for (int y = by; y != by + 8; ++y) {
+                uint32_t &row = added[z*dim+y];
+                row |= fill[( z - bz ) >> 2][( y - by ) >> 2];
+                // voxels that are already set need not be tested again.
+                uint32_t mask = test[( z - bz ) >> 2][( y - by ) >> 2] & ~opaque[z*dim+y];
+                if (mask) {
+                  row |= test_row(set_in, voxelToWorld, bx, y, z, mask >> bx) << bx;
+                }
+              }
             }
           }
         }
       }
+
+      for (unsigned i = 0; i != dim*dim; ++i) {
+        if (added[i] & ~opaque[i]) {
+          make_mixed();
+          opaque[i] |= added[i];
+          dirty = true;
+        }
+      }
+      compact();
     }
 
     void dump_lod(FILE *fp, const char *label, uint32_t *src) {
@@ -330,8 +590,9 @@ namespace octet { namespace scene {
     // unit test for update_lod function
     bool test_update_lod() {
       random r;
+      make_mixed();
       for (int i = 0; i != 100; ++i) {
-        memset(opaque, 0, sizeof(opaque));
+        memset(opaque, 0, dim*dim*sizeof(uint32_t));
         for (int z = 0; z != 32; z ++) {
           for (int y = 0; y != 32; y ++) {
             //unsigned density = z >= 16 ? (y >= 16 ? 0x10 : 0xfff0) : (y >= 16 ? 0x0 : 0x10000);
@@ -403,7 +664,7 @@ namespace octet { namespace scene {
       return true;
     }
 
-    unsigned is_any(ivec3_in pos, int level) {
+    unsigned is_any(ivec3_in pos, int level) const {
       switch(level) {
         case 0: return get32(opaque, pos.x(), pos.y(), pos.z());
         case 1: return get16(any_opaque, pos.x(), pos.y(), pos.z());
@@ -415,7 +676,7 @@ namespace octet { namespace scene {
       }
     }
 
-    unsigned is_all(ivec3_in pos, int level) {
+    unsigned is_all(ivec3_in pos, int level) const {
       switch(level) {
         case 0: return get32(opaque, pos.x(), pos.y(), pos.z());
         case 1: return get16(all_opaque, pos.x(), pos.y(), pos.z());
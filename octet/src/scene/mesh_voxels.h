@@ -26,27 +26,62 @@ namespace octet { namespace scene {
   typedef pair<entry, entry> entries;
 
   /// Experimental Voxel world mesh, uses subcubes to create a voxel world.
+  ///
+  /// Subcubes (bricks of 32x32x32 voxels) are stored sparsely in a hash map.
+  /// Empty bricks are not stored at all and full ones share a constant table,
+  /// so memory goes with the surface area of the world, not its volume.
+  /// Regions of 8x8x8 bricks count their bricks, which makes a hierarchy for
+  /// is_any(), is_all() and ray_cast() to skip space quickly.
+  ///
+  /// Faces are merged into larger quads (greedy meshing) a plane at a time
+  /// using the 32 bit rows of opaque voxels in each subcube.
   class mesh_voxels : public mesh {
     ivec3 size;
     float voxel_size;
 
-    enum { log_subcube_dim = 5, subcube_dim = 1 << log_subcube_dim };
+    enum {
+      log_subcube_dim = 5, subcube_dim = 1 << log_subcube_dim,
+      log_region_dim = 3, region_dim = 1 << log_region_dim,
+      region_level = log_subcube_dim + log_region_dim,
+    };
 
-    dynarray<ref<mesh_voxel_subcube> > subcubes;
+    // non-empty subcubes by brick position (mutable as hash_map lookups are not const)
+    mutable hash_map<uint64_t, ref<mesh_voxel_subcube> > subcubes;
 
-    struct kd_node {
-      int axis;
-      int kids[2];
+    // number of non-empty and full subcubes in each region
+    struct region {
+      unsigned num_bricks;
+      unsigned num_full;
     };
+    mutable hash_map<uint64_t, region> regions;
 
-    dynarray<kd_node> kd_tree;
+    // pack a position into a hash key, never zero.
+    static uint64_t get_key(ivec3_in pos) {
+      return (uint64_t)pos.x() | (uint64_t)pos.y() << 21 | (uint64_t)pos.z() << 42 | (uint64_t)1 << 63;
+    }
 
-    unsigned is_all(ivec3_in pos, int level) const {
-      if ((1<<level) <= subcube_dim) {
-        return all(pos >= ivec3(0, 0, 0)) && all(pos < size) ? 1 : 0;
-      } else {
-        mesh_voxel_subcube *subcube = get_subcube(pos>>level);
-        return subcube->is_any(pos & ivec3(subcube_dim-1), level);
+    static ivec3 get_pos(uint64_t key) {
+      return ivec3((int)(key & 0x1fffff), (int)((key >> 21) & 0x1fffff), (int)((key >> 42) & 0x1fffff));
+    }
+
+    // find the region for a brick, making it if necessary
+    region &get_region(ivec3_in brick) {
+      uint64_t key = get_key(brick >> log_region_dim);
+      if (!regions.contains(key)) {
+        region r = { 0, 0 };
+        regions[key] = r;
+      }
+      return regions[key];
+    }
+
+    // collect the subcubes and their positions.
+    void get_bricks(dynarray<mesh_voxel_subcube*> &bricks, dynarray<ivec3> *positions = 0) {
+      for (unsigned i = 0; i != subcubes.size(); ++i) {
+        uint64_t key = subcubes.get_key(i);
+        if (key) {
+          bricks.push_back(subcubes.get_value(i));
+          if (positions) positions->push_back(get_pos(key));
+        }
       }
     }
 
@@ -64,64 +99,201 @@ namespace octet { namespace scene {
       return d[i];
     }
 
+    // the six neighbours of a brick: -x, +x, -y, +y, -z, +z
+    static const ivec3 &face_delta(int i) {
+      static const ivec3 d[] = {
+        ivec3(-1, 0, 0),
+        ivec3(1, 0, 0),
+        ivec3(0, -1, 0),
+        ivec3(0, 1, 0),
+        ivec3(0, 0, -1),
+        ivec3(0, 0, 1)
+      };
+      return d[i];
+    }
+
+    // Re-mesh the subcubes that have changed, and their neighbours, on the thread pool.
+    // Each subcube keeps its own quads, which are then copied into the vertex buffer in parallel.
     void update_mesh() {
-      mesh_iterate_faces<face_counter, subcube_dim> count;
-      for (unsigned i = 0; i != subcubes.size(); ++i) {
-        mesh_voxel_subcube *p = subcubes[i];
-        if (p) {
-          p->count_faces(count);
-        }
+      dynarray<mesh_voxel_subcube*> bricks;
+      dynarray<ivec3> positions;
+      get_bricks(bricks, &positions);
+
+      // a changed subcube can hide or show faces on its neighbours' boundaries.
+      dynarray<unsigned> changed;
+      for (unsigned i = 0; i != bricks.size(); ++i) {
+        if (bricks[i]->is_dirty()) changed.push_back(i);
       }
+      if (changed.size() == 0) return;
 
-      allocate(sizeof(vertex)*count.num_faces*4, sizeof(uint32_t)*count.num_faces*6);
-      set_num_indices(count.num_faces*6);
-      set_num_vertices(count.num_faces*4);
+      for (unsigned i = 0; i != changed.size(); ++i) {
+        for (int j = 0; j != 6; ++j) {
+          mesh_voxel_subcube *p = get_subcube(positions[changed[i]] + face_delta(j));
+          if (p) p->mark_dirty();
+        }
+      }
 
-      mesh_iterate_faces<face_adder, subcube_dim> add;
-      add.vtx = (vertex *)get_vertices()->lock();
-      add.idx = (uint32_t *)get_indices()->lock();
-      add.dx = vec3(voxel_size, 0.0f, 0.0f);
-      add.dy = vec3(0.0f, voxel_size, 0.0f);
-      add.dz = vec3(0.0f, 0.0f, voxel_size);
-      add.voxel_size = voxel_size;
+      dynarray<unsigned> work;
+      for (unsigned i = 0; i != bricks.size(); ++i) {
+        if (bricks[i]->is_dirty()) work.push_back(i);
+      }
 
       vec3 offset = vec3(size) * (-0.5f * subcube_dim * voxel_size);
       vec3 scale(subcube_dim * voxel_size);
-      int idx = 0;
-      for (int z = 0; z != size.z(); ++z) {
-        for (int y = 0; y != size.y(); ++y) {
-          for (int x = 0; x != size.x(); ++x) {
-            mesh_voxel_subcube *p = subcubes[idx++];
-            add.origin = vec3(x, y, z) * scale + offset;
-            if (p) {
-              p->add_faces(add);
-            }
-          }
+      thread_pool::get().parallel_for(work.size(), [&](unsigned i) {
+        unsigned b = work[i];
+        const mesh_voxel_subcube *neighbours[6];
+        for (int j = 0; j != 6; ++j) {
+          neighbours[j] = get_subcube(positions[b] + face_delta(j));
         }
+        bricks[b]->build_mesh(neighbours, vec3(positions[b]) * scale + offset, voxel_size);
+      });
+
+      // each subcube gets its own range of quads in the mesh.
+      unsigned num_bricks = bricks.size();
+      dynarray<unsigned> first_quad(num_bricks + 1);
+      unsigned num_quads = 0;
+      for (unsigned i = 0; i != num_bricks; ++i) {
+        first_quad[i] = num_quads;
+        num_quads += bricks[i]->get_num_quads();
       }
-
-      assert(count.num_faces == add.num_faces);
-
-      get_vertices()->unlock();
-      get_indices()->unlock();
+      first_quad[num_bricks] = num_quads;
+
+      allocate(sizeof(vertex)*num_quads*4, sizeof(uint32_t)*num_quads*6);
+      set_num_indices(num_quads*6);
+      set_num_vertices(num_quads*4);
+
+      gl_resource::wolock vtx_lock(get_vertices());
+      gl_resource::wolock idx_lock(get_indices());
+      vertex *vtx = (vertex *)vtx_lock.u8();
+      uint32_t *idx = idx_lock.u32();
+      thread_pool::get().parallel_for(num_bricks, [&](unsigned i) {
+        unsigned first = first_quad[i];
+        unsigned count = first_quad[i+1] - first;
+        if (!count) return;
+        memcpy(vtx + first * 4, bricks[i]->get_vertices(), sizeof(vertex) * count * 4);
+        uint32_t *dest = idx + first * 6;
+        for (unsigned q = first; q != first + count; ++q) {
+          uint32_t v = q * 4;
+          dest[0] = v + 0;
+          dest[3] = dest[1] = v + 1;
+          dest[5] = dest[2] = v + 3;
+          dest[4] = v + 2;
+          dest += 6;
+        }
+      });
       //dump(log("voxels\n"));
     }
 
+    // Add voxels to every brick in parallel. Bricks that stay empty are not kept.
     template <class set> void add_voxels(mat4t_in voxelToWorld, const set &set_in) {
-      int idx = 0;
+      unsigned num_bricks = size.x() * size.y() * size.z();
       vec3 offset = vec3(size) * (-0.5f * subcube_dim) + vec3(0.5f);
       vec3 scale = vec3(subcube_dim);
-      for (int z = 0; z != size.z(); ++z) {
-        for (int y = 0; y != size.y(); ++y) {
-          for (int x = 0; x != size.x(); ++x) {
-            mat4t localVoxelToWorld = voxelToWorld;
-            vec3 pos = vec3(x, y, z) * scale + offset;
-            localVoxelToWorld.translate(pos.x(), pos.y(), pos.z());
-            //localVoxelToWorld.w() += vec4(0.5f, 0.5f, 0.5f, 0.0f);
-            subcubes[idx++]->add_voxels(localVoxelToWorld, set_in);
+      auto brick_to_world = [&](unsigned i) {
+        ivec3 pos(i % size.x(), i / size.x() % size.y(), i / (size.x() * size.y()));
+        mat4t localVoxelToWorld = voxelToWorld;
+        vec3 local = vec3(pos) * scale + offset;
+        localVoxelToWorld.translate(local.x(), local.y(), local.z());
+        return localVoxelToWorld;
+      };
+
+      // find the bricks the set may reach so that the others are not created or visited.
+      dynarray<uint8_t> reached(num_bricks);
+      thread_pool::get().parallel_for(num_bricks, [&](unsigned i) {
+        reached[i] = (uint8_t)mesh_voxel_subcube::may_intersect(brick_to_world(i), set_in);
+      });
+
+      dynarray<unsigned> work;
+      dynarray<mesh_voxel_subcube*> bricks;
+      dynarray<uint8_t> old_states;
+      for (unsigned i = 0; i != num_bricks; ++i) {
+        if (!reached[i]) continue;
+        ivec3 pos(i % size.x(), i / size.x() % size.y(), i / (size.x() * size.y()));
+        mesh_voxel_subcube *p = get_subcube(pos);
+        if (p && p->get_state() == mesh_voxel_subcube::state_full) continue;
+        work.push_back(i);
+        bricks.push_back(p ? p : new mesh_voxel_subcube());
+        old_states.push_back((uint8_t)( p ? p->get_state() : mesh_voxel_subcube::state_empty ));
+      }
+
+      thread_pool::get().parallel_for(work.size(), [&](unsigned w) {
+        bricks[w]->add_voxels(brick_to_world(work[w]), set_in);
+      });
+
+      // keep new bricks and count changes of state in the regions.
+      for (unsigned w = 0; w != work.size(); ++w) {
+        unsigned i = work[w];
+        ivec3 pos(i % size.x(), i / size.x() % size.y(), i / (size.x() * size.y()));
+        mesh_voxel_subcube *p = bricks[w];
+        unsigned old_state = old_states[w];
+        unsigned new_state = p->get_state();
+        if (old_state == mesh_voxel_subcube::state_empty) {
+          if (new_state == mesh_voxel_subcube::state_empty) {
+            delete p;
+            continue;
+          }
+          subcubes[get_key(pos)] = p;
+          get_region(pos).num_bricks++;
+        }
+        if (old_state != mesh_voxel_subcube::state_full && new_state == mesh_voxel_subcube::state_full) {
+          get_region(pos).num_full++;
+        }
+      }
+    }
+
+    // step through the cells of size 1 << levels[0] between t0 and t1 in voxel space,
+    // going down to the next level in cells that have some voxels.
+    bool march(vec3_in origin, vec3_in dir, float t0, float t1, const int *levels, ivec3 &voxel, float &distance) const {
+      int level = levels[0];
+      float cell_size = (float)(1 << level);
+      ivec3 limit = ( size * subcube_dim + ((1 << level) - 1) ) >> level;
+      vec3 start = origin + dir * (t0 + 1e-4f);
+
+      int cell[3], step[3];
+      float t_max[3], t_delta[3];
+      for (int a = 0; a != 3; ++a) {
+        cell[a] = (int)floorf(start[a] / cell_size);
+        if (dir[a] > 0) {
+          step[a] = 1;
+          t_max[a] = ( (cell[a] + 1) * cell_size - origin[a] ) / dir[a];
+          t_delta[a] = cell_size / dir[a];
+        } else if (dir[a] < 0) {
+          step[a] = -1;
+          t_max[a] = ( cell[a] * cell_size - origin[a] ) / dir[a];
+          t_delta[a] = -cell_size / dir[a];
+        } else {
+          step[a] = 0;
+          t_max[a] = t_delta[a] = 1e37f;
+        }
+      }
+
+      float t = t0;
+      while (t <= t1) {
+        int axis = t_max[0] < t_max[1] ? ( t_max[0] < t_max[2] ? 0 : 2 ) : ( t_max[1] < t_max[2] ? 1 : 2 );
+        float t_next = t_max[axis];
+        ivec3 pos(cell[0], cell[1], cell[2]);
+        if (all(pos >= ivec3(0, 0, 0)) && all(pos < limit) && is_any(pos, level)) {
+          if (level == 0 || is_all(pos, level)) {
+            // the voxel in this cell where the ray enters.
+            vec3 hit = origin + dir * (t + 1e-4f);
+            int v[3];
+            for (int a = 0; a != 3; ++a) {
+              v[a] = max(cell[a] << level, min((cell[a] + 1 << level) - 1, (int)floorf(hit[a])));
+            }
+            voxel = ivec3(v[0], v[1], v[2]);
+            distance = t;
+            return true;
+          }
+          if (march(origin, dir, t, t_next < t1 ? t_next : t1, levels + 1, voxel, distance)) {
+            return true;
           }
         }
+        cell[axis] += step[axis];
+        t_max[axis] += t_delta[axis];
+        t = t_next;
       }
+      return false;
     }
 
     /*mesh_voxels &cylinder(vec3_in centre, vec3_in axis, float radius, float half_length) {
@@ -168,33 +340,21 @@ namespace octet { namespace scene {
       size = size_in;
       //set_aabb(aabb(vec3(0, 0, 0), size));
 
-      subcubes.resize(size.x() * size.y() * size.z());
       set_aabb(aabb(vec3(0, 0, 0), vec3(size)*(voxel_size*subcube_dim*0.5f)));
-      int idx = 0;
-      for (int z = 0; z != size.z(); ++z) {
-        for (int y = 0; y != size.y(); ++y) {
-          for (int x = 0; x != size.x(); ++x) {
-            ivec3 pos(x, y, z);
-            subcubes[idx++] = new mesh_voxel_subcube();
-          }
-        }
-      }
-
-      //box(aabb(vec3(8, 8, 8), vec3(8, 8, 8)));
-      update_lod();
+      // subcubes are made on demand by add_voxels.
     }
 
     /// Update only the LODs used for collision detection.
     void update_lod() {
-      for (unsigned i = 0; i != subcubes.size(); ++i) {
-        mesh_voxel_subcube *p = subcubes[i];
-        if (p) {
-          p->update_lod();
-        }
-      }
+      dynarray<mesh_voxel_subcube*> bricks;
+      get_bricks(bricks);
+      thread_pool::get().parallel_for(bricks.size(), [&](unsigned i) {
+        bricks[i]->update_lod();
+      });
     }
 
     /// Update both the mesh and the LODs.
+    /// Only subcubes whose voxels have changed, and their neighbours, are meshed again.
     void update() {
       update_lod();
       update_mesh();
@@ -211,31 +371,32 @@ namespace octet { namespace scene {
     }
 
     void dump(FILE *fp) {
-      int idx = 0;
-      for (int z = 0; z != size.z(); ++z) {
-        for (int y = 0; y != size.y(); ++y) {
-          for (int x = 0; x != size.x(); ++x, idx++) {
-            fprintf(fp, "\n%d %d %d\n", x, y, z);
-            if (subcubes[idx]) {
-              subcubes[idx]->dump(fp);
-            }
-          }
+      for (unsigned i = 0; i != subcubes.size(); ++i) {
+        uint64_t key = subcubes.get_key(i);
+        if (key) {
+          ivec3 pos = get_pos(key);
+          fprintf(fp, "\n%d %d %d\n", pos.x(), pos.y(), pos.z());
+          subcubes.get_value(i)->dump(fp);
         }
       }
       mesh::dump(fp);
     }
 
-    /// get a subcube of 32x32x32 voxels.
+    /// get a subcube of 32x32x32 voxels, NULL if it is empty or outside the world.
     mesh_voxel_subcube *get_subcube(ivec3_in pos) const {
-      assert(all(pos < size));
-      //assert(x < (unsigned)size.x() && y < (unsigned)size.y() && z < (unsigned)size.z());
-      return subcubes[pos.x()+ size.x() * (pos.y() + size.y()*pos.z())];
+      if (!all(pos >= ivec3(0, 0, 0)) || !all(pos < size)) return NULL;
+      uint64_t key = get_key(pos);
+      return subcubes.contains(key) ? (mesh_voxel_subcube*)subcubes[key] : NULL;
     }
 
-    /// Is any cube in this subcube collidable?
+    /// Is any cube in this cell of size 1 << level collidable?
+    /// Levels between a subcube and a region of subcubes give a conservative answer.
     unsigned is_any(ivec3_in pos, int level) const {
-      if (level > log_subcube_dim) {
+      if (level > region_level) {
         return 1;
+      } else if (level > log_subcube_dim) {
+        uint64_t key = get_key(pos >> (region_level - level));
+        return regions.contains(key) && regions[key].num_bricks != 0;
       } else {
         int cube_level = log_subcube_dim - level;
         ivec3 cube_addr = pos >> cube_level;
@@ -243,8 +404,64 @@ namespace octet { namespace scene {
         //char b[3][128];
         //log("%d %s->%s/%s\n", level, pos.toString(b[0], sizeof(b[0])), cube_addr.toString(b[1], sizeof(b[1])), vox_addr.toString(b[2], sizeof(b[2])));
         mesh_voxel_subcube *subcube = get_subcube(cube_addr);
-        return subcube->is_any(vox_addr, level);
+        return subcube ? subcube->is_any(vox_addr, level) : 0;
+      }
+    }
+
+    /// Are all the cubes in this cell of size 1 << level collidable?
+    /// Levels between a subcube and a region of subcubes give a conservative answer.
+    unsigned is_all(ivec3_in pos, int level) const {
+      if (level > region_level) {
+        return 0;
+      } else if (level > log_subcube_dim) {
+        if (level != region_level) return 0;
+        uint64_t key = get_key(pos);
+        return regions.contains(key) && regions[key].num_full == region_dim * region_dim * region_dim;
+      } else {
+        int cube_level = log_subcube_dim - level;
+        mesh_voxel_subcube *subcube = get_subcube(pos >> cube_level);
+        return subcube ? subcube->is_all(pos & ((1<<cube_level) - 1), level) : 0;
+      }
+    }
+
+    /// Find the first solid voxel along a ray in the mesh's space.
+    /// Steps through regions, subcubes and 4x4x4 blocks before single voxels, skipping empty space.
+    bool ray_cast(vec3_in origin, vec3_in direction, float max_distance, ivec3 &voxel, float &distance) const {
+      vec3 corner = vec3(size) * (-0.5f * subcube_dim * voxel_size);
+      vec3 org = (origin - corner) / voxel_size;
+      vec3 dir = normalize(direction);
+      vec3 extent = vec3(size * subcube_dim);
+
+      // clip the ray to the world box.
+      float t0 = 0, t1 = max_distance / voxel_size;
+      for (int a = 0; a != 3; ++a) {
+        if (dir[a] == 0) {
+          if (org[a] < 0 || org[a] >= extent[a]) return false;
+        } else {
+          float ta = (0 - org[a]) / dir[a];
+          float tb = (extent[a] - org[a]) / dir[a];
+          if (ta > tb) swap(ta, tb);
+          t0 = max(t0, ta);
+          t1 = min(t1, tb);
+        }
+      }
+      if (t0 > t1) return false;
+
+      static const int levels[] = { region_level, log_subcube_dim, 2, 0 };
+      if (march(org, dir, t0, t1, levels, voxel, distance)) {
+        distance *= voxel_size;
+        return true;
+      }
+      return false;
+    }
+
+    /// Bytes used by the subcubes, which goes with the surface area of the world.
+    unsigned get_memory_used() const {
+      unsigned bytes = 0;
+      for (unsigned i = 0; i != subcubes.size(); ++i) {
+        if (subcubes.get_key(i)) bytes += subcubes.get_value(i)->get_memory_used();
       }
+      return bytes;
     }
 
     /// Experimental: collide two orientated voxel meshes.
@@ -271,7 +488,7 @@ namespace octet { namespace scene {
         return false;
       }
 
-      while(!stack.is_empty()) {
+      while(!stack.empty()) {
         entry ta = stack.back().first;
         entry tb = stack.back().second;
         stack.pop_back();
@@ -353,6 +353,11 @@ namespace octet { namespace scene {
 
       //log("%s: %d=%d %04x %d\n", get_atom_name(), get_uniform(), texture_slot, sampler_->get_gl_target(), sampler_->get_gl_texture(image_));
     }
+
+    /// get the image to sample
+    image *get_image() const {
+      return image_;
+    }
   };
 
   /// General purpose operation "parameter"
@@ -24,6 +24,7 @@
 #include "../scene/light_instance.h"
 #include "../scene/mesh_instance.h"
 #include "../scene/animation_instance.h"
+#include "../scene/soft_renderer.h"
 #include "../scene/visual_scene.h"
 #include "../scene/displacement_map.h"
 #include "../scene/indexer.h"
@@ -37,6 +38,7 @@
   #include "../scene/mesh_voxels.h"
 #endif
 #include "../scene/mesh_points.h"
+#include "../scene/signed_distance_field.h"
 #include "../scene/wireframe.h"
 
 namespace octet {
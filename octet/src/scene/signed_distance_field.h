@@ -0,0 +1,585 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Narrow band signed distance field
+//
+
+namespace octet { namespace scene {
+  /// Signed distance to the surface of a solid on a regular grid, negative inside.
+  ///
+  /// The field is baked from a closed triangle mesh or from any set with an intersects(vec3) test
+  /// (eg. a sphere, an aabb or a CSG class). Distances are only stored within a band of the surface,
+  /// in bricks of 8x8x8 cells. Bricks further away keep only their sign, so memory goes with
+  /// the surface area of the solid.
+  ///
+  /// Lookups are trilinear and O(1): the brick table gives the brick of a cell and the eight
+  /// corners of the cell are in that brick. get_distances and collide work on batches of points
+  /// so that the interpolation runs on several points at once.
+  ///
+  /// Example
+  ///
+  ///     ref<signed_distance_field> sdf = new signed_distance_field();
+  ///     sdf->bake(aabb(vec3(0.5f), vec3(0.5f)), 1.0f/64, deathstar());
+  ///     sdf->collide(x, v, vh, n, 0.01f, 0.75f, false);
+  class signed_distance_field : public resource {
+    enum {
+      log_brick_dim = 3,
+      brick_dim = 1 << log_brick_dim,
+      brick_nodes = brick_dim + 1,
+      brick_size = brick_nodes * brick_nodes * brick_nodes,
+      // points looked up at once by get_distances and collide.
+      batch_size = 64,
+    };
+
+    // brick table entries for bricks without a surface.
+    enum {
+      brick_outside = -1,
+      brick_inside = -2,
+    };
+
+    vec3 origin;
+    float cell_size;
+    float inv_cell_size;
+    float band;
+    ivec3 num_cells;
+    ivec3 num_bricks;
+
+    // index of the distances of each brick or brick_outside/brick_inside
+    dynarray<int> brick_table;
+
+    // brick_size distances for each brick near the surface, x fastest
+    dynarray<float> brick_values;
+
+    // eight corners of a cell, at the strides of a brick, for bricks without a surface.
+    float far_values[2][brick_size];
+
+    // surface samples used while baking: triangles (three points) and single points.
+    dynarray<vec3> triangles;
+    dynarray<vec3> points;
+
+    unsigned node_index(int x, int y, int z) const {
+      return ( z * ( num_cells.y() + 1 ) + y ) * ( num_cells.x() + 1 ) + x;
+    }
+
+    vec3 node_pos(int x, int y, int z) const {
+      return origin + vec3((float)x, (float)y, (float)z) * cell_size;
+    }
+
+    // size the grid to cover bounds and the band around them.
+    void init_grid(const aabb &bounds, float new_cell_size, float new_band) {
+      cell_size = new_cell_size;
+      inv_cell_size = 1.0f / cell_size;
+      band = new_band > 0 ? new_band : cell_size * 4;
+
+      vec3 pad(band + cell_size);
+      vec3 lo = bounds.get_min() - pad;
+      vec3 hi = bounds.get_max() + pad;
+      ivec3 cells;
+      for (int a = 0; a != 3; ++a) {
+        cells[a] = (int)ceilf(( hi[a] - lo[a] ) * inv_cell_size);
+      }
+      num_bricks = ( cells + ivec3(brick_dim - 1) ) >> log_brick_dim;
+      num_cells = num_bricks << log_brick_dim;
+      origin = lo;
+
+      brick_table.resize(num_bricks.x() * num_bricks.y() * num_bricks.z());
+      brick_values.resize(0);
+      for (unsigned i = 0; i != brick_size; ++i) {
+        far_values[0][i] = band;
+        far_values[1][i] = -band;
+      }
+    }
+
+    // closest point to p on the triangle abc (Ericson, Real-Time Collision Detection 5.1.5)
+    static vec3 closest_on_triangle(vec3_in p, vec3_in a, vec3_in b, vec3_in c) {
+      vec3 ab = b - a, ac = c - a, ap = p - a;
+      float d1 = dot(ab, ap), d2 = dot(ac, ap);
+      if (d1 <= 0 && d2 <= 0) return a;
+
+      vec3 bp = p - b;
+      float d3 = dot(ab, bp), d4 = dot(ac, bp);
+      if (d3 >= 0 && d4 <= d3) return b;
+
+      float vc = d1 * d4 - d3 * d2;
+      if (vc <= 0 && d1 >= 0 && d3 <= 0) return a + ab * ( d1 / ( d1 - d3 ) );
+
+      vec3 cp = p - c;
+      float d5 = dot(ab, cp), d6 = dot(ac, cp);
+      if (d6 >= 0 && d5 <= d6) return c;
+
+      float vb = d5 * d2 - d1 * d6;
+      if (vb <= 0 && d2 >= 0 && d6 <= 0) return a + ac * ( d2 / ( d2 - d6 ) );
+
+      float va = d3 * d6 - d5 * d4;
+      if (va <= 0 && ( d4 - d3 ) >= 0 && ( d5 - d6 ) >= 0) return b + ( c - b ) * ( ( d4 - d3 ) / ( ( d4 - d3 ) + ( d5 - d6 ) ) );
+
+      float denom = 1.0f / ( va + vb + vc );
+      if (!( denom == denom ) || denom > 1e30f || denom < -1e30f) {
+        // degenerate triangle: use the nearest vertex.
+        float da = squared(p - a), db = squared(p - b), dc = squared(p - c);
+        return da <= db && da <= dc ? a : db <= dc ? b : c;
+      }
+      return a + ab * ( vb * denom ) + ac * ( vc * denom );
+    }
+
+    // find the distances of the nodes of the bricks near the surface samples.
+    // inside has one byte for every node of the grid.
+    void build_bricks(const dynarray<uint8_t> &inside) {
+      unsigned num_tris = triangles.size() / 3;
+      unsigned num_prims = num_tris + points.size();
+      unsigned total_bricks = brick_table.size();
+
+      // bin each sample into the bricks whose nodes may be within the band.
+      dynarray<unsigned> counts(total_bricks + 1);
+      memset(counts.data(), 0, counts.size() * sizeof(unsigned));
+      dynarray<unsigned> pair_brick;
+      dynarray<unsigned> pair_prim;
+      float reach = band * inv_cell_size;
+      for (unsigned p = 0; p != num_prims; ++p) {
+        vec3 lo, hi;
+        if (p < num_tris) {
+          lo = min(min(triangles[p*3+0], triangles[p*3+1]), triangles[p*3+2]);
+          hi = max(max(triangles[p*3+0], triangles[p*3+1]), triangles[p*3+2]);
+        } else {
+          lo = hi = points[p - num_tris];
+        }
+        vec3 glo = ( lo - origin ) * inv_cell_size - vec3(reach);
+        vec3 ghi = ( hi - origin ) * inv_cell_size + vec3(reach);
+        int b0[3], b1[3];
+        bool empty = false;
+        for (int a = 0; a != 3; ++a) {
+          // the nodes of a brick go from its first cell to the first cell of the next one.
+          b0[a] = (int)floorf(( glo[a] - 1 ) / brick_dim);
+          b1[a] = (int)floorf(ghi[a] / brick_dim);
+          b0[a] = b0[a] < 0 ? 0 : b0[a];
+          b1[a] = b1[a] >= num_bricks[a] ? num_bricks[a] - 1 : b1[a];
+          empty |= b0[a] > b1[a];
+        }
+        if (empty) continue;
+        for (int z = b0[2]; z <= b1[2]; ++z) {
+          for (int y = b0[1]; y <= b1[1]; ++y) {
+            for (int x = b0[0]; x <= b1[0]; ++x) {
+              unsigned b = ( z * num_bricks.y() + y ) * num_bricks.x() + x;
+              pair_brick.push_back(b);
+              pair_prim.push_back(p);
+              counts[b+1]++;
+            }
+          }
+        }
+      }
+
+      // counting sort of the samples by brick.
+      for (unsigned b = 0; b != total_bricks; ++b) {
+        counts[b+1] += counts[b];
+      }
+      dynarray<unsigned> brick_prims(pair_prim.size());
+      {
+        dynarray<unsigned> next(total_bricks);
+        memcpy(next.data(), counts.data(), total_bricks * sizeof(unsigned));
+        for (unsigned i = 0; i != pair_prim.size(); ++i) {
+          brick_prims[next[pair_brick[i]]++] = pair_prim[i];
+        }
+      }
+
+      // bricks with samples get distances, the others keep the sign of their first node.
+      unsigned num_active = 0;
+      for (unsigned b = 0; b != total_bricks; ++b) {
+        int bx = b % num_bricks.x(), by = b / num_bricks.x() % num_bricks.y(), bz = b / ( num_bricks.x() * num_bricks.y() );
+        if (counts[b+1] != counts[b]) {
+          brick_table[b] = num_active++;
+        } else {
+          brick_table[b] = inside[node_index(bx * brick_dim, by * brick_dim, bz * brick_dim)] ? brick_inside : brick_outside;
+        }
+      }
+      brick_values.resize(num_active * brick_size);
+
+      // surface points only sample the surface at edge crossings, so a second pass measures
+      // the distance to the tangent plane at the nearest point, using the normals of the first pass.
+      dynarray<vec3> normals;
+      for (int pass = 0; pass != ( points.size() ? 2 : 1 ); ++pass) {
+        if (pass == 1) {
+          normals.resize(points.size());
+          thread_pool::get().parallel_for(points.size(), [&](unsigned i) {
+            vec3 g;
+            get_distance(points[i], g);
+            float len2 = squared(g);
+            normals[i] = len2 > 0 ? g * ( 1.0f / sqrtf(len2) ) : vec3(0, 0, 0);
+          });
+        }
+
+        thread_pool::get().parallel_for(total_bricks, [&](unsigned b) {
+          if (brick_table[b] < 0) return;
+          int bx = b % num_bricks.x(), by = b / num_bricks.x() % num_bricks.y(), bz = b / ( num_bricks.x() * num_bricks.y() );
+          float *dest = brick_values.data() + brick_table[b] * brick_size;
+          const unsigned *prims = brick_prims.data() + counts[b];
+          unsigned num = counts[b+1] - counts[b];
+          float band2 = band * band;
+          for (int z = 0; z != brick_nodes; ++z) {
+            for (int y = 0; y != brick_nodes; ++y) {
+              for (int x = 0; x != brick_nodes; ++x) {
+                int nx = bx * brick_dim + x, ny = by * brick_dim + y, nz = bz * brick_dim + z;
+                vec3 pos = node_pos(nx, ny, nz);
+                float best = band2;
+                unsigned nearest = ~0u;
+                for (unsigned i = 0; i != num; ++i) {
+                  unsigned p = prims[i];
+                  vec3 q = p < num_tris ? closest_on_triangle(pos, triangles[p*3+0], triangles[p*3+1], triangles[p*3+2]) : points[p - num_tris];
+                  float d2 = squared(pos - q);
+                  if (d2 < best) {
+                    best = d2;
+                    nearest = p;
+                  }
+                }
+                float d = sqrtf(best);
+                if (pass == 1 && nearest != ~0u && nearest >= num_tris) {
+                  // the plane is never further than the point, nor much nearer.
+                  float plane = fabsf(dot(pos - points[nearest - num_tris], normals[nearest - num_tris]));
+                  float lower = d - cell_size * 0.25f;
+                  d = plane > d ? d : plane < lower ? lower : plane;
+                }
+                *dest++ = inside[node_index(nx, ny, nz)] ? -d : d;
+              }
+            }
+          }
+        });
+      }
+
+      triangles.reset();
+      points.reset();
+    }
+
+    // gather the eight cell corners of each point and interpolate.
+    void lookup_batch(const float *pos, unsigned stride, unsigned count, float *distance, float *gradient, unsigned gradient_stride) const {
+      float fx[batch_size], fy[batch_size], fz[batch_size];
+      float c[8][batch_size];
+      static const unsigned corner_offsets[8] = {
+        0, 1, brick_nodes, brick_nodes + 1,
+        brick_nodes * brick_nodes, brick_nodes * brick_nodes + 1, brick_nodes * brick_nodes + brick_nodes, brick_nodes * brick_nodes + brick_nodes + 1,
+      };
+
+      // grid coordinates, clamped to the grid, and the corner values.
+      float limit[3] = { num_cells.x() * 0.99999f, num_cells.y() * 0.99999f, num_cells.z() * 0.99999f };
+      for (unsigned i = 0; i != count; ++i) {
+        const float *p = pos + i * stride;
+        float g[3];
+        int cell[3];
+        for (int a = 0; a != 3; ++a) {
+          g[a] = ( p[a] - origin[a] ) * inv_cell_size;
+          g[a] = g[a] < 0 ? 0 : g[a] > limit[a] ? limit[a] : g[a];
+          cell[a] = (int)g[a];
+        }
+        fx[i] = g[0] - cell[0];
+        fy[i] = g[1] - cell[1];
+        fz[i] = g[2] - cell[2];
+        int b = ( ( cell[2] >> log_brick_dim ) * num_bricks.y() + ( cell[1] >> log_brick_dim ) ) * num_bricks.x() + ( cell[0] >> log_brick_dim );
+        int entry = brick_table[b];
+        const float *src = entry >= 0 ? brick_values.data() + entry * brick_size : far_values[entry == brick_inside];
+        if (entry >= 0) {
+          int lx = cell[0] & ( brick_dim - 1 ), ly = cell[1] & ( brick_dim - 1 ), lz = cell[2] & ( brick_dim - 1 );
+          src += ( lz * brick_nodes + ly ) * brick_nodes + lx;
+        }
+        for (unsigned k = 0; k != 8; ++k) {
+          c[k][i] = src[corner_offsets[k]];
+        }
+      }
+
+      // trilinear interpolation and its derivative, simple enough for the compiler to vectorise.
+      float scale = inv_cell_size;
+      for (unsigned i = 0; i != count; ++i) {
+        float x1 = fx[i], y1 = fy[i], z1 = fz[i];
+        float x0 = 1 - x1, y0 = 1 - y1, z0 = 1 - z1;
+        // interpolate in x along the four edges, then in y, then in z.
+        float e00 = c[0][i] * x0 + c[1][i] * x1;
+        float e10 = c[2][i] * x0 + c[3][i] * x1;
+        float e01 = c[4][i] * x0 + c[5][i] * x1;
+        float e11 = c[6][i] * x0 + c[7][i] * x1;
+        float f0 = e00 * y0 + e10 * y1;
+        float f1 = e01 * y0 + e11 * y1;
+        distance[i] = f0 * z0 + f1 * z1;
+        if (gradient) {
+          float d00 = c[1][i] - c[0][i], d10 = c[3][i] - c[2][i], d01 = c[5][i] - c[4][i], d11 = c[7][i] - c[6][i];
+          float *gr = gradient + i * gradient_stride;
+          gr[0] = ( ( d00 * y0 + d10 * y1 ) * z0 + ( d01 * y0 + d11 * y1 ) * z1 ) * scale;
+          gr[1] = ( ( e10 - e00 ) * z0 + ( e11 - e01 ) * z1 ) * scale;
+          gr[2] = ( f1 - f0 ) * scale;
+        }
+      }
+    }
+
+  public:
+    RESOURCE_META(signed_distance_field)
+
+    /// Make an empty field; everywhere is outside.
+    signed_distance_field() {
+      origin = vec3(0, 0, 0);
+      cell_size = inv_cell_size = 1;
+      band = 1;
+      num_cells = ivec3(brick_dim, brick_dim, brick_dim);
+      num_bricks = ivec3(1, 1, 1);
+      brick_table.resize(1);
+      brick_table[0] = brick_outside;
+      for (unsigned i = 0; i != brick_size; ++i) {
+        far_values[0][i] = band;
+        far_values[1][i] = -band;
+      }
+    }
+
+    /// Bake the field of a set with an intersects(vec3) test inside bounds.
+    /// The surface is found between grid nodes that are in and out of the set, refined by bisection.
+    /// band is the distance from the surface that is stored, four cells by default.
+    template <class set> void bake(const aabb &bounds, float new_cell_size, const set &set_in, float new_band = 0) {
+      init_grid(bounds, new_cell_size, new_band);
+
+      int sx = num_cells.x() + 1, sy = num_cells.y() + 1, sz = num_cells.z() + 1;
+      dynarray<uint8_t> inside(sx * sy * sz);
+      thread_pool::get().parallel_for(sz, [&](unsigned z) {
+        for (int y = 0; y != sy; ++y) {
+          for (int x = 0; x != sx; ++x) {
+            inside[node_index(x, y, z)] = set_in.intersects(node_pos(x, y, z)) ? 1 : 0;
+          }
+        }
+      });
+
+      // points on the surface between neighbouring nodes, by z slice so that the order is fixed.
+      dynarray<dynarray<vec3>*> slice_points(sz);
+      thread_pool::get().parallel_for(sz, [&](unsigned z) {
+        dynarray<vec3> *result = new dynarray<vec3>();
+        for (int y = 0; y != sy; ++y) {
+          for (int x = 0; x != sx; ++x) {
+            uint8_t here = inside[node_index(x, y, z)];
+            for (int a = 0; a != 3; ++a) {
+              int x1 = x + ( a == 0 ), y1 = y + ( a == 1 ), z1 = (int)z + ( a == 2 );
+              if (x1 == sx || y1 == sy || z1 == sz || inside[node_index(x1, y1, z1)] == here) continue;
+              vec3 in = node_pos(x, y, z), out = node_pos(x1, y1, z1);
+              if (!here) {
+                vec3 tmp = in; in = out; out = tmp;
+              }
+              for (int i = 0; i != 6; ++i) {
+                vec3 mid = ( in + out ) * 0.5f;
+                if (set_in.intersects(mid)) in = mid; else out = mid;
+              }
+              result->push_back(( in + out ) * 0.5f);
+            }
+          }
+        }
+        slice_points[z] = result;
+      });
+      points.resize(0);
+      for (int z = 0; z != sz; ++z) {
+        for (unsigned i = 0; i != slice_points[z]->size(); ++i) {
+          points.push_back((*slice_points[z])[i]);
+        }
+        delete slice_points[z];
+      }
+
+      build_bricks(inside);
+    }
+
+    /// Bake the field of a closed triangle mesh in model space.
+    /// Inside and outside are found by counting crossings of rays along z.
+    /// band is the distance from the surface that is stored, four cells by default.
+    bool bake(mesh *source, float new_cell_size, float new_band = 0) {
+      unsigned pos_slot = source->get_slot(attribute_pos);
+      if (pos_slot == ~0u || source->get_kind(pos_slot) != GL_FLOAT || source->get_size(pos_slot) < 3) return false;
+      if (source->get_mode() != GL_TRIANGLES) return false;
+      unsigned index_type = source->get_index_type();
+      if (index_type != GL_UNSIGNED_INT && index_type != GL_UNSIGNED_SHORT) return false;
+
+      unsigned num_indices = source->get_num_indices();
+      unsigned stride = source->get_stride();
+      unsigned pos_offset = source->get_offset(pos_slot);
+      {
+        gl_resource::rolock vl(source->get_vertices());
+        gl_resource::rolock il(source->get_indices());
+        triangles.resize(num_indices / 3 * 3);
+        for (unsigned i = 0; i != triangles.size(); ++i) {
+          unsigned idx = index_type == GL_UNSIGNED_INT ? il.u32()[i] : il.u16()[i];
+          triangles[i] = (vec3)*(const vec3p*)(vl.u8() + stride * idx + pos_offset);
+        }
+      }
+      if (triangles.size() == 0) return false;
+
+      vec3 lo = triangles[0], hi = lo;
+      for (unsigned i = 1; i != triangles.size(); ++i) {
+        lo = min(lo, triangles[i]);
+        hi = max(hi, triangles[i]);
+      }
+      init_grid(aabb(( lo + hi ) * 0.5f, ( hi - lo ) * 0.5f), new_cell_size, new_band);
+
+      // bin the triangles by node column in x and y.
+      int sx = num_cells.x() + 1, sy = num_cells.y() + 1, sz = num_cells.z() + 1;
+      unsigned num_tris = triangles.size() / 3;
+      dynarray<unsigned> counts(sx * sy + 1);
+      memset(counts.data(), 0, counts.size() * sizeof(unsigned));
+      dynarray<unsigned> pair_column;
+      dynarray<unsigned> pair_tri;
+      for (unsigned t = 0; t != num_tris; ++t) {
+        vec3 tlo = ( min(min(triangles[t*3+0], triangles[t*3+1]), triangles[t*3+2]) - origin ) * inv_cell_size;
+        vec3 thi = ( max(max(triangles[t*3+0], triangles[t*3+1]), triangles[t*3+2]) - origin ) * inv_cell_size;
+        int x0 = (int)ceilf(tlo.x()), x1 = (int)floorf(thi.x()) + 1;
+        int y0 = (int)ceilf(tlo.y()), y1 = (int)floorf(thi.y()) + 1;
+        x0 = x0 < 0 ? 0 : x0; y0 = y0 < 0 ? 0 : y0;
+        x1 = x1 > sx ? sx : x1; y1 = y1 > sy ? sy : y1;
+        for (int y = y0 - 1 < 0 ? 0 : y0 - 1; y < y1; ++y) {
+          for (int x = x0 - 1 < 0 ? 0 : x0 - 1; x < x1; ++x) {
+            pair_column.push_back(y * sx + x);
+            pair_tri.push_back(t);
+            counts[y * sx + x + 1]++;
+          }
+        }
+      }
+      for (int c = 0; c != sx * sy; ++c) {
+        counts[c+1] += counts[c];
+      }
+      dynarray<unsigned> column_tris(pair_tri.size());
+      {
+        dynarray<unsigned> next(sx * sy);
+        memcpy(next.data(), counts.data(), sx * sy * sizeof(unsigned));
+        for (unsigned i = 0; i != pair_tri.size(); ++i) {
+          column_tris[next[pair_column[i]]++] = pair_tri[i];
+        }
+      }
+
+      // count the crossings of a ray along z below each node of a column.
+      // the ray is moved off the node a little so that it does not hit edges of the mesh exactly.
+      dynarray<uint8_t> inside(sx * sy * sz);
+      thread_pool::get().parallel_for(sx * sy, [&](unsigned column) {
+        int x = column % sx, y = column / sx;
+        float px = origin.x() + ( x + 0.000123f ) * cell_size;
+        float py = origin.y() + ( y + 0.000371f ) * cell_size;
+        dynarray<float> crossings;
+        for (unsigned i = counts[column]; i != counts[column+1]; ++i) {
+          const vec3 *tri = triangles.data() + column_tris[i] * 3;
+          float ax = tri[0].x() - px, ay = tri[0].y() - py;
+          float bx = tri[1].x() - px, by = tri[1].y() - py;
+          float cx = tri[2].x() - px, cy = tri[2].y() - py;
+          float u = bx * cy - by * cx, v = cx * ay - cy * ax, w = ax * by - ay * bx;
+          if (( u < 0 || v < 0 || w < 0 ) && ( u > 0 || v > 0 || w > 0 )) continue;
+          float sum = u + v + w;
+          if (sum == 0) continue;
+          crossings.push_back(( tri[0].z() * u + tri[1].z() * v + tri[2].z() * w ) / sum);
+        }
+        for (unsigned i = 1; i < crossings.size(); ++i) {
+          float value = crossings[i];
+          unsigned j = i;
+          for (; j > 0 && crossings[j-1] > value; --j) crossings[j] = crossings[j-1];
+          crossings[j] = value;
+        }
+        unsigned below = 0;
+        for (int z = 0; z != sz; ++z) {
+          float pz = origin.z() + z * cell_size;
+          while (below != crossings.size() && crossings[below] < pz) ++below;
+          inside[node_index(x, y, z)] = below & 1;
+        }
+      });
+
+      build_bricks(inside);
+      return true;
+    }
+
+    /// Signed distance at a point, clamped to the band.
+    float get_distance(vec3_in pos) const {
+      float result;
+      lookup_batch(pos.get(), 3, 1, &result, 0, 0);
+      return result;
+    }
+
+    /// Signed distance and its gradient at a point.
+    /// The gradient is zero further than the band from the surface.
+    float get_distance(vec3_in pos, vec3 &gradient) const {
+      float result, g[3];
+      lookup_batch(pos.get(), 3, 1, &result, g, 3);
+      gradient = vec3(g[0], g[1], g[2]);
+      return result;
+    }
+
+    /// Signed distances of count points stride floats apart.
+    /// If gradient is not null, write three floats for each point to it.
+    void get_distances(const float *pos, unsigned stride, unsigned count, float *distance, float *gradient = 0) const {
+      for (unsigned i = 0; i < count; i += batch_size) {
+        unsigned num = count - i < batch_size ? count - i : batch_size;
+        lookup_batch(pos + i * stride, stride, num, distance + i, gradient ? gradient + i * 3 : 0, 3);
+      }
+    }
+
+    /// Push points closer than radius to the surface back along the gradient and reflect the normal
+    /// part of their velocities, damping them like damp_reflect. Positions and velocities have
+    /// x, y, z for each point; vh (eg. half step velocities) may be null.
+    /// With keep_inside, points are kept inside the solid instead of outside.
+    /// Returns the number of points that collided.
+    unsigned collide(float *x, float *v, float *vh, unsigned count, float radius, float damping, bool keep_inside) const {
+      float side = keep_inside ? -1.0f : 1.0f;
+      dynarray<unsigned> collided(( count + batch_size - 1 ) / batch_size);
+      thread_pool::get().parallel_ranges(count, batch_size, [&](unsigned begin, unsigned end) {
+        float distance[batch_size], gradient[batch_size * 3];
+        lookup_batch(x + begin * 3, 3, end - begin, distance, gradient, 3);
+        unsigned hits = 0;
+        for (unsigned i = begin; i != end; ++i) {
+          float d = distance[i - begin] * side;
+          if (d >= radius) continue;
+          const float *g = gradient + ( i - begin ) * 3;
+          float len2 = g[0] * g[0] + g[1] * g[1] + g[2] * g[2];
+          if (len2 == 0) continue;
+          float scale = side / sqrtf(len2);
+          float n[3] = { g[0] * scale, g[1] * scale, g[2] * scale };
+          float push = radius - d;
+          float *xi = x + i * 3;
+          xi[0] += n[0] * push; xi[1] += n[1] * push; xi[2] += n[2] * push;
+          for (int k = 0; k != 2; ++k) {
+            float *vel = k == 0 ? v + i * 3 : vh ? vh + i * 3 : 0;
+            if (!vel) continue;
+            float vn = vel[0] * n[0] + vel[1] * n[1] + vel[2] * n[2];
+            if (vn < 0) {
+              vel[0] -= 2 * vn * n[0]; vel[1] -= 2 * vn * n[1]; vel[2] -= 2 * vn * n[2];
+              vel[0] *= damping; vel[1] *= damping; vel[2] *= damping;
+            }
+          }
+          hits++;
+        }
+        collided[begin / batch_size] = hits;
+      });
+      unsigned result = 0;
+      for (unsigned i = 0; i != collided.size(); ++i) {
+        result += collided[i];
+      }
+      return result;
+    }
+
+    /// True if pos is inside the solid. This lets a field be used as a set, eg. for mesh_voxels.
+    bool intersects(vec3_in pos) const {
+      return get_distance(pos) <= 0;
+    }
+
+    /// Bounds of the grid.
+    aabb get_aabb() const {
+      vec3 half = vec3(num_cells) * ( cell_size * 0.5f );
+      return aabb(origin + half, half);
+    }
+
+    float get_cell_size() const {
+      return cell_size;
+    }
+
+    float get_band() const {
+      return band;
+    }
+
+    /// Number of bricks that store distances.
+    unsigned get_num_surface_bricks() const {
+      return brick_values.size() / brick_size;
+    }
+
+    /// Number of bricks in the grid.
+    unsigned get_num_bricks() const {
+      return brick_table.size();
+    }
+
+    /// Bytes used by the brick table and distances.
+    unsigned get_memory_used() const {
+      return brick_table.size() * sizeof(int) + brick_values.size() * sizeof(float);
+    }
+  };
+}}
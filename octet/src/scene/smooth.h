@@ -8,6 +8,22 @@
 //
 
 namespace octet { namespace scene {
+  /// View dependent subdivision of a triangle mesh.
+  ///
+  /// Triangles that look bigger than max_edge_pixels from the viewpoint are split
+  /// in four, with new vertices on a curve through the edge's end points and normals.
+  /// Their neighbours are split in two or three to avoid cracks.
+  ///
+  /// The edges of the source mesh are found once. Each level is a set of parallel passes
+  /// over the triangles and edges, which keep the edge list up to date as they go,
+  /// so no level needs to search for its edges.
+  ///
+  ///     smooth *sm = new smooth(src_mesh);
+  ///     sm->set_view(camera_pos, camera_dir, screen_height / (2 * tan(fov/2)));
+  ///     sm->update();
+  ///
+  /// update() only subdivides again when the view has moved or turned by more than
+  /// set_view_tolerance() allows, so small camera jitter does not rebuild the mesh.
   class smooth : public mesh {
     // source mesh. Provides underlying geometry.
     ref<mesh> src;
@@ -15,29 +31,65 @@ namespace octet { namespace scene {
     // view dependent parameters
     vec3 view_pos;
     vec3 view_dir;
+    float pixels_per_radian;
+    float max_edge_pixels;
+    int max_depth;
+
+    // the view of the last update. We only subdivide again if this changes by more than the tolerance.
+    vec3 built_pos;
+    vec3 built_dir;
+    bool built;
+
+    // how far the view may move, as a fraction of the size of the source mesh,
+    // and the cosine of how far it may turn, before we subdivide again.
+    float move_tolerance;
+    float turn_tolerance;
+    float src_size;
+
+    // edges with normals closer than this (the cosine of the angle between them) are not split.
+    float smooth_cos;
+
+    // source mesh, found once by prepare()
+    bool prepared;
+    unsigned num_src_vertices;
+    dynarray<uint8_t> src_vertices;
+    dynarray<uint32_t> src_tri_verts;  // three vertices per triangle
+    dynarray<uint32_t> src_tri_edges;  // edge k of a triangle joins vertex k and k+1
+    dynarray<uint32_t> src_edge_verts; // two vertices per edge
+    hash_map<uint64_t, unsigned> edges;
 
     // working params
     unsigned num_dest_vertices;
-
-    dynarray<uint32_t> dest_indices;
-    hash_map<uint64_t, unsigned> edges;
     dynarray<uint8_t> dest_vertices;
+    dynarray<uint32_t> tri_verts;
+    dynarray<uint32_t> tri_edges;
+    dynarray<uint32_t> edge_verts;
+
+    // next level, copied over the above after each pass
+    dynarray<uint32_t> next_tri_verts;
+    dynarray<uint32_t> next_tri_edges;
+    dynarray<uint32_t> next_edge_verts;
+
+    // non zero if an edge is to be split. Set by many threads at once.
+    std::atomic<uint32_t> *edge_marks;
+    unsigned edge_marks_capacity;
+
+    // edge-vertex table: non zero if an edge is to be split, then the new vertex numbers.
+    dynarray<uint32_t> edge_split;
+    // the first new edge made from an edge or triangle
+    dynarray<uint32_t> edge_first;
+    dynarray<uint32_t> tri_first;
+
     unsigned pos_offset;
     unsigned normal_offset;
     unsigned uv_offset;
-    int depth;
 
-    bool split_edge(uint8_t *dest, const uint8_t *src0, const uint8_t *src1, unsigned stride) {
+    // new vertex for the middle of an edge
+    void split_edge(uint8_t *dest, const uint8_t *src0, const uint8_t *src1, unsigned stride) {
       const vec3p &pos0 = (const vec3p&)src0[pos_offset];
       const vec3p &pos1 = (const vec3p&)src1[pos_offset];
       const vec3p &n0 = (const vec3p&)src0[normal_offset];
       const vec3p &n1 = (const vec3p&)src1[normal_offset];
-      //const vec3 &uv0 = (const vec3&)src0[uv_offset];
-      //const vec3 &uv1 = (const vec3&)src1[uv_offset];
-
-      if (is_smooth(n0, n1, depth)) {
-        return false;
-      }
 
       // Catmul-Rom spline
       vec3 diff = (vec3)pos1 - (vec3)pos0;
@@ -53,129 +105,59 @@ namespace octet { namespace scene {
 
       pos = ((vec3)pos0 + (vec3)pos1) * 0.5f + (t0 - t1) * 0.125; // (3/8)/3 = 1/8
       normal = normalize(normal);
-
-      return true;
     }
 
-    unsigned add_edge(int i0, int i1) {
-      if (i0 > i1) { swap(i0, i1); }
-
-      unsigned &e = edges[((uint64_t)i1 << 32) | i0];
-
-      if (e == ~0) return 0;
-
-      if (e != 0) return e;
-
-      unsigned stride = get_stride();
-
-      dest_vertices.resize((num_dest_vertices + 1) * stride);
-
-      log("%*se%d %d %d\n", depth*2, "", num_dest_vertices, i0, i1);
-      bool split = split_edge(
-        &dest_vertices[num_dest_vertices * stride],
-        &dest_vertices[i0 * stride],
-        &dest_vertices[i1 * stride],
-        stride
-      );
-
-      if (split) {
-        e = num_dest_vertices++;
-        return e;
-      } else {
-        // unable to split. Don't test again.
-        e = ~0;
-        return 0;
+    // replace values with the sum of the values before them and return the total.
+    static unsigned exclusive_scan(dynarray<uint32_t> &values) {
+      enum { grain = 4096 };
+      unsigned count = values.size();
+      unsigned num_ranges = ( count + grain - 1 ) / grain;
+      dynarray<uint32_t> totals(num_ranges + 1);
+      thread_pool::get().parallel_for(num_ranges, [&](unsigned r) {
+        unsigned end = min(r * grain + grain, count), sum = 0;
+        for (unsigned i = r * grain; i != end; ++i) sum += values[i];
+        totals[r] = sum;
+      });
+      unsigned total = 0;
+      for (unsigned r = 0; r != num_ranges; ++r) {
+        unsigned t = totals[r];
+        totals[r] = total;
+        total += t;
       }
+      thread_pool::get().parallel_for(num_ranges, [&](unsigned r) {
+        unsigned end = min(r * grain + grain, count), sum = totals[r];
+        for (unsigned i = r * grain; i != end; ++i) {
+          unsigned v = values[i];
+          values[i] = sum;
+          sum += v;
+        }
+      });
+      return total;
     }
 
-    void add_triangle(unsigned i0, unsigned i1, unsigned i2) {
-      unsigned i3 = add_edge(i0, i1);
-      unsigned i4 = add_edge(i1, i2);
-      unsigned i5 = add_edge(i2, i0);
-
-      depth++;
-
-      log("%*sat: %d %d %d %d %d %d\n", depth*2, "", i0, i1, i2, i3, i4, i5);
-
-      switch( (i3 != 0) + (i4 != 0)*2 + (i5 != 0)*4 ) {
-        case 0: {
-          unsigned disize = dest_indices.size();
-          dest_indices.resize(disize+3);
-          dest_indices[disize+0] = i0;
-          dest_indices[disize+1] = i1;
-          dest_indices[disize+2] = i2;
-        } break;
-        case 1: {
-          //    1
-          //   3 
-          //  0   2
-          add_triangle(i3, i1, i2);
-          add_triangle(i3, i2, i0);
-        } break;
-        case 2: {
-          //    1
-          //     4 
-          //  0   2
-          add_triangle(i4, i0, i1);
-          add_triangle(i4, i2, i0);
-        } break;
-        case 3: {
-          //    1
-          //   3 4
-          //  0   2
-          add_triangle(i3, i1, i4);
-          add_triangle(i3, i4, i0);
-          add_triangle(i4, i2, i0);
-        } break;
-        case 4: {
-          //    1
-          //      
-          //  0 5 2
-          add_triangle(i5, i0, i1);
-          add_triangle(i5, i1, i2);
-        } break;
-        case 5: {
-          //    1
-          //   3  
-          //  0 5 2
-          add_triangle(i5, i0, i3);
-          add_triangle(i5, i3, i2);
-          add_triangle(i3, i1, i2);
-        } break;
-        case 6: {
-          //    1
-          //     4
-          //  0 5 2
-          add_triangle(i4, i2, i5);
-          add_triangle(i5, i0, i4);
-          add_triangle(i4, i0, i1);
-        } break;
-        case 7: {
-          //    1
-          //   3 4
-          //  0 5 2
-          add_triangle(i1, i4, i3);
-          add_triangle(i3, i4, i5);
-          add_triangle(i3, i5, i0);
-          add_triangle(i4, i2, i5);
-        } break;
+    // does this triangle look too big from the view point?
+    bool needs_split(const vec3 &p0, const vec3 &p1, const vec3 &p2) const {
+      float size = sqrtf(max(max(squared(p1 - p0), squared(p2 - p1)), squared(p0 - p2)));
+      vec3 to_centre = (p0 + p1 + p2) * (1.0f/3) - view_pos;
+      if (dot(to_centre, view_dir) < -size) {
+        // behind the viewer
+        return false;
       }
-      depth--;
+      float distance = max(length(to_centre), 1e-6f);
+      return size * pixels_per_radian > max_edge_pixels * distance;
     }
-          
-  public:
-    RESOURCE_META(smooth)
 
-    smooth(mesh *src=0) {
-      this->src = src;
-      view_pos = vec3(0, 0, 0);
-      update();
+    // the new edge that is the half of split edge e touching vertex v
+    unsigned half_edge(unsigned e, unsigned v) const {
+      return edge_first[e] + ( edge_verts[e*2] == v ? 0 : 1 );
     }
 
-    void update() {
-      if (!src) return;
-      if (src->get_mode() != GL_TRIANGLES) return;
-      if (src->get_index_type() != GL_UNSIGNED_INT) return;
+    // find the edges of the source mesh and keep a copy of its vertices.
+    bool prepare() {
+      prepared = false;
+      if (!src) return false;
+      if (src->get_mode() != GL_TRIANGLES) return false;
+      if (src->get_index_type() != GL_UNSIGNED_INT) return false;
 
       *(mesh*)this = *(mesh*)src;
 
@@ -185,57 +167,346 @@ namespace octet { namespace scene {
 
       // needs pos, normal and uv map
       if (pos_slot == ~0 || normal_slot == ~0 || uv_slot == ~0) {
-        return;
+        return false;
       }
 
       pos_offset = get_offset(pos_slot);
       normal_offset = get_offset(normal_slot);
       uv_offset = get_offset(uv_slot);
 
-      dest_indices.reserve(get_num_indices() * 4);
-      dest_vertices.reserve(get_num_vertices() * get_stride() * 4);
-      dest_vertices.resize(get_num_vertices() * get_stride());
-
       // copy vertices for existing triangles
+      num_src_vertices = get_num_vertices();
+      src_vertices.resize(num_src_vertices * get_stride());
       const void *sp = src->get_vertices()->lock_read_only();
-      memcpy(&dest_vertices[0], sp, get_num_vertices() * get_stride());
+      memcpy(src_vertices.data(), sp, num_src_vertices * get_stride());
       src->get_vertices()->unlock_read_only();
-      num_dest_vertices = get_num_vertices();
 
-      const void *sip = src->get_indices()->lock_read_only();
-      depth = 0;
+      // the size of the mesh sets the scale of the view tolerance.
+      vec3 lo(1e30f), hi(-1e30f);
+      for (unsigned i = 0; i != num_src_vertices; ++i) {
+        const vec3p &pos = (const vec3p&)src_vertices[i * get_stride() + pos_offset];
+        lo = min(lo, (vec3)pos);
+        hi = max(hi, (vec3)pos);
+      }
+      src_size = num_src_vertices ? length(hi - lo) : 0;
+
+      // each edge once, shared by the triangles either side.
+      src_tri_verts.resize(0);
+      src_tri_edges.resize(0);
+      src_edge_verts.resize(0);
+      edges.clear();
+      const uint32_t *sip = (const uint32_t*)src->get_indices()->lock_read_only();
       for (unsigned i = 0; i+2 < get_num_indices(); i += 3) {
-        uint32_t *tp = ((uint32_t*)sip) + i;
-        add_triangle(tp[0], tp[1], tp[2]);
+        const uint32_t *tp = sip + i;
+        if (tp[0] == tp[1] || tp[1] == tp[2] || tp[2] == tp[0]) continue;
+        for (unsigned k = 0; k != 3; ++k) {
+          uint32_t i0 = tp[k], i1 = tp[k == 2 ? 0 : k+1];
+          if (i0 > i1) { swap(i0, i1); }
+          unsigned &e = edges[((uint64_t)i1 << 32) | i0];
+          if (e == 0) {
+            src_edge_verts.push_back(i0);
+            src_edge_verts.push_back(i1);
+            e = src_edge_verts.size() / 2;
+          }
+          src_tri_verts.push_back(tp[k]);
+          src_tri_edges.push_back(e - 1);
+        }
       }
       src->get_indices()->unlock_read_only();
 
-      unsigned isize = dest_indices.size() * sizeof(dest_indices[0]);
-      unsigned vsize = dest_vertices.size() * sizeof(dest_vertices[0]);
-      gl_resource *indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, isize);
-      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, vsize);
-      indices->assign(&dest_indices[0], 0, isize);
-      vertices->assign(&dest_vertices[0], 0, vsize);
+      set_indices(new gl_resource(GL_ELEMENT_ARRAY_BUFFER, 0));
+      set_vertices(new gl_resource(GL_ARRAY_BUFFER, 0));
+      prepared = true;
+      return true;
+    }
+
+    // split the triangles of one level. Returns false if nothing needed splitting.
+    bool subdivide(int depth) {
+      unsigned num_tris = tri_verts.size() / 3;
+      unsigned num_edges = edge_verts.size() / 2;
+      unsigned stride = get_stride();
+      thread_pool &pool = thread_pool::get();
 
-      set_indices(indices);
-      set_vertices(vertices);
+      // mark the edges of big triangles. Neighbours see the marks and split to match.
+      if (edge_marks_capacity < num_edges) {
+        delete [] edge_marks;
+        edge_marks_capacity = num_edges * 2;
+        edge_marks = new std::atomic<uint32_t>[edge_marks_capacity];
+      }
+      std::atomic<uint32_t> *split = edge_marks;
+      pool.parallel_ranges(num_edges, 4096, [&](unsigned begin, unsigned end) {
+        for (unsigned e = begin; e != end; ++e) {
+          split[e].store(0, std::memory_order_relaxed);
+        }
+      });
+      pool.parallel_ranges(num_tris, 1024, [&](unsigned begin, unsigned end) {
+        for (unsigned t = begin; t != end; ++t) {
+          const uint32_t *tv = &tri_verts[t*3];
+          const vec3p &p0 = (const vec3p&)dest_vertices[tv[0] * stride + pos_offset];
+          const vec3p &p1 = (const vec3p&)dest_vertices[tv[1] * stride + pos_offset];
+          const vec3p &p2 = (const vec3p&)dest_vertices[tv[2] * stride + pos_offset];
+          if (!needs_split(p0, p1, p2)) continue;
+          for (unsigned k = 0; k != 3; ++k) {
+            unsigned e = tri_edges[t*3+k];
+            const vec3p &n0 = (const vec3p&)dest_vertices[edge_verts[e*2] * stride + normal_offset];
+            const vec3p &n1 = (const vec3p&)dest_vertices[edge_verts[e*2+1] * stride + normal_offset];
+            if (!is_smooth(n0, n1, depth)) {
+              split[e].store(1, std::memory_order_relaxed);
+            }
+          }
+        }
+      });
+
+      // number the new vertices and edges: a split edge becomes two.
+      // parallel_ranges waits for its tasks, so all the marks are visible here.
+      edge_split.resize(num_edges);
+      pool.parallel_ranges(num_edges, 4096, [&](unsigned begin, unsigned end) {
+        for (unsigned e = begin; e != end; ++e) {
+          edge_split[e] = split[e].load(std::memory_order_relaxed);
+        }
+      });
+      dynarray<uint32_t> &vertex_index = edge_split;
+      unsigned num_new_vertices = exclusive_scan(vertex_index);
+      if (num_new_vertices == 0) return false;
+
+      auto is_split = [&](unsigned e) -> unsigned {
+        return ( e + 1 == num_edges ? num_new_vertices : vertex_index[e+1] ) != vertex_index[e];
+      };
+
+      edge_first.resize(num_edges);
+      pool.parallel_ranges(num_edges, 4096, [&](unsigned begin, unsigned end) {
+        for (unsigned e = begin; e != end; ++e) {
+          edge_first[e] = is_split(e) ? 2 : 1;
+        }
+      });
+      unsigned num_outer_edges = exclusive_scan(edge_first);
+
+      // a triangle gets a new edge inside it for each split edge.
+      tri_first.resize(num_tris);
+      pool.parallel_ranges(num_tris, 4096, [&](unsigned begin, unsigned end) {
+        for (unsigned t = begin; t != end; ++t) {
+          tri_first[t] = is_split(tri_edges[t*3+0]) + is_split(tri_edges[t*3+1]) + is_split(tri_edges[t*3+2]);
+        }
+      });
+      unsigned num_inner_edges = exclusive_scan(tri_first);
+      unsigned num_next_edges = num_outer_edges + num_inner_edges;
+      unsigned num_next_tris = num_tris + num_inner_edges;
+
+      // make the new vertices and the halves of split edges.
+      unsigned first_vertex = num_dest_vertices;
+      num_dest_vertices += num_new_vertices;
+      if (dest_vertices.capacity() < num_dest_vertices * stride) {
+        dest_vertices.reserve(num_dest_vertices * stride * 2);
+      }
+      dest_vertices.resize(num_dest_vertices * stride);
+      next_edge_verts.resize(num_next_edges * 2);
+      pool.parallel_ranges(num_edges, 1024, [&](unsigned begin, unsigned end) {
+        for (unsigned e = begin; e != end; ++e) {
+          unsigned v0 = edge_verts[e*2], v1 = edge_verts[e*2+1];
+          uint32_t *dest = &next_edge_verts[edge_first[e] * 2];
+          if (is_split(e)) {
+            unsigned m = first_vertex + vertex_index[e];
+            split_edge(&dest_vertices[m * stride], &dest_vertices[v0 * stride], &dest_vertices[v1 * stride], stride);
+            dest[0] = v0; dest[1] = m;
+            dest[2] = m; dest[3] = v1;
+          } else {
+            dest[0] = v0; dest[1] = v1;
+          }
+        }
+      });
+
+      // replace each triangle with one to four triangles.
+      next_tri_verts.resize(num_next_tris * 3);
+      next_tri_edges.resize(num_next_tris * 3);
+      pool.parallel_ranges(num_tris, 1024, [&](unsigned begin, unsigned end) {
+        for (unsigned t = begin; t != end; ++t) {
+          const uint32_t *tv = &tri_verts[t*3];
+          const uint32_t *te = &tri_edges[t*3];
+          unsigned mid[3], num_split = 0, first_split = 0, first_whole = 0;
+          for (unsigned k = 0; k != 3; ++k) {
+            if (is_split(te[k])) {
+              mid[k] = first_vertex + vertex_index[te[k]];
+              if (!num_split++) first_split = k;
+            } else {
+              mid[k] = ~0u;
+              first_whole = k;
+            }
+          }
+
+          // triangles and inner edges for this triangle
+          unsigned out = t + tri_first[t];
+          unsigned inner = num_outer_edges + tri_first[t];
+          uint32_t *ov = &next_tri_verts[out*3];
+          uint32_t *oe = &next_tri_edges[out*3];
+          uint32_t *iv = &next_edge_verts[inner*2];
+          #define OCTET_SMOOTH_TRI(a, b, c, ea, eb, ec) \
+            ov[0] = a; ov[1] = b; ov[2] = c; oe[0] = ea; oe[1] = eb; oe[2] = ec; ov += 3; oe += 3;
+
+          if (num_split == 0) {
+            OCTET_SMOOTH_TRI(tv[0], tv[1], tv[2], edge_first[te[0]], edge_first[te[1]], edge_first[te[2]]);
+          } else if (num_split == 1) {
+            //     b
+            //   m
+            //  a     c
+            unsigned k = first_split, k1 = k == 2 ? 0 : k + 1, k2 = k1 == 2 ? 0 : k1 + 1;
+            unsigned a = tv[k], b = tv[k1], c = tv[k2], m = mid[k];
+            iv[0] = m; iv[1] = c;
+            OCTET_SMOOTH_TRI(a, m, c, half_edge(te[k], a), inner, edge_first[te[k2]]);
+            OCTET_SMOOTH_TRI(m, b, c, half_edge(te[k], b), edge_first[te[k1]], inner);
+          } else if (num_split == 2) {
+            //     b
+            //   m0  m1
+            //  a     c
+            unsigned k = first_whole == 2 ? 0 : first_whole + 1, k1 = k == 2 ? 0 : k + 1, k2 = k1 == 2 ? 0 : k1 + 1;
+            unsigned a = tv[k], b = tv[k1], c = tv[k2], m0 = mid[k], m1 = mid[k1];
+            iv[0] = m1; iv[1] = m0;
+            iv[2] = m1; iv[3] = a;
+            OCTET_SMOOTH_TRI(m0, b, m1, half_edge(te[k], b), half_edge(te[k1], b), inner);
+            OCTET_SMOOTH_TRI(a, m0, m1, half_edge(te[k], a), inner, inner + 1);
+            OCTET_SMOOTH_TRI(a, m1, c, inner + 1, half_edge(te[k1], c), edge_first[te[k2]]);
+          } else {
+            //     b
+            //   m0  m1
+            //  a  m2  c
+            unsigned a = tv[0], b = tv[1], c = tv[2], m0 = mid[0], m1 = mid[1], m2 = mid[2];
+            iv[0] = m0; iv[1] = m1;
+            iv[2] = m1; iv[3] = m2;
+            iv[4] = m2; iv[5] = m0;
+            OCTET_SMOOTH_TRI(a, m0, m2, half_edge(te[0], a), inner + 2, half_edge(te[2], a));
+            OCTET_SMOOTH_TRI(m0, b, m1, half_edge(te[0], b), half_edge(te[1], b), inner);
+            OCTET_SMOOTH_TRI(m2, m1, c, inner + 1, half_edge(te[1], c), half_edge(te[2], c));
+            OCTET_SMOOTH_TRI(m0, m1, m2, inner, inner + 1, inner + 2);
+          }
+          #undef OCTET_SMOOTH_TRI
+        }
+      });
+
+      tri_verts.resize(num_next_tris * 3);
+      tri_edges.resize(num_next_tris * 3);
+      edge_verts.resize(num_next_edges * 2);
+      memcpy(tri_verts.data(), next_tri_verts.data(), num_next_tris * 3 * sizeof(uint32_t));
+      memcpy(tri_edges.data(), next_tri_edges.data(), num_next_tris * 3 * sizeof(uint32_t));
+      memcpy(edge_verts.data(), next_edge_verts.data(), num_next_edges * 2 * sizeof(uint32_t));
+      return true;
+    }
+
+  public:
+    RESOURCE_META(smooth)
+
+    smooth(mesh *src=0) {
+      this->src = src;
+      view_pos = vec3(0, 0, 0);
+      view_dir = vec3(0, 0, -1);
+      pixels_per_radian = 512;
+      max_edge_pixels = 16;
+      max_depth = 4;
+      built = false;
+      prepared = false;
+      move_tolerance = 0.01f;
+      turn_tolerance = cosf(1.0f * (3.14159265f / 180));
+      src_size = 0;
+      smooth_cos = cosf(2.5f * (3.14159265f / 180));
+      edge_marks = NULL;
+      edge_marks_capacity = 0;
+      update();
+    }
+
+    ~smooth() {
+      delete [] edge_marks;
+    }
+
+    /// Set the viewpoint. pixels_per_radian is screen_height / (2 * tan(fov/2)) for a perspective camera.
+    void set_view(vec3_in pos, vec3_in dir, float pixels_per_radian) {
+      view_pos = pos;
+      view_dir = dir;
+      if (pixels_per_radian != this->pixels_per_radian) {
+        this->pixels_per_radian = pixels_per_radian;
+        built = false;
+      }
+    }
+
+    /// Subdivide again only when the view moves by more than move (a fraction of the size
+    /// of the source mesh) or turns by more than turn_degrees. The defaults are 0.01 and 1 degree.
+    /// Use zero for both to subdivide on every change of view.
+    void set_view_tolerance(float move, float turn_degrees) {
+      move_tolerance = move;
+      turn_tolerance = cosf(turn_degrees * (3.14159265f / 180));
+    }
+
+    /// Edges whose end normals are within this angle are flat enough not to split.
+    /// The default of 2.5 degrees moves the middle of an edge by about 0.5% of its length.
+    void set_smooth_angle(float degrees) {
+      smooth_cos = cosf(degrees * (3.14159265f / 180));
+      built = false;
+    }
+
+    /// Triangles with edges longer than this on the screen get split.
+    void set_max_edge_pixels(float pixels) {
+      max_edge_pixels = pixels;
+      built = false;
+    }
+
+    /// Limit the number of times a source triangle may be split.
+    void set_max_depth(int depth) {
+      max_depth = depth;
+      built = false;
+    }
+
+    /// Call this if the source mesh has changed.
+    void invalidate() {
+      prepared = false;
+      built = false;
+    }
+
+    /// Subdivide again if the view has changed since the last update.
+    void update() {
+      if (!prepared && !prepare()) return;
+      if (built) {
+        float max_move = move_tolerance * src_size;
+        bool moved = squared(view_pos - built_pos) > max_move * max_move;
+        bool turned = dot(normalize(view_dir), normalize(built_dir)) < turn_tolerance;
+        if (!moved && !turned) return;
+      }
+
+      // start from the source mesh
+      unsigned stride = get_stride();
+      num_dest_vertices = num_src_vertices;
+      dest_vertices.resize(num_src_vertices * stride);
+      memcpy(dest_vertices.data(), src_vertices.data(), num_src_vertices * stride);
+      tri_verts.resize(src_tri_verts.size());
+      tri_edges.resize(src_tri_edges.size());
+      edge_verts.resize(src_edge_verts.size());
+      memcpy(tri_verts.data(), src_tri_verts.data(), src_tri_verts.size() * sizeof(uint32_t));
+      memcpy(tri_edges.data(), src_tri_edges.data(), src_tri_edges.size() * sizeof(uint32_t));
+      memcpy(edge_verts.data(), src_edge_verts.data(), src_edge_verts.size() * sizeof(uint32_t));
+
+      for (int depth = 0; depth < max_depth; ++depth) {
+        if (!subdivide(depth)) break;
+      }
+
+      unsigned isize = tri_verts.size() * sizeof(tri_verts[0]);
+      unsigned vsize = num_dest_vertices * stride;
+      allocate(vsize, isize);
+      assign(vsize, isize, dest_vertices.data(), (uint8_t*)tri_verts.data());
       set_num_vertices(num_dest_vertices);
-      set_num_indices(dest_indices.size());
+      set_num_indices(tri_verts.size());
 
-      dump(log("dump"));
+      built_pos = view_pos;
+      built_dir = view_dir;
+      built = true;
     }
 
     void visit(visitor &v) {
       mesh::visit(v);
       v.visit(src, atom_src);
       v.visit(view_pos, atom_view_pos);
+      v.visit(view_dir, atom_view_dir);
     }
 
-    virtual bool is_smooth(const vec3 &n0, const vec3 &n1, int depth) {
-      return true;
-      float dotp = dot(n0, n1);
-      log("%*s  dotp=%f\n", depth*2, "", dotp);
-      return (dotp >= 0.9f) || depth >= 4;
+    /// Return true if an edge is flat enough not to need splitting, see set_smooth_angle().
+    /// Called from many threads at once.
+    virtual bool is_smooth(const vec3 &n0, const vec3 &n1, int /*depth*/) {
+      return dot(n0, n1) >= smooth_cos;
     }
   };
 }}
@@ -0,0 +1,883 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Software rasteriser for rendering without a GL context.
+//
+
+namespace octet { namespace scene {
+  /// Multithreaded, tile binned software rasteriser.
+  ///
+  /// Draws meshes with the flat colour, texture and diffuse lighting paths of material,
+  /// plus point sprites and lines, into an in-memory framebuffer. Nothing here calls OpenGL,
+  /// so render output and frame times can be checked on machines without a GPU.
+  ///
+  /// Draw calls transform and clip their primitives straight away.
+  /// end_frame() sorts the triangles into tiles and fills the tiles in parallel.
+  /// Each tile is owned by one thread and draws its triangles in submission order,
+  /// so the image is the same for any number of threads.
+  ///
+  /// Example
+  ///
+  ///     soft_renderer sr(640, 480);
+  ///     sr.begin_frame(vec4(0, 0, 0, 1));
+  ///     app_scene->render(sr, 640.0f / 480);
+  ///     sr.end_frame();
+  ///     printf("%016llx %.2fms\n", (long long)sr.get_hash(), sr.get_stats().frame_ms);
+  class soft_renderer {
+  public:
+    /// timings and counts for a frame.
+    struct frame_stats {
+      /// time spent in draw calls transforming and clipping primitives.
+      double transform_ms;
+      /// time spent sorting triangles into tiles.
+      double bin_ms;
+      /// time spent clearing and filling the tiles.
+      double raster_ms;
+      /// time from begin_frame() to the end of end_frame().
+      double frame_ms;
+      /// draw calls made.
+      unsigned draws;
+      /// draw calls with materials that can't be drawn in software (eg. channel projections).
+      unsigned skipped_draws;
+      /// triangles after clipping, including the quads for points and lines.
+      unsigned triangles;
+      /// triangle and tile pairs after binning.
+      unsigned binned_triangles;
+      /// pixels written after the depth test.
+      unsigned pixels;
+    };
+
+  private:
+    enum {
+      // tiles are 64x64 pixels.
+      tile_shift = 6,
+      tile_size = 1 << tile_shift,
+
+      // window coordinates are 28.4 fixed point.
+      subpixel_bits = 4,
+      subpixel_one = 1 << subpixel_bits,
+
+      // triangles are clipped to this many pixels outside the framebuffer to keep edge functions in 64 bits.
+      guard_band = 4096,
+
+      // interpolated attributes: normal xyz and uv. For point sprites the uv is the position on the disc.
+      num_attrs = 5,
+
+      // primitive assembly is split into at most this many ordered chunks.
+      max_chunks = 64,
+
+      // draw_state flags
+      flag_lit = 1,
+      flag_textured = 2,
+      flag_sprite = 4,
+    };
+
+    // a vertex in clip space with its attributes.
+    struct clip_vertex {
+      float pos[4];
+      float attr[num_attrs];
+    };
+
+    // a triangle ready to rasterise.
+    struct soft_triangle {
+      // fixed point window coordinates, counter clockwise
+      int x[3], y[3];
+
+      // bounds in pixels, inclusive and clipped to the framebuffer
+      int min_x, min_y, max_x, max_y;
+
+      // window depth 0..1 and 1/w
+      float z[3];
+      float inv_w[3];
+
+      // attributes divided by w for perspective correct interpolation
+      float attr[3][num_attrs];
+
+      unsigned state;
+    };
+
+    // shading for one draw call.
+    struct draw_state {
+      float color[4];
+      const uint8_t *texels;
+      unsigned tex_width;
+      unsigned tex_height;
+      unsigned tex_comps;
+      unsigned flags;
+      unsigned first_light;
+      unsigned num_lights;
+      float point_size;
+    };
+
+    unsigned width;
+    unsigned height;
+    unsigned tiles_x;
+    unsigned tiles_y;
+
+    // RGBA8 pixels, red in the low byte. Row 0 is the bottom, as in glReadPixels.
+    dynarray<uint32_t> color_buffer;
+    dynarray<float> depth_buffer;
+    uint32_t clear_color;
+
+    float point_size;
+
+    // this frame's primitives and shading
+    dynarray<soft_triangle> triangles;
+    dynarray<draw_state> states;
+    dynarray<float> lights;
+
+    // scratch space for draw calls
+    dynarray<clip_vertex> clip_vertices;
+    dynarray<soft_triangle> chunk_triangles[max_chunks];
+
+    // tile bins: triangle indices for tile t are bin_triangles[bin_start[t]..bin_start[t+1]).
+    dynarray<unsigned> bin_counts;
+    dynarray<unsigned> bin_start;
+    dynarray<unsigned> bin_triangles;
+    dynarray<unsigned> tile_pixels;
+
+    double frame_start;
+    frame_stats stats;
+    frame_stats total_stats;
+    unsigned num_frames;
+
+    static float clampf(float v, float lo, float hi) {
+      return v < lo ? lo : v > hi ? hi : v;
+    }
+
+    static uint32_t pack_color(const float *c) {
+      uint32_t r = (uint32_t)(clampf(c[0], 0, 1) * 255.0f + 0.5f);
+      uint32_t g = (uint32_t)(clampf(c[1], 0, 1) * 255.0f + 0.5f);
+      uint32_t b = (uint32_t)(clampf(c[2], 0, 1) * 255.0f + 0.5f);
+      uint32_t a = (uint32_t)(clampf(c[3], 0, 1) * 255.0f + 0.5f);
+      return r | (g << 8) | (b << 16) | (a << 24);
+    }
+
+    // read an attribute into dest[0..n). Missing lanes are (0, 0, 0, 1) as in OpenGL.
+    static void fetch(float *dest, unsigned n, const uint8_t *src, unsigned kind, unsigned size) {
+      for (unsigned i = 0; i != n; ++i) {
+        dest[i] = i == 3 ? 1.0f : 0.0f;
+      }
+      unsigned lanes = size < n ? size : n;
+      if (kind == GL_FLOAT) {
+        const float *f = (const float*)src;
+        for (unsigned i = 0; i != lanes; ++i) dest[i] = f[i];
+      } else if (kind == GL_UNSIGNED_BYTE) {
+        for (unsigned i = 0; i != lanes; ++i) dest[i] = src[i] * (1.0f/255);
+      }
+    }
+
+    static float plane_distance(const float *plane, const clip_vertex &v) {
+      return plane[0] * v.pos[0] + plane[1] * v.pos[1] + plane[2] * v.pos[2] + plane[3] * v.pos[3];
+    }
+
+    static void lerp_vertex(clip_vertex &dest, const clip_vertex &a, const clip_vertex &b, float t) {
+      for (unsigned i = 0; i != 4; ++i) dest.pos[i] = a.pos[i] + (b.pos[i] - a.pos[i]) * t;
+      for (unsigned i = 0; i != num_attrs; ++i) dest.attr[i] = a.attr[i] + (b.attr[i] - a.attr[i]) * t;
+    }
+
+    // is the edge a->b on the top or left of a counter clockwise triangle?
+    // pixel centres exactly on an edge belong to only one of the triangles sharing it.
+    static bool is_top_left(int ax, int ay, int bx, int by) {
+      return by < ay || (by == ay && bx > ax);
+    }
+
+    // project a clipped triangle to window coordinates and add it to out.
+    void emit_triangle(const clip_vertex *v0, const clip_vertex *v1, const clip_vertex *v2, unsigned state, dynarray<soft_triangle> &out) const {
+      const clip_vertex *v[3] = { v0, v1, v2 };
+      soft_triangle tri;
+      float half_w = width * 0.5f, half_h = height * 0.5f;
+      for (unsigned i = 0; i != 3; ++i) {
+        float inv_w = 1.0f / v[i]->pos[3];
+        float sx = (v[i]->pos[0] * inv_w + 1.0f) * half_w;
+        float sy = (v[i]->pos[1] * inv_w + 1.0f) * half_h;
+        tri.x[i] = (int)floorf(sx * subpixel_one + 0.5f);
+        tri.y[i] = (int)floorf(sy * subpixel_one + 0.5f);
+        tri.z[i] = v[i]->pos[2] * inv_w * 0.5f + 0.5f;
+        tri.inv_w[i] = inv_w;
+        for (unsigned j = 0; j != num_attrs; ++j) {
+          tri.attr[i][j] = v[i]->attr[j] * inv_w;
+        }
+      }
+
+      int64_t area = (int64_t)(tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (int64_t)(tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+      if (area == 0) return;
+
+      // both faces are drawn (there is no culling in the GL path either), so make every triangle counter clockwise.
+      if (area < 0) {
+        math::swap(tri.x[1], tri.x[2]);
+        math::swap(tri.y[1], tri.y[2]);
+        math::swap(tri.z[1], tri.z[2]);
+        math::swap(tri.inv_w[1], tri.inv_w[2]);
+        for (unsigned j = 0; j != num_attrs; ++j) {
+          math::swap(tri.attr[1][j], tri.attr[2][j]);
+        }
+      }
+
+      // pixel centres are at (x + 0.5, y + 0.5)
+      int lo_x = math::min(tri.x[0], math::min(tri.x[1], tri.x[2])), hi_x = math::max(tri.x[0], math::max(tri.x[1], tri.x[2]));
+      int lo_y = math::min(tri.y[0], math::min(tri.y[1], tri.y[2])), hi_y = math::max(tri.y[0], math::max(tri.y[1], tri.y[2]));
+      tri.min_x = math::max((lo_x - subpixel_one/2 + subpixel_one - 1) >> subpixel_bits, 0);
+      tri.min_y = math::max((lo_y - subpixel_one/2 + subpixel_one - 1) >> subpixel_bits, 0);
+      tri.max_x = math::min((hi_x - subpixel_one/2) >> subpixel_bits, (int)width - 1);
+      tri.max_y = math::min((hi_y - subpixel_one/2) >> subpixel_bits, (int)height - 1);
+      if (tri.min_x > tri.max_x || tri.min_y > tri.max_y) return;
+
+      tri.state = state;
+      out.push_back(tri);
+    }
+
+    // clip a triangle against the near plane and the guard band, then emit it.
+    void add_triangle(const clip_vertex &a, const clip_vertex &b, const clip_vertex &c, unsigned state, dynarray<soft_triangle> &out) const {
+      float gx = ( width * 0.5f + guard_band ) / ( width * 0.5f );
+      float gy = ( height * 0.5f + guard_band ) / ( height * 0.5f );
+      // near, far, then the guard band. Planes are dot(plane, pos) >= 0.
+      const float planes[6][4] = {
+        { 0, 0, 1, 1 }, { 0, 0, -1, 1 },
+        { 1, 0, 0, gx }, { -1, 0, 0, gx }, { 0, 1, 0, gy }, { 0, -1, 0, gy },
+      };
+
+      unsigned clip_mask = 0;
+      for (unsigned p = 0; p != 6; ++p) {
+        float da = plane_distance(planes[p], a), db = plane_distance(planes[p], b), dc = plane_distance(planes[p], c);
+        if (da < 0 && db < 0 && dc < 0) return;
+        if (da < 0 || db < 0 || dc < 0) clip_mask |= 1 << p;
+      }
+
+      if (!clip_mask) {
+        emit_triangle(&a, &b, &c, state, out);
+        return;
+      }
+
+      // Sutherland-Hodgman: each plane adds at most one vertex.
+      clip_vertex buffers[2][9];
+      unsigned num = 3;
+      buffers[0][0] = a; buffers[0][1] = b; buffers[0][2] = c;
+      unsigned cur = 0;
+      for (unsigned p = 0; p != 6; ++p) {
+        if (!(clip_mask & (1 << p))) continue;
+        const clip_vertex *src = buffers[cur];
+        clip_vertex *dest = buffers[cur ^ 1];
+        unsigned num_out = 0;
+        for (unsigned i = 0; i != num; ++i) {
+          const clip_vertex &va = src[i];
+          const clip_vertex &vb = src[i + 1 == num ? 0 : i + 1];
+          float da = plane_distance(planes[p], va), db = plane_distance(planes[p], vb);
+          if (da >= 0) dest[num_out++] = va;
+          if ((da >= 0) != (db >= 0)) {
+            lerp_vertex(dest[num_out++], va, vb, da / (da - db));
+          }
+        }
+        num = num_out;
+        cur ^= 1;
+        if (num < 3) return;
+      }
+
+      for (unsigned i = 2; i < num; ++i) {
+        emit_triangle(&buffers[cur][0], &buffers[cur][i-1], &buffers[cur][i], state, out);
+      }
+    }
+
+    // a round sprite, size pixels across, centred on the vertex.
+    void add_sprite(const clip_vertex &centre, float size, unsigned state, dynarray<soft_triangle> &out) const {
+      float w = centre.pos[3];
+      if (w <= 0) return;
+      float hx = size / width * w, hy = size / height * w;
+      clip_vertex corners[4];
+      static const float offsets[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+      for (unsigned i = 0; i != 4; ++i) {
+        corners[i] = centre;
+        corners[i].pos[0] += offsets[i][0] * hx;
+        corners[i].pos[1] += offsets[i][1] * hy;
+        corners[i].attr[3] = offsets[i][0];
+        corners[i].attr[4] = offsets[i][1];
+      }
+      add_triangle(corners[0], corners[1], corners[2], state, out);
+      add_triangle(corners[0], corners[2], corners[3], state, out);
+    }
+
+    // a line one pixel wide.
+    void add_line(const clip_vertex &a, const clip_vertex &b, unsigned state, dynarray<soft_triangle> &out) const {
+      // clip to the near plane first so that the width can be worked out in window space.
+      clip_vertex p0 = a, p1 = b;
+      float d0 = a.pos[2] + a.pos[3], d1 = b.pos[2] + b.pos[3];
+      if (d0 < 0 && d1 < 0) return;
+      if (d0 < 0) lerp_vertex(p0, a, b, d0 / (d0 - d1));
+      if (d1 < 0) lerp_vertex(p1, b, a, d1 / (d1 - d0));
+      if (p0.pos[3] <= 0 || p1.pos[3] <= 0) return;
+
+      float dx = (p1.pos[0] / p1.pos[3] - p0.pos[0] / p0.pos[3]) * width;
+      float dy = (p1.pos[1] / p1.pos[3] - p0.pos[1] / p0.pos[3]) * height;
+      float len = sqrtf(dx * dx + dy * dy);
+      float nx = len ? -dy / len : 0, ny = len ? dx / len : 1;
+
+      // half a pixel either side, in clip space
+      float ox = nx / width, oy = ny / height;
+      clip_vertex corners[4] = { p0, p0, p1, p1 };
+      corners[0].pos[0] += ox * p0.pos[3]; corners[0].pos[1] += oy * p0.pos[3];
+      corners[1].pos[0] -= ox * p0.pos[3]; corners[1].pos[1] -= oy * p0.pos[3];
+      corners[2].pos[0] -= ox * p1.pos[3]; corners[2].pos[1] -= oy * p1.pos[3];
+      corners[3].pos[0] += ox * p1.pos[3]; corners[3].pos[1] += oy * p1.pos[3];
+      add_triangle(corners[0], corners[1], corners[2], state, out);
+      add_triangle(corners[0], corners[2], corners[3], state, out);
+    }
+
+    // make primitives from clip_vertices in ordered chunks on all threads and append them to the frame.
+    void assemble(unsigned mode, unsigned num_indices, const uint8_t *indices, unsigned index_type, unsigned state, float size) {
+      unsigned num_prims = 0;
+      switch (mode) {
+        case GL_TRIANGLES: num_prims = num_indices / 3; break;
+        case GL_TRIANGLE_STRIP: case GL_TRIANGLE_FAN: num_prims = num_indices >= 3 ? num_indices - 2 : 0; break;
+        case GL_LINES: num_prims = num_indices / 2; break;
+        case GL_LINE_STRIP: num_prims = num_indices >= 2 ? num_indices - 1 : 0; break;
+        case GL_POINTS: num_prims = num_indices; break;
+      }
+      if (num_prims == 0) return;
+
+      unsigned grain = ( num_prims + max_chunks - 1 ) / max_chunks;
+      if (grain < 256) grain = 256;
+      unsigned num_chunks = ( num_prims + grain - 1 ) / grain;
+
+      const clip_vertex *verts = clip_vertices.data();
+      thread_pool::get().parallel_for(num_chunks, [&](unsigned chunk) {
+        dynarray<soft_triangle> &out = chunk_triangles[chunk];
+        out.resize(0);
+        unsigned end = math::min(( chunk + 1 ) * grain, num_prims);
+        for (unsigned prim = chunk * grain; prim != end; ++prim) {
+          unsigned idx[3];
+          unsigned first = mode == GL_TRIANGLES ? prim * 3 : mode == GL_LINES ? prim * 2 : prim;
+          unsigned count = mode == GL_POINTS ? 1 : mode == GL_LINES || mode == GL_LINE_STRIP ? 2 : 3;
+          for (unsigned i = 0; i != count; ++i) {
+            unsigned n = first + i;
+            if (mode == GL_TRIANGLE_FAN && i == 0) n = 0;
+            idx[i] = index_type == GL_UNSIGNED_INT ? ((const uint32_t*)indices)[n] : index_type == GL_UNSIGNED_SHORT ? ((const uint16_t*)indices)[n] : n;
+          }
+          if (count == 3) {
+            add_triangle(verts[idx[0]], verts[idx[1]], verts[idx[2]], state, out);
+          } else if (count == 2) {
+            add_line(verts[idx[0]], verts[idx[1]], state, out);
+          } else {
+            add_sprite(verts[idx[0]], size, state, out);
+          }
+        }
+      });
+
+      unsigned total = triangles.size();
+      for (unsigned chunk = 0; chunk != num_chunks; ++chunk) {
+        total += chunk_triangles[chunk].size();
+      }
+      // dynarray grows to the exact size, so grow geometrically here.
+      if (total > triangles.capacity()) {
+        triangles.reserve(math::max(total, triangles.capacity() * 2));
+      }
+      for (unsigned chunk = 0; chunk != num_chunks; ++chunk) {
+        dynarray<soft_triangle> &src = chunk_triangles[chunk];
+        unsigned pos = triangles.size();
+        triangles.resize(pos + src.size());
+        if (src.size()) memcpy(&triangles[pos], src.data(), src.size() * sizeof(soft_triangle));
+      }
+    }
+
+    unsigned add_state(const float *color, unsigned flags, image *img, const vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
+      draw_state s;
+      for (unsigned i = 0; i != 4; ++i) s.color[i] = color[i];
+      s.flags = flags;
+      s.point_size = 0;
+      s.texels = NULL;
+      s.tex_width = s.tex_height = s.tex_comps = 0;
+      if (img && (img->get_format() == GL_RGB || img->get_format() == GL_RGBA) && img->get_bytes()) {
+        s.texels = img->get_bytes();
+        s.tex_width = img->get_width();
+        s.tex_height = img->get_height();
+        s.tex_comps = img->get_format() == GL_RGBA ? 4 : 3;
+        s.flags |= flag_textured;
+      }
+      s.first_light = lights.size();
+      s.num_lights = 0;
+      if (flags & flag_lit) {
+        // ambient, then pos, direction, colour and attenuation for each light.
+        if (!light_uniforms || num_light_uniforms < material::ambient_size + num_lights * material::light_size) num_lights = 0;
+        lights.resize(s.first_light + 4 + num_lights * 8);
+        float *dest = &lights[s.first_light];
+        dest[0] = dest[1] = dest[2] = 0.5f; dest[3] = 1;
+        if (light_uniforms) {
+          const float *ambient = light_uniforms[0].get();
+          dest[0] = ambient[0]; dest[1] = ambient[1]; dest[2] = ambient[2]; dest[3] = ambient[3];
+        }
+        for (int i = 0; i != num_lights; ++i) {
+          const float *direction = light_uniforms[material::ambient_size + i * material::light_size + 1].get();
+          const float *color = light_uniforms[material::ambient_size + i * material::light_size + 2].get();
+          for (unsigned j = 0; j != 4; ++j) {
+            dest[4 + i * 8 + j] = direction[j];
+            dest[8 + i * 8 + j] = color[j];
+          }
+        }
+        s.num_lights = num_lights;
+      }
+      states.push_back(s);
+      return states.size() - 1;
+    }
+
+    // bilinear filtered texel with GL_REPEAT wrapping. level 0 only.
+    static void sample(float *dest, const draw_state &s, float u, float v) {
+      float fx = u * s.tex_width - 0.5f, fy = v * s.tex_height - 0.5f;
+      float flx = floorf(fx), fly = floorf(fy);
+      float tx = fx - flx, ty = fy - fly;
+      int x0 = (int)flx, y0 = (int)fly;
+      int w = (int)s.tex_width, h = (int)s.tex_height;
+      x0 = ( x0 % w + w ) % w;
+      y0 = ( y0 % h + h ) % h;
+      int x1 = x0 + 1 == w ? 0 : x0 + 1, y1 = y0 + 1 == h ? 0 : y0 + 1;
+      const uint8_t *t00 = s.texels + ( y0 * w + x0 ) * s.tex_comps;
+      const uint8_t *t10 = s.texels + ( y0 * w + x1 ) * s.tex_comps;
+      const uint8_t *t01 = s.texels + ( y1 * w + x0 ) * s.tex_comps;
+      const uint8_t *t11 = s.texels + ( y1 * w + x1 ) * s.tex_comps;
+      dest[3] = 1;
+      for (unsigned i = 0; i != s.tex_comps; ++i) {
+        float top = t00[i] + (t10[i] - t00[i]) * tx;
+        float bottom = t01[i] + (t11[i] - t01[i]) * tx;
+        dest[i] = ( top + (bottom - top) * ty ) * (1.0f/255);
+      }
+    }
+
+    // clear a tile and draw its triangles. Returns the number of pixels written.
+    unsigned raster_tile(unsigned tile) {
+      int tx0 = ( tile % tiles_x ) * tile_size, ty0 = ( tile / tiles_x ) * tile_size;
+      int tx1 = math::min(tx0 + (int)tile_size, (int)width) - 1, ty1 = math::min(ty0 + (int)tile_size, (int)height) - 1;
+
+      for (int y = ty0; y <= ty1; ++y) {
+        uint32_t *cp = &color_buffer[y * width];
+        float *dp = &depth_buffer[y * width];
+        for (int x = tx0; x <= tx1; ++x) {
+          cp[x] = clear_color;
+          dp[x] = 1.0f;
+        }
+      }
+
+      unsigned pixels = 0;
+      for (unsigned b = bin_start[tile]; b != bin_start[tile+1]; ++b) {
+        const soft_triangle &tri = triangles[bin_triangles[b]];
+        const draw_state &s = states[tri.state];
+        int x0 = math::max(tri.min_x, tx0), x1 = math::min(tri.max_x, tx1);
+        int y0 = math::max(tri.min_y, ty0), y1 = math::min(tri.max_y, ty1);
+
+        // edge k is opposite vertex k; its edge function is the weight of vertex k.
+        int64_t row[3], step_x[3], step_y[3], bias[3];
+        int px = x0 * subpixel_one + subpixel_one/2, py = y0 * subpixel_one + subpixel_one/2;
+        for (unsigned k = 0; k != 3; ++k) {
+          unsigned a = k == 2 ? 0 : k + 1, c = a == 2 ? 0 : a + 1;
+          int ax = tri.x[a], ay = tri.y[a], bx = tri.x[c], by = tri.y[c];
+          row[k] = (int64_t)(bx - ax) * (py - ay) - (int64_t)(by - ay) * (px - ax);
+          step_x[k] = -(int64_t)(by - ay) * subpixel_one;
+          step_y[k] = (int64_t)(bx - ax) * subpixel_one;
+          bias[k] = is_top_left(ax, ay, bx, by) ? 0 : -1;
+        }
+        int64_t area = (int64_t)(tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (int64_t)(tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+        float inv_area = 1.0f / (float)area;
+
+        for (int y = y0; y <= y1; ++y) {
+          int64_t e0 = row[0], e1 = row[1], e2 = row[2];
+          uint32_t *cp = &color_buffer[y * width];
+          float *dp = &depth_buffer[y * width];
+          for (int x = x0; x <= x1; ++x, e0 += step_x[0], e1 += step_x[1], e2 += step_x[2]) {
+            if (( (e0 + bias[0]) | (e1 + bias[1]) | (e2 + bias[2]) ) < 0) continue;
+
+            float b0 = e0 * inv_area, b1 = e1 * inv_area, b2 = 1.0f - b0 - b1;
+            float depth = b0 * tri.z[0] + b1 * tri.z[1] + b2 * tri.z[2];
+            if (depth >= dp[x] || depth < 0) continue;
+
+            float w = 1.0f / ( b0 * tri.inv_w[0] + b1 * tri.inv_w[1] + b2 * tri.inv_w[2] );
+            float attr[num_attrs];
+            for (unsigned j = 0; j != num_attrs; ++j) {
+              attr[j] = ( b0 * tri.attr[0][j] + b1 * tri.attr[1][j] + b2 * tri.attr[2][j] ) * w;
+            }
+
+            float color[4] = { s.color[0], s.color[1], s.color[2], s.color[3] };
+            if (s.flags & flag_sprite) {
+              // round points with a soft one pixel edge, blended with SRC_ALPHA, ONE_MINUS_SRC_ALPHA.
+              float r = sqrtf(attr[3] * attr[3] + attr[4] * attr[4]);
+              float coverage = clampf(( 1.0f - r ) * s.point_size * 0.5f, 0, 1);
+              if (coverage <= 0) continue;
+              float alpha = color[3] * coverage;
+              uint32_t dst = cp[x];
+              for (unsigned i = 0; i != 4; ++i) {
+                float d = ( ( dst >> (i * 8) ) & 0xff ) * (1.0f/255);
+                color[i] = (i == 3 ? alpha : color[i]) * alpha + d * ( 1.0f - alpha );
+              }
+            } else {
+              if (s.flags & flag_textured) {
+                sample(color, s, attr[3], attr[4]);
+              }
+              if (s.flags & flag_lit) {
+                // as in material::create_lighting: ambient + sum(max(dot(light_direction, nnormal), 0) * light_color)
+                float nlen = sqrtf(attr[0] * attr[0] + attr[1] * attr[1] + attr[2] * attr[2]);
+                float rn = nlen ? 1.0f / nlen : 0;
+                float nx = attr[0] * rn, ny = attr[1] * rn, nz = attr[2] * rn;
+                const float *l = &lights[s.first_light];
+                float light[3] = { l[0], l[1], l[2] };
+                for (unsigned i = 0; i != s.num_lights; ++i) {
+                  const float *dir = l + 4 + i * 8, *lcol = l + 8 + i * 8;
+                  float factor = math::max(dir[0] * nx + dir[1] * ny + dir[2] * nz, 0.0f);
+                  light[0] += factor * lcol[0];
+                  light[1] += factor * lcol[1];
+                  light[2] += factor * lcol[2];
+                }
+                color[0] *= light[0]; color[1] *= light[1]; color[2] *= light[2];
+              }
+              // the material combiner writes an alpha of 1.
+              color[3] = 1.0f;
+            }
+
+            cp[x] = pack_color(color);
+            dp[x] = depth;
+            pixels++;
+          }
+          row[0] += step_y[0]; row[1] += step_y[1]; row[2] += step_y[2];
+        }
+      }
+      return pixels;
+    }
+
+    void bin_triangles_to_tiles() {
+      unsigned num_tiles = tiles_x * tiles_y;
+      unsigned num_tris = triangles.size();
+      unsigned grain = math::max(( num_tris + max_chunks - 1 ) / max_chunks, 1024u);
+      unsigned num_chunks = ( num_tris + grain - 1 ) / grain;
+
+      // count the triangles for each chunk and tile
+      bin_counts.resize(num_chunks * num_tiles);
+      if (bin_counts.size()) memset(bin_counts.data(), 0, bin_counts.size() * sizeof(unsigned));
+      thread_pool::get().parallel_for(num_chunks, [&](unsigned chunk) {
+        unsigned *counts = &bin_counts[chunk * num_tiles];
+        unsigned end = math::min(( chunk + 1 ) * grain, num_tris);
+        for (unsigned i = chunk * grain; i != end; ++i) {
+          const soft_triangle &tri = triangles[i];
+          for (int ty = tri.min_y >> tile_shift; ty <= tri.max_y >> tile_shift; ++ty) {
+            for (int tx = tri.min_x >> tile_shift; tx <= tri.max_x >> tile_shift; ++tx) {
+              counts[ty * tiles_x + tx]++;
+            }
+          }
+        }
+      });
+
+      // tile major prefix sum, so each tile lists its triangles in submission order
+      bin_start.resize(num_tiles + 1);
+      unsigned total = 0;
+      for (unsigned tile = 0; tile != num_tiles; ++tile) {
+        bin_start[tile] = total;
+        for (unsigned chunk = 0; chunk != num_chunks; ++chunk) {
+          unsigned count = bin_counts[chunk * num_tiles + tile];
+          bin_counts[chunk * num_tiles + tile] = total;
+          total += count;
+        }
+      }
+      bin_start[num_tiles] = total;
+      bin_triangles.resize(total);
+
+      thread_pool::get().parallel_for(num_chunks, [&](unsigned chunk) {
+        unsigned *offsets = &bin_counts[chunk * num_tiles];
+        unsigned end = math::min(( chunk + 1 ) * grain, num_tris);
+        for (unsigned i = chunk * grain; i != end; ++i) {
+          const soft_triangle &tri = triangles[i];
+          for (int ty = tri.min_y >> tile_shift; ty <= tri.max_y >> tile_shift; ++ty) {
+            for (int tx = tri.min_x >> tile_shift; tx <= tri.max_x >> tile_shift; ++tx) {
+              bin_triangles[offsets[ty * tiles_x + tx]++] = i;
+            }
+          }
+        }
+      });
+      stats.binned_triangles = total;
+    }
+
+  public:
+    /// make a framebuffer of width x height pixels.
+    soft_renderer(unsigned width = 640, unsigned height = 480) {
+      this->width = 0;
+      this->height = 0;
+      point_size = 1;
+      clear_color = 0;
+      num_frames = 0;
+      frame_start = 0;
+      memset(&stats, 0, sizeof(stats));
+      memset(&total_stats, 0, sizeof(total_stats));
+      resize(width, height);
+    }
+
+    /// change the size of the framebuffer.
+    void resize(unsigned new_width, unsigned new_height) {
+      width = new_width;
+      height = new_height;
+      tiles_x = ( width + tile_size - 1 ) >> tile_shift;
+      tiles_y = ( height + tile_size - 1 ) >> tile_shift;
+      color_buffer.resize(width * height);
+      depth_buffer.resize(width * height);
+      tile_pixels.resize(tiles_x * tiles_y);
+    }
+
+    /// size of points for meshes drawn as GL_POINTS, like glPointSize.
+    void set_point_size(float size) {
+      point_size = size;
+    }
+
+    /// start a frame. The framebuffer is cleared to clear_color and depth 1 in end_frame().
+    void begin_frame(const vec4 &color = vec4(0, 0, 0, 1)) {
+      frame_start = get_time_seconds();
+      clear_color = pack_color(color.get());
+      triangles.resize(0);
+      states.resize(0);
+      lights.resize(0);
+      memset(&stats, 0, sizeof(stats));
+    }
+
+    /// draw a mesh with the colour, texture or diffuse lighting path of mat.
+    /// The matrices and lighting are the same as for material::render().
+    /// Materials with no colour or texture (eg. an empty COLLADA effect) draw as lit grey.
+    void draw_mesh(mesh *msh, material *mat, const mat4t &modelToProjection, const mat4t &modelToCamera, const vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
+      double t0 = get_time_seconds();
+      stats.draws++;
+
+      float color[4] = { 0.5f, 0.5f, 0.5f, 1.0f };
+      image *img = NULL;
+      bool lit = true;
+      if (mat) {
+        vec4 diffuse;
+        if (!mat->get_software_shading(diffuse, img, lit)) {
+          stats.skipped_draws++;
+          return;
+        }
+        for (unsigned i = 0; i != 4; ++i) color[i] = diffuse[i];
+      }
+
+      unsigned pos_slot = msh->get_slot(attribute_pos);
+      unsigned normal_slot = msh->get_slot(attribute_normal);
+      unsigned uv_slot = msh->get_slot(attribute_uv);
+      if (pos_slot == ~0u || !msh->get_vertices() || msh->get_num_vertices() == 0) return;
+      if (normal_slot == ~0u) lit = false;
+
+      unsigned mode = msh->get_mode();
+      unsigned flags = lit ? flag_lit : 0;
+      if (mode != GL_TRIANGLES && mode != GL_TRIANGLE_STRIP && mode != GL_TRIANGLE_FAN) flags = 0;
+      unsigned state = add_state(color, flags, img, light_uniforms, num_light_uniforms, num_lights);
+      if (mode == GL_POINTS) {
+        states[state].flags = flag_sprite;
+        states[state].point_size = point_size;
+      }
+
+      gl_resource::rolock vertex_lock(msh->get_vertices());
+      const uint8_t *vertices = vertex_lock.u8();
+      unsigned stride = msh->get_stride();
+      unsigned num_vertices = msh->get_num_vertices();
+      clip_vertices.resize(num_vertices);
+
+      // transform the vertices
+      thread_pool::get().parallel_ranges(num_vertices, 1024, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          const uint8_t *src = vertices + i * stride;
+          clip_vertex &cv = clip_vertices[i];
+          float pos[4];
+          fetch(pos, 4, src + msh->get_offset(pos_slot), msh->get_kind(pos_slot), msh->get_size(pos_slot));
+          vec4 proj = vec4(pos[0], pos[1], pos[2], pos[3]) * modelToProjection;
+          for (unsigned j = 0; j != 4; ++j) cv.pos[j] = proj[j];
+
+          cv.attr[0] = cv.attr[1] = cv.attr[2] = 0;
+          if (normal_slot != ~0u) {
+            float normal[3];
+            fetch(normal, 3, src + msh->get_offset(normal_slot), msh->get_kind(normal_slot), msh->get_size(normal_slot));
+            vec4 tnormal = vec4(normal[0], normal[1], normal[2], 0) * modelToCamera;
+            cv.attr[0] = tnormal[0]; cv.attr[1] = tnormal[1]; cv.attr[2] = tnormal[2];
+          }
+          cv.attr[3] = cv.attr[4] = 0;
+          if (uv_slot != ~0u) {
+            fetch(cv.attr + 3, 2, src + msh->get_offset(uv_slot), msh->get_kind(uv_slot), msh->get_size(uv_slot));
+          }
+        }
+      });
+
+      // indices, or 0, 1, 2... for meshes drawn with glDrawArrays
+      unsigned index_type = msh->get_index_type();
+      if (index_type && msh->get_indices()) {
+        gl_resource::rolock index_lock(msh->get_indices());
+        assemble(mode, msh->get_num_indices(), index_lock.u8(), index_type, state, point_size);
+      } else {
+        assemble(mode, num_vertices, NULL, 0, state, point_size);
+      }
+      stats.transform_ms += ( get_time_seconds() - t0 ) * 1000;
+    }
+
+    /// draw round point sprites, size pixels across, with alpha blending.
+    /// positions are float xyz, stride bytes apart.
+    void draw_points(const mat4t &modelToProjection, const float *positions, unsigned num_points, unsigned stride, float size, const vec4 &color) {
+      double t0 = get_time_seconds();
+      stats.draws++;
+      unsigned state = add_state(color.get(), flag_sprite, NULL, NULL, 0, 0);
+      states[state].point_size = size;
+      clip_vertices.resize(num_points);
+      thread_pool::get().parallel_ranges(num_points, 4096, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i != end; ++i) {
+          const float *p = (const float*)((const uint8_t*)positions + i * stride);
+          vec4 proj = vec4(p[0], p[1], p[2], 1) * modelToProjection;
+          clip_vertex &cv = clip_vertices[i];
+          for (unsigned j = 0; j != 4; ++j) cv.pos[j] = proj[j];
+          for (unsigned j = 0; j != num_attrs; ++j) cv.attr[j] = 0;
+        }
+      });
+      assemble(GL_POINTS, num_points, NULL, 0, state, size);
+      stats.transform_ms += ( get_time_seconds() - t0 ) * 1000;
+    }
+
+    /// draw lines one pixel wide between pairs of float xyz positions, like GL_LINES.
+    void draw_lines(const mat4t &modelToProjection, const float *positions, unsigned num_vertices, const vec4 &color) {
+      double t0 = get_time_seconds();
+      stats.draws++;
+      unsigned state = add_state(color.get(), 0, NULL, NULL, 0, 0);
+      clip_vertices.resize(num_vertices);
+      for (unsigned i = 0; i != num_vertices; ++i) {
+        vec4 proj = vec4(positions[i*3+0], positions[i*3+1], positions[i*3+2], 1) * modelToProjection;
+        clip_vertex &cv = clip_vertices[i];
+        for (unsigned j = 0; j != 4; ++j) cv.pos[j] = proj[j];
+        for (unsigned j = 0; j != num_attrs; ++j) cv.attr[j] = 0;
+      }
+      assemble(GL_LINES, num_vertices, NULL, 0, state, 1);
+      stats.transform_ms += ( get_time_seconds() - t0 ) * 1000;
+    }
+
+    /// bin and rasterise the frame's primitives on all threads.
+    void end_frame() {
+      double t0 = get_time_seconds();
+      bin_triangles_to_tiles();
+      double t1 = get_time_seconds();
+
+      unsigned num_tiles = tiles_x * tiles_y;
+      thread_pool::get().parallel_for(num_tiles, [&](unsigned tile) {
+        tile_pixels[tile] = raster_tile(tile);
+      });
+      double t2 = get_time_seconds();
+
+      for (unsigned tile = 0; tile != num_tiles; ++tile) {
+        stats.pixels += tile_pixels[tile];
+      }
+      stats.triangles = triangles.size();
+      stats.bin_ms = ( t1 - t0 ) * 1000;
+      stats.raster_ms = ( t2 - t1 ) * 1000;
+      stats.frame_ms = ( t2 - frame_start ) * 1000;
+
+      total_stats.transform_ms += stats.transform_ms;
+      total_stats.bin_ms += stats.bin_ms;
+      total_stats.raster_ms += stats.raster_ms;
+      total_stats.frame_ms += stats.frame_ms;
+      total_stats.draws += stats.draws;
+      total_stats.skipped_draws += stats.skipped_draws;
+      total_stats.triangles += stats.triangles;
+      total_stats.binned_triangles += stats.binned_triangles;
+      total_stats.pixels += stats.pixels;
+      num_frames++;
+    }
+
+    /// timings and counts for the last frame.
+    const frame_stats &get_stats() const {
+      return stats;
+    }
+
+    /// average timings and counts over all frames since reset_stats().
+    frame_stats get_average_stats() const {
+      frame_stats result = total_stats;
+      if (num_frames) {
+        result.transform_ms /= num_frames;
+        result.bin_ms /= num_frames;
+        result.raster_ms /= num_frames;
+        result.frame_ms /= num_frames;
+        result.draws /= num_frames;
+        result.skipped_draws /= num_frames;
+        result.triangles /= num_frames;
+        result.binned_triangles /= num_frames;
+        result.pixels /= num_frames;
+      }
+      return result;
+    }
+
+    /// number of frames in the average.
+    unsigned get_num_frames() const {
+      return num_frames;
+    }
+
+    /// start a new average.
+    void reset_stats() {
+      memset(&total_stats, 0, sizeof(total_stats));
+      num_frames = 0;
+    }
+
+    /// log the average frame time and its breakdown.
+    void log_stats() const {
+      frame_stats avg = get_average_stats();
+      log(
+        "soft_renderer: %d frames %.3fms (transform %.3f bin %.3f raster %.3f) %d draws %d triangles %d pixels\n",
+        num_frames, avg.frame_ms, avg.transform_ms, avg.bin_ms, avg.raster_ms, avg.draws, avg.triangles, avg.pixels
+      );
+    }
+
+    unsigned get_width() const {
+      return width;
+    }
+
+    unsigned get_height() const {
+      return height;
+    }
+
+    /// RGBA8 pixels, red in the low byte, bottom row first.
+    const uint32_t *get_pixels() const {
+      return color_buffer.data();
+    }
+
+    /// window depth of each pixel, 0..1.
+    const float *get_depth() const {
+      return depth_buffer.data();
+    }
+
+    /// RGBA8 pixel at (x, y), y = 0 at the bottom.
+    uint32_t get_pixel(unsigned x, unsigned y) const {
+      return color_buffer[y * width + x];
+    }
+
+    /// FNV-1a hash of the pixels for regression tests.
+    uint64_t get_hash() const {
+      uint64_t hash = 0xcbf29ce484222325ull;
+      const uint8_t *src = (const uint8_t*)color_buffer.data();
+      for (unsigned i = 0; i != width * height * 4; ++i) {
+        hash = ( hash ^ src[i] ) * 0x100000001b3ull;
+      }
+      return hash;
+    }
+
+    /// write the framebuffer as an uncompressed 32 bit TGA file.
+    bool save_tga(const char *path) const {
+      FILE *file = fopen(path, "wb");
+      if (!file) return false;
+      uint8_t header[18] = { 0 };
+      header[2] = 2;
+      header[12] = (uint8_t)width; header[13] = (uint8_t)(width >> 8);
+      header[14] = (uint8_t)height; header[15] = (uint8_t)(height >> 8);
+      header[16] = 32;
+      header[17] = 8;
+      fwrite(header, 1, sizeof(header), file);
+
+      // TGA is BGRA, bottom row first
+      dynarray<uint8_t> row(width * 4);
+      for (unsigned y = 0; y != height; ++y) {
+        for (unsigned x = 0; x != width; ++x) {
+          uint32_t c = color_buffer[y * width + x];
+          row[x*4+0] = (uint8_t)(c >> 16);
+          row[x*4+1] = (uint8_t)(c >> 8);
+          row[x*4+2] = (uint8_t)(c >> 0);
+          row[x*4+3] = (uint8_t)(c >> 24);
+        }
+        fwrite(row.data(), 1, width * 4, file);
+      }
+      bool ok = !ferror(file);
+      fclose(file);
+      return ok;
+    }
+  };
+}}
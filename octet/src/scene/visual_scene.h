@@ -444,6 +444,35 @@ namespace octet { namespace scene {
       }
     }
 
+    /// draw the mesh instances with a software renderer, as render() does with OpenGL.
+    /// Skinned meshes are drawn in their bind pose and debug lines and AABBs are not drawn.
+    void render(soft_renderer &sr, camera_instance &cam, float aspect_ratio) {
+      mat4t cameraToWorld = cam.get_node()->calcModelToWorld();
+
+      mat4t worldToCamera;
+      cameraToWorld.invertQuick(worldToCamera);
+
+      calc_lighting(worldToCamera);
+
+      cam.set_cameraToWorld(cameraToWorld, aspect_ratio);
+
+      for (unsigned mesh_index = 0; mesh_index != mesh_instances.size(); ++mesh_index) {
+        mesh_instance *mi = mesh_instances[mesh_index];
+        mat4t modelToWorld = mi->get_node()->calcModelToWorld();
+        mat4t modelToCamera;
+        mat4t modelToProjection;
+        cam.get_matrices(modelToProjection, modelToCamera, modelToWorld);
+        sr.draw_mesh(mi->get_mesh(), mi->get_material(), modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
+      }
+    }
+
+    /// draw with a software renderer using the first camera.
+    void render(soft_renderer &sr, float aspect_ratio) {
+      if (camera_instances.size() != 0) {
+        render(sr, *camera_instances[0], aspect_ratio);
+      }
+    }
+
     /// play an animation on another target (not the same one as in the collada file)
     void play(animation *anim, resource *target, bool is_looping) {
       animation_instance *inst = new animation_instance(anim, target, is_looping);
@@ -29,6 +29,9 @@ namespace octet { namespace shaders {
       glBindAttribLocation(program, attribute_blendindices, "blendindices");
       glBindAttribLocation(program, attribute_color, "color");
       glBindAttribLocation(program, attribute_uv, "uv");
+      glBindAttribLocation(program, attribute_channels_lo, "channels_lo");
+      glBindAttribLocation(program, attribute_channels_hi, "channels_hi");
+      glBindAttribLocation(program, attribute_psize, "psize");
       glLinkProgram(program);
 
       program_ = program;
@@ -36,7 +36,8 @@ const TiXmlString::size_type TiXmlString::npos = static_cast< TiXmlString::size_
 
 
 // Null rep.
-TiXmlString::Rep TiXmlString::nullrep_ = { 0, 0, { '\0' } };
+char TiXmlString::nullstr_[1] = { '\0' };
+TiXmlString::Rep TiXmlString::nullrep_ = { 0, 0, TiXmlString::nullstr_ };
 
 
 void TiXmlString::reserve (size_type cap)
@@ -54,7 +55,7 @@ void TiXmlString::reserve (size_type cap)
 TiXmlString& TiXmlString::assign(const char* str, size_type len)
 {
 	size_type cap = capacity();
-	if (len > cap || cap > 3*(len + 8))
+	if (len > cap || cap > 3*(len + 8) || cap == 0)
 	{
 		TiXmlString tmp;
 		tmp.init(len);
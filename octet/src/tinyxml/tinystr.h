@@ -215,6 +215,23 @@ class TiXmlString
 		other.rep_ = r;
 	}
 
+	/*	Point the string at len characters of somebody else's buffer instead of copying them.
+		mem must hold borrow_size() bytes and outlive the string, as must str. Nothing is
+		freed when the string dies. The owner of the buffer writes the terminator at str[len]
+		before c_str() is used; any change to the string makes a private copy first.
+	*/
+	void borrow (void* mem, const char* str, size_type len)
+	{
+		quit();
+		rep_ = static_cast<Rep*>( mem );
+		rep_->size = len;
+		rep_->capacity = 0;
+		rep_->str = const_cast<char*>( str );
+	}
+
+	// Bytes needed by borrow() for the string header.
+	static size_type borrow_size () { return sizeof(Rep); }
+
   private:
 
 	void init(size_type sz) { init(sz, sz); }
@@ -222,10 +239,12 @@ class TiXmlString
 	char* start() const { return rep_->str; }
 	char* finish() const { return rep_->str + rep_->size; }
 
+	// Owned reps are followed by capacity+1 chars and str points at them.
+	// A capacity of zero marks the shared null rep or a borrowed buffer.
 	struct Rep
 	{
 		size_type size, capacity;
-		char str[1];
+		char* str;
 	};
 
 	void init(size_type sz, size_type cap)
@@ -237,10 +256,11 @@ class TiXmlString
 			// doesn't work in some cases of new being overloaded. Switching
 			// to the normal allocation, although use an 'int' for systems
 			// that are overly picky about structure alignment.
-			const size_type bytesNeeded = sizeof(Rep) + cap;
+			const size_type bytesNeeded = sizeof(Rep) + cap + 1;
 			const size_type intsNeeded = ( bytesNeeded + sizeof(int) - 1 ) / sizeof( int ); 
 			rep_ = reinterpret_cast<Rep*>( new int[ intsNeeded ] );
 
+			rep_->str = reinterpret_cast<char*>( rep_ + 1 );
 			rep_->str[ rep_->size = sz ] = '\0';
 			rep_->capacity = cap;
 		}
@@ -252,7 +272,8 @@ class TiXmlString
 
 	void quit()
 	{
-		if (rep_ != &nullrep_)
+		// borrowed reps have no capacity and nothing to free.
+		if (rep_ != &nullrep_ && rep_->capacity)
 		{
 			// The rep_ is really an array of ints. (see the allocator, above).
 			// Cast it back before delete, so the compiler won't incorrectly call destructors.
@@ -262,6 +283,7 @@ class TiXmlString
 
 	Rep * rep_;
 	static Rep nullrep_;
+	static char nullstr_[1];
 
 } ;
 
@@ -269,7 +291,7 @@ class TiXmlString
 inline bool operator == (const TiXmlString & a, const TiXmlString & b)
 {
 	return    ( a.length() == b.length() )				// optimization on some platforms
-	       && ( strcmp(a.c_str(), b.c_str()) == 0 );	// actual compare
+	       && ( memcmp(a.data(), b.data(), a.length()) == 0 );	// actual compare, borrowed strings may not be terminated yet
 }
 inline bool operator < (const TiXmlString & a, const TiXmlString & b)
 {
@@ -153,7 +153,7 @@ TiXmlNode::~TiXmlNode()
 	{
 		temp = node;
 		node = node->next;
-		delete temp;
+		Destroy( temp );
 	}	
 }
 
@@ -175,7 +175,7 @@ void TiXmlNode::Clear()
 	{
 		temp = node;
 		node = node->next;
-		delete temp;
+		Destroy( temp );
 	}	
 
 	firstChild = 0;
@@ -322,7 +322,7 @@ TiXmlNode* TiXmlNode::ReplaceChild( TiXmlNode* replaceThis, const TiXmlNode& wit
 	else
 		firstChild = node;
 
-	delete replaceThis;
+	Destroy( replaceThis );
 	node->parent = this;
 	return node;
 }
@@ -350,7 +350,7 @@ bool TiXmlNode::RemoveChild( TiXmlNode* removeThis )
 	else
 		firstChild = removeThis->next;
 
-	delete removeThis;
+	Destroy( removeThis );
 	return true;
 }
 
@@ -441,7 +441,7 @@ void TiXmlElement::RemoveAttribute( const char * name )
 	if ( node )
 	{
 		attributeSet.Remove( node );
-		delete node;
+		Destroy( node );
 	}
 }
 
@@ -564,7 +564,7 @@ void TiXmlElement::ClearThis()
 	{
 		TiXmlAttribute* node = attributeSet.First();
 		attributeSet.Remove( node );
-		delete node;
+		Destroy( node );
 	}
 }
 
@@ -870,6 +870,7 @@ TiXmlDocument::TiXmlDocument() : TiXmlNode( TiXmlNode::TINYXML_DOCUMENT )
 {
 	tabsize = 4;
 	useMicrosoftBOM = false;
+	inSitu = false;
 	ClearError();
 }
 
@@ -877,6 +878,7 @@ TiXmlDocument::TiXmlDocument( const char * documentName ) : TiXmlNode( TiXmlNode
 {
 	tabsize = 4;
 	useMicrosoftBOM = false;
+	inSitu = false;
 	value = documentName;
 	ClearError();
 }
@@ -887,6 +889,7 @@ TiXmlDocument::TiXmlDocument( const std::string& documentName ) : TiXmlNode( TiX
 {
 	tabsize = 4;
 	useMicrosoftBOM = false;
+	inSitu = false;
     value = documentName;
 	ClearError();
 }
@@ -895,6 +898,7 @@ TiXmlDocument::TiXmlDocument( const std::string& documentName ) : TiXmlNode( TiX
 
 TiXmlDocument::TiXmlDocument( const TiXmlDocument& copy ) : TiXmlNode( TiXmlNode::TINYXML_DOCUMENT )
 {
+	inSitu = false;
 	copy.CopyTo( this );
 }
 
@@ -906,6 +910,74 @@ void TiXmlDocument::operator=( const TiXmlDocument& copy )
 }
 
 
+void TiXmlDocument::Clear()
+{
+	// Destroy the nodes before their memory goes.
+	TiXmlNode::Clear();
+	arena.Release();
+}
+
+
+void TiXmlArena::NewBlock( size_t size )
+{
+	// Blocks start at 64k and double, so a big document needs few of them.
+	size_t blockSize = blocks ? blocks->size * 2 : 65536;
+	if ( blockSize > 16*1024*1024 ) blockSize = 16*1024*1024;
+	if ( blockSize < size + 16 ) blockSize = size + 16;
+
+	// The header takes the first 16 bytes to keep the allocations aligned.
+	Block* block = reinterpret_cast<Block*>( new double[ ( blockSize + sizeof(double) - 1 ) / sizeof(double) ] );
+	block->next = blocks;
+	block->size = blockSize;
+	blocks = block;
+	top = reinterpret_cast<char*>( block ) + 16;
+	end = reinterpret_cast<char*>( block ) + blockSize;
+}
+
+
+void TiXmlArena::Terminate( char* pos )
+{
+	if ( numTerminators == maxTerminators )
+	{
+		size_t newMax = maxTerminators ? maxTerminators * 2 : 1024;
+		char** newTerminators = new char*[ newMax ];
+		if ( numTerminators ) memcpy( newTerminators, terminators, numTerminators * sizeof(char*) );
+		delete [] terminators;
+		terminators = newTerminators;
+		maxTerminators = newMax;
+	}
+	terminators[ numTerminators++ ] = pos;
+}
+
+
+void TiXmlArena::WriteTerminators()
+{
+	for ( size_t i = 0; i != numTerminators; ++i )
+		*terminators[i] = 0;
+
+	delete [] terminators;
+	terminators = 0;
+	numTerminators = maxTerminators = 0;
+}
+
+
+void TiXmlArena::Release()
+{
+	while ( blocks )
+	{
+		Block* next = blocks->next;
+		delete [] reinterpret_cast<double*>( blocks );
+		blocks = next;
+	}
+	top = end = 0;
+	used = 0;
+
+	delete [] terminators;
+	terminators = 0;
+	numTerminators = maxTerminators = 0;
+}
+
+
 bool TiXmlDocument::LoadFile( TiXmlEncoding encoding )
 {
 	return LoadFile( Value(), encoding );
@@ -1469,7 +1541,7 @@ void TiXmlAttributeSet::Add( TiXmlAttribute* addMe )
     #ifdef TIXML_USE_STL
 	assert( !Find( TIXML_STRING( addMe->Name() ) ) );	// Shouldn't be multiply adding to the set.
 	#else
-	assert( !Find( addMe->Name() ) );	// Shouldn't be multiply adding to the set.
+	assert( !Find( addMe->NameTStr() ) );	// Shouldn't be multiply adding to the set.
 	#endif
 
 	addMe->next = &sentinel;
@@ -1533,6 +1605,19 @@ TiXmlAttribute* TiXmlAttributeSet::Find( const char* name ) const
 }
 
 
+#ifndef TIXML_USE_STL
+TiXmlAttribute* TiXmlAttributeSet::Find( const TiXmlString& name ) const
+{
+	for( TiXmlAttribute* node = sentinel.next; node != &sentinel; node = node->next )
+	{
+		if ( node->name == name )
+			return node;
+	}
+	return 0;
+}
+#endif
+
+
 TiXmlAttribute* TiXmlAttributeSet::FindOrCreate( const char* _name )
 {
 	TiXmlAttribute* attrib = Find( _name );
@@ -37,6 +37,7 @@ distribution.
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <new>
 
 // Help out windows:
 #if defined( _DEBUG ) && !defined( DEBUG )
@@ -169,6 +170,79 @@ enum TiXmlEncoding
 
 const TiXmlEncoding TIXML_DEFAULT_ENCODING = TIXML_ENCODING_UNKNOWN;
 
+/**	A bump allocator used by TiXmlDocument::ParseInSitu().
+	Nodes, attributes and string headers are carved out of large blocks
+	which are all given back in one go when the document is cleared.
+	The arena also remembers where the borrowed strings end so that the
+	terminators can be written once the parser no longer needs the
+	delimiters that they overwrite.
+*/
+class TiXmlArena
+{
+public:
+	TiXmlArena() : blocks(0), top(0), end(0), used(0), terminators(0), numTerminators(0), maxTerminators(0) {}
+	~TiXmlArena() { Release(); }
+
+	/// Allocate size bytes, aligned for any TinyXml class. The memory lives until Release().
+	void* Alloc( size_t size )
+	{
+		size = ( size + 15 ) & ~(size_t)15;
+		if ( (size_t)( end - top ) < size ) NewBlock( size );
+		void* result = top;
+		top += size;
+		used += size;
+		return result;
+	}
+
+	/// Construct a node or attribute in the arena.
+	template < class T > T* New()
+	{
+		T* t = new ( Alloc( sizeof( T ) ) ) T();
+		t->ownerArena = this;
+		return t;
+	}
+
+	/// Construct a node in the arena with a value.
+	template < class T > T* New( const char* value )
+	{
+		T* t = new ( Alloc( sizeof( T ) ) ) T( value );
+		t->ownerArena = this;
+		return t;
+	}
+
+	/// Remember to write a '\0' at pos in WriteTerminators().
+	void Terminate( char* pos );
+
+	/// Terminate all the borrowed strings. Called at the end of the parse.
+	void WriteTerminators();
+
+	/// Free every block at once. Objects in the arena must already be destroyed.
+	void Release();
+
+	/// Bytes handed out since the last Release().
+	size_t BytesUsed() const { return used; }
+
+private:
+	TiXmlArena( const TiXmlArena& );			// not allowed.
+	void operator=( const TiXmlArena& );	// not allowed.
+
+	void NewBlock( size_t size );
+
+	struct Block
+	{
+		Block* next;
+		size_t size;
+	};
+
+	Block* blocks;
+	char* top;
+	char* end;
+	size_t used;
+	char** terminators;
+	size_t numTerminators;
+	size_t maxTerminators;
+};
+
 /** TiXmlBase is a base class for every class in TinyXml.
 	It does little except to establish that TinyXml classes
 	can be printed and provide some utility functions.
@@ -196,9 +270,10 @@ class TiXmlBase
 	friend class TiXmlNode;
 	friend class TiXmlElement;
 	friend class TiXmlDocument;
+	friend class TiXmlArena;
 
 public:
-	TiXmlBase()	:	userData(0)		{}
+	TiXmlBase()	:	userData(0), ownerArena(0)		{}
 	virtual ~TiXmlBase()			{}
 
 	/**	All TinyXml classes can print themselves to a filestream
@@ -307,7 +382,7 @@ protected:
 		a pointer just past the last character of the name,
 		or 0 if the function has an error.
 	*/
-	static const char* ReadName( const char* p, TIXML_STRING* name, TiXmlEncoding encoding );
+	static const char* ReadName( const char* p, TIXML_STRING* name, TiXmlEncoding encoding, TiXmlArena* arena = 0 );
 
 	/*	Reads text. Returns a pointer past the given end tag.
 		Wickedly complex options, but it keeps the (sensitive) code in one place.
@@ -317,7 +392,25 @@ protected:
 									bool ignoreWhiteSpace,		// whether to keep the white space
 									const char* endTag,			// what ends this text
 									bool ignoreCase,			// whether to ignore case in the end tag
-									TiXmlEncoding encoding );	// the current encoding
+									TiXmlEncoding encoding,		// the current encoding
+									TiXmlArena* arena = 0 );	// if set, decode in place and borrow the text
+
+	/*	Point str at len characters of the buffer being parsed in place and
+		have the arena terminate it when the parse is done. With STL strings
+		the characters are copied instead.
+	*/
+	static void BorrowString( TIXML_STRING* str, const char* start, size_t len, TiXmlArena* arena );
+
+	/*	Delete a node or attribute. Objects that live in an arena are only
+		destroyed, their memory goes when the arena is released.
+	*/
+	static void Destroy( TiXmlBase* base )
+	{
+		if ( base->ownerArena )
+			base->~TiXmlBase();
+		else
+			delete base;
+	}
 
 	// If an entity has been found, transform it into a character.
 	static const char* GetEntity( const char* in, char* value, int* length, TiXmlEncoding encoding );
@@ -374,6 +467,9 @@ protected:
 
     /// Field containing a generic user pointer
 	void*			userData;
+
+	/// The arena this object was constructed in by ParseInSitu, or 0 if it is on the heap.
+	TiXmlArena*		ownerArena;
 	
 	// None of these methods are reliable for any language except English.
 	// Good for approximation, not great for accuracy.
@@ -920,6 +1016,9 @@ public:
 #	ifdef TIXML_USE_STL
 	TiXmlAttribute*	Find( const std::string& _name ) const;
 	TiXmlAttribute* FindOrCreate( const std::string& _name );
+#	else
+	/// Find by length and content; works while the names are still borrowed and unterminated.
+	TiXmlAttribute*	Find( const TiXmlString& _name ) const;
 #	endif
 
 
@@ -1399,7 +1498,7 @@ public:
 	TiXmlDocument( const TiXmlDocument& copy );
 	void operator=( const TiXmlDocument& copy );
 
-	virtual ~TiXmlDocument() {}
+	virtual ~TiXmlDocument() { Clear(); }
 
 	/** Load a file using the current document value.
 		Returns true if successful. Will delete any existing
@@ -1438,6 +1537,27 @@ public:
 	*/
 	virtual const char* Parse( const char* p, TiXmlParsingData* data = 0, TiXmlEncoding encoding = TIXML_DEFAULT_ENCODING );
 
+	/** Parse a null terminated block of xml data in place. Names, attribute values
+		and text are decoded into the buffer itself and the strings point at it, and
+		the nodes come from an arena owned by the document which is freed in one go
+		by Clear(), the next ParseInSitu() or the destructor.
+
+		The buffer is modified (terminators are written over the delimiters)
+		so it must be writable, and it must outlive the document's nodes.
+		The DOM can be navigated and edited as usual; edited strings and added
+		nodes are copied to the heap. Returns true if successful.
+	*/
+	bool ParseInSitu( char* buffer, TiXmlEncoding encoding = TIXML_DEFAULT_ENCODING );
+
+	/// The arena to allocate parsed nodes from, or 0 if not parsing in place.
+	TiXmlArena* InSituArena() { return inSitu ? &arena : 0; }
+
+	/// Bytes of arena used by the last ParseInSitu().
+	size_t ArenaBytesUsed() const { return arena.BytesUsed(); }
+
+	/// Delete all the children of this document and free the arena.
+	void Clear();
+
 	/** Get the root element -- the only top level element -- of the document.
 		In well formed XML, there should only be one. TinyXml is tolerant of
 		multiple elements at the document level.
@@ -1545,6 +1665,8 @@ private:
 	int tabsize;
 	TiXmlCursor errorLocation;
 	bool useMicrosoftBOM;		// the UTF-8 BOM were found when read. Note this, and try to write.
+	bool inSitu;				// ParseInSitu is running: allocate from the arena.
+	TiXmlArena arena;
 };
 
 
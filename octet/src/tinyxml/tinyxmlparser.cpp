@@ -398,7 +398,7 @@ const char* TiXmlBase::SkipWhiteSpace( const char* p, TiXmlEncoding encoding )
 // One of TinyXML's more performance demanding functions. Try to keep the memory overhead down. The
 // "assign" optimization removes over 10% of the execution time.
 //
-const char* TiXmlBase::ReadName( const char* p, TIXML_STRING * name, TiXmlEncoding encoding )
+const char* TiXmlBase::ReadName( const char* p, TIXML_STRING * name, TiXmlEncoding encoding, TiXmlArena* arena )
 {
 	// Oddly, not supported on some comilers,
 	//name->clear();
@@ -428,7 +428,10 @@ const char* TiXmlBase::ReadName( const char* p, TIXML_STRING * name, TiXmlEncodi
 			++p;
 		}
 		if ( p-start > 0 ) {
-			name->assign( start, p-start );
+			if ( arena )
+				BorrowString( name, start, p-start, arena );
+			else
+				name->assign( start, p-start );
 		}
 		return p;
 	}
@@ -576,10 +579,59 @@ const char* TiXmlBase::ReadText(	const char* p,
 									bool trimWhiteSpace, 
 									const char* endTag, 
 									bool caseInsensitive,
-									TiXmlEncoding encoding )
+									TiXmlEncoding encoding,
+									TiXmlArena* arena )
 {
     *text = "";
-	if (    !trimWhiteSpace			// certain tags always keep whitespace
+	if ( arena )
+	{
+		// In place: decode behind the read pointer. Entities and condensed
+		// white space never grow, so the write pointer can't overtake it.
+		bool condense = trimWhiteSpace && condenseWhiteSpace;
+		if ( condense )
+			p = SkipWhiteSpace( p, encoding );
+		if ( !p )
+			return 0;
+
+		// The end tags are almost always one character.
+		char endChar = endTag[0] && !endTag[1] ? endTag[0] : 0;
+		char* start = const_cast< char* >( p );
+		char* q = start;
+		bool whitespace = false;
+		while (	   p && *p
+				&& ( endChar ? *p != endChar : !StringEqual( p, endTag, caseInsensitive, encoding ) ) )
+		{
+			unsigned char c = (unsigned char) *p;
+			if ( condense && IsWhiteSpace( *p ) )
+			{
+				whitespace = true;
+				++p;
+				continue;
+			}
+
+			if ( whitespace )
+			{
+				*q++ = ' ';
+				whitespace = false;
+			}
+
+			if ( c < 0x80 && c != '&' )
+			{
+				// Plain ascii, copy it over.
+				*q++ = *p++;
+			}
+			else
+			{
+				int len;
+				char cArr[4] = { 0, 0, 0, 0 };
+				p = GetChar( p, cArr, &len, encoding );
+				for ( int i = 0; i < len; ++i )
+					*q++ = cArr[i];
+			}
+		}
+		BorrowString( text, start, q - start, arena );
+	}
+	else if (    !trimWhiteSpace			// certain tags always keep whitespace
 		 || !condenseWhiteSpace )	// if true, whitespace is always kept
 	{
 		// Keep all the white space.
@@ -701,6 +753,38 @@ void TiXmlDocument::StreamIn( std::istream * in, TIXML_STRING * tag )
 
 #endif
 
+void TiXmlBase::BorrowString( TIXML_STRING* str, const char* start, size_t len, TiXmlArena* arena )
+{
+	#ifdef TIXML_USE_STL
+	(void)arena;
+	str->assign( start, len );
+	#else
+	if ( len )
+	{
+		str->borrow( arena->Alloc( TiXmlString::borrow_size() ), start, len );
+		arena->Terminate( const_cast< char* >( start ) + len );
+	}
+	else
+	{
+		*str = "";
+	}
+	#endif
+}
+
+bool TiXmlDocument::ParseInSitu( char* buffer, TiXmlEncoding encoding )
+{
+	Clear();
+	location.Clear();
+
+	inSitu = true;
+	Parse( buffer, 0, encoding );
+	inSitu = false;
+
+	// Nothing looks at the delimiters any more, so we can overwrite them.
+	arena.WriteTerminators();
+	return !Error();
+}
+
 const char* TiXmlDocument::Parse( const char* p, TiXmlParsingData* prevData, TiXmlEncoding encoding )
 {
 	ClearError();
@@ -818,6 +902,8 @@ void TiXmlDocument::SetError( int err, const char* pError, TiXmlParsingData* dat
 TiXmlNode* TiXmlNode::Identify( const char* p, TiXmlEncoding encoding )
 {
 	TiXmlNode* returnNode = 0;
+	TiXmlDocument* document = GetDocument();
+	TiXmlArena* arena = document ? document->InSituArena() : 0;
 
 	p = SkipWhiteSpace( p, encoding );
 	if( !p || !*p || *p != '<' )
@@ -849,21 +935,21 @@ TiXmlNode* TiXmlNode::Identify( const char* p, TiXmlEncoding encoding )
 		#ifdef DEBUG_PARSER
 			TIXML_LOG( "XML parsing Declaration\n" );
 		#endif
-		returnNode = new TiXmlDeclaration();
+		returnNode = arena ? arena->New< TiXmlDeclaration >() : new TiXmlDeclaration();
 	}
 	else if ( StringEqual( p, commentHeader, false, encoding ) )
 	{
 		#ifdef DEBUG_PARSER
 			TIXML_LOG( "XML parsing Comment\n" );
 		#endif
-		returnNode = new TiXmlComment();
+		returnNode = arena ? arena->New< TiXmlComment >() : new TiXmlComment();
 	}
 	else if ( StringEqual( p, cdataHeader, false, encoding ) )
 	{
 		#ifdef DEBUG_PARSER
 			TIXML_LOG( "XML parsing CDATA\n" );
 		#endif
-		TiXmlText* text = new TiXmlText( "" );
+		TiXmlText* text = arena ? arena->New< TiXmlText >( "" ) : new TiXmlText( "" );
 		text->SetCDATA( true );
 		returnNode = text;
 	}
@@ -872,7 +958,7 @@ TiXmlNode* TiXmlNode::Identify( const char* p, TiXmlEncoding encoding )
 		#ifdef DEBUG_PARSER
 			TIXML_LOG( "XML parsing Unknown(1)\n" );
 		#endif
-		returnNode = new TiXmlUnknown();
+		returnNode = arena ? arena->New< TiXmlUnknown >() : new TiXmlUnknown();
 	}
 	else if (    IsAlpha( *(p+1), encoding )
 			  || *(p+1) == '_' )
@@ -880,14 +966,14 @@ TiXmlNode* TiXmlNode::Identify( const char* p, TiXmlEncoding encoding )
 		#ifdef DEBUG_PARSER
 			TIXML_LOG( "XML parsing Element\n" );
 		#endif
-		returnNode = new TiXmlElement( "" );
+		returnNode = arena ? arena->New< TiXmlElement >( "" ) : new TiXmlElement( "" );
 	}
 	else
 	{
 		#ifdef DEBUG_PARSER
 			TIXML_LOG( "XML parsing Unknown(2)\n" );
 		#endif
-		returnNode = new TiXmlUnknown();
+		returnNode = arena ? arena->New< TiXmlUnknown >() : new TiXmlUnknown();
 	}
 
 	if ( returnNode )
@@ -1044,6 +1130,7 @@ const char* TiXmlElement::Parse( const char* p, TiXmlParsingData* data, TiXmlEnc
 {
 	p = SkipWhiteSpace( p, encoding );
 	TiXmlDocument* document = GetDocument();
+	TiXmlArena* arena = document ? document->InSituArena() : 0;
 
 	if ( !p || !*p )
 	{
@@ -1068,16 +1155,13 @@ const char* TiXmlElement::Parse( const char* p, TiXmlParsingData* data, TiXmlEnc
 	// Read the name.
 	const char* pErr = p;
 
-    p = ReadName( p, &value, encoding );
+    p = ReadName( p, &value, encoding, arena );
 	if ( !p || !*p )
 	{
 		if ( document )	document->SetError( TIXML_ERROR_FAILED_TO_READ_ELEMENT_NAME, pErr, data, encoding );
 		return 0;
 	}
 
-    TIXML_STRING endTag ("</");
-	endTag += value;
-
 	// Check for and read attributes. Also look for an empty
 	// tag or an end tag.
 	while ( p && *p )
@@ -1119,9 +1203,10 @@ const char* TiXmlElement::Parse( const char* p, TiXmlParsingData* data, TiXmlEnc
 			// </foo > and
 			// </foo> 
 			// are both valid end tags.
-			if ( StringEqual( p, endTag.c_str(), false, encoding ) )
+			// The name may be borrowed and not yet terminated, so compare by length.
+			if ( p[0] == '<' && p[1] == '/' && strncmp( p + 2, value.data(), value.length() ) == 0 )
 			{
-				p += endTag.length();
+				p += value.length() + 2;
 				p = SkipWhiteSpace( p, encoding );
 				if ( p && *p && *p == '>' ) {
 					++p;
@@ -1139,7 +1224,7 @@ const char* TiXmlElement::Parse( const char* p, TiXmlParsingData* data, TiXmlEnc
 		else
 		{
 			// Try to read an attribute:
-			TiXmlAttribute* attrib = new TiXmlAttribute();
+			TiXmlAttribute* attrib = arena ? arena->New< TiXmlAttribute >() : new TiXmlAttribute();
 			if ( !attrib )
 			{
 				return 0;
@@ -1152,20 +1237,16 @@ const char* TiXmlElement::Parse( const char* p, TiXmlParsingData* data, TiXmlEnc
 			if ( !p || !*p )
 			{
 				if ( document ) document->SetError( TIXML_ERROR_PARSING_ELEMENT, pErr, data, encoding );
-				delete attrib;
+				Destroy( attrib );
 				return 0;
 			}
 
 			// Handle the strange case of double attributes:
-			#ifdef TIXML_USE_STL
 			TiXmlAttribute* node = attributeSet.Find( attrib->NameTStr() );
-			#else
-			TiXmlAttribute* node = attributeSet.Find( attrib->Name() );
-			#endif
 			if ( node )
 			{
 				if ( document ) document->SetError( TIXML_ERROR_PARSING_ELEMENT, pErr, data, encoding );
-				delete attrib;
+				Destroy( attrib );
 				return 0;
 			}
 
@@ -1179,6 +1260,7 @@ const char* TiXmlElement::Parse( const char* p, TiXmlParsingData* data, TiXmlEnc
 const char* TiXmlElement::ReadValue( const char* p, TiXmlParsingData* data, TiXmlEncoding encoding )
 {
 	TiXmlDocument* document = GetDocument();
+	TiXmlArena* arena = document ? document->InSituArena() : 0;
 
 	// Read in text and elements in any order.
 	const char* pWithWhiteSpace = p;
@@ -1189,13 +1271,16 @@ const char* TiXmlElement::ReadValue( const char* p, TiXmlParsingData* data, TiXm
 		if ( *p != '<' )
 		{
 			// Take what we have, make a text element.
-			TiXmlText* textNode = new TiXmlText( "" );
+			TiXmlText* textNode = arena ? arena->New< TiXmlText >( "" ) : new TiXmlText( "" );
 
 			if ( !textNode )
 			{
 			    return 0;
 			}
 
+			// Set the parent, so it can find the document.
+			textNode->parent = this;
+
 			if ( TiXmlBase::IsWhiteSpaceCondensed() )
 			{
 				p = textNode->Parse( p, data, encoding );
@@ -1210,7 +1295,7 @@ const char* TiXmlElement::ReadValue( const char* p, TiXmlParsingData* data, TiXm
 			if ( !textNode->Blank() )
 				LinkEndChild( textNode );
 			else
-				delete textNode;
+				Destroy( textNode );
 		} 
 		else 
 		{
@@ -1290,11 +1375,16 @@ const char* TiXmlUnknown::Parse( const char* p, TiXmlParsingData* data, TiXmlEnc
 	++p;
     value = "";
 
+	TiXmlArena* arena = document ? document->InSituArena() : 0;
+	const char* start = p;
 	while ( p && *p && *p != '>' )
 	{
-		value += *p;
+		if ( !arena )
+			value += *p;
 		++p;
 	}
+	if ( arena )
+		BorrowString( &value, start, p - start, arena );
 
 	if ( !p )
 	{
@@ -1375,11 +1465,16 @@ const char* TiXmlComment::Parse( const char* p, TiXmlParsingData* data, TiXmlEnc
 
     value = "";
 	// Keep all the white space.
+	TiXmlArena* arena = document ? document->InSituArena() : 0;
+	const char* start = p;
 	while (	p && *p && !StringEqual( p, endTag, false, encoding ) )
 	{
-		value.append( p, 1 );
+		if ( !arena )
+			value.append( p, 1 );
 		++p;
 	}
+	if ( arena )
+		BorrowString( &value, start, p - start, arena );
 	if ( p && *p ) 
 		p += strlen( endTag );
 
@@ -1398,8 +1493,9 @@ const char* TiXmlAttribute::Parse( const char* p, TiXmlParsingData* data, TiXmlE
 		location = data->Cursor();
 	}
 	// Read the name, the '=' and the value.
+	TiXmlArena* arena = document ? document->InSituArena() : 0;
 	const char* pErr = p;
-	p = ReadName( p, &name, encoding );
+	p = ReadName( p, &name, encoding, arena );
 	if ( !p || !*p )
 	{
 		if ( document ) document->SetError( TIXML_ERROR_READING_ATTRIBUTES, pErr, data, encoding );
@@ -1428,13 +1524,13 @@ const char* TiXmlAttribute::Parse( const char* p, TiXmlParsingData* data, TiXmlE
 	{
 		++p;
 		end = "\'";		// single quote in string
-		p = ReadText( p, &value, false, end, false, encoding );
+		p = ReadText( p, &value, false, end, false, encoding, arena );
 	}
 	else if ( *p == DOUBLE_QUOTE )
 	{
 		++p;
 		end = "\"";		// double quote in string
-		p = ReadText( p, &value, false, end, false, encoding );
+		p = ReadText( p, &value, false, end, false, encoding, arena );
 	}
 	else
 	{
@@ -1442,6 +1538,7 @@ const char* TiXmlAttribute::Parse( const char* p, TiXmlParsingData* data, TiXmlE
 		// But this is such a common error that the parser will try
 		// its best, even without them.
 		value = "";
+		const char* start = p;
 		while (    p && *p											// existence
 				&& !IsWhiteSpace( *p )								// whitespace
 				&& *p != '/' && *p != '>' )							// tag end
@@ -1453,9 +1550,12 @@ const char* TiXmlAttribute::Parse( const char* p, TiXmlParsingData* data, TiXmlE
 				if ( document ) document->SetError( TIXML_ERROR_READING_ATTRIBUTES, p, data, encoding );
 				return 0;
 			}
-			value += *p;
+			if ( !arena )
+				value += *p;
 			++p;
 		}
+		if ( arena )
+			BorrowString( &value, start, p - start, arena );
 	}
 	return p;
 }
@@ -1518,13 +1618,18 @@ const char* TiXmlText::Parse( const char* p, TiXmlParsingData* data, TiXmlEncodi
 		p += strlen( startTag );
 
 		// Keep all the white space, ignore the encoding, etc.
+		TiXmlArena* arena = document ? document->InSituArena() : 0;
+		const char* start = p;
 		while (	   p && *p
 				&& !StringEqual( p, endTag, false, encoding )
 			  )
 		{
-			value += *p;
+			if ( !arena )
+				value += *p;
 			++p;
 		}
+		if ( arena )
+			BorrowString( &value, start, p - start, arena );
 
 		TIXML_STRING dummy; 
 		p = ReadText( p, &dummy, false, endTag, false, encoding );
@@ -1535,7 +1640,14 @@ const char* TiXmlText::Parse( const char* p, TiXmlParsingData* data, TiXmlEncodi
 		bool ignoreWhite = true;
 
 		const char* end = "<";
-		p = ReadText( p, &value, ignoreWhite, end, false, encoding );
+		TiXmlArena* arena = document ? document->InSituArena() : 0;
+		if ( arena && data )
+		{
+			// Decoding in place rewrites the text, so move the cursor past it first.
+			const char* q = strchr( p, '<' );
+			data->Stamp( q ? q : p + strlen( p ), encoding );
+		}
+		p = ReadText( p, &value, ignoreWhite, end, false, encoding, arena );
 		if ( p )
 			return p-1;	// don't truncate the '<'
 		return 0;